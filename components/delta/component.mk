@@ -0,0 +1,2 @@
+# See delta_set_boot_partition()
+COMPONENT_ADD_LDFLAGS += -Wl,--wrap=esp_image_verify
@@ -11,262 +11,1225 @@
 #include <stdint.h>
 #include <string.h>
 
-#include "freertos/FreeRTOS.h"
-#include "freertos/task.h"
-
-#include "esp_err.h"
+#ifdef ESP_PLATFORM
 #include "esp_log.h"
-#include "esp_system.h"
+#else
+#include <stdio.h>
+#define ESP_LOGE(tag, fmt, ...) fprintf(stderr, "E %s: " fmt "\n", tag, ##__VA_ARGS__)
+#define ESP_LOGI(tag, fmt, ...) fprintf(stderr, "I %s: " fmt "\n", tag, ##__VA_ARGS__)
+#endif
 
-#include "esp_partition.h"
-#include "esp_ota_ops.h"
+#include "mbedtls/version.h"
+#include "mbedtls/sha256.h"
 
 #include "detools.h"
 #include "delta.h"
+#include "delta_journal.h"
+#include "delta_sched.h"
+#include "delta_step_log.h"
+
+#if MBEDTLS_VERSION_NUMBER >= 0x03000000
+#define mbedtls_sha256_starts_ret mbedtls_sha256_starts
+#define mbedtls_sha256_update_ret mbedtls_sha256_update
+#define mbedtls_sha256_finish_ret mbedtls_sha256_finish
+#endif
+
+/* Patch bytes handed to detools at a time, if the patch cannot be mapped */
+#define DELTA_PATCH_CHUNK_SIZE (512)
+
+/* Patch bytes handed to detools at a time from a mapped patch */
+#define DELTA_PATCH_MAP_SLICE_SIZE (4096)
+
+/* Target bytes are flushed in blocks of this size before a checkpoint,
+ * the rest is kept in the checkpoint */
+#define DELTA_CHECKPOINT_ALIGN (16)
+
+/* Bump when the checkpoint record or what follows it changes meaning */
+#define DELTA_CHECKPOINT_VERSION (1)
+
+/* esp_image_header_t and esp_image_segment_header_t of the target image */
+#define DELTA_IMAGE_HEADER_SIZE (24)
+#define DELTA_IMAGE_HEADER_MAGIC (0xE9)
+#define DELTA_IMAGE_SEGMENT_COUNT_OFFSET (1)
+#define DELTA_IMAGE_HASH_APPENDED_OFFSET (23)
+#define DELTA_IMAGE_SEGMENT_HEADER_SIZE (8)
+
+#ifndef MIN
+#define MIN(x, y) (((x) < (y)) ? (x) : (y))
+#endif
 
 static const char *TAG = "delta";
 
-typedef struct flash_mem {
-    const esp_partition_t *src;
-    const esp_partition_t *dest;
-    const esp_partition_t *patch;
+/* SHA-256 of the target image, and of the part covered by the hash
+ * esptool appends to it. The appended hash follows the segments, which
+ * are found from the segment headers as the image goes by; a signature
+ * block may follow it. */
+typedef struct {
+    mbedtls_sha256_context sha256;
+    uint64_t offset;                /* Bytes hashed so far */
+    uint8_t header[DELTA_IMAGE_HEADER_SIZE];
+    uint8_t segment_header[DELTA_IMAGE_SEGMENT_HEADER_SIZE];
+    uint32_t segments_left;
+    uint64_t segment_offset;        /* Of the next segment header */
+    bool appended;                  /* The image has an appended hash */
+    uint64_t appended_offset;       /* Of the appended hash, once known */
+    bool image_hashed;              /* image_digest is complete */
+    uint8_t image_digest[DELTA_SHA256_SIZE];
+    uint8_t appended_hash[DELTA_SHA256_SIZE];
+} delta_image_hash_t;
+
+/* Checkpoint journal record, followed by the dumped detools state. */
+typedef struct {
+    uint32_t layout;        /* See delta_checkpoint_layout() */
+    size_t patch_size;
+    uint32_t patch_crc;     /* Of the patch bytes processed */
+    size_t src_address;
+    size_t dest_address;
+    size_t target_size;
+    size_t dest_offset;
+    uint8_t write_buf[DELTA_CHECKPOINT_ALIGN];
+    size_t write_buf_size;
+    bool page_erased;
+    delta_image_hash_t hash;
+    delta_stats_t stats;
+} delta_checkpoint_t;
+
+typedef struct delta_ctx {
+    delta_storage_t *src;
+    delta_storage_t *patch;
+    delta_storage_t *dest;
     size_t src_offset;
-    size_t patch_offset;
-    esp_ota_handle_t ota_handle;
-} flash_mem_t;
+    size_t dest_offset;
+    /* Target bytes are coalesced into sector-sized writes so that
+     * erased (0xFF) runs can be left unprogrammed. */
+    uint8_t write_buf[PARTITION_PAGE_SIZE];
+    size_t write_buf_size;
+    /* The flushed part of the destination page at dest_offset is erased */
+    bool page_erased;
+    delta_sched_t sched;
+    delta_stats_t stats;
+    delta_image_hash_t hash;
+    struct detools_apply_patch_t apply_patch;
+    uint8_t patch_buf[DELTA_PATCH_CHUNK_SIZE];
+    size_t target_size;
+    /* Checkpointing, if a journal is given */
+    delta_journal_t journal;
+    bool journaling;
+    size_t checkpoint_interval;
+    size_t next_checkpoint;
+    uint32_t patch_crc;
+    int64_t start_us;
+    delta_checkpoint_t *checkpoint;
+    size_t checkpoint_size;
+    size_t checkpoint_pos;
+} delta_ctx_t;
+
+static uint32_t delta_le32(const uint8_t *buf_p)
+{
+    return ((uint32_t)buf_p[0] | ((uint32_t)buf_p[1] << 8) |
+            ((uint32_t)buf_p[2] << 16) | ((uint32_t)buf_p[3] << 24));
+}
+
+/* Copies the part of buf (at offset) that falls in dst (at dst_offset).
+ * Returns true once the end of dst is reached. */
+static bool delta_copy_overlap(uint8_t *dst_p, uint64_t dst_offset, size_t dst_size,
+                               const uint8_t *buf_p, uint64_t offset, size_t size)
+{
+    uint64_t start = (offset > dst_offset) ? offset : dst_offset;
+    uint64_t end = MIN(offset + size, dst_offset + dst_size);
+
+    if (start < end) {
+        memcpy(dst_p + (start - dst_offset), buf_p + (start - offset), (size_t)(end - start));
+    }
+
+    return offset + size >= dst_offset + dst_size;
+}
+
+static void delta_image_hash_init(delta_image_hash_t *hash)
+{
+    memset(hash, 0, sizeof(*hash));
+    mbedtls_sha256_init(&hash->sha256);
+    mbedtls_sha256_starts_ret(&hash->sha256, 0);
+}
+
+static void delta_image_hash_clone(delta_image_hash_t *dst, const delta_image_hash_t *src)
+{
+    *dst = *src;
+    mbedtls_sha256_init(&dst->sha256);
+    mbedtls_sha256_clone(&dst->sha256, &src->sha256);
+}
+
+static void delta_image_hash_free(delta_image_hash_t *hash)
+{
+    mbedtls_sha256_free(&hash->sha256);
+}
+
+/* The appended hash covers the segments and the checksum byte after
+ * them, padded to 16 bytes, as in esp_image_format.c. */
+static void delta_image_hash_parse(delta_image_hash_t *hash, const uint8_t *buf_p, size_t size)
+{
+    uint64_t offset = hash->offset;
+
+    if (offset < DELTA_IMAGE_HEADER_SIZE &&
+        delta_copy_overlap(hash->header, 0, sizeof(hash->header), buf_p, offset, size)) {
+        if (hash->header[0] == DELTA_IMAGE_HEADER_MAGIC &&
+            hash->header[DELTA_IMAGE_HASH_APPENDED_OFFSET] == 1) {
+            hash->appended = true;
+            hash->segments_left = hash->header[DELTA_IMAGE_SEGMENT_COUNT_OFFSET];
+            hash->segment_offset = DELTA_IMAGE_HEADER_SIZE;
+            if (hash->segments_left == 0) {
+                hash->appended_offset = (hash->segment_offset + 16) & ~(uint64_t)15;
+            }
+        }
+    }
+
+    while (hash->segments_left > 0 &&
+           delta_copy_overlap(hash->segment_header, hash->segment_offset, sizeof(hash->segment_header),
+                              buf_p, offset, size)) {
+        hash->segment_offset += sizeof(hash->segment_header) + delta_le32(&hash->segment_header[4]);
+        if (--hash->segments_left == 0) {
+            hash->appended_offset = (hash->segment_offset + 16) & ~(uint64_t)15;
+        }
+    }
+}
+
+static void delta_image_hash_update(delta_image_hash_t *hash, const uint8_t *buf_p, size_t size)
+{
+    mbedtls_sha256_context image;
+    size_t n = 0;
+
+    delta_image_hash_parse(hash, buf_p, size);
+
+    if (hash->appended_offset > 0 && !hash->image_hashed &&
+        hash->offset + size >= hash->appended_offset) {
+        n = (size_t)(hash->appended_offset - hash->offset);
+        mbedtls_sha256_update_ret(&hash->sha256, buf_p, n);
+        mbedtls_sha256_init(&image);
+        mbedtls_sha256_clone(&image, &hash->sha256);
+        mbedtls_sha256_finish_ret(&image, hash->image_digest);
+        mbedtls_sha256_free(&image);
+        hash->image_hashed = true;
+    }
+    mbedtls_sha256_update_ret(&hash->sha256, buf_p + n, size - n);
+
+    if (hash->appended_offset > 0) {
+        (void)delta_copy_overlap(hash->appended_hash, hash->appended_offset, sizeof(hash->appended_hash),
+                                 buf_p, hash->offset, size);
+    }
+    hash->offset += size;
+}
+
+/* Compares the hash of the whole target with the expected hash, if
+ * given, and the hash appended to the image with that of the image.
+ * Sets verified if any matched. */
+static int delta_image_hash_verify(delta_image_hash_t *hash, const uint8_t *sha256, bool *verified)
+{
+    uint8_t digest[DELTA_SHA256_SIZE];
+
+    if (sha256 != NULL) {
+        mbedtls_sha256_finish_ret(&hash->sha256, digest);
+
+        if (memcmp(digest, sha256, DELTA_SHA256_SIZE) != 0) {
+            ESP_LOGE(TAG, "Target image does not match the expected SHA-256");
+            return -DELTA_TARGET_HASH_ERROR;
+        }
+        *verified = true;
+    }
+
+    if (hash->appended) {
+        if (!hash->image_hashed ||
+            hash->offset < hash->appended_offset + DELTA_SHA256_SIZE ||
+            memcmp(hash->image_digest, hash->appended_hash, DELTA_SHA256_SIZE) != 0) {
+            ESP_LOGE(TAG, "Target image does not match its appended SHA-256");
+            return -DELTA_TARGET_HASH_ERROR;
+        }
+        *verified = true;
+    }
+
+    return DELTA_OK;
+}
+
+static size_t delta_erased_run(const uint8_t *buf_p, size_t size)
+{
+    size_t n = 0;
+
+    while (n < size && buf_p[n] == 0xFF) {
+        n++;
+    }
+
+    return n;
+}
+
+static int delta_program(delta_ctx_t *ctx, size_t offset, const uint8_t *buf_p, size_t size)
+{
+    int ret;
+
+    ret = delta_sched_write(&ctx->sched, delta_storage_write_fn, ctx->dest,
+                            ctx->dest_offset + offset, buf_p, size);
+    if (ret) {
+        return ret;
+    }
+    ctx->stats.bytes_written += size;
+
+    return DELTA_OK;
+}
+
+/* Programs the first count bytes of the write buffer, leaving erased
+ * runs of at least DELTA_ERASED_RUN_MIN bytes (and so all erased
+ * pages) untouched. */
+static int delta_flush_dest(delta_ctx_t *ctx, size_t count)
+{
+    const uint8_t *buf = ctx->write_buf;
+    size_t size = count;
+    size_t start, end, run, page;
+    int ret;
+
+    if (size == 0) {
+        return DELTA_OK;
+    }
+
+    if (!ctx->dest->erased_ff) {
+        /* Encrypted writes must cover 16 byte blocks. */
+        if (size % 16 != 0) {
+            memset(ctx->write_buf + size, 0xFF, 16 - size % 16);
+            size += 16 - size % 16;
+        }
+        ret = delta_program(ctx, 0, buf, size);
+        goto out;
+    }
+
+    /* Destination pages may span flushes. */
+    for (start = 0; start < size; start = end) {
+        page = (ctx->dest_offset + start) % FLASH_WRITE_PAGE_SIZE;
+        end = MIN(size, start + FLASH_WRITE_PAGE_SIZE - page);
+        if (page == 0) {
+            ctx->page_erased = true;
+        }
+        if (delta_erased_run(buf + start, end - start) != end - start) {
+            ctx->page_erased = false;
+        }
+        if ((ctx->dest_offset + end) % FLASH_WRITE_PAGE_SIZE == 0 && ctx->page_erased) {
+            ctx->stats.pages_skipped++;
+        }
+    }
+
+    ret = DELTA_OK;
+    start = delta_erased_run(buf, size);
+
+    while (start < size && ret == DELTA_OK) {
+        end = start;
+        while (end < size) {
+            run = delta_erased_run(buf + end, size - end);
+            if (run == 0) {
+                end++;
+                continue;
+            }
+            if (run >= DELTA_ERASED_RUN_MIN || end + run == size) {
+                break;
+            }
+            end += run;
+        }
+
+        ret = delta_program(ctx, start, buf + start, end - start);
+        run = delta_erased_run(buf + end, size - end);
+        ctx->stats.bytes_skipped += run;
+        start = end + run;
+    }
+    ctx->stats.bytes_skipped += delta_erased_run(buf, size);
+
+out:
+    ctx->dest_offset += count;
+    ctx->write_buf_size -= count;
+    memmove(ctx->write_buf, ctx->write_buf + count, ctx->write_buf_size);
+
+    return ret;
+}
 
-static int delta_flash_write_dest(void *arg_p, const uint8_t *buf_p, size_t size)
+static int delta_write_dest(void *arg_p, const uint8_t *buf_p, size_t size)
 {
-    flash_mem_t *flash;
-    flash = (flash_mem_t *)arg_p;
+    delta_ctx_t *ctx;
+    size_t n;
+    int ret;
+
+    ctx = (delta_ctx_t *)arg_p;
 
-    if (!flash) {
+    if (!ctx) {
         return -DELTA_CASTING_ERROR;
     }
     if (size <= 0) {
         return -DELTA_INVALID_BUF_SIZE;
     }
+    if (ctx->dest_offset + ctx->write_buf_size + size > ctx->dest->size) {
+        return -DELTA_OUT_OF_MEMORY;
+    }
 
-    if (esp_ota_write(flash->ota_handle, buf_p, size) != ESP_OK) {
-        return -DELTA_WRITING_ERROR;
+    delta_image_hash_update(&ctx->hash, buf_p, size);
+
+    while (size > 0) {
+        n = MIN(size, sizeof(ctx->write_buf) - ctx->write_buf_size);
+        memcpy(ctx->write_buf + ctx->write_buf_size, buf_p, n);
+        ctx->write_buf_size += n;
+        buf_p += n;
+        size -= n;
+
+        if (ctx->write_buf_size == sizeof(ctx->write_buf)) {
+            ret = delta_flush_dest(ctx, ctx->write_buf_size);
+            if (ret) {
+                return ret;
+            }
+        }
     }
 
     return DELTA_OK;
 }
 
-static int delta_flash_read_src(void *arg_p, uint8_t *buf_p, size_t size)
+static int delta_read_src(void *arg_p, uint8_t *buf_p, size_t size)
 {
-    flash_mem_t *flash;
-    flash = (flash_mem_t *)arg_p;
+    delta_ctx_t *ctx;
+    ctx = (delta_ctx_t *)arg_p;
 
-    if (!flash) {
+    if (!ctx) {
         return -DELTA_CASTING_ERROR;
     }
     if (size <= 0) {
         return -DELTA_INVALID_BUF_SIZE;
     }
+    if (ctx->src_offset + size > ctx->src->size) {
+        return -DELTA_OUT_OF_BOUNDS_ERROR;
+    }
 
-    if (esp_partition_read(flash->src, flash->src_offset, buf_p, size) != ESP_OK) {
+    if (delta_storage_read(ctx->src, ctx->src_offset, buf_p, size) != DELTA_OK) {
         return -DELTA_READING_SOURCE_ERROR;
     }
 
-    flash->src_offset += size;
-    if (flash->src_offset >= flash->src->size) {
-        return -DELTA_OUT_OF_MEMORY;
-    }
+    ctx->src_offset += size;
 
     return DELTA_OK;
 }
 
-static int delta_flash_read_patch(void *arg_p, uint8_t *buf_p, size_t size)
+static int delta_seek_src(void *arg_p, int offset)
 {
-    flash_mem_t *flash;
-    flash = (flash_mem_t *)arg_p;
+    delta_ctx_t *ctx;
+    ctx = (delta_ctx_t *)arg_p;
 
-    if (!flash) {
+    if (!ctx) {
         return -DELTA_CASTING_ERROR;
     }
-    if (size <= 0) {
-        return -DELTA_INVALID_BUF_SIZE;
+
+    if ((offset < 0 && (size_t)-offset > ctx->src_offset) ||
+        (offset > 0 && ctx->src_offset + offset > ctx->src->size)) {
+        return -DELTA_SEEKING_ERROR;
     }
+    ctx->src_offset += offset;
+
+    return DELTA_OK;
+}
 
-    if (esp_partition_read(flash->patch, flash->patch_offset, buf_p, size) != ESP_OK) {
+/* Reads the target image size from the patch header, so that only the
+ * part of the destination the image will occupy needs erasing. */
+static int delta_read_target_size(delta_ctx_t *ctx, size_t patch_size, size_t *size)
+{
+    uint8_t header[6];
+    size_t length = MIN(sizeof(header), patch_size);
+    size_t i;
+    int offset;
+
+    if (length < 2 || delta_storage_read(ctx->patch, 0, header, length) != DELTA_OK) {
         return -DELTA_READING_PATCH_ERROR;
     }
 
-    flash->patch_offset += size;
-    if (flash->patch_offset >= flash->patch->size) {
-        return -DELTA_READING_PATCH_ERROR;
+    *size = header[1] & 0x3f;
+    offset = 6;
+
+    for (i = 1; (header[i] & 0x80) != 0; i++) {
+        if (i + 1 >= length) {
+            return -DELTA_READING_PATCH_ERROR;
+        }
+        *size |= (size_t)(header[i + 1] & 0x7f) << offset;
+        offset += 7;
     }
 
     return DELTA_OK;
 }
 
-static int delta_flash_seek_src(void *arg_p, int offset)
+static int delta_checkpoint_write(void *arg_p, const void *buf_p, size_t size)
 {
-    flash_mem_t *flash;
-    flash = (flash_mem_t *)arg_p;
+    delta_ctx_t *ctx = (delta_ctx_t *)arg_p;
 
-    if (!flash) {
-        return -DELTA_CASTING_ERROR;
+    if (ctx->checkpoint_pos + size > ctx->checkpoint_size) {
+        return -DELTA_INVALID_BUF_SIZE;
     }
+    memcpy((uint8_t *)ctx->checkpoint + ctx->checkpoint_pos, buf_p, size);
+    ctx->checkpoint_pos += size;
 
-    flash->src_offset += offset;
-    if (flash->src_offset >= flash->src->size) {
-        return -DELTA_SEEKING_ERROR;
+    return DELTA_OK;
+}
+
+static int delta_checkpoint_read(void *arg_p, void *buf_p, size_t size)
+{
+    delta_ctx_t *ctx = (delta_ctx_t *)arg_p;
+
+    if (ctx->checkpoint_pos + size > ctx->checkpoint_size) {
+        return -DELTA_INVALID_BUF_SIZE;
     }
+    memcpy(buf_p, (uint8_t *)ctx->checkpoint + ctx->checkpoint_pos, size);
+    ctx->checkpoint_pos += size;
 
     return DELTA_OK;
 }
 
-static int delta_init_flash_mem(flash_mem_t *flash, const delta_opts_t *opts)
+/* The checkpoint and the detools state are dumped as they are in RAM,
+ * so a checkpoint written by another build, e.g. before an update of
+ * the app applying the patch, is only used if the layout matches. */
+static uint32_t delta_checkpoint_layout(void)
+{
+    return (((uint32_t)DELTA_CHECKPOINT_VERSION << 24) |
+            ((sizeof(delta_checkpoint_t) + sizeof(struct detools_apply_patch_t)) & 0xffffff));
+}
+
+static bool delta_checkpoint_is_for(const delta_checkpoint_t *checkpoint, size_t size,
+                                    const delta_apply_opts_t *opts)
 {
-    if (!flash) {
-        return -DELTA_PARTITION_ERROR;
+    return size >= sizeof(*checkpoint) &&
+           checkpoint->layout == delta_checkpoint_layout() &&
+           checkpoint->src_address == opts->src->address &&
+           checkpoint->dest_address == opts->dest->address;
+}
+
+/* Saves everything needed to continue from the current patch offset.
+ * Target bytes up to the checkpoint are programmed first, but for a
+ * partial block that is kept in the checkpoint. */
+static int delta_checkpoint(delta_ctx_t *ctx)
+{
+    delta_checkpoint_t *checkpoint = ctx->checkpoint;
+    int64_t start, now;
+    int ret;
+
+    ret = delta_flush_dest(ctx, ctx->write_buf_size / DELTA_CHECKPOINT_ALIGN * DELTA_CHECKPOINT_ALIGN);
+    if (ret) {
+        return ret;
     }
 
-    flash->src = esp_ota_get_running_partition();
-    flash->dest = esp_ota_get_next_update_partition(NULL);
-    flash->patch = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_SPIFFS, opts->patch);
+    start = delta_sched_now_us();
+    checkpoint->layout = delta_checkpoint_layout();
+    checkpoint->patch_size = ctx->apply_patch.patch_size;
+    checkpoint->patch_crc = ctx->patch_crc;
+    checkpoint->src_address = ctx->src->address;
+    checkpoint->dest_address = ctx->dest->address;
+    checkpoint->target_size = ctx->target_size;
+    checkpoint->dest_offset = ctx->dest_offset;
+    memcpy(checkpoint->write_buf, ctx->write_buf, ctx->write_buf_size);
+    checkpoint->write_buf_size = ctx->write_buf_size;
+    checkpoint->page_erased = ctx->page_erased;
+    delta_image_hash_clone(&checkpoint->hash, &ctx->hash);
+    checkpoint->stats = ctx->stats;
 
-    if (flash->src == NULL || flash->dest == NULL || flash->patch == NULL) {
-        return -DELTA_PARTITION_ERROR;
+    ctx->checkpoint_pos = sizeof(*checkpoint);
+    ret = detools_apply_patch_dump(&ctx->apply_patch, delta_checkpoint_write);
+    if (ret) {
+        delta_image_hash_free(&checkpoint->hash);
+        ESP_LOGE(TAG, "Patch state cannot be checkpointed: %s", delta_error_as_string(ret));
+        ctx->journaling = false;
+        return DELTA_OK;
     }
 
-    if (flash->src->subtype >= ESP_PARTITION_SUBTYPE_APP_OTA_MAX ||
-        flash->dest->subtype >= ESP_PARTITION_SUBTYPE_APP_OTA_MAX) {
-        return -DELTA_PARTITION_ERROR;
+    ret = delta_journal_append(&ctx->journal, DELTA_JOURNAL_CHECKPOINT, checkpoint, ctx->checkpoint_pos);
+    delta_image_hash_free(&checkpoint->hash);
+    if (ret) {
+        return ret;
     }
 
-    if (esp_ota_begin(flash->dest, OTA_SIZE_UNKNOWN, &(flash->ota_handle)) != ESP_OK) {
-        return -DELTA_PARTITION_ERROR;
+    now = delta_sched_now_us();
+    ctx->stats.checkpoints++;
+    ctx->stats.checkpoint_us += now - start;
+
+    /* Spread checkpoints out if they take more than their share. */
+    if (ctx->stats.checkpoint_us * 100 > (uint64_t)(now - ctx->start_us) * DELTA_CHECKPOINT_MAX_OVERHEAD) {
+        ctx->checkpoint_interval *= 2;
+    }
+    ctx->next_checkpoint = detools_apply_patch_get_to_offset(&ctx->apply_patch) + ctx->checkpoint_interval;
+
+    return DELTA_OK;
+}
+
+/* CRC of the first size bytes of the patch. */
+static int delta_patch_crc(delta_ctx_t *ctx, size_t size, uint32_t *crc_p)
+{
+    size_t offset, n;
+
+    *crc_p = 0;
+
+    for (offset = 0; offset < size; offset += n) {
+        n = MIN(size - offset, sizeof(ctx->patch_buf));
+        if (delta_storage_read(ctx->patch, offset, ctx->patch_buf, n) != DELTA_OK) {
+            return -DELTA_READING_PATCH_ERROR;
+        }
+        *crc_p = delta_crc32(*crc_p, ctx->patch_buf, n);
+    }
+
+    return DELTA_OK;
+}
+
+/* Continues from the last checkpoint in the journal, if it is for this
+ * apply and the patch it was taken on. Sets resumed if so. */
+static int delta_restore(delta_ctx_t *ctx, const delta_apply_opts_t *opts, bool *resumed)
+{
+    delta_checkpoint_t *checkpoint = ctx->checkpoint;
+    size_t size = ctx->checkpoint_size;
+    uint16_t type;
+    uint32_t crc;
+    int ret;
+
+    *resumed = false;
+
+    if (delta_journal_last(&ctx->journal, &type, checkpoint, &size) != DELTA_OK ||
+        type != DELTA_JOURNAL_CHECKPOINT ||
+        !delta_checkpoint_is_for(checkpoint, size, opts) ||
+        checkpoint->patch_size != opts->patch_size ||
+        checkpoint->target_size != ctx->target_size) {
+        return DELTA_OK;
     }
-    esp_log_level_set("esp_image", ESP_LOG_ERROR);
 
-    flash->src_offset = 0;
-    flash->patch_offset = 0;
+    ctx->checkpoint_pos = sizeof(*checkpoint);
+    ctx->checkpoint_size = size;
+    ret = detools_apply_patch_restore(&ctx->apply_patch, delta_checkpoint_read);
+    ctx->checkpoint_size = delta_journal_max_size();
+    if (ret == 0) {
+        ret = delta_patch_crc(ctx, detools_apply_patch_get_patch_offset(&ctx->apply_patch), &crc);
+    }
+    if (ret != 0 || crc != checkpoint->patch_crc) {
+        ESP_LOGI(TAG, "Checkpoint does not match the patch, starting over");
+        ctx->src_offset = 0;
+        return detools_apply_patch_init(&ctx->apply_patch,
+                                        delta_read_src,
+                                        delta_seek_src,
+                                        opts->patch_size,
+                                        delta_write_dest,
+                                        ctx);
+    }
+
+    ctx->patch_crc = crc;
+    ctx->dest_offset = checkpoint->dest_offset;
+    memcpy(ctx->write_buf, checkpoint->write_buf, checkpoint->write_buf_size);
+    ctx->write_buf_size = checkpoint->write_buf_size;
+    ctx->page_erased = checkpoint->page_erased;
+    delta_image_hash_free(&ctx->hash);
+    delta_image_hash_clone(&ctx->hash, &checkpoint->hash);
+    ctx->stats = checkpoint->stats;
+    ctx->stats.resumed_at = detools_apply_patch_get_to_offset(&ctx->apply_patch);
+    *resumed = true;
 
     return DELTA_OK;
 }
 
-static int delta_set_boot_partition(flash_mem_t *flash)
+static int delta_init_ctx(delta_ctx_t *ctx, const delta_apply_opts_t *opts)
 {
-    if (esp_ota_set_boot_partition(flash->dest) != ESP_OK) {
-        return -DELTA_TARGET_IMAGE_ERROR;
+    size_t erase_offset = 0;
+    bool resumed = false;
+    int ret;
+
+    ctx->src = opts->src;
+    ctx->patch = opts->patch;
+    ctx->dest = opts->dest;
+
+    if (opts->patch_size > ctx->patch->size) {
+        return -DELTA_READING_PATCH_ERROR;
+    }
+
+    if (delta_read_target_size(ctx, opts->patch_size, &ctx->target_size) != DELTA_OK ||
+        ctx->target_size > ctx->dest->size) {
+        ctx->target_size = ctx->dest->size;
+    }
+
+    delta_sched_init(&ctx->sched, opts->max_stall_us);
+    delta_image_hash_init(&ctx->hash);
+
+    ret = detools_apply_patch_init(&ctx->apply_patch,
+                                   delta_read_src,
+                                   delta_seek_src,
+                                   opts->patch_size,
+                                   delta_write_dest,
+                                   ctx);
+    if (ret) {
+        return ret;
+    }
+
+    if (opts->journal != NULL) {
+        ctx->checkpoint_size = delta_journal_max_size();
+        ctx->checkpoint = malloc(ctx->checkpoint_size);
+        if (ctx->checkpoint == NULL) {
+            return -DELTA_OUT_OF_MEMORY;
+        }
+
+        ret = delta_journal_init(&ctx->journal, opts->journal, &ctx->sched);
+        if (ret == 0) {
+            ret = delta_restore(ctx, opts, &resumed);
+        }
+        if (ret) {
+            return ret;
+        }
+
+        ctx->journaling = true;
+        ctx->checkpoint_interval = opts->checkpoint_interval;
+        if (ctx->checkpoint_interval == 0) {
+            ctx->checkpoint_interval = DELTA_CHECKPOINT_INTERVAL;
+        }
+        ctx->next_checkpoint = detools_apply_patch_get_to_offset(&ctx->apply_patch) +
+                               ctx->checkpoint_interval;
+    }
+
+    /* Target bytes after the checkpoint may have been programmed before
+     * the apply was interrupted. Those in the sector of the checkpoint are
+     * programmed with the same values again, the rest is erased. */
+    if (resumed) {
+        ESP_LOGI(TAG, "Resuming at target offset %u", (unsigned)ctx->stats.resumed_at);
+        erase_offset = (ctx->dest_offset + PARTITION_PAGE_SIZE - 1) / PARTITION_PAGE_SIZE * PARTITION_PAGE_SIZE;
+    }
+
+    if (erase_offset < ctx->target_size &&
+        delta_sched_erase(&ctx->sched, delta_storage_erase_fn, ctx->dest, ctx->dest->address,
+                          erase_offset, ctx->target_size - erase_offset, ctx->dest->erase_sizes) != DELTA_OK) {
+        return -DELTA_CLEARING_ERROR;
     }
-    free(flash);
 
-    const esp_partition_t *boot_partition = esp_ota_get_boot_partition();
-    ESP_LOGI(TAG, "Next Boot Partition: Subtype %d at Offset 0x%x", boot_partition->subtype, boot_partition->address);
-    ESP_LOGI(TAG, "Ready to reboot!!!");
+    ctx->start_us = delta_sched_now_us();
 
     return DELTA_OK;
 }
 
-int delta_partition_init(delta_partition_writer_t *writer, const char *partition, int patch_size)
+/* Feeds the patch to detools, straight from memory if the patch
+ * storage can be mapped, and checkpoints between the pieces. */
+static int delta_process_patch(delta_ctx_t *ctx, size_t patch_size)
+{
+    const void *patch_p;
+    const uint8_t *buf_p;
+    size_t offset, size, slice;
+    int ret = DELTA_OK;
+
+    if (delta_storage_mmap(ctx->patch, 0, patch_size, &patch_p) != DELTA_OK) {
+        patch_p = NULL;
+    }
+    slice = (patch_p != NULL) ? DELTA_PATCH_MAP_SLICE_SIZE : sizeof(ctx->patch_buf);
+    offset = detools_apply_patch_get_patch_offset(&ctx->apply_patch);
+
+    while (offset < patch_size && ret == DELTA_OK) {
+        size = MIN(patch_size - offset, slice);
+
+        if (patch_p != NULL) {
+            buf_p = (const uint8_t *)patch_p + offset;
+        } else if (delta_storage_read(ctx->patch, offset, ctx->patch_buf, size) == DELTA_OK) {
+            buf_p = ctx->patch_buf;
+        } else {
+            ret = -DELTA_READING_PATCH_ERROR;
+            break;
+        }
+
+        ret = detools_apply_patch_process(&ctx->apply_patch, buf_p, size);
+        offset += size;
+
+        if (ret == DELTA_OK && ctx->journaling) {
+            ctx->patch_crc = delta_crc32(ctx->patch_crc, buf_p, size);
+            if (detools_apply_patch_get_to_offset(&ctx->apply_patch) >= ctx->next_checkpoint) {
+                ret = delta_checkpoint(ctx);
+            }
+        }
+    }
+
+    if (patch_p != NULL) {
+        delta_storage_munmap(ctx->patch, patch_p);
+    }
+
+    return ret;
+}
+
+/* Errors that come from the patch or the target it produces, and so
+ * would end a resumed apply again. Failing reads, writes and erases,
+ * or running out of memory, may be gone after a reset. */
+static bool delta_error_is_final(int error)
 {
-    if (writer == NULL || partition == NULL) {
+    switch (-error) {
+    case DETOOLS_BAD_PATCH_TYPE:
+    case DETOOLS_BAD_COMPRESSION:
+    case DETOOLS_LZMA_DECODE:
+    case DETOOLS_CORRUPT_PATCH:
+    case DETOOLS_SHORT_HEADER:
+    case DETOOLS_NOT_ENOUGH_PATCH_DATA:
+    case DETOOLS_CORRUPT_PATCH_OVERFLOW:
+    case DETOOLS_CORRUPT_PATCH_CRLE_KIND:
+    case DETOOLS_HEATSHRINK_HEADER:
+    case DETOOLS_LZ4_DECODE:
+    case DETOOLS_LZ4_WINDOW:
+    case DELTA_TARGET_HASH_ERROR:
+        return true;
+    default:
+        return false;
+    }
+}
+
+int delta_apply(const delta_apply_opts_t *opts)
+{
+    delta_ctx_t *ctx;
+    bool started = false;
+    int size;
+    int ret;
+
+    if (opts == NULL || opts->src == NULL || opts->patch == NULL || opts->dest == NULL) {
         return -DELTA_INVALID_ARGUMENT_ERROR;
     }
 
-    const esp_partition_t *patch = esp_partition_find_first(ESP_PARTITION_TYPE_DATA,
-        ESP_PARTITION_SUBTYPE_DATA_SPIFFS, partition);
-    if (patch == NULL) {
-        ESP_LOGE(TAG, "Partition Error: Could not find '%s' partition", partition);
-        return ESP_FAIL;
+    ctx = calloc(1, sizeof(delta_ctx_t));
+    if (!ctx) {
+        return -DELTA_OUT_OF_MEMORY;
+    }
+
+    ret = delta_init_ctx(ctx, opts);
+    if (ret) {
+        goto out;
     }
+    started = true;
 
-    size_t patch_page_size = (patch_size + PARTITION_PAGE_SIZE) - (patch_size % PARTITION_PAGE_SIZE);
-    if (esp_partition_erase_range(patch, 0, patch_page_size) != ESP_OK) {
-        ESP_LOGE(TAG, "Partition Error: Could not erase '%s' region!", partition);
-        return ESP_FAIL;
+    ret = delta_process_patch(ctx, opts->patch_size);
+    if (ret == 0) {
+        ret = detools_apply_patch_finalize(&ctx->apply_patch);
+    } else {
+        (void)detools_apply_patch_finalize(&ctx->apply_patch);
     }
+    if (ret <= 0) {
+        goto out;
+    }
+    size = ret;
 
-    writer->name = partition;
-    writer->patch = patch;
-    writer->size = patch_size;
-    writer->offset = 0;
+    ret = delta_flush_dest(ctx, ctx->write_buf_size);
+    if (ret) {
+        goto out;
+    }
 
-    return ESP_OK;
+    ret = delta_image_hash_verify(&ctx->hash, opts->sha256, &ctx->stats.verified);
+    if (ret) {
+        goto out;
+    }
+
+    ESP_LOGI(TAG, "Patch Successful!!!");
+    ctx->stats.worst_stall_us = ctx->sched.worst_stall_us;
+    ctx->stats.flash_slices = ctx->sched.slices;
+    ctx->stats.flash_busy_us = ctx->sched.busy_us;
+    ESP_LOGI(TAG, "Programmed %u B, skipped %u erased B (%u pages)",
+             (unsigned)ctx->stats.bytes_written, (unsigned)ctx->stats.bytes_skipped,
+             (unsigned)ctx->stats.pages_skipped);
+    ESP_LOGI(TAG, "Worst flash stall %u us over %u operations",
+             (unsigned)ctx->stats.worst_stall_us, (unsigned)ctx->stats.flash_slices);
+    if (ctx->stats.checkpoints > 0) {
+        ESP_LOGI(TAG, "%u checkpoints took %u us", (unsigned)ctx->stats.checkpoints,
+                 (unsigned)ctx->stats.checkpoint_us);
+    }
+    if (opts->stats) {
+        *opts->stats = ctx->stats;
+    }
+    ret = size;
+
+out:
+    /* Once done, or failed on the patch itself, resuming would end the
+     * same way. Other failures keep their checkpoints. */
+    if (started && ctx->checkpoint != NULL && (ret > 0 || delta_error_is_final(ret)) &&
+        delta_journal_append(&ctx->journal, DELTA_JOURNAL_DONE, NULL, 0) != DELTA_OK) {
+        ESP_LOGE(TAG, "Could not close the checkpoint journal");
+    }
+    delta_image_hash_free(&ctx->hash);
+    free(ctx->checkpoint);
+    free(ctx);
+
+    return ret;
 }
 
-int delta_partition_write(delta_partition_writer_t *writer, const char *buf, int size)
+int delta_apply_pending(const delta_apply_opts_t *opts)
 {
-    if (writer == NULL || buf == NULL) {
+    delta_journal_t journal;
+    delta_checkpoint_t *checkpoint;
+    size_t size = delta_journal_max_size();
+    uint16_t type;
+    int ret;
+
+    if (opts == NULL || opts->src == NULL || opts->dest == NULL || opts->journal == NULL) {
         return -DELTA_INVALID_ARGUMENT_ERROR;
     }
 
-    if (writer->offset >= writer->size) {
+    ret = delta_journal_init(&journal, opts->journal, NULL);
+    if (ret) {
+        return ret;
+    }
+
+    checkpoint = malloc(size);
+    if (!checkpoint) {
+        return -DELTA_OUT_OF_MEMORY;
+    }
+
+    ret = 0;
+    if (delta_journal_last(&journal, &type, checkpoint, &size) == DELTA_OK &&
+        type == DELTA_JOURNAL_CHECKPOINT &&
+        delta_checkpoint_is_for(checkpoint, size, opts)) {
+        ret = (int)checkpoint->patch_size;
+    }
+    free(checkpoint);
+
+    return ret;
+}
+
+typedef struct {
+    delta_storage_t *storage;
+    delta_storage_t *patch;
+    delta_sched_t sched;
+    delta_stats_t stats;
+    struct detools_apply_patch_in_place_t apply_patch;
+    uint8_t patch_buf[DELTA_PATCH_CHUNK_SIZE];
+    /* Segments are shifted a sector at a time */
+    uint8_t workspace[PARTITION_PAGE_SIZE];
+    /* Source segments kept instead of shifting, if any */
+    uint8_t *swap;
+    /* Step persistence, if a journal is given */
+    delta_step_log_t steps;
+    delta_step_log_id_t id;
+    int step;
+} delta_in_place_ctx_t;
+
+static int delta_in_place_mem_read(void *arg_p, void *dst_p, uintptr_t src, size_t size)
+{
+    delta_in_place_ctx_t *ctx = (delta_in_place_ctx_t *)arg_p;
+
+    if (src + size > ctx->storage->size) {
         return -DELTA_OUT_OF_BOUNDS_ERROR;
     }
+    if (delta_storage_read(ctx->storage, src, dst_p, size) != DELTA_OK) {
+        return -DELTA_READING_SOURCE_ERROR;
+    }
+
+    return DELTA_OK;
+}
+
+static int delta_in_place_mem_write(void *arg_p, uintptr_t dst, void *src_p, size_t size)
+{
+    delta_in_place_ctx_t *ctx = (delta_in_place_ctx_t *)arg_p;
 
-    if (esp_partition_write(writer->patch, writer->offset, buf, size) != ESP_OK) {
-        ESP_LOGE(TAG, "Partition Error: Could not write to '%s' region!", writer->name);
-        return ESP_FAIL;
-    };
+    if (dst + size > ctx->storage->size) {
+        return -DELTA_OUT_OF_MEMORY;
+    }
+    if (delta_sched_write(&ctx->sched, delta_storage_write_fn, ctx->storage,
+                          dst, src_p, size) != DELTA_OK) {
+        return -DELTA_WRITING_ERROR;
+    }
+    ctx->stats.bytes_written += size;
 
-    writer->offset += size;
-    return ESP_OK;
+    return DELTA_OK;
 }
 
-int delta_check_and_apply(int patch_size, const delta_opts_t *opts)
+static int delta_in_place_mem_erase(void *arg_p, uintptr_t addr, size_t size)
 {
-    static const delta_opts_t DEFAULT_DELTA_OPTS = {
-        .src = DEFAULT_PARTITION_LABEL_SRC,
-        .dest = DEFAULT_PARTITION_LABEL_DEST,
-        .patch = DEFAULT_PARTITION_LABEL_PATCH
-    };
+    delta_in_place_ctx_t *ctx = (delta_in_place_ctx_t *)arg_p;
 
-    ESP_LOGI(TAG, "Initializing delta update...");
+    if (addr + size > ctx->storage->size) {
+        return -DELTA_OUT_OF_MEMORY;
+    }
+    if (delta_sched_erase(&ctx->sched, delta_storage_erase_fn, ctx->storage, ctx->storage->address,
+                          addr, size, ctx->storage->erase_sizes) != DELTA_OK) {
+        return -DELTA_CLEARING_ERROR;
+    }
 
-    flash_mem_t *flash = NULL;
-    int ret = 0;
+    return DELTA_OK;
+}
 
-    if (patch_size < 0) {
-        return patch_size;
-    } else if (patch_size > 0) {
-        flash = calloc(1, sizeof(flash_mem_t));
-        if (!flash) {
-            return -DELTA_OUT_OF_MEMORY;
+/* Each completed step is logged before the next one overwrites what it
+ * read. The final step zero(0) is not logged, the log is closed once
+ * the target image is verified instead. */
+static int delta_in_place_step_set(void *arg_p, int step)
+{
+    delta_in_place_ctx_t *ctx = (delta_in_place_ctx_t *)arg_p;
+    int64_t start;
+    int ret;
+
+    if (step == 0) {
+        return DELTA_OK;
+    }
+
+    start = delta_sched_now_us();
+    ret = delta_step_log_set(&ctx->steps, step);
+    if (ret) {
+        return ret;
+    }
+    ctx->step = step;
+    ctx->stats.checkpoints++;
+    ctx->stats.checkpoint_us += delta_sched_now_us() - start;
+
+    return DELTA_OK;
+}
+
+static int delta_in_place_step_get(void *arg_p, int *step_p)
+{
+    *step_p = ((delta_in_place_ctx_t *)arg_p)->step;
+
+    return DELTA_OK;
+}
+
+/* An interrupted apply to the same storage, if any, and its last step. */
+static bool delta_in_place_interrupted(const delta_step_log_t *steps, const delta_storage_t *storage,
+                                       delta_step_log_id_t *id, int *step_p)
+{
+    if (!steps->found || steps->id.address != storage->address) {
+        return false;
+    }
+    *id = steps->id;
+
+    return delta_step_log_get(steps, id, step_p) &&
+           (*step_p > 0 || *step_p == DETOOLS_IN_PLACE_SWAP_STEP);
+}
+
+/* Continues after the last step logged. Once a step is done the source
+ * image is gone, so steps logged for another patch are an error rather
+ * than a reason to start over. */
+static int delta_in_place_restore(delta_in_place_ctx_t *ctx, const delta_apply_opts_t *opts)
+{
+    delta_step_log_id_t last;
+    size_t offset, n;
+    int step;
+
+    ctx->id.patch_size = (uint32_t)opts->patch_size;
+    ctx->id.address = (uint32_t)ctx->storage->address;
+
+    for (offset = 0; offset < opts->patch_size; offset += n) {
+        n = MIN(opts->patch_size - offset, sizeof(ctx->patch_buf));
+        if (delta_storage_read(ctx->patch, offset, ctx->patch_buf, n) != DELTA_OK) {
+            return -DELTA_READING_PATCH_ERROR;
         }
+        ctx->id.patch_crc = delta_crc32(ctx->id.patch_crc, ctx->patch_buf, n);
+    }
+
+    if (!delta_in_place_interrupted(&ctx->steps, ctx->storage, &last, &step)) {
+        return delta_step_log_begin(&ctx->steps, &ctx->id);
+    }
+
+    /* Source segments kept in RAM are lost on a reset. */
+    if (step == DETOOLS_IN_PLACE_SWAP_STEP) {
+        ESP_LOGE(TAG, "Interrupted in-place update kept source segments in RAM, neither image is intact");
+        return -DELTA_JOURNAL_ERROR;
+    }
+
+    if (!delta_step_log_get(&ctx->steps, &ctx->id, &ctx->step)) {
+        ESP_LOGE(TAG, "Interrupted in-place update was for another patch");
+        return -DELTA_JOURNAL_ERROR;
+    }
+
+    ctx->stats.resumed_step = ctx->step;
+    ESP_LOGI(TAG, "Resuming after step %d", ctx->step);
+
+    return DELTA_OK;
+}
+
+/* Feeds the whole patch to detools, straight from memory if the patch
+ * storage can be mapped. Completed steps only advance the engine. */
+static int delta_in_place_process_patch(delta_in_place_ctx_t *ctx, size_t patch_size)
+{
+    const void *patch_p;
+    const uint8_t *buf_p;
+    size_t offset, size, slice;
+    int ret = DELTA_OK;
+
+    if (delta_storage_mmap(ctx->patch, 0, patch_size, &patch_p) != DELTA_OK) {
+        patch_p = NULL;
+    }
+    slice = (patch_p != NULL) ? DELTA_PATCH_MAP_SLICE_SIZE : sizeof(ctx->patch_buf);
+
+    for (offset = 0; offset < patch_size && ret == DELTA_OK; offset += size) {
+        size = MIN(patch_size - offset, slice);
 
-        if (!opts) {
-            opts = &DEFAULT_DELTA_OPTS;
+        if (patch_p != NULL) {
+            buf_p = (const uint8_t *)patch_p + offset;
+        } else if (delta_storage_read(ctx->patch, offset, ctx->patch_buf, size) == DELTA_OK) {
+            buf_p = ctx->patch_buf;
+        } else {
+            ret = -DELTA_READING_PATCH_ERROR;
+            break;
         }
 
-        ret = delta_init_flash_mem(flash, opts);
-        if (ret) {
-            return ret;
+        ret = detools_apply_patch_in_place_process(&ctx->apply_patch, buf_p, size);
+    }
+
+    if (patch_p != NULL) {
+        delta_storage_munmap(ctx->patch, patch_p);
+    }
+
+    if (ret == DELTA_OK) {
+        ret = detools_apply_patch_in_place_finalize(&ctx->apply_patch);
+    } else {
+        (void)detools_apply_patch_in_place_finalize(&ctx->apply_patch);
+    }
+
+    return ret;
+}
+
+/* Reads the target image back, as steps skipped on resume were never
+ * hashed, and checks it the same way as delta_apply(). */
+static int delta_in_place_verify(delta_in_place_ctx_t *ctx, size_t size, const uint8_t *sha256)
+{
+    delta_image_hash_t hash;
+    size_t offset, n;
+    int ret = DELTA_OK;
+
+    delta_image_hash_init(&hash);
+
+    for (offset = 0; offset < size; offset += n) {
+        n = MIN(size - offset, sizeof(ctx->patch_buf));
+        if (delta_storage_read(ctx->storage, offset, ctx->patch_buf, n) != DELTA_OK) {
+            ret = -DELTA_READING_SOURCE_ERROR;
+            goto out;
         }
+        delta_image_hash_update(&hash, ctx->patch_buf, n);
+    }
 
-        ret = detools_apply_patch_callbacks(delta_flash_read_src,
-                                            delta_flash_seek_src,
-                                            delta_flash_read_patch,
-                                            (size_t) patch_size,
-                                            delta_flash_write_dest,
-                                            flash);
+    ret = delta_image_hash_verify(&hash, sha256, &ctx->stats.verified);
 
-        if (ret <= 0) {
-            return ret;
+out:
+    delta_image_hash_free(&hash);
+
+    return ret;
+}
+
+int delta_apply_in_place(const delta_apply_opts_t *opts)
+{
+    delta_in_place_ctx_t *ctx;
+    int size;
+    int ret;
+
+    if (opts == NULL || opts->patch == NULL || opts->dest == NULL ||
+        (opts->src != NULL && opts->src != opts->dest)) {
+        return -DELTA_INVALID_ARGUMENT_ERROR;
+    }
+
+    /* Segments are written piecewise, which encrypted flash (that
+     * must be written 16 bytes at a time) does not allow. */
+    if (!opts->dest->erased_ff) {
+        return -DELTA_INVALID_ARGUMENT_ERROR;
+    }
+
+    if (opts->patch_size > opts->patch->size) {
+        return -DELTA_READING_PATCH_ERROR;
+    }
+
+    ctx = calloc(1, sizeof(delta_in_place_ctx_t));
+    if (!ctx) {
+        return -DELTA_OUT_OF_MEMORY;
+    }
+
+    ctx->storage = opts->dest;
+    ctx->patch = opts->patch;
+    delta_sched_init(&ctx->sched, opts->max_stall_us);
+
+    if (opts->journal != NULL) {
+        ret = delta_step_log_init(&ctx->steps, opts->journal, &ctx->sched);
+        if (ret == 0) {
+            ret = delta_in_place_restore(ctx, opts);
+        }
+        if (ret) {
+            goto out;
+        }
+    }
+
+    ret = detools_apply_patch_in_place_init(&ctx->apply_patch,
+                                            delta_in_place_mem_read,
+                                            delta_in_place_mem_write,
+                                            delta_in_place_mem_erase,
+                                            opts->journal != NULL ? delta_in_place_step_set : NULL,
+                                            opts->journal != NULL ? delta_in_place_step_get : NULL,
+                                            opts->patch_size,
+                                            ctx);
+    if (ret == 0) {
+        ret = detools_apply_patch_in_place_set_workspace(&ctx->apply_patch, ctx->workspace,
+                                                         sizeof(ctx->workspace));
+    }
+    if (ret == 0 && opts->in_place_swap_size > 0) {
+        ctx->swap = malloc(opts->in_place_swap_size);
+        if (ctx->swap == NULL) {
+            ret = -DELTA_OUT_OF_MEMORY;
+        } else {
+            ret = detools_apply_patch_in_place_set_swap(&ctx->apply_patch, ctx->swap,
+                                                        opts->in_place_swap_size);
         }
+    }
+    if (ret) {
+        goto out;
+    }
 
-        ESP_LOGI(TAG, "Patch Successful!!!");
-        return delta_set_boot_partition(flash);
+    ret = delta_in_place_process_patch(ctx, opts->patch_size);
+    if (ret <= 0) {
+        /* Keep the journal as it is, so that the update can resume. */
+        goto out;
     }
+    size = ret;
 
-    return 0;
+    ret = delta_in_place_verify(ctx, (size_t)size, opts->sha256);
+
+    /* Every step is done, resuming would end the same way. */
+    if (opts->journal != NULL && delta_step_log_set(&ctx->steps, 0) != DELTA_OK) {
+        ESP_LOGE(TAG, "Could not close the step log");
+    }
+    if (ret) {
+        goto out;
+    }
+
+    ESP_LOGI(TAG, "Patch Successful!!!");
+    ctx->stats.worst_stall_us = ctx->sched.worst_stall_us;
+    ctx->stats.flash_slices = ctx->sched.slices;
+    ctx->stats.flash_busy_us = ctx->sched.busy_us;
+    ESP_LOGI(TAG, "Programmed %u B in place", (unsigned)ctx->stats.bytes_written);
+    if (ctx->stats.checkpoints > 0) {
+        ESP_LOGI(TAG, "%u steps took %u us to log", (unsigned)ctx->stats.checkpoints,
+                 (unsigned)ctx->stats.checkpoint_us);
+    }
+    if (opts->stats) {
+        *opts->stats = ctx->stats;
+    }
+    ret = size;
+
+out:
+    free(ctx->swap);
+    free(ctx);
+
+    return ret;
 }
 
-const char *delta_error_as_string(int error)
+int delta_apply_in_place_pending(const delta_apply_opts_t *opts)
 {
-    if (error < 28) {
-        return detools_error_as_string(error);
+    delta_step_log_t steps;
+    delta_step_log_id_t id;
+    int step;
+    int ret;
+
+    if (opts == NULL || opts->dest == NULL || opts->journal == NULL) {
+        return -DELTA_INVALID_ARGUMENT_ERROR;
+    }
+
+    ret = delta_step_log_init(&steps, opts->journal, NULL);
+    if (ret) {
+        return ret;
     }
 
+    if (delta_in_place_interrupted(&steps, opts->dest, &id, &step)) {
+        if (step == DETOOLS_IN_PLACE_SWAP_STEP) {
+            return -DELTA_JOURNAL_ERROR;
+        }
+        return (int)id.patch_size;
+    }
+
+    return 0;
+}
+
+const char *delta_error_as_string(int error)
+{
     if (error < 0) {
         error *= -1;
     }
 
+    if (error < 28) {
+        return detools_error_as_string(error);
+    }
+
     switch (error) {
     case DELTA_OUT_OF_MEMORY:
         return "Target partition out of memory.";
@@ -279,7 +1242,7 @@ const char *delta_error_as_string(int error)
     case DELTA_SEEKING_ERROR:
         return "Seek error: source image.";
     case DELTA_CASTING_ERROR:
-        return "Error casting to flash_mem_t.";
+        return "Error casting to delta_ctx_t.";
     case DELTA_INVALID_BUF_SIZE:
         return "Read/write buffer less or equal to 0.";
     case DELTA_CLEARING_ERROR:
@@ -288,6 +1251,14 @@ const char *delta_error_as_string(int error)
         return "Flash partition not found.";
     case DELTA_TARGET_IMAGE_ERROR:
         return "Invalid target image to boot from.";
+    case DELTA_INVALID_ARGUMENT_ERROR:
+        return "Invalid argument.";
+    case DELTA_OUT_OF_BOUNDS_ERROR:
+        return "Write beyond the patch partition.";
+    case DELTA_TARGET_HASH_ERROR:
+        return "Target image SHA-256 mismatch.";
+    case DELTA_JOURNAL_ERROR:
+        return "No valid checkpoint journal record.";
     default:
         return "Unknown error.";
     }
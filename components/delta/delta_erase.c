@@ -0,0 +1,142 @@
+/*
+ * SPDX-FileCopyrightText: 2016 Intel Corporation
+ *                         2020 Thesis projects
+ *
+ * SPDX-License-Identifier: Apache 2.0 License
+ *
+ * SPDX-FileContributor: 2021 Laukik Hase
+ */
+
+#include <string.h>
+
+#include "delta.h"
+#include "delta_erase.h"
+
+static const size_t erase_sizes[] = {
+    DELTA_ERASE_BLOCK64_SIZE,
+    DELTA_ERASE_BLOCK32_SIZE,
+    DELTA_ERASE_SECTOR_SIZE,
+};
+
+static const uint32_t erase_masks[] = {
+    DELTA_ERASE_BLOCK64,
+    DELTA_ERASE_BLOCK32,
+    DELTA_ERASE_SECTOR,
+};
+
+static int erase_index(size_t size)
+{
+    switch (size) {
+    case DELTA_ERASE_SECTOR_SIZE:
+        return 0;
+    case DELTA_ERASE_BLOCK32_SIZE:
+        return 1;
+    case DELTA_ERASE_BLOCK64_SIZE:
+        return 2;
+    default:
+        return -1;
+    }
+}
+
+int delta_erase_plan_init(delta_erase_plan_t *plan, size_t base, size_t offset, size_t size, uint32_t sizes)
+{
+    if (plan == NULL || (base + offset) % DELTA_ERASE_SECTOR_SIZE != 0) {
+        return -DELTA_INVALID_ARGUMENT_ERROR;
+    }
+
+    plan->base = base;
+    plan->offset = offset;
+    plan->end = offset + (size + DELTA_ERASE_SECTOR_SIZE - 1) / DELTA_ERASE_SECTOR_SIZE * DELTA_ERASE_SECTOR_SIZE;
+    plan->sizes = sizes | DELTA_ERASE_SECTOR;
+
+    return DELTA_OK;
+}
+
+bool delta_erase_plan_next(delta_erase_plan_t *plan, delta_erase_op_t *op)
+{
+    size_t i;
+
+    if (plan->offset >= plan->end) {
+        return false;
+    }
+
+    for (i = 0; i < sizeof(erase_sizes) / sizeof(erase_sizes[0]); i++) {
+        if ((plan->sizes & erase_masks[i]) &&
+            (plan->base + plan->offset) % erase_sizes[i] == 0 &&
+            plan->end - plan->offset >= erase_sizes[i]) {
+            break;
+        }
+    }
+
+    op->offset = plan->offset;
+    op->size = erase_sizes[i];
+    plan->offset += op->size;
+
+    return true;
+}
+
+uint32_t delta_erase_op_cost_us(const delta_erase_op_t *op)
+{
+    switch (op->size) {
+    case DELTA_ERASE_BLOCK64_SIZE:
+        return DELTA_ERASE_BLOCK64_COST_US;
+    case DELTA_ERASE_BLOCK32_SIZE:
+        return DELTA_ERASE_BLOCK32_COST_US;
+    default:
+        return DELTA_ERASE_SECTOR_COST_US;
+    }
+}
+
+int delta_erase_range(delta_erase_fn_t erase, void *arg_p, size_t base,
+                      size_t offset, size_t size, uint32_t sizes)
+{
+    delta_erase_plan_t plan;
+    delta_erase_op_t op;
+    int ret;
+
+    ret = delta_erase_plan_init(&plan, base, offset, size, sizes);
+    if (ret) {
+        return ret;
+    }
+
+    while (delta_erase_plan_next(&plan, &op)) {
+        ret = erase(arg_p, op.offset, op.size);
+        if (ret) {
+            return ret;
+        }
+    }
+
+    return DELTA_OK;
+}
+
+void delta_erase_sim_init(delta_erase_sim_t *sim, uint8_t *mem, size_t size)
+{
+    memset(sim, 0, sizeof(*sim));
+    sim->mem = mem;
+    sim->size = size;
+    sim->cost_us[0] = DELTA_ERASE_SECTOR_COST_US;
+    sim->cost_us[1] = DELTA_ERASE_BLOCK32_COST_US;
+    sim->cost_us[2] = DELTA_ERASE_BLOCK64_COST_US;
+}
+
+int delta_erase_sim_erase(void *arg_p, size_t offset, size_t size)
+{
+    delta_erase_sim_t *sim = (delta_erase_sim_t *)arg_p;
+    int i = erase_index(size);
+
+    if (sim == NULL || i < 0 || (sim->base + offset) % size != 0) {
+        return -DELTA_INVALID_ARGUMENT_ERROR;
+    }
+
+    if (sim->mem != NULL) {
+        if (offset + size > sim->size) {
+            return -DELTA_OUT_OF_BOUNDS_ERROR;
+        }
+        memset(sim->mem + offset, 0xFF, size);
+    }
+
+    sim->ops[i]++;
+    sim->total_us += sim->cost_us[i];
+
+    return DELTA_OK;
+}
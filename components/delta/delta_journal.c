@@ -0,0 +1,235 @@
+/*
+ * SPDX-FileCopyrightText: 2016 Intel Corporation
+ *                         2020 Thesis projects
+ *
+ * SPDX-License-Identifier: Apache 2.0 License
+ *
+ * SPDX-FileContributor: 2021 Laukik Hase
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "delta.h"
+#include "delta_journal.h"
+
+#define JOURNAL_MAGIC (0x4e524a44) /* "DJRN" */
+
+#define ALIGN_UP(x, a) (((x) + (a) - 1) / (a) * (a))
+
+#ifndef MIN
+#define MIN(x, y) (((x) < (y)) ? (x) : (y))
+#endif
+
+typedef struct {
+    uint32_t magic;
+    uint32_t seq;
+    uint16_t type;
+    uint16_t reserved;
+    uint32_t size;
+    uint32_t crc;   /* Of the fields above and the payload */
+} journal_header_t;
+
+static const uint32_t crc32_nibble[16] = {
+    0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac,
+    0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+    0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c,
+    0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c
+};
+
+uint32_t delta_crc32(uint32_t crc, const void *buf_p, size_t size)
+{
+    const uint8_t *p = buf_p;
+
+    crc = ~crc;
+
+    while (size-- > 0) {
+        crc ^= *p++;
+        crc = (crc >> 4) ^ crc32_nibble[crc & 0xf];
+        crc = (crc >> 4) ^ crc32_nibble[crc & 0xf];
+    }
+
+    return ~crc;
+}
+
+size_t delta_journal_max_size(void)
+{
+    return DELTA_JOURNAL_SECTOR_SIZE - sizeof(journal_header_t);
+}
+
+static size_t journal_end(const delta_journal_t *journal)
+{
+    return journal->storage->size / DELTA_JOURNAL_SECTOR_SIZE * DELTA_JOURNAL_SECTOR_SIZE;
+}
+
+static uint32_t journal_header_crc(const journal_header_t *header)
+{
+    return delta_crc32(0, header, offsetof(journal_header_t, crc));
+}
+
+/* Checks the payload CRC of the record at offset. */
+static int journal_check(delta_journal_t *journal, size_t offset, const journal_header_t *header)
+{
+    uint8_t buf[128];
+    uint32_t crc = journal_header_crc(header);
+    size_t pos, n;
+
+    offset += sizeof(*header);
+
+    for (pos = 0; pos < header->size; pos += n) {
+        n = MIN(sizeof(buf), header->size - pos);
+        if (delta_storage_read(journal->storage, offset + pos, buf, n) != DELTA_OK) {
+            return -DELTA_JOURNAL_ERROR;
+        }
+        crc = delta_crc32(crc, buf, n);
+    }
+
+    return crc == header->crc ? DELTA_OK : -DELTA_JOURNAL_ERROR;
+}
+
+/* Walks the records of a sector, up to the first invalid one. */
+static void journal_scan_sector(delta_journal_t *journal, size_t sector)
+{
+    journal_header_t header;
+    size_t offset = sector;
+    size_t end = sector + DELTA_JOURNAL_SECTOR_SIZE;
+
+    while (offset + sizeof(header) <= end) {
+        if (delta_storage_read(journal->storage, offset, &header, sizeof(header)) != DELTA_OK ||
+            header.magic != JOURNAL_MAGIC ||
+            header.size > end - offset - sizeof(header) ||
+            journal_check(journal, offset, &header) != DELTA_OK) {
+            break;
+        }
+
+        if (!journal->found || (int32_t)(header.seq - journal->seq) > 0) {
+            journal->found = true;
+            journal->seq = header.seq;
+            journal->last_type = header.type;
+            journal->last_offset = offset + sizeof(header);
+            journal->last_size = header.size;
+        }
+
+        offset += ALIGN_UP(sizeof(header) + header.size, DELTA_JOURNAL_ALIGN);
+    }
+}
+
+int delta_journal_init(delta_journal_t *journal, delta_storage_t *storage, delta_sched_t *sched)
+{
+    size_t sector;
+
+    if (journal == NULL || storage == NULL ||
+        storage->size < 2 * DELTA_JOURNAL_SECTOR_SIZE) {
+        return -DELTA_INVALID_ARGUMENT_ERROR;
+    }
+
+    memset(journal, 0, sizeof(*journal));
+    journal->storage = storage;
+    journal->sched = sched;
+
+    for (sector = 0; sector < journal_end(journal); sector += DELTA_JOURNAL_SECTOR_SIZE) {
+        journal_scan_sector(journal, sector);
+    }
+
+    if (journal->found) {
+        journal->offset = (journal->last_offset / DELTA_JOURNAL_SECTOR_SIZE + 1) * DELTA_JOURNAL_SECTOR_SIZE;
+        if (journal->offset >= journal_end(journal)) {
+            journal->offset = 0;
+        }
+    }
+
+    return DELTA_OK;
+}
+
+int delta_journal_last(delta_journal_t *journal, uint16_t *type_p, void *buf_p, size_t *size_p)
+{
+    if (!journal->found) {
+        return -DELTA_JOURNAL_ERROR;
+    }
+    if (journal->last_size > *size_p) {
+        return -DELTA_INVALID_BUF_SIZE;
+    }
+
+    if (delta_storage_read(journal->storage, journal->last_offset, buf_p, journal->last_size) != DELTA_OK) {
+        return -DELTA_JOURNAL_ERROR;
+    }
+    *type_p = journal->last_type;
+    *size_p = journal->last_size;
+
+    return DELTA_OK;
+}
+
+static int journal_write(delta_journal_t *journal, size_t offset, const void *buf_p, size_t size)
+{
+    if (journal->sched != NULL) {
+        return delta_sched_write(journal->sched, delta_storage_write_fn, journal->storage,
+                                 offset, buf_p, size);
+    }
+
+    return delta_storage_write(journal->storage, offset, buf_p, size);
+}
+
+int delta_journal_append(delta_journal_t *journal, uint16_t type, const void *buf_p, size_t size)
+{
+    journal_header_t header;
+    size_t total = ALIGN_UP(sizeof(header) + size, DELTA_JOURNAL_ALIGN);
+    size_t sector_end;
+    int ret;
+
+    if (size > delta_journal_max_size()) {
+        return -DELTA_INVALID_BUF_SIZE;
+    }
+
+    if (journal->offset % DELTA_JOURNAL_SECTOR_SIZE != 0) {
+        sector_end = ALIGN_UP(journal->offset, DELTA_JOURNAL_SECTOR_SIZE);
+        if (journal->offset + sizeof(header) + size > sector_end) {
+            journal->offset = sector_end < journal_end(journal) ? sector_end : 0;
+        }
+    }
+
+    /* Moving on to the next sector drops its (oldest) records. */
+    if (journal->offset % DELTA_JOURNAL_SECTOR_SIZE == 0) {
+        if (journal->sched != NULL) {
+            ret = delta_sched_erase(journal->sched, delta_storage_erase_fn, journal->storage,
+                                    journal->storage->address, journal->offset,
+                                    DELTA_JOURNAL_SECTOR_SIZE, DELTA_ERASE_SECTOR);
+        } else {
+            ret = delta_storage_erase(journal->storage, journal->offset, DELTA_JOURNAL_SECTOR_SIZE);
+        }
+        if (ret) {
+            return -DELTA_CLEARING_ERROR;
+        }
+    }
+
+    header.magic = JOURNAL_MAGIC;
+    header.seq = journal->seq + 1;
+    header.type = type;
+    header.reserved = 0xffff;
+    header.size = size;
+    header.crc = delta_crc32(journal_header_crc(&header), buf_p, size);
+
+    /* The header goes last, it commits the record. */
+    if (size > 0) {
+        ret = journal_write(journal, journal->offset + sizeof(header), buf_p, size);
+        if (ret) {
+            return ret;
+        }
+    }
+    ret = journal_write(journal, journal->offset, &header, sizeof(header));
+    if (ret) {
+        return ret;
+    }
+
+    journal->found = true;
+    journal->seq = header.seq;
+    journal->last_type = type;
+    journal->last_offset = journal->offset + sizeof(header);
+    journal->last_size = size;
+    journal->offset += total;
+    if (journal->offset >= journal_end(journal)) {
+        journal->offset = 0;
+    }
+
+    return DELTA_OK;
+}
@@ -0,0 +1,379 @@
+/*
+ * SPDX-FileCopyrightText: 2016 Intel Corporation
+ *                         2020 Thesis projects
+ *
+ * SPDX-License-Identifier: Apache 2.0 License
+ *
+ * SPDX-FileContributor: 2021 Laukik Hase
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "esp_err.h"
+#include "esp_log.h"
+#include "esp_system.h"
+
+#include "esp_partition.h"
+#include "esp_ota_ops.h"
+#include "esp_image_format.h"
+
+#include "delta.h"
+#include "delta_storage.h"
+
+/* Signatures are only checked by esp_image_verify() */
+#if defined(CONFIG_SECURE_BOOT) || defined(CONFIG_SECURE_SIGNED_ON_UPDATE)
+#define DELTA_FAST_FINALIZE_SUPPORTED (0)
+#else
+#define DELTA_FAST_FINALIZE_SUPPORTED (1)
+#endif
+
+static const char *TAG = "delta";
+
+/* Target image verified while patching, skipped by the next
+ * esp_image_verify() of its partition */
+static const esp_partition_t *delta_verified_partition;
+static size_t delta_verified_size;
+
+esp_err_t __real_esp_image_verify(esp_image_load_mode_t mode, const esp_partition_pos_t *part,
+                                  esp_image_metadata_t *data);
+
+/* esp_ota_set_boot_partition() reads the whole image back through
+ * esp_image_verify(), which the component wraps at link time. */
+esp_err_t __wrap_esp_image_verify(esp_image_load_mode_t mode, const esp_partition_pos_t *part,
+                                  esp_image_metadata_t *data)
+{
+    const esp_partition_t *verified = delta_verified_partition;
+
+    delta_verified_partition = NULL;
+
+    if (verified != NULL && mode == ESP_IMAGE_VERIFY && part != NULL &&
+        part->offset == verified->address && data != NULL) {
+        memset(data, 0, sizeof(*data));
+        data->start_addr = part->offset;
+        data->image_len = delta_verified_size;
+        return ESP_OK;
+    }
+
+    return __real_esp_image_verify(mode, part, data);
+}
+
+static int delta_set_boot_partition(const esp_partition_t *dest, const delta_opts_t *opts,
+                                    const delta_stats_t *stats, int size)
+{
+    esp_err_t err;
+
+    if (stats->verified) {
+        ESP_LOGI(TAG, "Target image verified while patching");
+
+        if (opts->fast_finalize && DELTA_FAST_FINALIZE_SUPPORTED) {
+            delta_verified_partition = dest;
+            delta_verified_size = (size_t)size;
+        }
+    }
+
+    err = esp_ota_set_boot_partition(dest);
+    delta_verified_partition = NULL;
+    if (err != ESP_OK) {
+        return -DELTA_TARGET_IMAGE_ERROR;
+    }
+
+    const esp_partition_t *boot_partition = esp_ota_get_boot_partition();
+    ESP_LOGI(TAG, "Next Boot Partition: Subtype %d at Offset 0x%x", boot_partition->subtype, boot_partition->address);
+    ESP_LOGI(TAG, "Ready to reboot!!!");
+
+    return DELTA_OK;
+}
+
+int delta_partition_init(delta_partition_writer_t *writer, const char *partition, int patch_size)
+{
+    delta_storage_partition_t storage;
+
+    if (writer == NULL || partition == NULL) {
+        return -DELTA_INVALID_ARGUMENT_ERROR;
+    }
+
+    const esp_partition_t *patch = esp_partition_find_first(ESP_PARTITION_TYPE_DATA,
+        ESP_PARTITION_SUBTYPE_DATA_SPIFFS, partition);
+    if (patch == NULL) {
+        ESP_LOGE(TAG, "Partition Error: Could not find '%s' partition", partition);
+        return ESP_FAIL;
+    }
+
+    if ((size_t)patch_size > patch->size ||
+        delta_storage_partition_init(&storage, patch) != DELTA_OK ||
+        delta_storage_erase_range(&storage.storage, 0, patch_size) != DELTA_OK) {
+        ESP_LOGE(TAG, "Partition Error: Could not erase '%s' region!", partition);
+        return ESP_FAIL;
+    }
+
+    writer->name = partition;
+    writer->patch = patch;
+    writer->size = patch_size;
+    writer->offset = 0;
+
+    return ESP_OK;
+}
+
+int delta_partition_write(delta_partition_writer_t *writer, const char *buf, int size)
+{
+    if (writer == NULL || buf == NULL) {
+        return -DELTA_INVALID_ARGUMENT_ERROR;
+    }
+
+    if (writer->offset >= writer->size) {
+        return -DELTA_OUT_OF_BOUNDS_ERROR;
+    }
+
+    if (esp_partition_write(writer->patch, writer->offset, buf, size) != ESP_OK) {
+        ESP_LOGE(TAG, "Partition Error: Could not write to '%s' region!", writer->name);
+        return ESP_FAIL;
+    };
+
+    writer->offset += size;
+    return ESP_OK;
+}
+
+/* Storages for the running (source), next update (destination), patch
+ * and journal partitions. The journal is optional. */
+typedef struct {
+    delta_storage_partition_t src;
+    delta_storage_partition_t dest;
+    delta_storage_partition_t patch;
+    delta_storage_partition_t journal;
+} delta_ota_storages_t;
+
+static int delta_init_storages(delta_ota_storages_t *storages, const delta_opts_t *opts,
+                               delta_apply_opts_t *apply_opts)
+{
+    const esp_partition_t *src_partition = esp_ota_get_running_partition();
+    const esp_partition_t *dest_partition = esp_ota_get_next_update_partition(NULL);
+    const esp_partition_t *patch_partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA,
+        ESP_PARTITION_SUBTYPE_DATA_SPIFFS, opts->patch);
+    const esp_partition_t *journal_partition = NULL;
+
+    if (src_partition == NULL || dest_partition == NULL || patch_partition == NULL) {
+        return -DELTA_PARTITION_ERROR;
+    }
+
+    if (src_partition->subtype >= ESP_PARTITION_SUBTYPE_APP_OTA_MAX ||
+        dest_partition->subtype >= ESP_PARTITION_SUBTYPE_APP_OTA_MAX) {
+        return -DELTA_PARTITION_ERROR;
+    }
+
+    if (opts->journal != NULL) {
+        journal_partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA,
+            ESP_PARTITION_SUBTYPE_ANY, opts->journal);
+    }
+
+    memset(apply_opts, 0, sizeof(*apply_opts));
+    delta_storage_partition_init(&storages->src, src_partition);
+    delta_storage_partition_init(&storages->dest, dest_partition);
+    delta_storage_partition_init(&storages->patch, patch_partition);
+    apply_opts->src = &storages->src.storage;
+    apply_opts->dest = &storages->dest.storage;
+    apply_opts->patch = &storages->patch.storage;
+
+    if (journal_partition != NULL) {
+        delta_storage_partition_init(&storages->journal, journal_partition);
+        apply_opts->journal = &storages->journal.storage;
+        apply_opts->checkpoint_interval = opts->checkpoint_interval;
+    }
+
+    return DELTA_OK;
+}
+
+int delta_check_and_apply(int patch_size, const delta_opts_t *opts)
+{
+    static const delta_opts_t DEFAULT_DELTA_OPTS = INIT_DEFAULT_DELTA_OPTS();
+
+    delta_ota_storages_t storages;
+    delta_apply_opts_t apply_opts;
+    delta_stats_t stats;
+    int ret;
+
+    ESP_LOGI(TAG, "Initializing delta update...");
+
+    if (patch_size <= 0) {
+        return patch_size;
+    }
+
+    if (!opts) {
+        opts = &DEFAULT_DELTA_OPTS;
+    }
+
+    ret = delta_init_storages(&storages, opts, &apply_opts);
+    if (ret) {
+        return ret;
+    }
+    esp_log_level_set("esp_image", ESP_LOG_ERROR);
+
+    apply_opts.patch_size = (size_t)patch_size;
+    apply_opts.sha256 = opts->sha256;
+    apply_opts.max_stall_us = opts->max_stall_us;
+    apply_opts.stats = &stats;
+
+    ret = delta_apply(&apply_opts);
+    if (ret <= 0) {
+        return ret;
+    }
+
+    if (opts->stats) {
+        *opts->stats = stats;
+    }
+
+    return delta_set_boot_partition(storages.dest.partition, opts, &stats, ret);
+}
+
+int delta_check_and_resume(const delta_opts_t *opts)
+{
+    static const delta_opts_t DEFAULT_DELTA_OPTS = INIT_DEFAULT_DELTA_OPTS();
+
+    delta_ota_storages_t storages;
+    delta_apply_opts_t apply_opts;
+    int patch_size;
+    int ret;
+
+    if (!opts) {
+        opts = &DEFAULT_DELTA_OPTS;
+    }
+
+    ret = delta_init_storages(&storages, opts, &apply_opts);
+    if (ret || apply_opts.journal == NULL) {
+        return ret;
+    }
+
+    patch_size = delta_apply_pending(&apply_opts);
+    if (patch_size <= 0) {
+        return patch_size;
+    }
+
+    ESP_LOGI(TAG, "Resuming interrupted delta update...");
+    ret = delta_check_and_apply(patch_size, opts);
+    if (ret) {
+        return ret;
+    }
+
+    return patch_size;
+}
+
+/* Storages for the opts->dest partition patched in place, the patch
+ * and the journal partitions. The journal is optional. */
+static int delta_init_in_place_storages(delta_ota_storages_t *storages, const delta_opts_t *opts,
+                                        delta_apply_opts_t *apply_opts)
+{
+    const esp_partition_t *running_partition = esp_ota_get_running_partition();
+    const esp_partition_t *dest_partition = esp_partition_find_first(ESP_PARTITION_TYPE_APP,
+        ESP_PARTITION_SUBTYPE_ANY, opts->dest);
+    const esp_partition_t *patch_partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA,
+        ESP_PARTITION_SUBTYPE_DATA_SPIFFS, opts->patch);
+    const esp_partition_t *journal_partition = NULL;
+
+    if (running_partition == NULL || dest_partition == NULL || patch_partition == NULL) {
+        return -DELTA_PARTITION_ERROR;
+    }
+
+    /* The running image cannot be overwritten. */
+    if (dest_partition->address == running_partition->address ||
+        dest_partition->subtype < ESP_PARTITION_SUBTYPE_APP_OTA_MIN ||
+        dest_partition->subtype >= ESP_PARTITION_SUBTYPE_APP_OTA_MAX) {
+        ESP_LOGE(TAG, "Partition Error: Cannot patch '%s' in place", opts->dest);
+        return -DELTA_PARTITION_ERROR;
+    }
+
+    if (opts->journal != NULL) {
+        journal_partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA,
+            ESP_PARTITION_SUBTYPE_ANY, opts->journal);
+    }
+
+    memset(apply_opts, 0, sizeof(*apply_opts));
+    delta_storage_partition_init(&storages->dest, dest_partition);
+    delta_storage_partition_init(&storages->patch, patch_partition);
+    apply_opts->dest = &storages->dest.storage;
+    apply_opts->patch = &storages->patch.storage;
+
+    if (journal_partition != NULL) {
+        delta_storage_partition_init(&storages->journal, journal_partition);
+        apply_opts->journal = &storages->journal.storage;
+    } else {
+        ESP_LOGI(TAG, "No journal partition, the in-place update cannot be resumed");
+    }
+
+    return DELTA_OK;
+}
+
+int delta_check_and_apply_in_place(int patch_size, const delta_opts_t *opts)
+{
+    static const delta_opts_t DEFAULT_DELTA_OPTS = INIT_DEFAULT_DELTA_OPTS();
+
+    delta_ota_storages_t storages;
+    delta_apply_opts_t apply_opts;
+    delta_stats_t stats;
+    int ret;
+
+    ESP_LOGI(TAG, "Initializing in-place delta update...");
+
+    if (patch_size <= 0) {
+        return patch_size;
+    }
+
+    if (!opts) {
+        opts = &DEFAULT_DELTA_OPTS;
+    }
+
+    ret = delta_init_in_place_storages(&storages, opts, &apply_opts);
+    if (ret) {
+        return ret;
+    }
+    esp_log_level_set("esp_image", ESP_LOG_ERROR);
+
+    apply_opts.patch_size = (size_t)patch_size;
+    apply_opts.sha256 = opts->sha256;
+    apply_opts.max_stall_us = opts->max_stall_us;
+    apply_opts.in_place_swap_size = opts->in_place_swap_size;
+    apply_opts.stats = &stats;
+
+    ret = delta_apply_in_place(&apply_opts);
+    if (ret <= 0) {
+        return ret;
+    }
+
+    if (opts->stats) {
+        *opts->stats = stats;
+    }
+
+    return delta_set_boot_partition(storages.dest.partition, opts, &stats, ret);
+}
+
+int delta_check_and_resume_in_place(const delta_opts_t *opts)
+{
+    static const delta_opts_t DEFAULT_DELTA_OPTS = INIT_DEFAULT_DELTA_OPTS();
+
+    delta_ota_storages_t storages;
+    delta_apply_opts_t apply_opts;
+    int patch_size;
+    int ret;
+
+    if (!opts) {
+        opts = &DEFAULT_DELTA_OPTS;
+    }
+
+    ret = delta_init_in_place_storages(&storages, opts, &apply_opts);
+    if (ret || apply_opts.journal == NULL) {
+        return ret;
+    }
+
+    patch_size = delta_apply_in_place_pending(&apply_opts);
+    if (patch_size <= 0) {
+        return patch_size;
+    }
+
+    ESP_LOGI(TAG, "Resuming interrupted in-place delta update...");
+    ret = delta_check_and_apply_in_place(patch_size, opts);
+    if (ret) {
+        return ret;
+    }
+
+    return patch_size;
+}
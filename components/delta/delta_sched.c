@@ -0,0 +1,184 @@
+/*
+ * SPDX-FileCopyrightText: 2016 Intel Corporation
+ *                         2020 Thesis projects
+ *
+ * SPDX-License-Identifier: Apache 2.0 License
+ *
+ * SPDX-FileContributor: 2021 Laukik Hase
+ */
+
+#include <string.h>
+
+#ifdef ESP_PLATFORM
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_timer.h"
+#else
+#include <sched.h>
+#include <time.h>
+#endif
+
+#include "delta.h"
+#include "delta_sched.h"
+
+#ifdef ESP_PLATFORM
+
+int64_t delta_sched_now_us(void)
+{
+    return esp_timer_get_time();
+}
+
+static void sched_yield_default(void)
+{
+    taskYIELD();
+}
+
+#else
+
+int64_t delta_sched_now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void sched_yield_default(void)
+{
+    sched_yield();
+}
+
+#endif
+
+static int erase_cost_index(size_t size)
+{
+    switch (size) {
+    case DELTA_ERASE_BLOCK64_SIZE:
+        return 2;
+    case DELTA_ERASE_BLOCK32_SIZE:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+/* Accounts one flash operation, then yields before the next one. */
+static void sched_slice_done(delta_sched_t *sched, int64_t start)
+{
+    uint32_t elapsed = (uint32_t)(delta_sched_now_us() - start);
+
+    if (elapsed > sched->worst_stall_us) {
+        sched->worst_stall_us = elapsed;
+    }
+    sched->busy_us += elapsed;
+    sched->slices++;
+
+    if (sched->max_slice_us != 0) {
+        sched->yield();
+    }
+}
+
+void delta_sched_init(delta_sched_t *sched, uint32_t max_slice_us)
+{
+    memset(sched, 0, sizeof(*sched));
+    sched->max_slice_us = max_slice_us;
+    sched->erase_cost_us[0] = DELTA_ERASE_SECTOR_COST_US;
+    sched->erase_cost_us[1] = DELTA_ERASE_BLOCK32_COST_US;
+    sched->erase_cost_us[2] = DELTA_ERASE_BLOCK64_COST_US;
+    sched->write_ns_per_byte = DELTA_SCHED_WRITE_NS_PER_BYTE;
+    sched->yield = sched_yield_default;
+}
+
+int delta_sched_erase(delta_sched_t *sched, delta_erase_fn_t erase, void *arg_p,
+                      size_t base, size_t offset, size_t size, uint32_t sizes)
+{
+    delta_erase_plan_t plan;
+    delta_erase_op_t op;
+    int64_t start;
+    uint32_t elapsed;
+    int ret, i;
+
+    ret = delta_erase_plan_init(&plan, base, offset, size, sizes);
+    if (ret) {
+        return ret;
+    }
+
+    while (plan.offset < plan.end) {
+        /* Drop block erases measured to take longer than a slice. */
+        if (sched->max_slice_us != 0) {
+            if (sched->erase_cost_us[2] > sched->max_slice_us) {
+                plan.sizes &= ~DELTA_ERASE_BLOCK64;
+            }
+            if (sched->erase_cost_us[1] > sched->max_slice_us) {
+                plan.sizes &= ~DELTA_ERASE_BLOCK32;
+            }
+        }
+
+        delta_erase_plan_next(&plan, &op);
+        start = delta_sched_now_us();
+        ret = erase(arg_p, op.offset, op.size);
+        if (ret) {
+            return ret;
+        }
+
+        elapsed = (uint32_t)(delta_sched_now_us() - start);
+        i = erase_cost_index(op.size);
+        if (elapsed > sched->erase_cost_us[i]) {
+            sched->erase_cost_us[i] = elapsed;
+        }
+        sched_slice_done(sched, start);
+    }
+
+    return DELTA_OK;
+}
+
+int delta_sched_write(delta_sched_t *sched, delta_write_fn_t write, void *arg_p,
+                      size_t offset, const uint8_t *buf_p, size_t size)
+{
+    size_t slice, n;
+    int64_t start;
+    uint32_t elapsed;
+    int ret;
+
+    while (size > 0) {
+        if (sched->max_slice_us == 0) {
+            n = size;
+        } else {
+            slice = (size_t)sched->max_slice_us * 1000 / sched->write_ns_per_byte;
+            slice -= slice % FLASH_WRITE_PAGE_SIZE;
+            if (slice < FLASH_WRITE_PAGE_SIZE) {
+                slice = FLASH_WRITE_PAGE_SIZE;
+            }
+
+            /* End slices on page boundaries so no page is split. */
+            n = slice - (offset % FLASH_WRITE_PAGE_SIZE);
+            if (n > size) {
+                n = size;
+            }
+        }
+
+        start = delta_sched_now_us();
+        ret = write(arg_p, offset, buf_p, n);
+        if (ret) {
+            return ret;
+        }
+
+        elapsed = (uint32_t)(delta_sched_now_us() - start);
+        if (n >= FLASH_WRITE_PAGE_SIZE) {
+            /* Moving average, so one slow page does not halve the slices. */
+            sched->write_ns_per_byte = (3 * sched->write_ns_per_byte +
+                                        (uint32_t)((uint64_t)elapsed * 1000 / n)) / 4;
+            if (sched->write_ns_per_byte == 0) {
+                sched->write_ns_per_byte = 1;
+            }
+        }
+        sched_slice_done(sched, start);
+
+        offset += n;
+        buf_p += n;
+        size -= n;
+    }
+
+    return DELTA_OK;
+}
@@ -0,0 +1,251 @@
+/*
+ * SPDX-FileCopyrightText: 2016 Intel Corporation
+ *                         2020 Thesis projects
+ *
+ * SPDX-License-Identifier: Apache 2.0 License
+ *
+ * SPDX-FileContributor: 2021 Laukik Hase
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "delta.h"
+#include "delta_journal.h"
+#include "delta_step_log.h"
+
+#define STEP_LOG_MAGIC (0x50545344) /* "DSTP" */
+
+typedef struct {
+    uint32_t magic;
+    uint32_t seq;
+    delta_step_log_id_t id;
+    uint32_t step;  /* Last step when the sector was started */
+    uint32_t reserved;
+    uint32_t crc;   /* Of the fields above */
+} step_log_header_t;
+
+/* The complement tells a programmed entry from an erased or torn one. */
+typedef struct {
+    uint32_t step;
+    uint32_t check;
+} step_log_entry_t;
+
+#define STEP_LOG_ENTRIES ((DELTA_STEP_LOG_SECTOR_SIZE - sizeof(step_log_header_t)) / sizeof(step_log_entry_t))
+
+static size_t step_log_end(const delta_step_log_t *log)
+{
+    return log->storage->size / DELTA_STEP_LOG_SECTOR_SIZE * DELTA_STEP_LOG_SECTOR_SIZE;
+}
+
+static size_t step_log_entry_offset(size_t sector, size_t index)
+{
+    return sector + sizeof(step_log_header_t) + index * sizeof(step_log_entry_t);
+}
+
+static int step_log_read_entry(delta_step_log_t *log, size_t sector, size_t index,
+                               step_log_entry_t *entry)
+{
+    if (delta_storage_read(log->storage, step_log_entry_offset(sector, index),
+                           entry, sizeof(*entry)) != DELTA_OK) {
+        return -DELTA_JOURNAL_ERROR;
+    }
+
+    return DELTA_OK;
+}
+
+static bool step_log_entry_erased(const step_log_entry_t *entry)
+{
+    return entry->step == UINT32_MAX && entry->check == UINT32_MAX;
+}
+
+static bool step_log_entry_valid(const step_log_entry_t *entry)
+{
+    return entry->check == ~entry->step;
+}
+
+/* Entries are programmed in order, so the programmed ones (the last
+ * possibly torn) come before the erased ones. Finds the first erased
+ * entry and the last valid step before it, if any. */
+static int step_log_scan_entries(delta_step_log_t *log, size_t sector, int step)
+{
+    step_log_entry_t entry;
+    size_t low = 0;
+    size_t high = STEP_LOG_ENTRIES;
+    size_t mid;
+    int ret;
+
+    while (low < high) {
+        mid = low + (high - low) / 2;
+        ret = step_log_read_entry(log, sector, mid, &entry);
+        if (ret) {
+            return ret;
+        }
+        if (step_log_entry_erased(&entry)) {
+            high = mid;
+        } else {
+            low = mid + 1;
+        }
+    }
+
+    log->offset = step_log_entry_offset(sector, low);
+    log->step = step;
+
+    while (low-- > 0) {
+        ret = step_log_read_entry(log, sector, low, &entry);
+        if (ret) {
+            return ret;
+        }
+        if (step_log_entry_valid(&entry)) {
+            log->step = (int)entry.step;
+            break;
+        }
+    }
+
+    return DELTA_OK;
+}
+
+int delta_step_log_init(delta_step_log_t *log, delta_storage_t *storage, delta_sched_t *sched)
+{
+    step_log_header_t header;
+    int step = 0;
+    size_t sector;
+
+    if (log == NULL || storage == NULL ||
+        storage->size < 2 * DELTA_STEP_LOG_SECTOR_SIZE) {
+        return -DELTA_INVALID_ARGUMENT_ERROR;
+    }
+
+    memset(log, 0, sizeof(*log));
+    log->storage = storage;
+    log->sched = sched;
+
+    for (sector = 0; sector < step_log_end(log); sector += DELTA_STEP_LOG_SECTOR_SIZE) {
+        if (delta_storage_read(storage, sector, &header, sizeof(header)) != DELTA_OK ||
+            header.magic != STEP_LOG_MAGIC ||
+            header.crc != delta_crc32(0, &header, offsetof(step_log_header_t, crc))) {
+            continue;
+        }
+
+        if (!log->found || (int32_t)(header.seq - log->seq) > 0) {
+            log->found = true;
+            log->seq = header.seq;
+            log->id = header.id;
+            log->sector = sector;
+            step = (int)header.step;
+        }
+    }
+
+    if (!log->found) {
+        return DELTA_OK;
+    }
+
+    return step_log_scan_entries(log, log->sector, step);
+}
+
+bool delta_step_log_get(const delta_step_log_t *log, const delta_step_log_id_t *id, int *step_p)
+{
+    if (!log->found || memcmp(&log->id, id, sizeof(*id)) != 0) {
+        *step_p = 0;
+        return false;
+    }
+
+    *step_p = log->step;
+
+    return true;
+}
+
+static int step_log_write(delta_step_log_t *log, size_t offset, const void *buf_p, size_t size)
+{
+    if (log->sched != NULL) {
+        return delta_sched_write(log->sched, delta_storage_write_fn, log->storage,
+                                 offset, buf_p, size);
+    }
+
+    return delta_storage_write(log->storage, offset, buf_p, size);
+}
+
+/* Erases the sector after the current one and writes its header. The
+ * current sector stays the last one until the header is written. */
+static int step_log_next_sector(delta_step_log_t *log, const delta_step_log_id_t *id, int step)
+{
+    step_log_header_t header;
+    size_t sector = 0;
+    int ret;
+
+    if (log->found) {
+        sector = log->sector + DELTA_STEP_LOG_SECTOR_SIZE;
+        if (sector >= step_log_end(log)) {
+            sector = 0;
+        }
+    }
+
+    if (log->sched != NULL) {
+        ret = delta_sched_erase(log->sched, delta_storage_erase_fn, log->storage,
+                                log->storage->address, sector,
+                                DELTA_STEP_LOG_SECTOR_SIZE, DELTA_ERASE_SECTOR);
+    } else {
+        ret = delta_storage_erase(log->storage, sector, DELTA_STEP_LOG_SECTOR_SIZE);
+    }
+    if (ret) {
+        return -DELTA_CLEARING_ERROR;
+    }
+
+    memset(&header, 0xff, sizeof(header));
+    header.magic = STEP_LOG_MAGIC;
+    header.seq = log->seq + 1;
+    header.id = *id;
+    header.step = (uint32_t)step;
+    header.crc = delta_crc32(0, &header, offsetof(step_log_header_t, crc));
+
+    ret = step_log_write(log, sector, &header, sizeof(header));
+    if (ret) {
+        return ret;
+    }
+
+    log->found = true;
+    log->seq = header.seq;
+    log->id = *id;
+    log->sector = sector;
+    log->offset = step_log_entry_offset(sector, 0);
+    log->step = step;
+
+    return DELTA_OK;
+}
+
+int delta_step_log_begin(delta_step_log_t *log, const delta_step_log_id_t *id)
+{
+    return step_log_next_sector(log, id, 0);
+}
+
+int delta_step_log_set(delta_step_log_t *log, int step)
+{
+    step_log_entry_t entry;
+    int ret;
+
+    if (!log->found) {
+        return -DELTA_JOURNAL_ERROR;
+    }
+
+    /* Carry on in a fresh sector, which drops the oldest one. */
+    if (log->offset >= step_log_entry_offset(log->sector, STEP_LOG_ENTRIES)) {
+        ret = step_log_next_sector(log, &log->id, log->step);
+        if (ret) {
+            return ret;
+        }
+    }
+
+    entry.step = (uint32_t)step;
+    entry.check = ~entry.step;
+
+    ret = step_log_write(log, log->offset, &entry, sizeof(entry));
+    if (ret) {
+        return ret;
+    }
+
+    log->offset += sizeof(entry);
+    log->step = step;
+
+    return DELTA_OK;
+}
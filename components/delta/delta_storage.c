@@ -0,0 +1,298 @@
+/*
+ * SPDX-FileCopyrightText: 2016 Intel Corporation
+ *                         2020 Thesis projects
+ *
+ * SPDX-License-Identifier: Apache 2.0 License
+ *
+ * SPDX-FileContributor: 2021 Laukik Hase
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifndef ESP_PLATFORM
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "delta.h"
+#include "delta_storage.h"
+
+#define DELTA_ERASE_ALL (DELTA_ERASE_SECTOR | DELTA_ERASE_BLOCK32 | DELTA_ERASE_BLOCK64)
+
+int delta_storage_mmap(delta_storage_t *storage, size_t offset, size_t size, const void **ptr_p)
+{
+    if (storage->ops->mmap == NULL) {
+        return -DELTA_INVALID_ARGUMENT_ERROR;
+    }
+    if (offset + size > storage->size) {
+        return -DELTA_OUT_OF_BOUNDS_ERROR;
+    }
+
+    return storage->ops->mmap(storage, offset, size, ptr_p);
+}
+
+void delta_storage_munmap(delta_storage_t *storage, const void *ptr)
+{
+    if (storage->ops->munmap != NULL) {
+        storage->ops->munmap(storage, ptr);
+    }
+}
+
+int delta_storage_erase_fn(void *arg_p, size_t offset, size_t size)
+{
+    return delta_storage_erase((delta_storage_t *)arg_p, offset, size);
+}
+
+int delta_storage_write_fn(void *arg_p, size_t offset, const uint8_t *buf_p, size_t size)
+{
+    return delta_storage_write((delta_storage_t *)arg_p, offset, buf_p, size);
+}
+
+int delta_storage_erase_range(delta_storage_t *storage, size_t offset, size_t size)
+{
+    return delta_erase_range(delta_storage_erase_fn, storage, storage->address,
+                             offset, size, storage->erase_sizes);
+}
+
+/*
+ * Memory backed storages share the access functions.
+ */
+
+static int mem_read(delta_storage_t *storage, uint8_t *mem, size_t offset, void *buf_p, size_t size)
+{
+    if (offset + size > storage->size) {
+        return -DELTA_OUT_OF_BOUNDS_ERROR;
+    }
+    memcpy(buf_p, mem + offset, size);
+
+    return DELTA_OK;
+}
+
+static int mem_write(delta_storage_t *storage, uint8_t *mem, size_t offset, const void *buf_p, size_t size)
+{
+    if (offset + size > storage->size) {
+        return -DELTA_OUT_OF_BOUNDS_ERROR;
+    }
+    memcpy(mem + offset, buf_p, size);
+
+    return DELTA_OK;
+}
+
+/* Memory has no sectors, so the storage may end in the middle of the
+ * last one erased. */
+static int mem_erase(delta_storage_t *storage, uint8_t *mem, size_t offset, size_t size)
+{
+    if (offset >= storage->size) {
+        return -DELTA_OUT_OF_BOUNDS_ERROR;
+    }
+    if (size > storage->size - offset) {
+        size = storage->size - offset;
+    }
+    memset(mem + offset, 0xFF, size);
+
+    return DELTA_OK;
+}
+
+/*
+ * RAM buffer backend.
+ */
+
+static int ram_read(delta_storage_t *storage, size_t offset, void *buf_p, size_t size)
+{
+    return mem_read(storage, ((delta_storage_ram_t *)storage)->buf, offset, buf_p, size);
+}
+
+static int ram_write(delta_storage_t *storage, size_t offset, const void *buf_p, size_t size)
+{
+    return mem_write(storage, ((delta_storage_ram_t *)storage)->buf, offset, buf_p, size);
+}
+
+static int ram_erase(delta_storage_t *storage, size_t offset, size_t size)
+{
+    return mem_erase(storage, ((delta_storage_ram_t *)storage)->buf, offset, size);
+}
+
+static int ram_mmap(delta_storage_t *storage, size_t offset, size_t size, const void **ptr_p)
+{
+    (void)size;
+    *ptr_p = ((delta_storage_ram_t *)storage)->buf + offset;
+
+    return DELTA_OK;
+}
+
+static const delta_storage_ops_t ram_ops = {
+    .read = ram_read,
+    .write = ram_write,
+    .erase = ram_erase,
+    .mmap = ram_mmap,
+    .munmap = NULL
+};
+
+int delta_storage_ram_init(delta_storage_ram_t *ram, void *buf, size_t size)
+{
+    if (ram == NULL || buf == NULL) {
+        return -DELTA_INVALID_ARGUMENT_ERROR;
+    }
+
+    ram->storage.ops = &ram_ops;
+    ram->storage.size = size;
+    ram->storage.address = 0;
+    ram->storage.erase_sizes = DELTA_ERASE_ALL;
+    ram->storage.erased_ff = true;
+    ram->buf = buf;
+
+    return DELTA_OK;
+}
+
+#ifndef ESP_PLATFORM
+
+/*
+ * Linux file backend.
+ */
+
+static int file_read(delta_storage_t *storage, size_t offset, void *buf_p, size_t size)
+{
+    return mem_read(storage, ((delta_storage_file_t *)storage)->map, offset, buf_p, size);
+}
+
+static int file_write(delta_storage_t *storage, size_t offset, const void *buf_p, size_t size)
+{
+    delta_storage_file_t *file = (delta_storage_file_t *)storage;
+    int ret;
+
+    if ((file->flags & DELTA_STORAGE_FILE_CREATE) == 0) {
+        return -DELTA_WRITING_ERROR;
+    }
+
+    ret = mem_write(storage, file->map, offset, buf_p, size);
+    if (ret == DELTA_OK && offset + size > file->written) {
+        file->written = offset + size;
+    }
+
+    return ret;
+}
+
+/* Erased runs are left unwritten by delta_apply(), so they count as
+ * data as well. */
+static int file_erase(delta_storage_t *storage, size_t offset, size_t size)
+{
+    delta_storage_file_t *file = (delta_storage_file_t *)storage;
+    int ret;
+
+    if ((file->flags & DELTA_STORAGE_FILE_CREATE) == 0) {
+        return -DELTA_CLEARING_ERROR;
+    }
+
+    ret = mem_erase(storage, file->map, offset, size);
+    if (ret == DELTA_OK && offset + size > file->written) {
+        file->written = (offset + size < storage->size) ? offset + size : storage->size;
+    }
+
+    return ret;
+}
+
+static int file_mmap(delta_storage_t *storage, size_t offset, size_t size, const void **ptr_p)
+{
+    (void)size;
+    *ptr_p = ((delta_storage_file_t *)storage)->map + offset;
+
+    return DELTA_OK;
+}
+
+static const delta_storage_ops_t file_ops = {
+    .read = file_read,
+    .write = file_write,
+    .erase = file_erase,
+    .mmap = file_mmap,
+    .munmap = NULL
+};
+
+int delta_storage_file_init(delta_storage_file_t *file, const char *path, int flags, size_t size)
+{
+    struct stat st;
+    int prot;
+
+    if (file == NULL || path == NULL) {
+        return -DELTA_INVALID_ARGUMENT_ERROR;
+    }
+
+    if (flags & DELTA_STORAGE_FILE_CREATE) {
+        file->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (file->fd < 0) {
+            return -DELTA_PARTITION_ERROR;
+        }
+        if (ftruncate(file->fd, (off_t)size) != 0) {
+            goto err;
+        }
+        prot = PROT_READ | PROT_WRITE;
+    } else {
+        file->fd = open(path, O_RDONLY);
+        if (file->fd < 0) {
+            return -DELTA_PARTITION_ERROR;
+        }
+        if (fstat(file->fd, &st) != 0) {
+            goto err;
+        }
+        size = (size_t)st.st_size;
+        prot = PROT_READ;
+    }
+
+    file->map = NULL;
+    if (size > 0) {
+        file->map = mmap(NULL, size, prot, MAP_SHARED, file->fd, 0);
+        if (file->map == MAP_FAILED) {
+            goto err;
+        }
+    }
+
+    file->storage.ops = &file_ops;
+    file->storage.size = size;
+    file->storage.address = 0;
+    file->storage.erase_sizes = DELTA_ERASE_ALL;
+    file->storage.erased_ff = true;
+    file->written = 0;
+    file->flags = flags;
+
+    return DELTA_OK;
+
+err:
+    close(file->fd);
+
+    return -DELTA_PARTITION_ERROR;
+}
+
+int delta_storage_file_set_size(delta_storage_file_t *file, size_t size)
+{
+    if (file == NULL || size > file->storage.size) {
+        return -DELTA_INVALID_ARGUMENT_ERROR;
+    }
+    file->written = size;
+
+    return DELTA_OK;
+}
+
+int delta_storage_file_deinit(delta_storage_file_t *file)
+{
+    int ret = DELTA_OK;
+
+    if (file->map != NULL && munmap(file->map, file->storage.size) != 0) {
+        ret = -DELTA_WRITING_ERROR;
+    }
+
+    if ((file->flags & DELTA_STORAGE_FILE_CREATE) &&
+        ftruncate(file->fd, (off_t)file->written) != 0) {
+        ret = -DELTA_WRITING_ERROR;
+    }
+
+    if (close(file->fd) != 0) {
+        ret = -DELTA_WRITING_ERROR;
+    }
+
+    return ret;
+}
+
+#endif
@@ -0,0 +1,101 @@
+/*
+ * SPDX-FileCopyrightText: 2016 Intel Corporation
+ *                         2020 Thesis projects
+ *
+ * SPDX-License-Identifier: Apache 2.0 License
+ *
+ * SPDX-FileContributor: 2021 Laukik Hase
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "esp_err.h"
+#include "esp_partition.h"
+#include "esp_flash_encrypt.h"
+
+#include "delta.h"
+#include "delta_storage.h"
+
+static int partition_read(delta_storage_t *storage, size_t offset, void *buf_p, size_t size)
+{
+    delta_storage_partition_t *part = (delta_storage_partition_t *)storage;
+
+    if (esp_partition_read(part->partition, offset, buf_p, size) != ESP_OK) {
+        return -DELTA_READING_SOURCE_ERROR;
+    }
+
+    return DELTA_OK;
+}
+
+static int partition_write(delta_storage_t *storage, size_t offset, const void *buf_p, size_t size)
+{
+    delta_storage_partition_t *part = (delta_storage_partition_t *)storage;
+
+    if (esp_partition_write(part->partition, offset, buf_p, size) != ESP_OK) {
+        return -DELTA_WRITING_ERROR;
+    }
+
+    return DELTA_OK;
+}
+
+static int partition_erase(delta_storage_t *storage, size_t offset, size_t size)
+{
+    delta_storage_partition_t *part = (delta_storage_partition_t *)storage;
+
+    if (esp_partition_erase_range(part->partition, offset, size) != ESP_OK) {
+        return -DELTA_CLEARING_ERROR;
+    }
+
+    return DELTA_OK;
+}
+
+/* Only one mapping per partition storage is kept at a time. */
+static int partition_mmap(delta_storage_t *storage, size_t offset, size_t size, const void **ptr_p)
+{
+    delta_storage_partition_t *part = (delta_storage_partition_t *)storage;
+
+    /* Mapped reads are always decrypted, unlike esp_partition_read()
+     * of an unencrypted partition. */
+    if (!part->partition->encrypted && esp_flash_encryption_enabled()) {
+        return -DELTA_PARTITION_ERROR;
+    }
+
+    if (esp_partition_mmap(part->partition, offset, size, ESP_PARTITION_MMAP_DATA,
+                           ptr_p, &part->mmap_handle) != ESP_OK) {
+        return -DELTA_PARTITION_ERROR;
+    }
+
+    return DELTA_OK;
+}
+
+static void partition_munmap(delta_storage_t *storage, const void *ptr)
+{
+    (void)ptr;
+    spi_flash_munmap(((delta_storage_partition_t *)storage)->mmap_handle);
+}
+
+static const delta_storage_ops_t partition_ops = {
+    .read = partition_read,
+    .write = partition_write,
+    .erase = partition_erase,
+    .mmap = partition_mmap,
+    .munmap = partition_munmap
+};
+
+int delta_storage_partition_init(delta_storage_partition_t *part, const esp_partition_t *partition)
+{
+    if (part == NULL || partition == NULL) {
+        return -DELTA_INVALID_ARGUMENT_ERROR;
+    }
+
+    part->storage.ops = &partition_ops;
+    part->storage.size = partition->size;
+    part->storage.address = partition->address;
+    part->storage.erase_sizes = DELTA_FLASH_ERASE_SIZES;
+    /* Encrypted flash does not read back erased as 0xFF. */
+    part->storage.erased_ff = !partition->encrypted && !esp_flash_encryption_enabled();
+    part->partition = partition;
+
+    return DELTA_OK;
+}
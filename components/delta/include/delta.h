@@ -9,14 +9,41 @@
 
 #pragma once
 
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "delta_erase.h"
+#include "delta_storage.h"
+
 /* PARTITION LABELS */
 #define DEFAULT_PARTITION_LABEL_SRC "factory"
 #define DEFAULT_PARTITION_LABEL_DEST "ota_0"
 #define DEFAULT_PARTITION_LABEL_PATCH "patch"
+#define DEFAULT_PARTITION_LABEL_JOURNAL "journal"
 
 /* PAGE SIZE */
 #define PARTITION_PAGE_SIZE (0x1000)
 
+/* Erase commands used on the flash, see delta_erase.h. The esp_flash
+ * driver only exposes sector and 64 KiB block erases. */
+#ifndef DELTA_FLASH_ERASE_SIZES
+#define DELTA_FLASH_ERASE_SIZES (DELTA_ERASE_SECTOR | DELTA_ERASE_BLOCK64)
+#endif
+
+/* FLASH PROGRAM PAGE SIZE */
+#define FLASH_WRITE_PAGE_SIZE (0x100)
+
+/* Erased (0xFF) runs at least this long are not programmed */
+#define DELTA_ERASED_RUN_MIN (32)
+
+/* Target bytes between checkpoints, and the share of the apply time
+ * (in percent) checkpoints may take before they are spread out */
+#define DELTA_CHECKPOINT_INTERVAL (64 * 1024)
+#define DELTA_CHECKPOINT_MAX_OVERHEAD (2)
+
+/* SHA-256 DIGEST SIZE */
+#define DELTA_SHA256_SIZE (32)
+
 /* Error codes. */
 #define DELTA_OK                                          0
 #define DELTA_OUT_OF_MEMORY                              28
@@ -31,17 +58,147 @@
 #define DELTA_TARGET_IMAGE_ERROR                         37
 #define DELTA_INVALID_ARGUMENT_ERROR                     38
 #define DELTA_OUT_OF_BOUNDS_ERROR                        39
+#define DELTA_TARGET_HASH_ERROR                          40
+#define DELTA_JOURNAL_ERROR                              41
+
+typedef struct {
+    size_t bytes_written;   /* Target bytes programmed to flash */
+    size_t bytes_skipped;   /* Erased (0xFF) target bytes not programmed */
+    size_t pages_skipped;   /* Whole flash pages left erased */
+    uint32_t worst_stall_us;/* Longest single flash erase or write */
+    uint32_t flash_slices;  /* Flash operations issued */
+    uint64_t flash_busy_us; /* Time spent in flash operations */
+    bool verified;          /* Target matched its appended or expected hash */
+    uint32_t checkpoints;   /* Checkpoints written to the journal */
+    uint64_t checkpoint_us; /* Time spent writing checkpoints */
+    size_t resumed_at;      /* Target offset the apply resumed at, if resumed */
+    int resumed_step;       /* In-place step the apply resumed after, if resumed */
+} delta_stats_t;
+
+typedef struct {
+    delta_storage_t *src;
+    delta_storage_t *patch;
+    delta_storage_t *dest;
+    size_t patch_size;
+    /* Expected SHA-256 of the target image, or NULL. */
+    const uint8_t *sha256;
+    /* See delta_opts_t. */
+    uint32_t max_stall_us;
+    /* Checkpoint journal of at least two sectors, or NULL. The apply
+     * resumes from its last checkpoint if it is for the same patch.
+     * The journal is closed once done, or failed on the patch or the
+     * target hash; other failures keep the checkpoints to resume from.
+     * delta_apply_in_place() keeps a step log in it instead. */
+    delta_storage_t *journal;
+    /* Target bytes between checkpoints. */
+    size_t checkpoint_interval;
+    /* RAM for delta_apply_in_place() to skip shifting the image up
+     * front, zero(0) to always shift. Not power-fail safe, an
+     * interrupted apply cannot be resumed. */
+    size_t in_place_swap_size;
+    /* Filled in by delta_apply() if not NULL. */
+    delta_stats_t *stats;
+} delta_apply_opts_t;
+
+/**
+ * Applies the patch in opts->patch to opts->src, writing the target
+ * image to opts->dest. The part of the destination the target image
+ * occupies is erased first. The SHA-256 of the target image is
+ * computed while it is written and checked against the hash appended
+ * to the image and/or opts->sha256.
+ *
+ * Runs on any storage backend, also off target.
+ *
+ * @param[in] opts storages and options for applying the patch.
+ *
+ * @return Size of the target image or a negative error code.
+ */
+int delta_apply(const delta_apply_opts_t *opts);
+
+/**
+ * Checks opts->journal for an interrupted apply from opts->src to
+ * opts->dest.
+ *
+ * @return Size of the patch to resume applying, zero(0) if there is
+ *         none or a negative error code.
+ */
+int delta_apply_pending(const delta_apply_opts_t *opts);
+
+/**
+ * Applies the in-place patch in opts->patch to the image in
+ * opts->dest, overwriting it with the target image. opts->src must be
+ * NULL or opts->dest. The patch must be created for the size of
+ * opts->dest, with a segment size that is a multiple of the flash
+ * sector size. The target image is read back and checked against the
+ * hash appended to it and/or opts->sha256.
+ *
+ * Every completed step is logged in opts->journal (see
+ * delta_step_log.h), at the cost of one small flash write, and an
+ * interrupted apply continues after the last one. Without a journal
+ * a power loss leaves neither image intact.
+ *
+ * The source image is first shifted up by the shift size of the
+ * patch. With opts->in_place_swap_size of at least that size, rounded
+ * up to whole segments, source segments are kept in RAM instead, which
+ * halves flash writes and erases, but a power loss leaves neither image
+ * intact. Only that such an apply was started is logged, it then
+ * fails with -DELTA_JOURNAL_ERROR until the journal is erased.
+ *
+ * @param[in] opts storages and options for applying the patch.
+ *
+ * @return Size of the target image or a negative error code.
+ */
+int delta_apply_in_place(const delta_apply_opts_t *opts);
+
+/**
+ * Checks opts->journal for an interrupted in-place apply to
+ * opts->dest.
+ *
+ * @return Size of the patch to resume applying, zero(0) if there is
+ *         none or a negative error code, -DELTA_JOURNAL_ERROR if it
+ *         kept source segments in RAM and cannot be resumed.
+ */
+int delta_apply_in_place_pending(const delta_apply_opts_t *opts);
+
+#ifdef ESP_PLATFORM
 
 typedef struct {
     const char *src;
     const char *dest;
     const char *patch;
+    /* Checkpoint journal partition. Checkpointing is disabled if
+     * there is no such partition. */
+    const char *journal;
+    /* Target bytes between checkpoints. */
+    size_t checkpoint_interval;
+    /* Expected SHA-256 of the target image, e.g. from the patch metadata.
+     * NULL to only check the hash appended to the image by esptool. */
+    const uint8_t *sha256;
+    /* Longest flash erase or write to issue while applying, to bound
+     * how long the cache (and the other core) is stalled. Zero(0) for
+     * no bound, which favours throughput. */
+    uint32_t max_stall_us;
+    /* See delta_apply_opts_t, for delta_check_and_apply_in_place(). */
+    size_t in_place_swap_size;
+    /* Switch the boot partition without reading the target image back,
+     * if it matched its hash while patching. Ignored with secure boot
+     * or signed apps, whose signatures are only checked on read back. */
+    bool fast_finalize;
+    /* Filled in by delta_check_and_apply() if not NULL. */
+    delta_stats_t *stats;
 } delta_opts_t;
 
 #define INIT_DEFAULT_DELTA_OPTS() { \
     .src = DEFAULT_PARTITION_LABEL_SRC, \
     .dest = DEFAULT_PARTITION_LABEL_DEST, \
-    .patch = DEFAULT_PARTITION_LABEL_PATCH \
+    .patch = DEFAULT_PARTITION_LABEL_PATCH, \
+    .journal = DEFAULT_PARTITION_LABEL_JOURNAL, \
+    .checkpoint_interval = DELTA_CHECKPOINT_INTERVAL, \
+    .sha256 = NULL, \
+    .max_stall_us = 0, \
+    .in_place_swap_size = 0, \
+    .fast_finalize = false, \
+    .stats = NULL \
 }
 
 typedef struct {
@@ -60,6 +217,12 @@ int delta_partition_write(delta_partition_writer_t *writer, const char *buf, int
  * and applies that patch if it exists. Then restarts
  * the device and boots from the new image.
  *
+ * The SHA-256 of the target image is computed while it is
+ * written and checked against the hash appended to the image
+ * and/or opts->sha256 before the boot partition is switched.
+ * esp_ota_set_boot_partition() then reads the image back, unless
+ * opts->fast_finalize is set.
+ *
  * @param[in] patch_size size of the patch.
  * @param[in] opts options for applying the patch.
  *
@@ -68,6 +231,46 @@ int delta_partition_write(delta_partition_writer_t *writer, const char *buf, int
  */
 int delta_check_and_apply(int patch_size, const delta_opts_t *opts);
 
+/**
+ * Resumes applying a patch if an earlier delta_check_and_apply() was
+ * interrupted, e.g. by a power loss. Call on boot.
+ *
+ * @param[in] opts options for applying the patch.
+ *
+ * @return Size of the patch if it was applied, zero(0) if there was
+ * nothing to resume or a negative error code.
+ */
+int delta_check_and_resume(const delta_opts_t *opts);
+
+/**
+ * Like delta_check_and_apply(), but patches the image in the
+ * opts->dest partition in place, for devices with a single OTA app
+ * partition. Must be run from another app partition, e.g. a small
+ * factory app. Completed steps are logged in the opts->journal
+ * partition, without it the update cannot survive a power loss.
+ *
+ * @param[in] patch_size size of the patch.
+ * @param[in] opts options for applying the patch.
+ *
+ * @return zero(0) if no patch or a negative error
+ * code.
+ */
+int delta_check_and_apply_in_place(int patch_size, const delta_opts_t *opts);
+
+/**
+ * Resumes an interrupted delta_check_and_apply_in_place(). Call on
+ * boot, before the image in opts->dest is used.
+ *
+ * @param[in] opts options for applying the patch.
+ *
+ * @return Size of the patch if it was applied, zero(0) if there was
+ * nothing to resume or a negative error code. -DELTA_JOURNAL_ERROR if
+ * the apply used opts->in_place_swap_size and neither image is intact.
+ */
+int delta_check_and_resume_in_place(const delta_opts_t *opts);
+
+#endif
+
 /**
  * Get the error string for given error code.
  *
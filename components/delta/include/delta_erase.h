@@ -0,0 +1,109 @@
+/*
+ * SPDX-FileCopyrightText: 2016 Intel Corporation
+ *                         2020 Thesis projects
+ *
+ * SPDX-License-Identifier: Apache 2.0 License
+ *
+ * SPDX-FileContributor: 2021 Laukik Hase
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* ERASE GRANULARITIES */
+#define DELTA_ERASE_SECTOR_SIZE   (0x1000)
+#define DELTA_ERASE_BLOCK32_SIZE  (0x8000)
+#define DELTA_ERASE_BLOCK64_SIZE  (0x10000)
+
+/* Erase commands supported by the flash, as a mask. */
+#define DELTA_ERASE_SECTOR        (1 << 0)
+#define DELTA_ERASE_BLOCK32       (1 << 1)
+#define DELTA_ERASE_BLOCK64       (1 << 2)
+
+/* Typical erase times of the SPI NOR parts we ship, in microseconds. */
+#define DELTA_ERASE_SECTOR_COST_US    (45000)
+#define DELTA_ERASE_BLOCK32_COST_US   (120000)
+#define DELTA_ERASE_BLOCK64_COST_US   (150000)
+
+typedef struct {
+    size_t offset;
+    size_t size;
+} delta_erase_op_t;
+
+typedef struct {
+    size_t base;    /* Flash address of offset 0, for block alignment */
+    size_t offset;  /* Next offset to plan */
+    size_t end;
+    uint32_t sizes;
+} delta_erase_plan_t;
+
+/**
+ * Erase callback.
+ *
+ * @param[in] arg_p User data passed to delta_erase_range().
+ * @param[in] offset Offset to erase from, aligned to size.
+ * @param[in] size One of the DELTA_ERASE_*_SIZE granularities.
+ *
+ * @return zero(0) or negative error code.
+ */
+typedef int (*delta_erase_fn_t)(void *arg_p, size_t offset, size_t size);
+
+/**
+ * Plans erasing [offset, offset + size) with the largest aligned
+ * erase commands in sizes, and sector erases at the edges.
+ *
+ * @param[out] plan Plan to initialize.
+ * @param[in] base Flash address of offset zero (partition address).
+ * @param[in] offset Sector aligned offset to erase from.
+ * @param[in] size Number of bytes to erase, rounded up to sectors.
+ * @param[in] sizes Mask of supported DELTA_ERASE_* commands.
+ *
+ * @return zero(0) or negative error code.
+ */
+int delta_erase_plan_init(delta_erase_plan_t *plan, size_t base, size_t offset, size_t size, uint32_t sizes);
+
+/**
+ * Gets the next erase operation of the plan.
+ *
+ * @return true if op was filled in, false when the plan is done.
+ */
+bool delta_erase_plan_next(delta_erase_plan_t *plan, delta_erase_op_t *op);
+
+/**
+ * Estimated time of the erase operation, in microseconds.
+ */
+uint32_t delta_erase_op_cost_us(const delta_erase_op_t *op);
+
+/**
+ * Erases a range through the planner.
+ *
+ * @return zero(0) or negative error code from erase.
+ */
+int delta_erase_range(delta_erase_fn_t erase, void *arg_p, size_t base,
+                      size_t offset, size_t size, uint32_t sizes);
+
+/*
+ * Host erase simulator, to exercise plans without hardware.
+ */
+typedef struct {
+    size_t base;            /* Flash address of offset 0 */
+    uint8_t *mem;           /* Optional memory, set to 0xFF on erase */
+    size_t size;
+    uint32_t cost_us[3];    /* Sector, 32K and 64K block erase cost */
+    uint32_t ops[3];
+    uint64_t total_us;
+} delta_erase_sim_t;
+
+/**
+ * Initializes the simulator with the typical DELTA_ERASE_*_COST_US.
+ */
+void delta_erase_sim_init(delta_erase_sim_t *sim, uint8_t *mem, size_t size);
+
+/**
+ * Erase callback accounting the cost of each operation, to be used
+ * with delta_erase_range() and sim as argument.
+ */
+int delta_erase_sim_erase(void *arg_p, size_t offset, size_t size);
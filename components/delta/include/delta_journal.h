@@ -0,0 +1,83 @@
+/*
+ * SPDX-FileCopyrightText: 2016 Intel Corporation
+ *                         2020 Thesis projects
+ *
+ * SPDX-License-Identifier: Apache 2.0 License
+ *
+ * SPDX-FileContributor: 2021 Laukik Hase
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "delta_sched.h"
+#include "delta_storage.h"
+
+/* Journal sector size, records never span sectors */
+#define DELTA_JOURNAL_SECTOR_SIZE (0x1000)
+
+/* Records start on this alignment */
+#define DELTA_JOURNAL_ALIGN (16)
+
+/* Record types */
+#define DELTA_JOURNAL_DONE          (0)
+#define DELTA_JOURNAL_CHECKPOINT    (1)
+
+/**
+ * Append-only log of CRC protected records. Records are appended
+ * sector after sector and the journal wraps around, erasing the
+ * oldest sector, so wear is spread over the whole storage. Only the
+ * most recent record is ever read back.
+ */
+typedef struct {
+    delta_storage_t *storage;
+    delta_sched_t *sched;   /* Optional, to bound journal flash stalls */
+    uint32_t seq;           /* Sequence number of the last record */
+    bool found;             /* A valid record was found */
+    uint16_t last_type;
+    size_t last_offset;     /* Payload offset of the last record */
+    size_t last_size;
+    size_t offset;          /* Where the next record is appended */
+} delta_journal_t;
+
+/**
+ * Opens the journal on given storage, of at least two sectors, and
+ * looks up its most recent record. Records are appended in a fresh
+ * sector, so a record torn by a power loss is never appended to.
+ *
+ * @return zero(0) or negative error code.
+ */
+int delta_journal_init(delta_journal_t *journal, delta_storage_t *storage, delta_sched_t *sched);
+
+/**
+ * Reads the payload of the most recent record.
+ *
+ * @param[out] type_p Record type.
+ * @param[out] buf_p Payload buffer.
+ * @param[in,out] size_p Buffer size in, payload size out.
+ *
+ * @return zero(0) or negative error code, DELTA_JOURNAL_ERROR if
+ *         there is no record.
+ */
+int delta_journal_last(delta_journal_t *journal, uint16_t *type_p, void *buf_p, size_t *size_p);
+
+/**
+ * Appends a record. Once this returns the record is the most recent
+ * one, also after a power loss.
+ *
+ * @return zero(0) or negative error code.
+ */
+int delta_journal_append(delta_journal_t *journal, uint16_t type, const void *buf_p, size_t size);
+
+/**
+ * Largest record payload.
+ */
+size_t delta_journal_max_size(void);
+
+/**
+ * CRC-32 (IEEE 802.3) of given buffer, continued from crc.
+ */
+uint32_t delta_crc32(uint32_t crc, const void *buf_p, size_t size);
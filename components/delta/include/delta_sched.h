@@ -0,0 +1,76 @@
+/*
+ * SPDX-FileCopyrightText: 2016 Intel Corporation
+ *                         2020 Thesis projects
+ *
+ * SPDX-License-Identifier: Apache 2.0 License
+ *
+ * SPDX-FileContributor: 2021 Laukik Hase
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "delta_erase.h"
+
+/* Estimated page program time, in nanoseconds per byte. */
+#define DELTA_SCHED_WRITE_NS_PER_BYTE (2000)
+
+/**
+ * Write callback.
+ *
+ * @param[in] arg_p User data passed to delta_sched_write().
+ * @param[in] offset Offset to write to.
+ * @param[in] buf_p Buffer to write.
+ * @param[in] size Number of bytes to write.
+ *
+ * @return zero(0) or negative error code.
+ */
+typedef int (*delta_write_fn_t)(void *arg_p, size_t offset, const uint8_t *buf_p, size_t size);
+
+/**
+ * Splits flash erase and write work into slices that each stall the
+ * flash (and with it the cache of both cores) for at most
+ * max_slice_us, and yields between slices.
+ */
+typedef struct {
+    uint32_t max_slice_us;      /* Zero(0) for no bound */
+    uint32_t erase_cost_us[3];  /* Sector, 32K and 64K block erase, as measured */
+    uint32_t write_ns_per_byte; /* As measured */
+    uint32_t worst_stall_us;    /* Longest single flash operation seen */
+    uint32_t slices;
+    uint64_t busy_us;
+    void (*yield)(void);
+} delta_sched_t;
+
+/**
+ * Initializes the scheduler.
+ *
+ * @param[out] sched Scheduler to initialize.
+ * @param[in] max_slice_us Longest flash operation to issue, or zero(0)
+ *                         to issue operations as large as possible.
+ */
+void delta_sched_init(delta_sched_t *sched, uint32_t max_slice_us);
+
+/**
+ * Erases a range with the largest erase commands in sizes that fit
+ * in a slice. Sector erases are used even if they do not.
+ *
+ * @return zero(0) or negative error code from erase.
+ */
+int delta_sched_erase(delta_sched_t *sched, delta_erase_fn_t erase, void *arg_p,
+                      size_t base, size_t offset, size_t size, uint32_t sizes);
+
+/**
+ * Writes a buffer in slices, at least one flash page at a time.
+ *
+ * @return zero(0) or negative error code from write.
+ */
+int delta_sched_write(delta_sched_t *sched, delta_write_fn_t write, void *arg_p,
+                      size_t offset, const uint8_t *buf_p, size_t size);
+
+/**
+ * Monotonic time in microseconds, as used to measure flash operations.
+ */
+int64_t delta_sched_now_us(void);
@@ -0,0 +1,78 @@
+/*
+ * SPDX-FileCopyrightText: 2016 Intel Corporation
+ *                         2020 Thesis projects
+ *
+ * SPDX-License-Identifier: Apache 2.0 License
+ *
+ * SPDX-FileContributor: 2021 Laukik Hase
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "delta_sched.h"
+#include "delta_storage.h"
+
+/* Step log sector size */
+#define DELTA_STEP_LOG_SECTOR_SIZE (0x1000)
+
+/* Identifies the apply the steps belong to. */
+typedef struct {
+    uint32_t patch_size;
+    uint32_t patch_crc;
+    uint32_t address;   /* Of the storage patched in place */
+} delta_step_log_id_t;
+
+/**
+ * Log of in-place apply steps. Each sector starts with a header
+ * naming the apply, followed by fixed size step entries that are
+ * programmed one at a time, so a step costs one small write. A sector
+ * is only erased when the log moves on to it, on wrap around or for
+ * another apply. The last step is kept in memory.
+ */
+typedef struct {
+    delta_storage_t *storage;
+    delta_sched_t *sched;   /* Optional, to bound flash stalls */
+    bool found;             /* A valid sector was found */
+    uint32_t seq;           /* Sequence number of the current sector */
+    delta_step_log_id_t id; /* Of the current sector */
+    size_t sector;          /* Offset of the current sector */
+    size_t offset;          /* Where the next entry is programmed */
+    int step;               /* Last step logged */
+} delta_step_log_t;
+
+/**
+ * Opens the step log on given storage, of at least two sectors, and
+ * looks up its last step.
+ *
+ * @return zero(0) or negative error code.
+ */
+int delta_step_log_init(delta_step_log_t *log, delta_storage_t *storage, delta_sched_t *sched);
+
+/**
+ * Gets the last step logged for given apply.
+ *
+ * @param[out] step_p Last step, zero(0) if none or if the last steps
+ *                    logged are for another apply.
+ *
+ * @return true if the last steps logged are for given apply.
+ */
+bool delta_step_log_get(const delta_step_log_t *log, const delta_step_log_id_t *id, int *step_p);
+
+/**
+ * Starts logging steps of given apply in a fresh sector.
+ *
+ * @return zero(0) or negative error code.
+ */
+int delta_step_log_begin(delta_step_log_t *log, const delta_step_log_id_t *id);
+
+/**
+ * Logs a step. Once this returns the step is the last one, also
+ * after a power loss.
+ *
+ * @return zero(0) or negative error code.
+ */
+int delta_step_log_set(delta_step_log_t *log, int step);
@@ -0,0 +1,161 @@
+/*
+ * SPDX-FileCopyrightText: 2016 Intel Corporation
+ *                         2020 Thesis projects
+ *
+ * SPDX-License-Identifier: Apache 2.0 License
+ *
+ * SPDX-FileContributor: 2021 Laukik Hase
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef ESP_PLATFORM
+#include "esp_partition.h"
+#endif
+
+typedef struct delta_storage delta_storage_t;
+
+/**
+ * Storage backend operations. Offsets are relative to the start of
+ * the storage, and all operations return zero(0) or a negative error
+ * code.
+ */
+typedef struct {
+    int (*read)(delta_storage_t *storage, size_t offset, void *buf_p, size_t size);
+    int (*write)(delta_storage_t *storage, size_t offset, const void *buf_p, size_t size);
+    /* Offset and size are aligned to one of the storage erase_sizes.
+     * The last erase extends past the end of a storage whose size is
+     * not, e.g. a RAM buffer sized to the image. */
+    int (*erase)(delta_storage_t *storage, size_t offset, size_t size);
+    /* Optional. Maps size bytes at offset for reading, until munmap. */
+    int (*mmap)(delta_storage_t *storage, size_t offset, size_t size, const void **ptr_p);
+    void (*munmap)(delta_storage_t *storage, const void *ptr);
+} delta_storage_ops_t;
+
+struct delta_storage {
+    const delta_storage_ops_t *ops;
+    size_t size;
+    size_t address;         /* Flash address of offset 0, for erase alignment */
+    uint32_t erase_sizes;   /* DELTA_ERASE_* commands the storage supports */
+    bool erased_ff;         /* Erased storage reads back as 0xFF */
+};
+
+static inline int delta_storage_read(delta_storage_t *storage, size_t offset, void *buf_p, size_t size)
+{
+    return storage->ops->read(storage, offset, buf_p, size);
+}
+
+static inline int delta_storage_write(delta_storage_t *storage, size_t offset, const void *buf_p, size_t size)
+{
+    return storage->ops->write(storage, offset, buf_p, size);
+}
+
+static inline int delta_storage_erase(delta_storage_t *storage, size_t offset, size_t size)
+{
+    return storage->ops->erase(storage, offset, size);
+}
+
+/**
+ * Maps a region of the storage for reading.
+ *
+ * @return zero(0) if mapped, or a negative error code, also if the
+ *         storage cannot be mapped.
+ */
+int delta_storage_mmap(delta_storage_t *storage, size_t offset, size_t size, const void **ptr_p);
+
+void delta_storage_munmap(delta_storage_t *storage, const void *ptr);
+
+/**
+ * Erases given range with the largest erase commands the storage
+ * supports, see delta_erase_range().
+ *
+ * @return zero(0) or negative error code.
+ */
+int delta_storage_erase_range(delta_storage_t *storage, size_t offset, size_t size);
+
+/* delta_erase_fn_t and delta_write_fn_t with the storage as argument. */
+int delta_storage_erase_fn(void *arg_p, size_t offset, size_t size);
+
+int delta_storage_write_fn(void *arg_p, size_t offset, const uint8_t *buf_p, size_t size);
+
+/*
+ * RAM buffer backend, for RAM or PSRAM staging.
+ */
+typedef struct {
+    delta_storage_t storage;
+    uint8_t *buf;
+} delta_storage_ram_t;
+
+/**
+ * Initializes a storage on top of given buffer.
+ *
+ * @return zero(0) or negative error code.
+ */
+int delta_storage_ram_init(delta_storage_ram_t *ram, void *buf, size_t size);
+
+#ifdef ESP_PLATFORM
+
+/*
+ * ESP partition backend.
+ */
+typedef struct {
+    delta_storage_t storage;
+    const esp_partition_t *partition;
+    spi_flash_mmap_handle_t mmap_handle;
+} delta_storage_partition_t;
+
+/**
+ * Initializes a storage on top of given partition.
+ *
+ * @return zero(0) or negative error code.
+ */
+int delta_storage_partition_init(delta_storage_partition_t *part, const esp_partition_t *partition);
+
+#else
+
+/* File backend open flags */
+#define DELTA_STORAGE_FILE_READ     (0)
+#define DELTA_STORAGE_FILE_CREATE   (1 << 0)
+
+/*
+ * Linux file backend, mapped into memory.
+ */
+typedef struct {
+    delta_storage_t storage;
+    int fd;
+    uint8_t *map;
+    size_t written;         /* End of the furthest write or erase */
+    int flags;
+} delta_storage_file_t;
+
+/**
+ * Opens and maps given file. With DELTA_STORAGE_FILE_CREATE the file
+ * is created with given size and truncated to the end of the data
+ * written or erased by delta_storage_file_deinit(), else size is
+ * ignored and the file is mapped read-only.
+ *
+ * @return zero(0) or negative error code.
+ */
+int delta_storage_file_init(delta_storage_file_t *file, const char *path, int flags, size_t size);
+
+/**
+ * Sets the size the file is truncated to, e.g. to the target image
+ * size returned by delta_apply(). Erases cover whole sectors, so the
+ * file may otherwise end in erased (0xFF) bytes past the image.
+ *
+ * @return zero(0) or negative error code.
+ */
+int delta_storage_file_set_size(delta_storage_file_t *file, size_t size);
+
+/**
+ * Unmaps and closes the file.
+ *
+ * @return zero(0) or negative error code.
+ */
+int delta_storage_file_deinit(delta_storage_file_t *file);
+
+#endif
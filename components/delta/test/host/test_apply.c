@@ -0,0 +1,334 @@
+/*
+ * SPDX-FileCopyrightText: 2016 Intel Corporation
+ *                         2020 Thesis projects
+ *
+ * SPDX-License-Identifier: Apache 2.0 License
+ *
+ * SPDX-FileContributor: 2021 Laukik Hase
+ */
+
+/*
+ * Host tests of applying patches, also in place, to memory storages
+ * that fail part way, and of resuming them from the journal.
+ *
+ * gcc -DDETOOLS_CONFIG_COMPRESSION_NONE=1 -Icomponents/delta/include
+ *     -Icomponents/detools/include -Icomponents/detools/heatshrink
+ *     components/delta/test/host/test_apply.c components/delta/delta.c
+ *     components/delta/delta_erase.c components/delta/delta_journal.c
+ *     components/delta/delta_sched.c components/delta/delta_step_log.c
+ *     components/delta/delta_storage.c components/detools/detools.c
+ *     components/detools/heatshrink/heatshrink_decoder.c -lmbedcrypto -o test_apply
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "delta.h"
+#include "delta_storage.h"
+#include "detools.h"
+
+#define K (1024)
+#define TARGET_SIZE (40000)
+
+/* In-place patch parameters */
+#define MEMORY_SIZE (48 * K)
+#define SEGMENT_SIZE (4 * K)
+#define SHIFT_SIZE (8 * K)
+#define FROM_SIZE (40000)
+#define TO_SIZE (36000)
+
+static int failures;
+
+#define TEST_ASSERT(cond) do {                                          \
+        if (!(cond)) {                                                  \
+            fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond);  \
+            failures++;                                                 \
+        }                                                               \
+    } while (0)
+
+static uint8_t src_buf[4 * K];
+static uint8_t dest_buf[64 * K];
+static uint8_t patch_buf[TARGET_SIZE + 64];
+static uint8_t journal_buf[2 * 4 * K];
+static uint8_t target[TARGET_SIZE];
+static uint8_t from[FROM_SIZE];
+
+/* Writes to the destination fail once this many have been done, if
+ * not negative. */
+static const delta_storage_ops_t *ram_ops;
+static delta_storage_ops_t failing_ops;
+static long writes_left;
+
+static int failing_write(delta_storage_t *storage, size_t offset, const void *buf_p, size_t size)
+{
+    if (writes_left >= 0 && writes_left-- == 0) {
+        return -DELTA_WRITING_ERROR;
+    }
+
+    return ram_ops->write(storage, offset, buf_p, size);
+}
+
+static size_t put_header_size(uint8_t *buf_p, size_t value)
+{
+    size_t n = 1;
+
+    buf_p[0] = value & 0x3f;
+    value >>= 6;
+
+    while (value > 0) {
+        buf_p[n - 1] |= 0x80;
+        buf_p[n++] = value & 0x7f;
+        value >>= 7;
+    }
+
+    return n;
+}
+
+static size_t put_size(uint8_t *buf_p, int value)
+{
+    size_t n = put_header_size(buf_p, (size_t)(value < 0 ? -value : value));
+
+    if (value < 0) {
+        buf_p[0] |= 0x40;
+    }
+
+    return n;
+}
+
+/* An uncompressed sequential patch with the whole target as extra
+ * data. */
+static size_t make_patch(void)
+{
+    size_t n = 0;
+    size_t i;
+
+    for (i = 0; i < TARGET_SIZE; i++) {
+        target[i] = (uint8_t)((i * 7919) >> 3);
+    }
+
+    patch_buf[n++] = 0;
+    n += put_header_size(&patch_buf[n], TARGET_SIZE);
+    n += put_size(&patch_buf[n], 0);
+    n += put_size(&patch_buf[n], 0);
+    n += put_size(&patch_buf[n], TARGET_SIZE);
+    memcpy(&patch_buf[n], target, TARGET_SIZE);
+    n += TARGET_SIZE;
+    n += put_size(&patch_buf[n], 0);
+
+    return n;
+}
+
+/* An uncompressed in-place patch. Half of every segment is diff data
+ * against the from data the segment reads, the rest extra data. */
+static size_t make_in_place_patch(void)
+{
+    static uint8_t shifted[MEMORY_SIZE];
+    size_t n = 0;
+    size_t index, to_offset, to_size, from_offset, diff_size, i;
+
+    for (i = 0; i < FROM_SIZE; i++) {
+        from[i] = (uint8_t)((i * 7919) >> 5);
+    }
+
+    /* The memory as the engine reads it, with the source shifted up by
+     * whole segments. */
+    memset(shifted, 0xff, sizeof(shifted));
+    memcpy(&shifted[SHIFT_SIZE], from, FROM_SIZE);
+
+    patch_buf[n++] = 0x10;
+    n += put_header_size(&patch_buf[n], MEMORY_SIZE);
+    n += put_header_size(&patch_buf[n], SEGMENT_SIZE);
+    n += put_header_size(&patch_buf[n], SHIFT_SIZE);
+    n += put_header_size(&patch_buf[n], FROM_SIZE);
+    n += put_header_size(&patch_buf[n], TO_SIZE);
+
+    for (index = 0; index * SEGMENT_SIZE < TO_SIZE; index++) {
+        to_offset = index * SEGMENT_SIZE;
+        to_size = TO_SIZE - to_offset;
+        if (to_size > SEGMENT_SIZE) {
+            to_size = SEGMENT_SIZE;
+        }
+        from_offset = SEGMENT_SIZE * (index + 1);
+        if (from_offset < SHIFT_SIZE) {
+            from_offset = SHIFT_SIZE;
+        }
+        diff_size = to_size / 2;
+
+        n += put_size(&patch_buf[n], 0);
+        n += put_size(&patch_buf[n], (int)diff_size);
+        for (i = 0; i < diff_size; i++) {
+            patch_buf[n] = (i % 3 == 0) ? 1 : 0;
+            target[to_offset + i] = (uint8_t)(shifted[from_offset + i] + patch_buf[n]);
+            n++;
+        }
+        n += put_size(&patch_buf[n], (int)(to_size - diff_size));
+        for (i = diff_size; i < to_size; i++) {
+            target[to_offset + i] = (uint8_t)(index + i * 13);
+            patch_buf[n++] = target[to_offset + i];
+        }
+        n += put_size(&patch_buf[n], 0);
+    }
+
+    return n;
+}
+
+static void init_in_place_opts(delta_apply_opts_t *opts, delta_storage_ram_t *dest,
+                               delta_storage_ram_t *patch, delta_storage_ram_t *journal)
+{
+    size_t patch_size = make_in_place_patch();
+
+    memset(dest_buf, 0xff, sizeof(dest_buf));
+    memcpy(dest_buf, from, FROM_SIZE);
+    memset(journal_buf, 0xff, sizeof(journal_buf));
+
+    delta_storage_ram_init(dest, dest_buf, MEMORY_SIZE);
+    delta_storage_ram_init(patch, patch_buf, patch_size);
+    delta_storage_ram_init(journal, journal_buf, sizeof(journal_buf));
+
+    ram_ops = dest->storage.ops;
+    failing_ops = *ram_ops;
+    failing_ops.write = failing_write;
+    dest->storage.ops = &failing_ops;
+    writes_left = -1;
+
+    memset(opts, 0, sizeof(*opts));
+    opts->patch = &patch->storage;
+    opts->dest = &dest->storage;
+    opts->patch_size = patch_size;
+    opts->journal = &journal->storage;
+}
+
+static void init_opts(delta_apply_opts_t *opts, delta_storage_ram_t *src, delta_storage_ram_t *dest,
+                      delta_storage_ram_t *patch, delta_storage_ram_t *journal, size_t patch_size)
+{
+    memset(dest_buf, 0, sizeof(dest_buf));
+    memset(journal_buf, 0xff, sizeof(journal_buf));
+
+    delta_storage_ram_init(src, src_buf, sizeof(src_buf));
+    delta_storage_ram_init(dest, dest_buf, sizeof(dest_buf));
+    delta_storage_ram_init(patch, patch_buf, patch_size);
+    delta_storage_ram_init(journal, journal_buf, sizeof(journal_buf));
+
+    ram_ops = dest->storage.ops;
+    failing_ops = *ram_ops;
+    failing_ops.write = failing_write;
+    dest->storage.ops = &failing_ops;
+    writes_left = -1;
+
+    memset(opts, 0, sizeof(*opts));
+    opts->src = &src->storage;
+    opts->patch = &patch->storage;
+    opts->dest = &dest->storage;
+    opts->patch_size = patch_size;
+    opts->journal = &journal->storage;
+    opts->checkpoint_interval = 4 * K;
+}
+
+/* A failing write may be gone after a reset, so the checkpoints are
+ * kept and the apply resumes. */
+static void test_resume_after_write_error(void)
+{
+    delta_storage_ram_t src, dest, patch, journal;
+    delta_apply_opts_t opts;
+    delta_stats_t stats;
+    size_t patch_size = make_patch();
+
+    init_opts(&opts, &src, &dest, &patch, &journal, patch_size);
+
+    /* detools reports the failing write as an I/O failure. */
+    writes_left = 5;
+    TEST_ASSERT(delta_apply(&opts) == -DETOOLS_IO_FAILED);
+    TEST_ASSERT(delta_apply_pending(&opts) == (int)patch_size);
+
+    writes_left = -1;
+    opts.stats = &stats;
+    TEST_ASSERT(delta_apply(&opts) == TARGET_SIZE);
+    TEST_ASSERT(stats.resumed_at > 0);
+    TEST_ASSERT(memcmp(dest_buf, target, TARGET_SIZE) == 0);
+    TEST_ASSERT(delta_apply_pending(&opts) == 0);
+}
+
+/* A target that does not match its hash would not match it after a
+ * reset either, so the journal is closed. */
+static void test_close_after_hash_error(void)
+{
+    delta_storage_ram_t src, dest, patch, journal;
+    delta_apply_opts_t opts;
+    uint8_t sha256[DELTA_SHA256_SIZE];
+
+    memset(sha256, 0, sizeof(sha256));
+    init_opts(&opts, &src, &dest, &patch, &journal, make_patch());
+    opts.sha256 = sha256;
+
+    TEST_ASSERT(delta_apply(&opts) == -DELTA_TARGET_HASH_ERROR);
+    TEST_ASSERT(delta_apply_pending(&opts) == 0);
+}
+
+/* Every shifted segment and target segment is logged, so an in-place
+ * apply continues after the last one. */
+static void test_in_place_resume(void)
+{
+    delta_storage_ram_t dest, patch, journal;
+    delta_apply_opts_t opts;
+    delta_stats_t stats;
+
+    init_in_place_opts(&opts, &dest, &patch, &journal);
+
+    writes_left = 14;
+    TEST_ASSERT(delta_apply_in_place(&opts) < 0);
+    TEST_ASSERT(delta_apply_in_place_pending(&opts) == (int)opts.patch_size);
+
+    writes_left = -1;
+    opts.stats = &stats;
+    TEST_ASSERT(delta_apply_in_place(&opts) == TO_SIZE);
+    TEST_ASSERT(stats.resumed_step > 0);
+    TEST_ASSERT(memcmp(dest_buf, target, TO_SIZE) == 0);
+    TEST_ASSERT(delta_apply_in_place_pending(&opts) == 0);
+}
+
+/* Source segments kept in RAM are lost when the apply is cut off, so
+ * it is reported as such instead of being resumed or started over. */
+static void test_in_place_swap_interrupted(void)
+{
+    delta_storage_ram_t dest, patch, journal;
+    delta_apply_opts_t opts;
+
+    init_in_place_opts(&opts, &dest, &patch, &journal);
+    opts.in_place_swap_size = SHIFT_SIZE;
+
+    writes_left = 4;
+    TEST_ASSERT(delta_apply_in_place(&opts) < 0);
+    TEST_ASSERT(memcmp(dest_buf, from, SEGMENT_SIZE) != 0);
+    TEST_ASSERT(delta_apply_in_place_pending(&opts) == -DELTA_JOURNAL_ERROR);
+
+    writes_left = -1;
+    TEST_ASSERT(delta_apply_in_place(&opts) == -DELTA_JOURNAL_ERROR);
+    TEST_ASSERT(delta_apply_in_place_pending(&opts) == -DELTA_JOURNAL_ERROR);
+}
+
+/* A swap apply that is not cut off closes the step log. */
+static void test_in_place_swap(void)
+{
+    delta_storage_ram_t dest, patch, journal;
+    delta_apply_opts_t opts;
+
+    init_in_place_opts(&opts, &dest, &patch, &journal);
+    opts.in_place_swap_size = SHIFT_SIZE;
+
+    TEST_ASSERT(delta_apply_in_place(&opts) == TO_SIZE);
+    TEST_ASSERT(memcmp(dest_buf, target, TO_SIZE) == 0);
+    TEST_ASSERT(delta_apply_in_place_pending(&opts) == 0);
+}
+
+int main(void)
+{
+    test_resume_after_write_error();
+    test_close_after_hash_error();
+    test_in_place_resume();
+    test_in_place_swap_interrupted();
+    test_in_place_swap();
+
+    printf("%s: %d failures\n", __FILE__, failures);
+
+    return (failures != 0);
+}
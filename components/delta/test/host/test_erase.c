@@ -0,0 +1,186 @@
+/*
+ * SPDX-FileCopyrightText: 2016 Intel Corporation
+ *                         2020 Thesis projects
+ *
+ * SPDX-License-Identifier: Apache 2.0 License
+ *
+ * SPDX-FileContributor: 2021 Laukik Hase
+ */
+
+/*
+ * Host tests of the erase planner and of erasing memory storages.
+ *
+ * gcc -Icomponents/delta/include components/delta/test/host/test_erase.c
+ *     components/delta/delta_erase.c components/delta/delta_storage.c -o test_erase
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "delta.h"
+#include "delta_erase.h"
+#include "delta_storage.h"
+
+#define K (1024)
+
+static int failures;
+
+#define TEST_ASSERT(cond) do {                                          \
+        if (!(cond)) {                                                  \
+            fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond);  \
+            failures++;                                                 \
+        }                                                               \
+    } while (0)
+
+/* Plans given range and compares it with the expected operations,
+ * terminated by a zero size. */
+static void check_plan(size_t base, size_t offset, size_t size, uint32_t sizes,
+                       const delta_erase_op_t *expected)
+{
+    delta_erase_plan_t plan;
+    delta_erase_op_t op;
+    size_t i = 0;
+
+    TEST_ASSERT(delta_erase_plan_init(&plan, base, offset, size, sizes) == DELTA_OK);
+
+    while (delta_erase_plan_next(&plan, &op)) {
+        TEST_ASSERT(expected[i].size != 0);
+        if (expected[i].size == 0) {
+            return;
+        }
+        TEST_ASSERT(op.offset == expected[i].offset);
+        TEST_ASSERT(op.size == expected[i].size);
+        TEST_ASSERT((base + op.offset) % op.size == 0);
+        i++;
+    }
+
+    TEST_ASSERT(expected[i].size == 0);
+}
+
+static void test_plan_aligned(void)
+{
+    const delta_erase_op_t two_blocks[] = {
+        { 0, 64 * K }, { 64 * K, 64 * K }, { 0, 0 }
+    };
+    const delta_erase_op_t one_sector[] = {
+        { 0, 4 * K }, { 0, 0 }
+    };
+    const delta_erase_op_t none[] = {
+        { 0, 0 }
+    };
+
+    check_plan(0x10000, 0, 128 * K, DELTA_ERASE_SECTOR | DELTA_ERASE_BLOCK32 | DELTA_ERASE_BLOCK64,
+               two_blocks);
+
+    /* Sizes are rounded up to whole sectors. */
+    check_plan(0x10000, 0, 1, DELTA_ERASE_SECTOR | DELTA_ERASE_BLOCK64, one_sector);
+    check_plan(0x10000, 0, 4 * K, DELTA_ERASE_SECTOR | DELTA_ERASE_BLOCK64, one_sector);
+    check_plan(0x10000, 0, 0, DELTA_ERASE_SECTOR | DELTA_ERASE_BLOCK64, none);
+}
+
+static void test_plan_edges(void)
+{
+    /* Sectors up to the 32K boundary, a 32K block up to the 64K
+     * boundary, a 64K block and sectors after it. */
+    const delta_erase_op_t expected[] = {
+        { 0x0000, 4 * K }, { 0x1000, 4 * K }, { 0x2000, 4 * K }, { 0x3000, 4 * K },
+        { 0x4000, 4 * K }, { 0x5000, 4 * K }, { 0x6000, 4 * K },
+        { 0x7000, 32 * K },
+        { 0xf000, 64 * K },
+        { 0x1f000, 4 * K }, { 0x20000, 4 * K },
+        { 0, 0 }
+    };
+
+    check_plan(0x1000, 0, 0x21000 - 0x1000 + 1, DELTA_ERASE_SECTOR | DELTA_ERASE_BLOCK32 |
+               DELTA_ERASE_BLOCK64, expected);
+}
+
+static void test_plan_sizes(void)
+{
+    const delta_erase_op_t sectors[] = {
+        { 0x0000, 4 * K }, { 0x1000, 4 * K }, { 0x2000, 4 * K }, { 0x3000, 4 * K },
+        { 0, 0 }
+    };
+    const delta_erase_op_t blocks32[] = {
+        { 0x0000, 32 * K }, { 0x8000, 32 * K }, { 0x10000, 4 * K },
+        { 0, 0 }
+    };
+    const delta_erase_op_t block64 = { 0, 64 * K };
+    const delta_erase_op_t block32 = { 0, 32 * K };
+    const delta_erase_op_t sector = { 0, 4 * K };
+    delta_erase_plan_t plan;
+
+    TEST_ASSERT(delta_erase_op_cost_us(&block64) == DELTA_ERASE_BLOCK64_COST_US);
+    TEST_ASSERT(delta_erase_op_cost_us(&block32) == DELTA_ERASE_BLOCK32_COST_US);
+    TEST_ASSERT(delta_erase_op_cost_us(&sector) == DELTA_ERASE_SECTOR_COST_US);
+
+    /* Sector erases are always allowed. */
+    check_plan(0, 0, 16 * K, 0, sectors);
+    check_plan(0, 0, 68 * K, DELTA_ERASE_BLOCK32, blocks32);
+
+    TEST_ASSERT(delta_erase_plan_init(&plan, 0, 0x800, 4 * K, DELTA_ERASE_SECTOR) ==
+                -DELTA_INVALID_ARGUMENT_ERROR);
+    TEST_ASSERT(delta_erase_plan_init(&plan, 0x800, 0, 4 * K, DELTA_ERASE_SECTOR) ==
+                -DELTA_INVALID_ARGUMENT_ERROR);
+}
+
+static void test_sim(void)
+{
+    static uint8_t mem[256 * K];
+    delta_erase_sim_t sim;
+    size_t i;
+
+    memset(mem, 0, sizeof(mem));
+    delta_erase_sim_init(&sim, mem, sizeof(mem));
+
+    TEST_ASSERT(delta_erase_range(delta_erase_sim_erase, &sim, 0, 4 * K, 128 * K,
+                                  DELTA_ERASE_SECTOR | DELTA_ERASE_BLOCK32 | DELTA_ERASE_BLOCK64) ==
+                DELTA_OK);
+
+    for (i = 0; i < sizeof(mem); i++) {
+        if (mem[i] != ((i >= 4 * K && i < 132 * K) ? 0xff : 0)) {
+            break;
+        }
+    }
+
+    TEST_ASSERT(i == sizeof(mem));
+    TEST_ASSERT(sim.ops[0] == 8);
+    TEST_ASSERT(sim.ops[1] == 1);
+    TEST_ASSERT(sim.ops[2] == 1);
+    TEST_ASSERT(sim.total_us == 8 * DELTA_ERASE_SECTOR_COST_US + DELTA_ERASE_BLOCK32_COST_US +
+                DELTA_ERASE_BLOCK64_COST_US);
+
+    TEST_ASSERT(delta_erase_range(delta_erase_sim_erase, &sim, 0, 252 * K, 8 * K,
+                                  DELTA_ERASE_SECTOR) == -DELTA_OUT_OF_BOUNDS_ERROR);
+}
+
+/* A RAM storage sized to an image ends in the middle of a sector. */
+static void test_ram_partial_sector(void)
+{
+    static uint8_t buf[10000 + 16];
+    delta_storage_ram_t ram;
+
+    memset(buf, 0, sizeof(buf));
+    TEST_ASSERT(delta_storage_ram_init(&ram, buf, 10000) == DELTA_OK);
+
+    TEST_ASSERT(delta_storage_erase_range(&ram.storage, 0, 10000) == DELTA_OK);
+    TEST_ASSERT(buf[0] == 0xff);
+    TEST_ASSERT(buf[9999] == 0xff);
+    TEST_ASSERT(buf[10000] == 0);
+
+    TEST_ASSERT(delta_storage_erase_range(&ram.storage, 8 * K, 1) == DELTA_OK);
+    TEST_ASSERT(delta_storage_erase_range(&ram.storage, 12 * K, 1) == -DELTA_OUT_OF_BOUNDS_ERROR);
+}
+
+int main(void)
+{
+    test_plan_aligned();
+    test_plan_edges();
+    test_plan_sizes();
+    test_sim();
+    test_ram_partial_sector();
+
+    printf("%s: %d failures\n", __FILE__, failures);
+
+    return (failures != 0);
+}
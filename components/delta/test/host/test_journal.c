@@ -0,0 +1,176 @@
+/*
+ * SPDX-FileCopyrightText: 2016 Intel Corporation
+ *                         2020 Thesis projects
+ *
+ * SPDX-License-Identifier: Apache 2.0 License
+ *
+ * SPDX-FileContributor: 2021 Laukik Hase
+ */
+
+/*
+ * Host tests of the journal: recovery of the last record after torn
+ * writes and sector rotation.
+ *
+ * gcc -Icomponents/delta/include components/delta/test/host/test_journal.c
+ *     components/delta/delta_journal.c components/delta/delta_sched.c
+ *     components/delta/delta_erase.c components/delta/delta_storage.c -o test_journal
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "delta.h"
+#include "delta_journal.h"
+#include "delta_storage.h"
+
+#define SECTORS (3)
+
+static int failures;
+
+#define TEST_ASSERT(cond) do {                                          \
+        if (!(cond)) {                                                  \
+            fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond);  \
+            failures++;                                                 \
+        }                                                               \
+    } while (0)
+
+/* Same layout as the journal record header. */
+typedef struct {
+    uint32_t magic;
+    uint32_t seq;
+    uint16_t type;
+    uint16_t reserved;
+    uint32_t size;
+    uint32_t crc;
+} record_header_t;
+
+static uint8_t mem[SECTORS * DELTA_JOURNAL_SECTOR_SIZE];
+static delta_storage_ram_t ram;
+
+static void storage_init(void)
+{
+    memset(mem, 0xff, sizeof(mem));
+    delta_storage_ram_init(&ram, mem, sizeof(mem));
+}
+
+/* Reopens the journal, as after a reboot, and checks its last record. */
+static void check_last(delta_journal_t *journal, uint16_t type, const void *buf_p, size_t size)
+{
+    static uint8_t buf[DELTA_JOURNAL_SECTOR_SIZE];
+    size_t buf_size = sizeof(buf);
+    uint16_t last_type;
+
+    TEST_ASSERT(delta_journal_init(journal, &ram.storage, NULL) == DELTA_OK);
+    TEST_ASSERT(journal->found);
+    TEST_ASSERT(delta_journal_last(journal, &last_type, buf, &buf_size) == DELTA_OK);
+    TEST_ASSERT(last_type == type);
+    TEST_ASSERT(buf_size == size);
+    TEST_ASSERT(size == 0 || memcmp(buf, buf_p, size) == 0);
+}
+
+static void test_empty(void)
+{
+    delta_journal_t journal;
+    uint8_t buf[16];
+    size_t size = sizeof(buf);
+    uint16_t type;
+
+    storage_init();
+
+    TEST_ASSERT(delta_journal_init(&journal, &ram.storage, NULL) == DELTA_OK);
+    TEST_ASSERT(!journal.found);
+    TEST_ASSERT(delta_journal_last(&journal, &type, buf, &size) == -DELTA_JOURNAL_ERROR);
+
+    TEST_ASSERT(delta_journal_append(&journal, DELTA_JOURNAL_DONE, NULL, 0) == DELTA_OK);
+    check_last(&journal, DELTA_JOURNAL_DONE, NULL, 0);
+
+    TEST_ASSERT(delta_journal_append(&journal, DELTA_JOURNAL_CHECKPOINT, buf,
+                                     delta_journal_max_size() + 1) == -DELTA_INVALID_BUF_SIZE);
+}
+
+static void test_torn_header(void)
+{
+    delta_journal_t journal;
+    record_header_t header;
+    const char first[] = "first";
+    const char second[] = "second record";
+    size_t torn;
+
+    storage_init();
+
+    TEST_ASSERT(delta_journal_init(&journal, &ram.storage, NULL) == DELTA_OK);
+    TEST_ASSERT(delta_journal_append(&journal, DELTA_JOURNAL_CHECKPOINT, first, sizeof(first)) == DELTA_OK);
+    TEST_ASSERT(delta_journal_append(&journal, DELTA_JOURNAL_CHECKPOINT, second, sizeof(second)) == DELTA_OK);
+    check_last(&journal, DELTA_JOURNAL_CHECKPOINT, second, sizeof(second));
+
+    /* Power lost while the header of the next record was written,
+     * after its payload. Only the magic made it. */
+    torn = (journal.last_offset + sizeof(second) + 15) / 16 * 16;
+    memset(&header, 0xff, sizeof(header));
+    header.magic = 0x4e524a44;
+    memcpy(&mem[torn + sizeof(header)], "third", 5);
+    memcpy(&mem[torn], &header, 4);
+    check_last(&journal, DELTA_JOURNAL_CHECKPOINT, second, sizeof(second));
+
+    /* The whole header made it, but a bit of it is wrong. */
+    header.seq = journal.seq + 1;
+    header.type = DELTA_JOURNAL_CHECKPOINT;
+    header.size = 5;
+    header.crc = 0x12345678;
+    memcpy(&mem[torn], &header, sizeof(header));
+    check_last(&journal, DELTA_JOURNAL_CHECKPOINT, second, sizeof(second));
+
+    /* The next record goes to a fresh sector and replaces both. */
+    TEST_ASSERT(journal.offset == DELTA_JOURNAL_SECTOR_SIZE);
+    TEST_ASSERT(delta_journal_append(&journal, DELTA_JOURNAL_DONE, first, sizeof(first)) == DELTA_OK);
+    TEST_ASSERT(journal.last_offset == DELTA_JOURNAL_SECTOR_SIZE + sizeof(header));
+    check_last(&journal, DELTA_JOURNAL_DONE, first, sizeof(first));
+
+    /* A corrupt payload drops the record. */
+    mem[journal.last_offset]++;
+    check_last(&journal, DELTA_JOURNAL_CHECKPOINT, second, sizeof(second));
+}
+
+static void test_rotation(void)
+{
+    static uint8_t buf[1000];
+    delta_journal_t journal;
+    delta_journal_t reopened;
+    uint32_t seq = 0;
+    int i;
+
+    storage_init();
+
+    TEST_ASSERT(delta_journal_init(&journal, &ram.storage, NULL) == DELTA_OK);
+
+    /* Four records per sector, wrapping around several times. A
+     * second journal reopens the storage after each record. */
+    for (i = 0; i < 10 * 4 * SECTORS + 1; i++) {
+        memset(buf, i, sizeof(buf));
+        TEST_ASSERT(delta_journal_append(&journal, DELTA_JOURNAL_CHECKPOINT, buf, sizeof(buf)) == DELTA_OK);
+        TEST_ASSERT(journal.seq == seq + 1);
+        seq = journal.seq;
+        TEST_ASSERT(journal.last_offset / DELTA_JOURNAL_SECTOR_SIZE == (size_t)(i / 4 % SECTORS));
+        check_last(&reopened, DELTA_JOURNAL_CHECKPOINT, buf, sizeof(buf));
+        TEST_ASSERT(reopened.seq == seq);
+    }
+
+    /* The reopened journal carries on in the sector after the last
+     * record, even though it has room left. */
+    TEST_ASSERT(reopened.offset == (size_t)(((i - 1) / 4 + 1) % SECTORS) * DELTA_JOURNAL_SECTOR_SIZE);
+    memset(buf, 0x5a, sizeof(buf));
+    TEST_ASSERT(delta_journal_append(&reopened, DELTA_JOURNAL_DONE, buf, sizeof(buf)) == DELTA_OK);
+    check_last(&journal, DELTA_JOURNAL_DONE, buf, sizeof(buf));
+    TEST_ASSERT(journal.seq == seq + 1);
+}
+
+int main(void)
+{
+    test_empty();
+    test_torn_header();
+    test_rotation();
+
+    printf("%s: %d failures\n", __FILE__, failures);
+
+    return (failures != 0);
+}
@@ -0,0 +1,164 @@
+/*
+ * SPDX-FileCopyrightText: 2016 Intel Corporation
+ *                         2020 Thesis projects
+ *
+ * SPDX-License-Identifier: Apache 2.0 License
+ *
+ * SPDX-FileContributor: 2021 Laukik Hase
+ */
+
+/*
+ * Host tests of the step log: recovery of the last step after a torn
+ * entry and sector wrap around.
+ *
+ * gcc -Icomponents/delta/include components/delta/test/host/test_step_log.c
+ *     components/delta/delta_step_log.c components/delta/delta_journal.c
+ *     components/delta/delta_sched.c components/delta/delta_erase.c
+ *     components/delta/delta_storage.c -o test_step_log
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "delta.h"
+#include "delta_step_log.h"
+#include "delta_storage.h"
+
+#define SECTORS (2)
+
+static int failures;
+
+#define TEST_ASSERT(cond) do {                                          \
+        if (!(cond)) {                                                  \
+            fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond);  \
+            failures++;                                                 \
+        }                                                               \
+    } while (0)
+
+static uint8_t mem[SECTORS * DELTA_STEP_LOG_SECTOR_SIZE];
+static delta_storage_ram_t ram;
+
+static const delta_step_log_id_t id = { 123456, 0xdeadbeef, 0x110000 };
+
+static void storage_init(void)
+{
+    memset(mem, 0xff, sizeof(mem));
+    delta_storage_ram_init(&ram, mem, sizeof(mem));
+}
+
+/* Reopens the step log, as after a reboot, and checks its last step. */
+static void check_step(delta_step_log_t *log, int step)
+{
+    int last;
+
+    TEST_ASSERT(delta_step_log_init(log, &ram.storage, NULL) == DELTA_OK);
+    TEST_ASSERT(delta_step_log_get(log, &id, &last));
+    TEST_ASSERT(last == step);
+}
+
+static void test_empty(void)
+{
+    delta_step_log_t log;
+    int step = -1;
+
+    storage_init();
+
+    TEST_ASSERT(delta_step_log_init(&log, &ram.storage, NULL) == DELTA_OK);
+    TEST_ASSERT(!log.found);
+    TEST_ASSERT(!delta_step_log_get(&log, &id, &step));
+    TEST_ASSERT(step == 0);
+    TEST_ASSERT(delta_step_log_set(&log, 1) == -DELTA_JOURNAL_ERROR);
+
+    TEST_ASSERT(delta_step_log_begin(&log, &id) == DELTA_OK);
+    check_step(&log, 0);
+}
+
+static void test_torn_entry(void)
+{
+    const delta_step_log_id_t other = { 123456, 0xdeadbeef, 0x210000 };
+    delta_step_log_t log;
+    uint32_t torn = 11;
+    size_t offset;
+    int step;
+    int i;
+
+    storage_init();
+
+    TEST_ASSERT(delta_step_log_init(&log, &ram.storage, NULL) == DELTA_OK);
+    TEST_ASSERT(delta_step_log_begin(&log, &id) == DELTA_OK);
+
+    for (i = 1; i <= 10; i++) {
+        TEST_ASSERT(delta_step_log_set(&log, i) == DELTA_OK);
+    }
+    check_step(&log, 10);
+
+    /* Power lost while the next entry was programmed, its complement
+     * is still erased. */
+    offset = log.offset;
+    memcpy(&mem[offset], &torn, sizeof(torn));
+    check_step(&log, 10);
+    TEST_ASSERT(log.offset == offset + 8);
+
+    /* Logging carries on after the torn entry. */
+    TEST_ASSERT(delta_step_log_set(&log, 12) == DELTA_OK);
+    check_step(&log, 12);
+
+    /* Steps of another apply are not resumed. */
+    step = -1;
+    TEST_ASSERT(!delta_step_log_get(&log, &other, &step));
+    TEST_ASSERT(step == 0);
+
+    /* A header torn in the other sector is ignored. */
+    memcpy(&mem[DELTA_STEP_LOG_SECTOR_SIZE], "DSTP", 4);
+    check_step(&log, 12);
+
+    /* Another apply starts in the other sector. */
+    TEST_ASSERT(delta_step_log_begin(&log, &other) == DELTA_OK);
+    TEST_ASSERT(delta_step_log_set(&log, 1) == DELTA_OK);
+    TEST_ASSERT(log.sector == DELTA_STEP_LOG_SECTOR_SIZE);
+    TEST_ASSERT(delta_step_log_init(&log, &ram.storage, NULL) == DELTA_OK);
+    TEST_ASSERT(!delta_step_log_get(&log, &id, &step));
+    TEST_ASSERT(delta_step_log_get(&log, &other, &step));
+    TEST_ASSERT(step == 1);
+}
+
+static void test_wrap_around(void)
+{
+    delta_step_log_t log;
+    delta_step_log_t reopened;
+    int i;
+
+    storage_init();
+
+    TEST_ASSERT(delta_step_log_init(&log, &ram.storage, NULL) == DELTA_OK);
+    TEST_ASSERT(delta_step_log_begin(&log, &id) == DELTA_OK);
+
+    /* Over two full sectors of entries, so the first sector is
+     * reused. A second log reopens the storage now and then. */
+    for (i = 1; i <= 1200; i++) {
+        TEST_ASSERT(delta_step_log_set(&log, i) == DELTA_OK);
+        if (i % 97 == 0 || (i >= 505 && i <= 510)) {
+            check_step(&reopened, i);
+            TEST_ASSERT(reopened.sector == log.sector);
+            TEST_ASSERT(reopened.offset == log.offset);
+        }
+    }
+
+    check_step(&reopened, 1200);
+    TEST_ASSERT(log.sector == 0);
+
+    /* The reopened log continues where the first one stopped. */
+    TEST_ASSERT(delta_step_log_set(&reopened, 1201) == DELTA_OK);
+    check_step(&log, 1201);
+}
+
+int main(void)
+{
+    test_empty();
+    test_torn_entry();
+    test_wrap_around();
+
+    printf("%s: %d failures\n", __FILE__, failures);
+
+    return (failures != 0);
+}
@@ -33,6 +33,13 @@
 #include <stdlib.h>
 #include "detools.h"
 
+#if DETOOLS_CONFIG_FILE_IO == 1 && DETOOLS_CONFIG_FILE_IO_MMAP == 1
+#    include <fcntl.h>
+#    include <unistd.h>
+#    include <sys/mman.h>
+#    include <sys/stat.h>
+#endif
+
 /* Patch types. */
 #define PATCH_TYPE_SEQUENTIAL                               0
 #define PATCH_TYPE_IN_PLACE                                 1
@@ -42,6 +49,8 @@
 #define COMPRESSION_LZMA                                    1
 #define COMPRESSION_CRLE                                    2
 #define COMPRESSION_HEATSHRINK                              4
+#define COMPRESSION_LZ4                                     6
+#define COMPRESSION_LZ4_PRIMED                              7
 
 #define MIN(x, y) (((x) < (y)) ? (x) : (y))
 #define MAX(x, y) (((x) > (y)) ? (x) : (y))
@@ -84,8 +93,7 @@ static int chunk_get(struct detools_apply_patch_chunk_t *self_p,
 }
 
 #if DETOOLS_CONFIG_COMPRESSION_NONE == 1        \
-    || DETOOLS_CONFIG_COMPRESSION_CRLE == 1     \
-    || DETOOLS_CONFIG_COMPRESSION_LZMA == 1
+    || DETOOLS_CONFIG_COMPRESSION_CRLE == 1
 
 static void chunk_read_all_no_check(struct detools_apply_patch_chunk_t *self_p,
                                     uint8_t *buf_p,
@@ -171,10 +179,13 @@ static int patch_reader_none_decompress(
 
     none_p = &self_p->compression.none;
 
-    if (none_p->patch_offset + *size_p > none_p->patch_size) {
+    if (none_p->patch_offset == none_p->patch_size) {
         return (-DETOOLS_CORRUPT_PATCH);
     }
 
+    /* A size value may be read ahead past the end of the patch. */
+    *size_p = MIN(*size_p, none_p->patch_size - none_p->patch_offset);
+
     res = chunk_read(self_p->patch_chunk_p,
                      buf_p,
                      size_p);
@@ -188,6 +199,56 @@ static int patch_reader_none_decompress(
     return (0);
 }
 
+/**
+ * Patch data in the chunk, without copying it, unless data has been
+ * read ahead or the patch is compressed. The data is consumed with
+ * patch_reader_none_skip().
+ *
+ * @return Number of bytes at *buf_pp, or zero(0).
+ */
+static size_t patch_reader_none_peek(
+    struct detools_apply_patch_patch_reader_t *self_p,
+    const uint8_t **buf_pp)
+{
+    struct detools_apply_patch_patch_reader_none_t *none_p;
+    struct detools_apply_patch_chunk_t *chunk_p;
+
+    if ((self_p->decompress != patch_reader_none_decompress)
+        || (self_p->ahead.offset != self_p->ahead.size)) {
+        return (0);
+    }
+
+    none_p = &self_p->compression.none;
+    chunk_p = self_p->patch_chunk_p;
+    *buf_pp = &chunk_p->buf_p[chunk_p->offset];
+
+    return (MIN(chunk_left(chunk_p),
+                none_p->patch_size - none_p->patch_offset));
+}
+
+static void patch_reader_none_skip(
+    struct detools_apply_patch_patch_reader_t *self_p,
+    size_t size)
+{
+    self_p->patch_chunk_p->offset += size;
+    self_p->compression.none.patch_offset += size;
+}
+
+/**
+ * Up to given number of bytes of patch data, without copying it, see
+ * patch_reader_none_peek().
+ */
+static size_t patch_reader_none_span(
+    struct detools_apply_patch_patch_reader_t *self_p,
+    const uint8_t **buf_pp,
+    size_t size)
+{
+    size = MIN(size, patch_reader_none_peek(self_p, buf_pp));
+    patch_reader_none_skip(self_p, size);
+
+    return (size);
+}
+
 static int patch_reader_none_destroy(
     struct detools_apply_patch_patch_reader_t *self_p)
 {
@@ -232,6 +293,16 @@ static void unpack_heatshrink_header(uint8_t byte,
     *lookahead_sz2_p = ((byte & 0xf) + 3);
 }
 
+static heatshrink_decoder *heatshrink_decoder_of(
+    struct detools_apply_patch_patch_reader_heatshrink_t *heatshrink_p)
+{
+#if HEATSHRINK_DYNAMIC_ALLOC
+    return (heatshrink_p->decoder_p);
+#else
+    return (&heatshrink_p->decoder);
+#endif
+}
+
 static int patch_reader_heatshrink_decompress(
     struct detools_apply_patch_patch_reader_t *self_p,
     uint8_t *buf_p,
@@ -259,15 +330,26 @@ static int patch_reader_heatshrink_decompress(
                                  &heatshrink_p->window_sz2,
                                  &heatshrink_p->lookahead_sz2);
 
+#if HEATSHRINK_DYNAMIC_ALLOC
+        heatshrink_p->decoder_p = heatshrink_decoder_alloc(
+            (uint16_t)(1 << heatshrink_p->window_sz2),
+            (uint8_t)heatshrink_p->window_sz2,
+            (uint8_t)heatshrink_p->lookahead_sz2);
+
+        if (heatshrink_p->decoder_p == NULL) {
+            return (-DETOOLS_HEATSHRINK_HEADER);
+        }
+#else
         if ((heatshrink_p->window_sz2 != HEATSHRINK_STATIC_WINDOW_BITS)
                 || (heatshrink_p->lookahead_sz2 != HEATSHRINK_STATIC_LOOKAHEAD_BITS)) {
             return (-DETOOLS_HEATSHRINK_HEADER);
         }
+#endif
     }
 
     while (1) {
         /* Get available data. */
-        pres = heatshrink_decoder_poll(&heatshrink_p->decoder,
+        pres = heatshrink_decoder_poll(heatshrink_decoder_of(heatshrink_p),
                                        buf_p,
                                        left,
                                        &size);
@@ -287,7 +369,7 @@ static int patch_reader_heatshrink_decompress(
         res = chunk_get(self_p->patch_chunk_p, &byte);
 
         if (res == 0) {
-            sres = heatshrink_decoder_sink(&heatshrink_p->decoder,
+            sres = heatshrink_decoder_sink(heatshrink_decoder_of(heatshrink_p),
                                            &byte,
                                            sizeof(byte),
                                            &size);
@@ -317,7 +399,17 @@ static int patch_reader_heatshrink_destroy(
 
     heatshrink_p = &self_p->compression.heatshrink;
 
+#if HEATSHRINK_DYNAMIC_ALLOC
+    if (heatshrink_p->decoder_p == NULL) {
+        return (0);
+    }
+
+    fres = heatshrink_decoder_finish(heatshrink_p->decoder_p);
+    heatshrink_decoder_free(heatshrink_p->decoder_p);
+    heatshrink_p->decoder_p = NULL;
+#else
     fres = heatshrink_decoder_finish(&heatshrink_p->decoder);
+#endif
 
     if (fres == HSDR_FINISH_DONE) {
         return (0);
@@ -334,7 +426,11 @@ static int patch_reader_heatshrink_init(
     heatshrink_p = &self_p->compression.heatshrink;
     heatshrink_p->window_sz2 = -1;
     heatshrink_p->lookahead_sz2 = -1;
+#if HEATSHRINK_DYNAMIC_ALLOC
+    heatshrink_p->decoder_p = NULL;
+#else
     heatshrink_decoder_reset(&heatshrink_p->decoder);
+#endif
     self_p->destroy = patch_reader_heatshrink_destroy;
     self_p->decompress = patch_reader_heatshrink_decompress;
 
@@ -349,85 +445,91 @@ static int patch_reader_heatshrink_init(
 
 #if DETOOLS_CONFIG_COMPRESSION_LZMA == 1
 
-static int get_decompressed_data(
+/* Serves decompressed data left over from an earlier call. */
+static size_t get_stashed_data(
     struct detools_apply_patch_patch_reader_lzma_t *lzma_p,
     uint8_t *buf_p,
     size_t size)
 {
-    int res;
+    size = MIN(size, lzma_p->stash_size);
+    memcpy(buf_p, &lzma_p->stash[lzma_p->stash_offset], size);
+    lzma_p->stash_offset += size;
+    lzma_p->stash_size -= size;
 
-    if (lzma_p->output_size >= size) {
-        memcpy(buf_p, lzma_p->output_p, size);
-        memmove(lzma_p->output_p,
-                &lzma_p->output_p[size],
-                lzma_p->output_size - size);
-        lzma_p->output_size -= size;
-        res = 0;
-    } else {
-        res = 1;
+    if (lzma_p->stash_size == 0) {
+        lzma_p->stash_offset = 0;
     }
 
-    return (res);
+    return (size);
 }
 
-static int prepare_input_buffer(struct detools_apply_patch_patch_reader_t *self_p)
+/**
+ * Decompress from the patch chunk into given buffer, without copying
+ * the input.
+ *
+ * @return Number of decompressed bytes, or negative error code.
+ */
+static int lzma_decode(struct detools_apply_patch_patch_reader_t *self_p,
+                       uint8_t *buf_p,
+                       size_t size)
 {
     struct detools_apply_patch_patch_reader_lzma_t *lzma_p;
-    uint8_t *next_p;
+    struct detools_apply_patch_chunk_t *chunk_p;
+    lzma_ret ret;
     size_t left;
 
     lzma_p = &self_p->compression.lzma;
-    left = chunk_left(self_p->patch_chunk_p);
+    chunk_p = self_p->patch_chunk_p;
+    left = chunk_left(chunk_p);
 
-    if (left == 0) {
-        return (1);
+    if ((left == 0) || (size == 0)) {
+        return (0);
     }
 
-    next_p = malloc(lzma_p->stream.avail_in + left);
+    lzma_p->stream.next_in = &chunk_p->buf_p[chunk_p->offset];
+    lzma_p->stream.avail_in = left;
+    lzma_p->stream.next_out = buf_p;
+    lzma_p->stream.avail_out = size;
 
-    if (next_p == NULL) {
-        return (-DETOOLS_OUT_OF_MEMORY);
-    }
-
-    if (lzma_p->stream.next_in != NULL) {
-        memcpy(next_p, lzma_p->stream.next_in, lzma_p->stream.avail_in);
-        free(lzma_p->input_p);
-    }
+    ret = lzma_code(&lzma_p->stream, LZMA_RUN);
 
-    lzma_p->input_p = next_p;
-    chunk_read_all_no_check(self_p->patch_chunk_p,
-                            &lzma_p->input_p[lzma_p->stream.avail_in],
-                            left);
-    lzma_p->stream.next_in = next_p;
-    lzma_p->stream.avail_in += left;
+    switch (ret) {
 
-    return (0);
-}
+    case LZMA_OK:
+    case LZMA_BUF_ERROR:
+        break;
 
-static int prepare_output_buffer(struct detools_apply_patch_patch_reader_t *self_p,
-                                 size_t size)
-{
-    struct detools_apply_patch_patch_reader_lzma_t *lzma_p;
-    uint8_t *output_p;
+    case LZMA_STREAM_END:
+        /* The patch ends with the stream. */
+        if (lzma_p->stream.avail_in > 0) {
+            return (-DETOOLS_CORRUPT_PATCH);
+        }
 
-    lzma_p = &self_p->compression.lzma;
+        break;
 
-    output_p = malloc(size);
+    case LZMA_MEMLIMIT_ERROR:
+        return (-DETOOLS_LZMA_MEMORY_LIMIT);
 
-    if (output_p == NULL) {
+    case LZMA_MEM_ERROR:
         return (-DETOOLS_OUT_OF_MEMORY);
+
+    default:
+        return (-DETOOLS_LZMA_DECODE);
     }
 
-    if (lzma_p->output_p != NULL) {
-        memcpy(output_p, lzma_p->output_p, lzma_p->output_size);
-        free(lzma_p->output_p);
+    /* Neither input consumed nor output produced, so the stream is
+     * stuck and would be called again forever. */
+    if ((lzma_p->stream.avail_in == left)
+        && (lzma_p->stream.avail_out == size)
+        && (ret != LZMA_STREAM_END)) {
+        return (-DETOOLS_LZMA_DECODE);
     }
 
-    lzma_p->output_p = output_p;
-    lzma_p->stream.next_out = (output_p + lzma_p->output_size);
-    lzma_p->stream.avail_out = (size - lzma_p->output_size);
+    chunk_p->offset += (left - lzma_p->stream.avail_in);
+    lzma_p->stream.next_in = NULL;
+    lzma_p->stream.avail_in = 0;
 
-    return (0);
+    return ((int)(size - lzma_p->stream.avail_out));
 }
 
 static int patch_reader_lzma_decompress(
@@ -437,55 +539,44 @@ static int patch_reader_lzma_decompress(
 {
     int res;
     struct detools_apply_patch_patch_reader_lzma_t *lzma_p;
-    lzma_ret ret;
+    size_t size;
+    size_t stash_end;
 
     lzma_p = &self_p->compression.lzma;
+    size = get_stashed_data(lzma_p, buf_p, *size_p);
 
-    /* Check if enough decompressed data is available. */
-    res = get_decompressed_data(lzma_p, buf_p, *size_p);
-
-    if (res == 0) {
-        return (res);
-    }
-
-    while (1) {
-        /* Try to decompress requested data. */
-        if (lzma_p->stream.avail_in > 0) {
-            res = prepare_output_buffer(self_p, *size_p);
-
-            if (res != 0) {
-                return (res);
-            }
-
-            ret = lzma_code(&lzma_p->stream, LZMA_RUN);
+    /* Decompress straight into the destination buffer. */
+    if (size < *size_p) {
+        res = lzma_decode(self_p, &buf_p[size], *size_p - size);
 
-            switch (ret) {
+        if (res < 0) {
+            return (res);
+        }
 
-            case LZMA_OK:
-            case LZMA_STREAM_END:
-                break;
+        size += (size_t)res;
+    }
 
-            default:
-                return (-DETOOLS_LZMA_DECODE);
-            }
+    /* Keep consuming the chunk while there is room in the stash, so
+     * that no patch data is left over after the last requested
+     * byte. */
+    stash_end = (lzma_p->stash_offset + lzma_p->stash_size);
+    res = lzma_decode(self_p,
+                      &lzma_p->stash[stash_end],
+                      sizeof(lzma_p->stash) - stash_end);
 
-            lzma_p->output_size = (size_t)(lzma_p->stream.next_out - lzma_p->output_p);
-        }
+    if (res < 0) {
+        return (res);
+    }
 
-        /* Check if enough decompressed data is available. */
-        res = get_decompressed_data(lzma_p, buf_p, *size_p);
+    lzma_p->stash_size += (size_t)res;
 
-        if (res == 0) {
-            return (res);
-        }
+    if (size == 0) {
+        return (1);
+    }
 
-        /* Get more data to decompress. */
-        res = prepare_input_buffer(self_p);
+    *size_p = size;
 
-        if (res != 0) {
-            return (res);
-        }
-    }
+    return (0);
 }
 
 static int patch_reader_lzma_destroy(
@@ -495,161 +586,557 @@ static int patch_reader_lzma_destroy(
 
     lzma_p = &self_p->compression.lzma;
 
-    if (lzma_p->input_p != NULL) {
-        free(lzma_p->input_p);
-    }
-
-    if (lzma_p->output_p != NULL) {
-        free(lzma_p->output_p);
-    }
-
     lzma_end(&lzma_p->stream);
 
-    if ((lzma_p->stream.avail_in == 0) && (lzma_p->output_size == 0)) {
+    if (lzma_p->stash_size == 0) {
         return (0);
     } else {
         return (-DETOOLS_CORRUPT_PATCH);
     }
 }
 
-static int patch_reader_lzma_init(struct detools_apply_patch_patch_reader_t *self_p)
+/* Allocations are never freed individually, the whole buffer is
+ * reused by the next patch. */
+static void *lzma_memory_alloc(void *opaque_p, size_t nmemb, size_t size)
+{
+    struct detools_lzma_memory_t *memory_p;
+    size_t offset;
+    void *buf_p;
+
+    memory_p = opaque_p;
+
+    if ((size != 0) && (nmemb > (SIZE_MAX / size))) {
+        return (NULL);
+    }
+
+    size *= nmemb;
+    offset = ((memory_p->offset + 7) & ~(size_t)7);
+
+    if ((offset > memory_p->size) || (size > (memory_p->size - offset))) {
+        return (NULL);
+    }
+
+    buf_p = &memory_p->buf_p[offset];
+    memory_p->offset = (offset + size);
+
+    return (buf_p);
+}
+
+static void lzma_memory_free(void *opaque_p, void *buf_p)
+{
+    (void)opaque_p;
+    (void)buf_p;
+}
+
+static int patch_reader_lzma_init(struct detools_apply_patch_patch_reader_t *self_p,
+                                  size_t patch_size)
 {
+    (void)patch_size;
+
     lzma_ret ret;
     struct detools_apply_patch_patch_reader_lzma_t *lzma_p;
+    struct detools_lzma_memory_t *memory_p;
 
     lzma_p = &self_p->compression.lzma;
+    memory_p = &self_p->lzma_memory;
     memset(&lzma_p->stream, 0, sizeof(lzma_p->stream));
 
-    ret = lzma_alone_decoder(&lzma_p->stream, UINT64_MAX);
+    if (memory_p->buf_p != NULL) {
+        memory_p->offset = 0;
+        lzma_p->allocator.alloc = lzma_memory_alloc;
+        lzma_p->allocator.free = lzma_memory_free;
+        lzma_p->allocator.opaque = memory_p;
+        lzma_p->stream.allocator = &lzma_p->allocator;
+    }
+
+    /* The limit is checked when the header is decoded, before the
+     * dictionary is allocated. */
+    ret = lzma_alone_decoder(&lzma_p->stream, memory_p->limit);
 
-    if (ret != LZMA_OK) {
+    if (ret == LZMA_MEM_ERROR) {
+        return (-DETOOLS_OUT_OF_MEMORY);
+    } else if (ret != LZMA_OK) {
         return (-DETOOLS_LZMA_INIT);
     }
 
-    lzma_p->input_p = NULL;
-    lzma_p->output_p = NULL;
-    lzma_p->output_size = 0;
+    lzma_p->stash_offset = 0;
+    lzma_p->stash_size = 0;
     self_p->destroy = patch_reader_lzma_destroy;
     self_p->decompress = patch_reader_lzma_decompress;
 
     return (0);
 }
 
-#endif
+/* The decoder state is all in the caller's buffer, which is dumped as
+ * is. Pointers in it stay valid as long as the buffer is at the same
+ * address and the code is the same. */
+static int patch_reader_lzma_dump(
+    struct detools_apply_patch_patch_reader_t *self_p,
+    detools_state_write_t state_write,
+    void *arg_p)
+{
+    struct detools_lzma_memory_t *memory_p;
+    int res;
 
-/*
- * CRLE patch reader.
- */
+    memory_p = &self_p->lzma_memory;
 
-#if DETOOLS_CONFIG_COMPRESSION_CRLE == 1
+    if (memory_p->buf_p == NULL) {
+        return (-DETOOLS_NOT_IMPLEMENTED);
+    }
 
-static void unpack_usize_init(struct detools_unpack_usize_t *self_p)
-{
-    self_p->state = detools_unpack_usize_state_first_t;
-    self_p->value = 0;
-    self_p->offset = 0;
+    res = state_write(arg_p,
+                      memory_p->buf_p,
+                      memory_p->offset);
+
+    if (res != 0) {
+        return (-DETOOLS_IO_FAILED);
+    }
+
+    return (0);
 }
 
-static int unpack_usize(struct detools_unpack_usize_t *self_p,
-                        struct detools_apply_patch_chunk_t *patch_chunk_p,
-                        int *size_p)
+static int patch_reader_lzma_restore(
+    struct detools_apply_patch_patch_reader_t *self_p,
+    struct detools_lzma_memory_t *memory_p,
+    detools_state_read_t state_read,
+    void *arg_p)
 {
+    struct detools_apply_patch_patch_reader_lzma_t *lzma_p;
     int res;
-    uint8_t byte;
 
-    switch (self_p->state) {
+    lzma_p = &self_p->compression.lzma;
 
-    case detools_unpack_usize_state_first_t:
-        self_p->value = 0;
-        self_p->offset = 0;
-        self_p->state = detools_unpack_usize_state_consecutive_t;
-        break;
+    if ((memory_p->buf_p == NULL)
+        || (memory_p->buf_p != self_p->lzma_memory.buf_p)
+        || (memory_p->size < self_p->lzma_memory.offset)) {
+        return (-DETOOLS_LZMA_MEMORY_MISMATCH);
+    }
 
-    case detools_unpack_usize_state_consecutive_t:
-        break;
+    memory_p->offset = self_p->lzma_memory.offset;
+    memory_p->limit = self_p->lzma_memory.limit;
+    self_p->lzma_memory = *memory_p;
 
-    default:
-        return (-DETOOLS_INTERNAL_ERROR);
+    res = state_read(arg_p,
+                     memory_p->buf_p,
+                     memory_p->offset);
+
+    if (res != 0) {
+        return (-DETOOLS_IO_FAILED);
     }
 
-    do {
-        res = chunk_get(patch_chunk_p, &byte);
+    lzma_p->allocator.opaque = &self_p->lzma_memory;
+    lzma_p->stream.allocator = &lzma_p->allocator;
+    self_p->destroy = patch_reader_lzma_destroy;
+    self_p->decompress = patch_reader_lzma_decompress;
 
-        if (res != 0) {
-            return (res);
-        }
+    return (0);
+}
 
-        if (is_overflow(self_p->offset)) {
-            return (-DETOOLS_CORRUPT_PATCH_OVERFLOW);
+#elif DETOOLS_CONFIG_COMPRESSION_LZMA_EMBEDDED == 1
+
+/* Gives the decoder the caller's buffer, or one from the heap, once
+ * the stream header tells how much it needs. */
+static int lzma_set_buffer(struct detools_apply_patch_patch_reader_t *self_p)
+{
+    struct detools_apply_patch_patch_reader_lzma_t *lzma_p;
+    struct detools_lzma_memory_t *memory_p;
+    size_t size;
+    void *buf_p;
+
+    lzma_p = &self_p->compression.lzma;
+    memory_p = &self_p->lzma_memory;
+    size = lzmadec_memory_usage(&lzma_p->decoder);
+
+    if (size > memory_p->limit) {
+        return (-DETOOLS_LZMA_MEMORY_LIMIT);
+    }
+
+    if (memory_p->buf_p != NULL) {
+        buf_p = memory_p->buf_p;
+        size = memory_p->size;
+    } else {
+        buf_p = malloc(size);
+
+        if (buf_p == NULL) {
+            return (-DETOOLS_OUT_OF_MEMORY);
         }
 
-        self_p->value |= ((byte & 0x7f) << self_p->offset);
-        self_p->offset += 7;
-    } while ((byte & 0x80) != 0);
+        lzma_p->heap = true;
+    }
 
-    *size_p = self_p->value;
+    if (lzmadec_set_buffer(&lzma_p->decoder, buf_p, size) != LZMADEC_OK) {
+        return (-DETOOLS_LZMA_MEMORY_LIMIT);
+    }
 
     return (0);
 }
 
-static int patch_reader_crle_decompress_idle(
-    struct detools_apply_patch_patch_reader_t *self_p,
-    struct detools_apply_patch_patch_reader_crle_t *crle_p)
+/* Decodes as much of the patch chunk as the dictionary has room for. */
+static int lzma_decode(struct detools_apply_patch_patch_reader_t *self_p)
 {
+    struct detools_apply_patch_patch_reader_lzma_t *lzma_p;
+    struct detools_apply_patch_chunk_t *chunk_p;
+    lzmadec_res ret;
+    size_t size;
     int res;
-    uint8_t kind;
 
-    res = chunk_get(self_p->patch_chunk_p, &kind);
+    lzma_p = &self_p->compression.lzma;
+    chunk_p = self_p->patch_chunk_p;
 
-    if (res != 0) {
-        return (res);
-    }
+    while (true) {
+        if (lzma_p->decoder.status == LZMADEC_STATUS_NEED_BUFFER) {
+            res = lzma_set_buffer(self_p);
 
-    res = 2;
+            if (res != 0) {
+                return (res);
+            }
+        }
 
-    switch (kind) {
+        size = chunk_left(chunk_p);
+        ret = lzmadec_decode(&lzma_p->decoder,
+                             &chunk_p->buf_p[chunk_p->offset],
+                             &size);
+        chunk_p->offset += size;
 
-    case 0:
-        crle_p->state = detools_crle_state_scattered_size_t;
-        unpack_usize_init(&crle_p->kind.scattered.size);
-        break;
+        if (ret != LZMADEC_NEED_BUFFER) {
+            break;
+        }
+    }
 
-    case 1:
-        crle_p->state = detools_crle_state_repeated_repetitions_t;
-        unpack_usize_init(&crle_p->kind.repeated.size);
-        break;
+    switch (ret) {
+
+    case LZMADEC_OK:
+    case LZMADEC_END:
+        return (0);
+
+    case LZMADEC_ERROR_MEMORY:
+        return (-DETOOLS_LZMA_MEMORY_LIMIT);
 
     default:
-        res = -DETOOLS_CORRUPT_PATCH_CRLE_KIND;
-        break;
+        return (-DETOOLS_LZMA_DECODE);
     }
-
-    return (res);
 }
 
-static int patch_reader_crle_decompress_scattered_size(
+static int patch_reader_lzma_decompress(
     struct detools_apply_patch_patch_reader_t *self_p,
-    struct detools_apply_patch_patch_reader_crle_t *crle_p)
+    uint8_t *buf_p,
+    size_t *size_p)
 {
+    struct detools_apply_patch_patch_reader_lzma_t *lzma_p;
+    size_t size;
     int res;
-    int size;
 
-    res = unpack_usize(&crle_p->kind.scattered.size,
-                       self_p->patch_chunk_p,
-                       &size);
+    lzma_p = &self_p->compression.lzma;
+
+    res = lzma_decode(self_p);
 
     if (res != 0) {
         return (res);
     }
 
-    crle_p->state = detools_crle_state_scattered_data_t;
-    crle_p->kind.scattered.number_of_bytes_left = (size_t)size;
+    size = lzmadec_read(&lzma_p->decoder, buf_p, *size_p);
 
-    return (2);
-}
+    /* Refill the dictionary, so that no patch data is left over after
+     * the last requested byte. */
+    res = lzma_decode(self_p);
 
-static int patch_reader_crle_decompress_scattered_data(
-    struct detools_apply_patch_patch_reader_t *self_p,
+    if (res != 0) {
+        return (res);
+    }
+
+    if (size == 0) {
+        return (1);
+    }
+
+    *size_p = size;
+
+    return (0);
+}
+
+static int patch_reader_lzma_destroy(
+    struct detools_apply_patch_patch_reader_t *self_p)
+{
+    struct detools_apply_patch_patch_reader_lzma_t *lzma_p;
+
+    lzma_p = &self_p->compression.lzma;
+
+    if (lzma_p->heap) {
+        free(lzma_p->decoder.buf_p);
+        lzma_p->heap = false;
+    }
+
+    if (lzmadec_finished(&lzma_p->decoder)) {
+        return (0);
+    } else {
+        return (-DETOOLS_CORRUPT_PATCH);
+    }
+}
+
+static int patch_reader_lzma_init(struct detools_apply_patch_patch_reader_t *self_p,
+                                  size_t patch_size)
+{
+    struct detools_apply_patch_patch_reader_lzma_t *lzma_p;
+
+    lzma_p = &self_p->compression.lzma;
+    lzmadec_init(&lzma_p->decoder, patch_size);
+    lzma_p->heap = false;
+    self_p->destroy = patch_reader_lzma_destroy;
+    self_p->decompress = patch_reader_lzma_decompress;
+
+    return (0);
+}
+
+/* The decoder is free of pointers but to its buffer, so only the used
+ * part of the buffer is dumped with it, and it can be restored into
+ * any buffer large enough. */
+static int patch_reader_lzma_dump(
+    struct detools_apply_patch_patch_reader_t *self_p,
+    detools_state_write_t state_write,
+    void *arg_p)
+{
+    struct detools_apply_patch_patch_reader_lzma_t *lzma_p;
+    size_t size;
+    int res;
+
+    lzma_p = &self_p->compression.lzma;
+    size = lzmadec_buffer_used(&lzma_p->decoder);
+
+    if (size == 0) {
+        return (0);
+    }
+
+    res = state_write(arg_p, lzma_p->decoder.buf_p, size);
+
+    if (res != 0) {
+        return (-DETOOLS_IO_FAILED);
+    }
+
+    return (0);
+}
+
+static int patch_reader_lzma_restore(
+    struct detools_apply_patch_patch_reader_t *self_p,
+    struct detools_lzma_memory_t *memory_p,
+    detools_state_read_t state_read,
+    void *arg_p)
+{
+    struct detools_apply_patch_patch_reader_lzma_t *lzma_p;
+    size_t size;
+    int res;
+
+    lzma_p = &self_p->compression.lzma;
+    self_p->lzma_memory = *memory_p;
+    lzma_p->heap = false;
+    self_p->destroy = patch_reader_lzma_destroy;
+    self_p->decompress = patch_reader_lzma_decompress;
+    size = lzmadec_buffer_used(&lzma_p->decoder);
+
+    if (size == 0) {
+        lzma_p->decoder.buf_p = NULL;
+
+        return (0);
+    }
+
+    if (memory_p->buf_p == NULL) {
+        lzma_p->decoder.buf_p = NULL;
+        res = lzma_set_buffer(self_p);
+    } else if (lzmadec_set_buffer(&lzma_p->decoder,
+                                  memory_p->buf_p,
+                                  memory_p->size) != LZMADEC_OK) {
+        res = -DETOOLS_LZMA_MEMORY_MISMATCH;
+    } else {
+        res = 0;
+    }
+
+    if (res != 0) {
+        return (res);
+    }
+
+    res = state_read(arg_p, lzma_p->decoder.buf_p, size);
+
+    if (res != 0) {
+        return (-DETOOLS_IO_FAILED);
+    }
+
+    return (0);
+}
+
+#endif
+
+#if DETOOLS_CONFIG_COMPRESSION_LZMA == 1        \
+    || DETOOLS_CONFIG_COMPRESSION_LZMA_EMBEDDED == 1
+
+static void patch_reader_set_lzma_memory(
+    struct detools_apply_patch_patch_reader_t *self_p,
+    void *buf_p,
+    size_t size,
+    uint64_t limit)
+{
+    self_p->lzma_memory.buf_p = buf_p;
+    self_p->lzma_memory.size = size;
+    self_p->lzma_memory.offset = 0;
+    self_p->lzma_memory.limit = limit;
+}
+
+#endif
+
+/*
+ * CRLE patch reader.
+ */
+
+#if DETOOLS_CONFIG_COMPRESSION_CRLE == 1
+
+static void unpack_usize_init(struct detools_unpack_usize_t *self_p)
+{
+    self_p->state = detools_unpack_usize_state_first_t;
+    self_p->value = 0;
+    self_p->offset = 0;
+}
+
+/**
+ * Unpack a size value found whole in the chunk, without saving any
+ * state on the way. Returns 1 if the chunk ends first.
+ */
+static int unpack_usize_fast(struct detools_apply_patch_chunk_t *patch_chunk_p,
+                             int *size_p)
+{
+    const uint8_t *buf_p;
+    size_t left;
+    size_t i;
+    int value;
+    int offset;
+
+    buf_p = &patch_chunk_p->buf_p[patch_chunk_p->offset];
+    left = chunk_left(patch_chunk_p);
+    value = 0;
+    offset = 0;
+
+    for (i = 0; i < left; i++) {
+        if (is_overflow(offset)) {
+            return (-DETOOLS_CORRUPT_PATCH_OVERFLOW);
+        }
+
+        value |= ((buf_p[i] & 0x7f) << offset);
+        offset += 7;
+
+        if ((buf_p[i] & 0x80) == 0) {
+            patch_chunk_p->offset += (i + 1);
+            *size_p = value;
+
+            return (0);
+        }
+    }
+
+    return (1);
+}
+
+static int unpack_usize(struct detools_unpack_usize_t *self_p,
+                        struct detools_apply_patch_chunk_t *patch_chunk_p,
+                        int *size_p)
+{
+    int res;
+    uint8_t byte;
+
+    switch (self_p->state) {
+
+    case detools_unpack_usize_state_first_t:
+        res = unpack_usize_fast(patch_chunk_p, size_p);
+
+        if (res != 1) {
+            return (res);
+        }
+
+        /* Split over chunks, unpack byte by byte. */
+        self_p->value = 0;
+        self_p->offset = 0;
+        self_p->state = detools_unpack_usize_state_consecutive_t;
+        break;
+
+    case detools_unpack_usize_state_consecutive_t:
+        break;
+
+    default:
+        return (-DETOOLS_INTERNAL_ERROR);
+    }
+
+    do {
+        res = chunk_get(patch_chunk_p, &byte);
+
+        if (res != 0) {
+            return (res);
+        }
+
+        if (is_overflow(self_p->offset)) {
+            return (-DETOOLS_CORRUPT_PATCH_OVERFLOW);
+        }
+
+        self_p->value |= ((byte & 0x7f) << self_p->offset);
+        self_p->offset += 7;
+    } while ((byte & 0x80) != 0);
+
+    *size_p = self_p->value;
+
+    return (0);
+}
+
+static int patch_reader_crle_decompress_idle(
+    struct detools_apply_patch_patch_reader_t *self_p,
+    struct detools_apply_patch_patch_reader_crle_t *crle_p)
+{
+    int res;
+    uint8_t kind;
+
+    res = chunk_get(self_p->patch_chunk_p, &kind);
+
+    if (res != 0) {
+        return (res);
+    }
+
+    res = 2;
+
+    switch (kind) {
+
+    case 0:
+        crle_p->state = detools_crle_state_scattered_size_t;
+        unpack_usize_init(&crle_p->kind.scattered.size);
+        break;
+
+    case 1:
+        crle_p->state = detools_crle_state_repeated_repetitions_t;
+        unpack_usize_init(&crle_p->kind.repeated.size);
+        break;
+
+    default:
+        res = -DETOOLS_CORRUPT_PATCH_CRLE_KIND;
+        break;
+    }
+
+    return (res);
+}
+
+static int patch_reader_crle_decompress_scattered_size(
+    struct detools_apply_patch_patch_reader_t *self_p,
+    struct detools_apply_patch_patch_reader_crle_t *crle_p)
+{
+    int res;
+    int size;
+
+    res = unpack_usize(&crle_p->kind.scattered.size,
+                       self_p->patch_chunk_p,
+                       &size);
+
+    if (res != 0) {
+        return (res);
+    }
+
+    crle_p->state = detools_crle_state_scattered_data_t;
+    crle_p->kind.scattered.number_of_bytes_left = (size_t)size;
+
+    return (2);
+}
+
+static int patch_reader_crle_decompress_scattered_data(
+    struct detools_apply_patch_patch_reader_t *self_p,
     struct detools_apply_patch_patch_reader_crle_t *crle_p,
     uint8_t *buf_p,
     size_t *size_p)
@@ -717,13 +1204,9 @@ static int patch_reader_crle_decompress_repeated_data_read(
     size_t *size_p)
 {
     size_t size;
-    size_t i;
 
     size = MIN(*size_p, crle_p->kind.repeated.number_of_bytes_left);
-
-    for (i = 0; i < size; i++) {
-        buf_p[i] = crle_p->kind.repeated.value;
-    }
+    memset(buf_p, crle_p->kind.repeated.value, size);
 
     *size_p = size;
     crle_p->kind.repeated.number_of_bytes_left -= size;
@@ -742,10 +1225,16 @@ static int patch_reader_crle_decompress(
 {
     int res;
     struct detools_apply_patch_patch_reader_crle_t *crle_p;
+    size_t size;
+    size_t produced;
 
     crle_p = &self_p->compression.crle;
+    produced = 0;
 
+    /* Fill the buffer with as many runs as the chunk holds. */
     do {
+        size = (*size_p - produced);
+
         switch (crle_p->state) {
 
         case detools_crle_state_idle_t:
@@ -759,8 +1248,8 @@ static int patch_reader_crle_decompress(
         case detools_crle_state_scattered_data_t:
             res = patch_reader_crle_decompress_scattered_data(self_p,
                     crle_p,
-                    buf_p,
-                    size_p);
+                    &buf_p[produced],
+                    &size);
             break;
 
         case detools_crle_state_repeated_repetitions_t:
@@ -774,16 +1263,31 @@ static int patch_reader_crle_decompress(
 
         case detools_crle_state_repeated_data_read_t:
             res = patch_reader_crle_decompress_repeated_data_read(crle_p,
-                    buf_p,
-                    size_p);
+                    &buf_p[produced],
+                    &size);
             break;
 
         default:
             res = -DETOOLS_INTERNAL_ERROR;
             break;
         }
+
+        if (res == 0) {
+            produced += size;
+
+            if (produced < *size_p) {
+                res = 2;
+            }
+        }
     } while (res == 2);
 
+    /* Out of patch data, but some bytes were produced. */
+    if ((res == 1) && (produced > 0)) {
+        res = 0;
+    }
+
+    *size_p = produced;
+
     return (res);
 }
 
@@ -811,14 +1315,272 @@ static int patch_reader_crle_init(struct detools_apply_patch_patch_reader_t *sel
 #endif
 
 /*
- * Patch reader.
+ * LZ4 patch reader.
  */
 
-/**
- * Initialize given patch reader.
- */
-static int patch_reader_init(struct detools_apply_patch_patch_reader_t *self_p,
-                             struct detools_apply_patch_chunk_t *patch_chunk_p,
+#if DETOOLS_CONFIG_COMPRESSION_LZ4 == 1
+
+/* Appends the source data the next block is primed with to the
+ * window. */
+static int lz4_prime(struct detools_apply_patch_patch_reader_t *self_p)
+{
+    lz4dec_t *decoder_p;
+    uint8_t *buf_p;
+    uint32_t offset;
+    size_t size;
+    int res;
+
+    if (self_p->source_read == NULL) {
+        return (-DETOOLS_NOT_IMPLEMENTED);
+    }
+
+    decoder_p = &self_p->compression.lz4.decoder;
+
+    while (true) {
+        buf_p = lz4dec_source(decoder_p, &offset, &size);
+
+        if (size == 0) {
+            break;
+        }
+
+        res = self_p->source_read(self_p->source_arg_p, offset, buf_p, size);
+
+        if (res != 0) {
+            return (res);
+        }
+
+        lz4dec_primed(decoder_p, size);
+    }
+
+    return (0);
+}
+
+static int patch_reader_lz4_decompress(
+    struct detools_apply_patch_patch_reader_t *self_p,
+    uint8_t *buf_p,
+    size_t *size_p)
+{
+    struct detools_apply_patch_chunk_t *chunk_p;
+    lz4dec_res ret;
+    size_t size;
+    size_t produced;
+    size_t left;
+    int res;
+
+    chunk_p = self_p->patch_chunk_p;
+    produced = 0;
+
+    /* Sequence headers after the last requested byte are consumed as
+     * well, so that no patch data is left over. */
+    do {
+        size = chunk_left(chunk_p);
+        left = (*size_p - produced);
+        ret = lz4dec_decode(&self_p->compression.lz4.decoder,
+                            &chunk_p->buf_p[chunk_p->offset],
+                            &size,
+                            &buf_p[produced],
+                            &left);
+        chunk_p->offset += size;
+        produced += left;
+
+        if (ret == LZ4DEC_NEED_SOURCE) {
+            res = lz4_prime(self_p);
+
+            if (res != 0) {
+                return (res);
+            }
+        }
+    } while (ret == LZ4DEC_NEED_SOURCE);
+
+    *size_p = produced;
+
+    switch (ret) {
+
+    case LZ4DEC_OK:
+    case LZ4DEC_END:
+        break;
+
+    case LZ4DEC_ERROR_WINDOW:
+        return (-DETOOLS_LZ4_WINDOW);
+
+    default:
+        return (-DETOOLS_LZ4_DECODE);
+    }
+
+    if (*size_p == 0) {
+        return (1);
+    }
+
+    return (0);
+}
+
+static int patch_reader_lz4_destroy(
+    struct detools_apply_patch_patch_reader_t *self_p)
+{
+    struct detools_apply_patch_patch_reader_lz4_t *lz4_p;
+
+    lz4_p = &self_p->compression.lz4;
+
+    if (lz4_p->heap) {
+        free(lz4_p->decoder.window_p);
+        lz4_p->heap = false;
+    }
+
+    if (lz4dec_finished(&lz4_p->decoder)) {
+        return (0);
+    } else {
+        return (-DETOOLS_CORRUPT_PATCH);
+    }
+}
+
+/* The caller's window, or one from the heap. */
+static int lz4_window(struct detools_apply_patch_patch_reader_t *self_p,
+                      size_t size,
+                      uint8_t **window_pp)
+{
+    if (self_p->lz4_window.buf_p != NULL) {
+        if (self_p->lz4_window.size < size) {
+            return (-DETOOLS_LZ4_WINDOW);
+        }
+
+        *window_pp = self_p->lz4_window.buf_p;
+    } else {
+        *window_pp = malloc(size);
+
+        if (*window_pp == NULL) {
+            return (-DETOOLS_OUT_OF_MEMORY);
+        }
+
+        self_p->compression.lz4.heap = true;
+    }
+
+    return (0);
+}
+
+static int patch_reader_lz4_init(struct detools_apply_patch_patch_reader_t *self_p,
+                                 bool primed)
+{
+    struct detools_apply_patch_patch_reader_lz4_t *lz4_p;
+    uint8_t *window_p;
+    size_t size;
+    int res;
+
+    if (primed && (self_p->source_read == NULL)) {
+        return (-DETOOLS_NOT_IMPLEMENTED);
+    }
+
+    lz4_p = &self_p->compression.lz4;
+    lz4_p->heap = false;
+
+    if (self_p->lz4_window.buf_p != NULL) {
+        size = self_p->lz4_window.size;
+    } else {
+        size = DETOOLS_CONFIG_LZ4_WINDOW_SIZE;
+    }
+
+    res = lz4_window(self_p, size, &window_p);
+
+    if (res != 0) {
+        return (res);
+    }
+
+    if (primed) {
+        lz4dec_init_primed(&lz4_p->decoder, window_p, size);
+    } else {
+        lz4dec_init(&lz4_p->decoder, window_p, size);
+    }
+
+    self_p->destroy = patch_reader_lz4_destroy;
+    self_p->decompress = patch_reader_lz4_decompress;
+
+    return (0);
+}
+
+static int patch_reader_lz4_dump(
+    struct detools_apply_patch_patch_reader_t *self_p,
+    detools_state_write_t state_write,
+    void *arg_p)
+{
+    struct detools_apply_patch_patch_reader_lz4_t *lz4_p;
+    size_t size;
+    int res;
+
+    lz4_p = &self_p->compression.lz4;
+    size = lz4dec_window_used(&lz4_p->decoder);
+
+    if (size == 0) {
+        return (0);
+    }
+
+    res = state_write(arg_p, lz4_p->decoder.window_p, size);
+
+    if (res != 0) {
+        return (-DETOOLS_IO_FAILED);
+    }
+
+    return (0);
+}
+
+static int patch_reader_lz4_restore(
+    struct detools_apply_patch_patch_reader_t *self_p,
+    struct detools_lz4_window_t *window_p,
+    detools_state_read_t state_read,
+    void *arg_p)
+{
+    struct detools_apply_patch_patch_reader_lz4_t *lz4_p;
+    uint8_t *buf_p;
+    size_t size;
+    int res;
+
+    lz4_p = &self_p->compression.lz4;
+    self_p->lz4_window = *window_p;
+    lz4_p->heap = false;
+    lz4_p->decoder.window_p = NULL;
+    self_p->destroy = patch_reader_lz4_destroy;
+    self_p->decompress = patch_reader_lz4_decompress;
+
+    res = lz4_window(self_p, lz4_p->decoder.window_size, &buf_p);
+
+    if (res != 0) {
+        return (res);
+    }
+
+    lz4dec_set_window(&lz4_p->decoder, buf_p);
+    size = lz4dec_window_used(&lz4_p->decoder);
+
+    if (size == 0) {
+        return (0);
+    }
+
+    res = state_read(arg_p, buf_p, size);
+
+    if (res != 0) {
+        return (-DETOOLS_IO_FAILED);
+    }
+
+    return (0);
+}
+
+static void patch_reader_set_lz4_window(
+    struct detools_apply_patch_patch_reader_t *self_p,
+    void *buf_p,
+    size_t size)
+{
+    self_p->lz4_window.buf_p = buf_p;
+    self_p->lz4_window.size = size;
+}
+
+#endif
+
+/*
+ * Patch reader.
+ */
+
+/**
+ * Initialize given patch reader.
+ */
+static int patch_reader_init(struct detools_apply_patch_patch_reader_t *self_p,
+                             struct detools_apply_patch_chunk_t *patch_chunk_p,
                              size_t patch_size,
                              int compression)
 {
@@ -830,6 +1592,8 @@ static int patch_reader_init(struct detools_apply_patch_patch_reader_t *self_p,
 
     self_p->patch_chunk_p = patch_chunk_p;
     self_p->size.state = detools_unpack_usize_state_first_t;
+    self_p->ahead.offset = 0;
+    self_p->ahead.size = 0;
 
     switch (compression) {
 
@@ -839,9 +1603,10 @@ static int patch_reader_init(struct detools_apply_patch_patch_reader_t *self_p,
         break;
 #endif
 
-#if DETOOLS_CONFIG_COMPRESSION_LZMA == 1
+#if DETOOLS_CONFIG_COMPRESSION_LZMA == 1        \
+    || DETOOLS_CONFIG_COMPRESSION_LZMA_EMBEDDED == 1
     case COMPRESSION_LZMA:
-        res = patch_reader_lzma_init(self_p);
+        res = patch_reader_lzma_init(self_p, patch_size);
         break;
 #endif
 
@@ -857,6 +1622,16 @@ static int patch_reader_init(struct detools_apply_patch_patch_reader_t *self_p,
         break;
 #endif
 
+#if DETOOLS_CONFIG_COMPRESSION_LZ4 == 1
+    case COMPRESSION_LZ4:
+        res = patch_reader_lz4_init(self_p, false);
+        break;
+
+    case COMPRESSION_LZ4_PRIMED:
+        res = patch_reader_lz4_init(self_p, true);
+        break;
+#endif
+
     default:
         res = -DETOOLS_BAD_COMPRESSION;
         break;
@@ -867,10 +1642,12 @@ static int patch_reader_init(struct detools_apply_patch_patch_reader_t *self_p,
 
 static int patch_reader_dump(struct detools_apply_patch_patch_reader_t *self_p,
                              int compression,
-                             detools_state_write_t state_write)
+                             detools_state_write_t state_write,
+                             void *arg_p)
 {
     (void)self_p;
     (void)state_write;
+    (void)arg_p;
 
     int res;
 
@@ -883,6 +1660,13 @@ static int patch_reader_dump(struct detools_apply_patch_patch_reader_t *self_p,
         break;
 #endif
 
+#if DETOOLS_CONFIG_COMPRESSION_LZMA == 1        \
+    || DETOOLS_CONFIG_COMPRESSION_LZMA_EMBEDDED == 1
+    case COMPRESSION_LZMA:
+        res = patch_reader_lzma_dump(self_p, state_write, arg_p);
+        break;
+#endif
+
 #if DETOOLS_CONFIG_COMPRESSION_CRLE == 1
     case COMPRESSION_CRLE:
         break;
@@ -890,6 +1674,17 @@ static int patch_reader_dump(struct detools_apply_patch_patch_reader_t *self_p,
 
 #if DETOOLS_CONFIG_COMPRESSION_HEATSHRINK == 1
     case COMPRESSION_HEATSHRINK:
+#if HEATSHRINK_DYNAMIC_ALLOC
+        /* The decoder is not part of the dumped state. */
+        res = -DETOOLS_NOT_IMPLEMENTED;
+#endif
+        break;
+#endif
+
+#if DETOOLS_CONFIG_COMPRESSION_LZ4 == 1
+    case COMPRESSION_LZ4:
+    case COMPRESSION_LZ4_PRIMED:
+        res = patch_reader_lz4_dump(self_p, state_write, arg_p);
         break;
 #endif
 
@@ -905,60 +1700,262 @@ static int patch_reader_restore(struct detools_apply_patch_patch_reader_t *self_
                                 struct detools_apply_patch_patch_reader_t *dumped_p,
                                 struct detools_apply_patch_chunk_t *patch_chunk_p,
                                 int compression,
-                                detools_state_read_t state_read)
+                                detools_state_read_t state_read,
+                                void *arg_p)
 {
     (void)state_read;
+    (void)arg_p;
 
     int res;
+#if DETOOLS_CONFIG_COMPRESSION_LZMA == 1        \
+    || DETOOLS_CONFIG_COMPRESSION_LZMA_EMBEDDED == 1
+    struct detools_lzma_memory_t lzma_memory;
+
+    lzma_memory = self_p->lzma_memory;
+#endif
+#if DETOOLS_CONFIG_COMPRESSION_LZ4 == 1
+    struct detools_lz4_window_t lz4_window;
+    int (*source_read)(void *arg_p, size_t offset, uint8_t *buf_p, size_t size);
+    void *source_arg_p;
+
+    lz4_window = self_p->lz4_window;
+    source_read = self_p->source_read;
+    source_arg_p = self_p->source_arg_p;
+#endif
+
+    res = 0;
+    *self_p = *dumped_p;
+    self_p->patch_chunk_p = patch_chunk_p;
+#if DETOOLS_CONFIG_COMPRESSION_LZ4 == 1
+    self_p->source_read = source_read;
+    self_p->source_arg_p = source_arg_p;
+#endif
+
+    switch (compression) {
+
+#if DETOOLS_CONFIG_COMPRESSION_NONE == 1
+    case COMPRESSION_NONE:
+        self_p->destroy = patch_reader_none_destroy;
+        self_p->decompress = patch_reader_none_decompress;
+        break;
+#endif
+
+#if DETOOLS_CONFIG_COMPRESSION_LZMA == 1        \
+    || DETOOLS_CONFIG_COMPRESSION_LZMA_EMBEDDED == 1
+    case COMPRESSION_LZMA:
+        res = patch_reader_lzma_restore(self_p,
+                                        &lzma_memory,
+                                        state_read,
+                                        arg_p);
+        break;
+#endif
+
+#if DETOOLS_CONFIG_COMPRESSION_CRLE == 1
+    case COMPRESSION_CRLE:
+        self_p->destroy = patch_reader_crle_destroy;
+        self_p->decompress = patch_reader_crle_decompress;
+        break;
+#endif
+
+#if DETOOLS_CONFIG_COMPRESSION_HEATSHRINK == 1
+    case COMPRESSION_HEATSHRINK:
+        self_p->destroy = patch_reader_heatshrink_destroy;
+        self_p->decompress = patch_reader_heatshrink_decompress;
+        break;
+#endif
+
+#if DETOOLS_CONFIG_COMPRESSION_LZ4 == 1
+    case COMPRESSION_LZ4:
+    case COMPRESSION_LZ4_PRIMED:
+        res = patch_reader_lz4_restore(self_p,
+                                       &lz4_window,
+                                       state_read,
+                                       arg_p);
+        break;
+#endif
+
+    default:
+        res = -DETOOLS_NOT_IMPLEMENTED;
+        break;
+    }
+
+    return (res);
+}
+
+/**
+ * Try to decompress given number of bytes.
+ *
+ * @return zero(0) if at least one byte was decompressed, one(1) if
+ *         zero bytes were decompressed and more input is needed, or
+ *         negative error code.
+ */
+static int patch_reader_decompress(
+    struct detools_apply_patch_patch_reader_t *self_p,
+    uint8_t *buf_p,
+    size_t *size_p)
+{
+    int res;
+    size_t size;
+    size_t left;
+
+    size = (size_t)(self_p->ahead.size - self_p->ahead.offset);
+
+    if (size == 0) {
+        return (self_p->decompress(self_p, buf_p, size_p));
+    }
+
+    /* Data read ahead first, then as much as is available. */
+    size = MIN(size, *size_p);
+    memcpy(buf_p, &self_p->ahead.buf[self_p->ahead.offset], size);
+    self_p->ahead.offset += (uint8_t)size;
+    left = (*size_p - size);
+
+    if (left > 0) {
+        res = self_p->decompress(self_p, &buf_p[size], &left);
+
+        if (res < 0) {
+            return (res);
+        }
+
+        if (res == 0) {
+            size += left;
+        }
+    }
+
+    *size_p = size;
+
+    return (0);
+}
+
+/**
+ * Unpack a size value from given buffer.
+ *
+ * @return Number of bytes unpacked, zero(0) if the value continues
+ *         after the buffer, or negative error code.
+ */
+static int unpack_size_buf(const uint8_t *buf_p, size_t size, int *size_p)
+{
+    int value;
+    int offset;
+    size_t i;
+
+    value = (buf_p[0] & 0x3f);
+    offset = 6;
+
+    for (i = 0; (buf_p[i] & 0x80) != 0; i++) {
+        if ((i + 1) == size) {
+            return (0);
+        }
+
+        if (is_overflow(offset)) {
+            return (-DETOOLS_CORRUPT_PATCH_OVERFLOW);
+        }
+
+        value |= ((buf_p[i + 1] & 0x7f) << offset);
+        offset += 7;
+    }
+
+    if ((buf_p[0] & 0x40) != 0) {
+        value *= -1;
+    }
+
+    *size_p = value;
+
+    return ((int)i + 1);
+}
+
+/**
+ * Unpack a size value straight from an uncompressed patch, or from
+ * data read ahead, if all of it is there.
+ *
+ * @return zero(0) if unpacked, one(1) if more data is needed, or
+ *         negative error code.
+ */
+static int patch_reader_unpack_size_ahead(
+    struct detools_apply_patch_patch_reader_t *self_p,
+    int *size_p)
+{
+    size_t size;
+    int res;
+
+#if DETOOLS_CONFIG_COMPRESSION_NONE == 1
+    const uint8_t *buf_p;
+
+    size = patch_reader_none_peek(self_p, &buf_p);
 
-    res = 0;
-    *self_p = *dumped_p;
-    self_p->patch_chunk_p = patch_chunk_p;
+    if (size > 0) {
+        res = unpack_size_buf(buf_p, size, size_p);
 
-    switch (compression) {
+        if (res > 0) {
+            patch_reader_none_skip(self_p, (size_t)res);
+            res = 0;
+        } else if (res == 0) {
+            res = 1;
+        }
 
-#if DETOOLS_CONFIG_COMPRESSION_NONE == 1
-    case COMPRESSION_NONE:
-        self_p->destroy = patch_reader_none_destroy;
-        self_p->decompress = patch_reader_none_decompress;
-        break;
+        return (res);
+    }
 #endif
 
-#if DETOOLS_CONFIG_COMPRESSION_CRLE == 1
-    case COMPRESSION_CRLE:
-        self_p->destroy = patch_reader_crle_destroy;
-        self_p->decompress = patch_reader_crle_decompress;
-        break;
-#endif
+    if (self_p->ahead.offset == self_p->ahead.size) {
+        size = sizeof(self_p->ahead.buf);
+        res = self_p->decompress(self_p, &self_p->ahead.buf[0], &size);
 
-#if DETOOLS_CONFIG_COMPRESSION_HEATSHRINK == 1
-    case COMPRESSION_HEATSHRINK:
-        self_p->destroy = patch_reader_heatshrink_destroy;
-        self_p->decompress = patch_reader_heatshrink_decompress;
-        break;
-#endif
+        if (res != 0) {
+            return (res);
+        }
 
-    default:
-        res = -DETOOLS_NOT_IMPLEMENTED;
-        break;
+        self_p->ahead.offset = 0;
+        self_p->ahead.size = (uint8_t)size;
+    }
+
+    res = unpack_size_buf(&self_p->ahead.buf[self_p->ahead.offset],
+                          (size_t)(self_p->ahead.size - self_p->ahead.offset),
+                          size_p);
+
+    if (res > 0) {
+        self_p->ahead.offset += (uint8_t)res;
+        res = 0;
+    } else if (res == 0) {
+        res = 1;
     }
 
     return (res);
 }
 
 /**
- * Try to decompress given number of bytes.
+ * Consume patch data after the last to byte, that is the end mark of
+ * an LZ4 frame given in a chunk of its own.
  *
- * @return zero(0) if at least one byte was decompressed, one(1) if
- *         zero bytes were decompressed and more input is needed, or
- *         negative error code.
+ * @return one(1) if data was consumed, otherwise
+ *         -DETOOLS_ALREADY_DONE or negative error code.
  */
-static int patch_reader_decompress(
-    struct detools_apply_patch_patch_reader_t *self_p,
-    uint8_t *buf_p,
-    size_t *size_p)
+static int patch_reader_drain(struct detools_apply_patch_patch_reader_t *self_p)
 {
-    return (self_p->decompress(self_p, buf_p, size_p));
+#if DETOOLS_CONFIG_COMPRESSION_LZ4 == 1
+    uint8_t byte;
+    size_t size;
+    size_t offset;
+    int res;
+
+    if (self_p->decompress == patch_reader_lz4_decompress) {
+        offset = self_p->patch_chunk_p->offset;
+        size = 0;
+        res = patch_reader_lz4_decompress(self_p, &byte, &size);
+
+        if (res < 0) {
+            return (res);
+        }
+
+        if (self_p->patch_chunk_p->offset > offset) {
+            return (1);
+        }
+    }
+#else
+    (void)self_p;
+#endif
+
+    return (-DETOOLS_ALREADY_DONE);
 }
 
 /**
@@ -972,6 +1969,14 @@ static int patch_reader_unpack_size(
     uint8_t byte;
     size_t size;
 
+    if (self_p->size.state == detools_unpack_usize_state_first_t) {
+        res = patch_reader_unpack_size_ahead(self_p, size_p);
+
+        if (res <= 0) {
+            return (res);
+        }
+    }
+
     size = 1;
 
     do {
@@ -1137,6 +2142,69 @@ static int process_size(struct detools_apply_patch_t *self_p,
     return (res);
 }
 
+#if DETOOLS_CONFIG_COMPRESSION_NONE == 1
+
+/**
+ * Process data of an uncompressed patch straight from the chunk.
+ *
+ * @return zero(0) if data was processed, one(1) if it has to be
+ *         copied, or negative error code.
+ */
+static int process_data_none(struct detools_apply_patch_t *self_p,
+                             enum detools_apply_patch_state_t next_state)
+{
+    int res;
+    size_t i;
+    size_t size;
+    const uint8_t *buf_p;
+    uint8_t from[DETOOLS_CONFIG_NONE_BLOCK_SIZE];
+
+    if (next_state == detools_apply_patch_state_extra_size_t) {
+        size = patch_reader_none_span(&self_p->patch_reader,
+                                      &buf_p,
+                                      MIN(sizeof(from), self_p->chunk_size));
+
+        if (size == 0) {
+            return (1);
+        }
+
+        res = self_p->from_read(self_p->arg_p, &from[0], size);
+
+        if (res != 0) {
+            return (-DETOOLS_IO_FAILED);
+        }
+
+        self_p->from_offset += (int)size;
+
+        for (i = 0; i < size; i++) {
+            from[i] = (uint8_t)(from[i] + buf_p[i]);
+        }
+
+        buf_p = &from[0];
+    } else {
+        size = patch_reader_none_span(&self_p->patch_reader,
+                                      &buf_p,
+                                      self_p->chunk_size);
+
+        if (size == 0) {
+            return (1);
+        }
+    }
+
+    self_p->to_offset += size;
+    self_p->chunk_size -= size;
+
+    res = self_p->to_write(self_p->arg_p, buf_p, size);
+
+    if (res != 0) {
+        return (-DETOOLS_IO_FAILED);
+    }
+
+    return (res);
+}
+
+#endif
+
 static int process_data(struct detools_apply_patch_t *self_p,
                         enum detools_apply_patch_state_t next_state)
 {
@@ -1154,6 +2222,14 @@ static int process_data(struct detools_apply_patch_t *self_p,
         return (0);
     }
 
+#if DETOOLS_CONFIG_COMPRESSION_NONE == 1
+    res = process_data_none(self_p, next_state);
+
+    if (res != 1) {
+        return (res);
+    }
+#endif
+
     res = patch_reader_decompress(&self_p->patch_reader,
                                   &to[0],
                                   &to_size);
@@ -1271,7 +2347,7 @@ static int apply_patch_process_once(struct detools_apply_patch_t *self_p)
         break;
 
     case detools_apply_patch_state_done_t:
-        res = -DETOOLS_ALREADY_DONE;
+        res = patch_reader_drain(&self_p->patch_reader);
         break;
 
     case detools_apply_patch_state_failed_t:
@@ -1318,6 +2394,43 @@ static int apply_patch_common_finalize(
     return (res);
 }
 
+#if DETOOLS_CONFIG_COMPRESSION_LZ4 == 1
+
+/* Reads source data at given offset for the LZ4 patch reader, and
+ * seeks back to where the from stream was. */
+static int apply_patch_source_read(void *arg_p,
+                                   size_t offset,
+                                   uint8_t *buf_p,
+                                   size_t size)
+{
+    struct detools_apply_patch_t *self_p;
+    int res;
+
+    self_p = (struct detools_apply_patch_t *)arg_p;
+    res = self_p->from_seek(self_p->arg_p, (int)offset - self_p->from_offset);
+
+    if (res != 0) {
+        return (-DETOOLS_IO_FAILED);
+    }
+
+    res = self_p->from_read(self_p->arg_p, buf_p, size);
+
+    if (res != 0) {
+        return (-DETOOLS_IO_FAILED);
+    }
+
+    res = self_p->from_seek(self_p->arg_p,
+                            self_p->from_offset - (int)(offset + size));
+
+    if (res != 0) {
+        return (-DETOOLS_IO_FAILED);
+    }
+
+    return (0);
+}
+
+#endif
+
 int detools_apply_patch_init(struct detools_apply_patch_t *self_p,
                              detools_read_t from_read,
                              detools_seek_t from_seek,
@@ -1334,10 +2447,60 @@ int detools_apply_patch_init(struct detools_apply_patch_t *self_p,
     self_p->arg_p = arg_p;
     self_p->state = detools_apply_patch_state_init_t;
     self_p->patch_reader.destroy = NULL;
+#if DETOOLS_CONFIG_COMPRESSION_LZMA == 1        \
+    || DETOOLS_CONFIG_COMPRESSION_LZMA_EMBEDDED == 1
+    patch_reader_set_lzma_memory(&self_p->patch_reader,
+                                 NULL,
+                                 0,
+                                 DETOOLS_CONFIG_LZMA_MEMORY_LIMIT);
+#endif
+#if DETOOLS_CONFIG_COMPRESSION_LZ4 == 1
+    patch_reader_set_lz4_window(&self_p->patch_reader, NULL, 0);
+#endif
+#if DETOOLS_CONFIG_COMPRESSION_LZ4 == 1
+    self_p->patch_reader.source_read = apply_patch_source_read;
+    self_p->patch_reader.source_arg_p = self_p;
+#endif
+
+    return (0);
+}
+
+#if DETOOLS_CONFIG_COMPRESSION_LZMA == 1        \
+    || DETOOLS_CONFIG_COMPRESSION_LZMA_EMBEDDED == 1
+
+int detools_apply_patch_set_lzma_memory(struct detools_apply_patch_t *self_p,
+                                        void *buf_p,
+                                        size_t size,
+                                        uint64_t limit)
+{
+    if (self_p->state != detools_apply_patch_state_init_t) {
+        return (-DETOOLS_INTERNAL_ERROR);
+    }
+
+    patch_reader_set_lzma_memory(&self_p->patch_reader, buf_p, size, limit);
+
+    return (0);
+}
+
+#endif
+
+#if DETOOLS_CONFIG_COMPRESSION_LZ4 == 1
+
+int detools_apply_patch_set_lz4_window(struct detools_apply_patch_t *self_p,
+                                       void *buf_p,
+                                       size_t size)
+{
+    if (self_p->state != detools_apply_patch_state_init_t) {
+        return (-DETOOLS_INTERNAL_ERROR);
+    }
+
+    patch_reader_set_lz4_window(&self_p->patch_reader, buf_p, size);
 
     return (0);
 }
 
+#endif
+
 int detools_apply_patch_dump(struct detools_apply_patch_t *self_p,
                              detools_state_write_t state_write)
 {
@@ -1355,7 +2518,8 @@ int detools_apply_patch_dump(struct detools_apply_patch_t *self_p,
 
     return (patch_reader_dump(&self_p->patch_reader,
                               self_p->compression,
-                              state_write));
+                              state_write,
+                              self_p->arg_p));
 }
 
 int detools_apply_patch_restore(struct detools_apply_patch_t *self_p,
@@ -1394,7 +2558,8 @@ int detools_apply_patch_restore(struct detools_apply_patch_t *self_p,
                                  &dumped.patch_reader,
                                  &self_p->chunk,
                                  self_p->compression,
-                                 state_read));
+                                 state_read,
+                                 self_p->arg_p));
 }
 
 size_t detools_apply_patch_get_patch_offset(struct detools_apply_patch_t *self_p)
@@ -1461,53 +2626,38 @@ static int in_place_all_steps_completed(struct detools_apply_patch_in_place_t *s
 
         if (res != 0) {
             res = -DETOOLS_STEP_SET_FAILED;
+        } else {
+            self_p->completed_step = 0;
         }
     }
 
     return (res);
 }
 
-static int in_place_is_step_completed(struct detools_apply_patch_in_place_t *self_p,
-                                      bool *res_p)
+/*
+ * The completed step is read with step_get() once, at init, and kept
+ * up to date as steps are set, so memory operations do not call it.
+ */
+static bool in_place_is_step_completed(struct detools_apply_patch_in_place_t *self_p)
 {
-    int res;
-    int completed_step;
-
-    if (self_p->step_get != NULL) {
-        res = self_p->step_get(self_p->arg_p, &completed_step);
-
-        if (res != 0) {
-            return (-DETOOLS_STEP_GET_FAILED);
-        }
-
-        *res_p = (self_p->ongoing_step <= completed_step);
-    } else {
-        *res_p = false;
-    }
-
-    return (0);
+    return (self_p->ongoing_step <= self_p->completed_step);
 }
 
 static int in_place_next_step(struct detools_apply_patch_in_place_t *self_p)
 {
     int res;
-    bool is_step_completed;
 
     res = 0;
 
-    if (self_p->step_set != NULL) {
-        res = in_place_is_step_completed(self_p, &is_step_completed);
+    if ((self_p->step_set != NULL)
+        && (self_p->swap.segments == 0)
+        && !in_place_is_step_completed(self_p)) {
+        res = self_p->step_set(self_p->arg_p, self_p->ongoing_step);
 
         if (res != 0) {
-            return (res);
-        }
-
-        if (!is_step_completed) {
-            res = self_p->step_set(self_p->arg_p, self_p->ongoing_step);
-
-            if (res != 0) {
-                res = -DETOOLS_STEP_SET_FAILED;
-            }
+            res = -DETOOLS_STEP_SET_FAILED;
+        } else {
+            self_p->completed_step = self_p->ongoing_step;
         }
     }
 
@@ -1521,16 +2671,7 @@ static int in_place_mem_read(struct detools_apply_patch_in_place_t *self_p,
                              uintptr_t src,
                              size_t size)
 {
-    int res;
-    bool is_step_completed;
-
-    res = in_place_is_step_completed(self_p, &is_step_completed);
-
-    if (res != 0) {
-        return (res);
-    }
-
-    if (!is_step_completed) {
+    if (!in_place_is_step_completed(self_p)) {
         return (self_p->mem_read(self_p->arg_p, dst_p, src, size));
     } else {
         memset(dst_p, 0, size);
@@ -1544,16 +2685,7 @@ static int in_place_mem_write(struct detools_apply_patch_in_place_t *self_p,
                               void *src_p,
                               size_t size)
 {
-    int res;
-    bool is_step_completed;
-
-    res = in_place_is_step_completed(self_p, &is_step_completed);
-
-    if (res != 0) {
-        return (res);
-    }
-
-    if (!is_step_completed) {
+    if (!in_place_is_step_completed(self_p)) {
         return (self_p->mem_write(self_p->arg_p, dst, src_p, size));
     } else {
         return (0);
@@ -1564,22 +2696,34 @@ static int in_place_mem_erase(struct detools_apply_patch_in_place_t *self_p,
                               uintptr_t addr,
                               size_t size)
 {
-    int res;
-    bool is_step_completed;
-
-    res = in_place_is_step_completed(self_p, &is_step_completed);
-
-    if (res != 0) {
-        return (res);
-    }
-
-    if (!is_step_completed) {
+    if (!in_place_is_step_completed(self_p)) {
         return (self_p->mem_erase(self_p->arg_p, addr, size));
     } else {
         return (0);
     }
 }
 
+/*
+ * Workspace for memory operations, the buffer given to
+ * detools_apply_patch_in_place_set_workspace() or the given stack
+ * buffer.
+ */
+static uint8_t *in_place_workspace(struct detools_apply_patch_in_place_t *self_p,
+                                   uint8_t *stack_p,
+                                   size_t stack_size,
+                                   size_t *size_p)
+{
+    if (self_p->workspace.buf_p != NULL) {
+        *size_p = self_p->workspace.size;
+
+        return (self_p->workspace.buf_p);
+    } else {
+        *size_p = stack_size;
+
+        return (stack_p);
+    }
+}
+
 static int in_place_shift_memory(struct detools_apply_patch_in_place_t *self_p,
                                  size_t memory_size,
                                  size_t from_size)
@@ -1589,10 +2733,13 @@ static int in_place_shift_memory(struct detools_apply_patch_in_place_t *self_p,
     int res;
     size_t read_address;
     size_t write_address;
-    uint8_t buf[128];
+    uint8_t stack_buf[DETOOLS_CONFIG_IN_PLACE_BUF_SIZE];
+    uint8_t *buf_p;
+    size_t buf_size;
     size_t offset;
     size_t size;
 
+    buf_p = in_place_workspace(self_p, &stack_buf[0], sizeof(stack_buf), &buf_size);
     number_of_segments = DIV_CEIL(MIN(from_size, memory_size - self_p->shift_size),
                                   self_p->segment_size);
     read_address = ((number_of_segments - 1) * self_p->segment_size);
@@ -1612,9 +2759,9 @@ static int in_place_shift_memory(struct detools_apply_patch_in_place_t *self_p,
         offset = 0;
 
         while (offset < self_p->segment_size) {
-            size = MIN(sizeof(buf), self_p->segment_size - offset);
+            size = MIN(buf_size, self_p->segment_size - offset);
             res = in_place_mem_read(self_p,
-                                    &buf[0],
+                                    buf_p,
                                     read_address + offset,
                                     size);
 
@@ -1624,7 +2771,7 @@ static int in_place_shift_memory(struct detools_apply_patch_in_place_t *self_p,
 
             res = in_place_mem_write(self_p,
                                      write_address + offset,
-                                     &buf[0],
+                                     buf_p,
                                      size);
 
             if (res != 0) {
@@ -1640,8 +2787,112 @@ static int in_place_shift_memory(struct detools_apply_patch_in_place_t *self_p,
             return (res);
         }
 
-        write_address -= self_p->segment_size;
-        read_address -= self_p->segment_size;
+        write_address -= self_p->segment_size;
+        read_address -= self_p->segment_size;
+    }
+
+    return (0);
+}
+
+/*
+ * Instead of shifting the source image up front, the from data may be
+ * read at its original address. Source segments are then saved in the
+ * swap buffer before they are erased for the target, for as long as
+ * the from data of later segments may be in them, which is the shift
+ * size. Swapped data does not survive a restart, so this is only done
+ * for a fresh apply, and steps are not reported. Instead, a swap step
+ * is set up front, for the apply to be known as not resumable.
+ */
+static bool in_place_swap_init(struct detools_apply_patch_in_place_t *self_p,
+                               size_t memory_size,
+                               size_t from_size)
+{
+    size_t segments;
+
+    if ((self_p->swap.buf_p == NULL)
+        || (self_p->completed_step != 0)
+        || (self_p->shift_size == 0)
+        || (self_p->shift_size > memory_size)) {
+        return (false);
+    }
+
+    segments = DIV_CEIL(self_p->shift_size, self_p->segment_size);
+
+    if (segments * self_p->segment_size > self_p->swap.size) {
+        return (false);
+    }
+
+    self_p->swap.segments = segments;
+    self_p->swap.end = MIN(DIV_CEIL(MIN(from_size, memory_size - self_p->shift_size),
+                                    self_p->segment_size) * self_p->segment_size,
+                           memory_size);
+
+    return (true);
+}
+
+static int in_place_swap_save(struct detools_apply_patch_in_place_t *self_p,
+                              size_t address)
+{
+    size_t slot;
+
+    if (address >= self_p->swap.end) {
+        return (0);
+    }
+
+    slot = ((address / self_p->segment_size) % self_p->swap.segments);
+
+    return (in_place_mem_read(self_p,
+                              &self_p->swap.buf_p[slot * self_p->segment_size],
+                              address,
+                              MIN(self_p->segment_size,
+                                  self_p->swap.end - address)));
+}
+
+/*
+ * Read from data at given shifted address.
+ */
+static int in_place_from_read(struct detools_apply_patch_in_place_t *self_p,
+                              uint8_t *dst_p,
+                              size_t src,
+                              size_t size)
+{
+    size_t index;
+    size_t offset;
+    size_t n;
+
+    if (self_p->swap.segments == 0) {
+        return (in_place_mem_read(self_p, dst_p, src, size));
+    }
+
+    if (src < self_p->shift_size) {
+        return (-DETOOLS_CORRUPT_PATCH);
+    }
+
+    src -= self_p->shift_size;
+
+    while (size > 0) {
+        index = (src / self_p->segment_size);
+
+        /* Not yet erased for the target. */
+        if (index >= self_p->segment.index) {
+            return (in_place_mem_read(self_p, dst_p, src, size));
+        }
+
+        offset = (src % self_p->segment_size);
+        n = MIN(size, self_p->segment_size - offset);
+
+        if ((index + self_p->swap.segments < self_p->segment.index)
+            || (src + n > self_p->swap.end)) {
+            return (-DETOOLS_CORRUPT_PATCH);
+        }
+
+        memcpy(dst_p,
+               &self_p->swap.buf_p[(index % self_p->swap.segments)
+                                   * self_p->segment_size + offset],
+               n);
+        dst_p += n;
+        src += n;
+        size -= n;
     }
 
     return (0);
@@ -1739,12 +2990,22 @@ static int in_place_process_init(struct detools_apply_patch_in_place_t *self_p)
     self_p->segment.index = 0;
 
     if (to_size > 0) {
-        res = in_place_shift_memory(self_p,
-                                    (size_t)memory_size,
-                                    (size_t)from_size);
+        if (in_place_swap_init(self_p, (size_t)memory_size, (size_t)from_size)) {
+            if (self_p->step_set != NULL) {
+                res = self_p->step_set(self_p->arg_p, DETOOLS_IN_PLACE_SWAP_STEP);
 
-        if (res != 0) {
-            return (res);
+                if (res != 0) {
+                    return (-DETOOLS_STEP_SET_FAILED);
+                }
+            }
+        } else {
+            res = in_place_shift_memory(self_p,
+                                        (size_t)memory_size,
+                                        (size_t)from_size);
+
+            if (res != 0) {
+                return (res);
+            }
         }
 
         self_p->state = detools_apply_patch_state_dfpatch_size_t;
@@ -1781,6 +3042,14 @@ static int in_place_process_dfpatch_size(
     self_p->segment.to_pos = 0;
     self_p->segment.index++;
 
+    if (self_p->swap.segments > 0) {
+        res = in_place_swap_save(self_p, self_p->segment.to_offset);
+
+        if (res != 0) {
+            return (res);
+        }
+    }
+
     return (in_place_mem_erase(self_p,
                                self_p->segment.to_offset,
                                self_p->segment.to_size));
@@ -1807,16 +3076,95 @@ static int in_place_process_size(struct detools_apply_patch_in_place_t *self_p,
     return (0);
 }
 
+#if DETOOLS_CONFIG_COMPRESSION_NONE == 1
+
+/**
+ * Process data of an uncompressed patch in blocks straight from the
+ * chunk.
+ *
+ * @return zero(0) if data was processed, one(1) if it has to be
+ *         copied, or negative error code.
+ */
+static int in_place_process_data_none(
+    struct detools_apply_patch_in_place_t *self_p,
+    enum detools_apply_patch_state_t next_state)
+{
+    int res;
+    size_t i;
+    size_t size;
+    const uint8_t *buf_p;
+    uint8_t stack_from[DETOOLS_CONFIG_NONE_BLOCK_SIZE];
+    uint8_t *from_p;
+    size_t from_size;
+
+    from_p = in_place_workspace(self_p,
+                                &stack_from[0],
+                                sizeof(stack_from),
+                                &from_size);
+
+    /* The memory write callback takes a modifiable buffer, so extra
+     * data is copied as well, but in large blocks. */
+    size = patch_reader_none_span(&self_p->patch_reader,
+                                  &buf_p,
+                                  MIN(from_size, self_p->chunk_size));
+
+    if (size == 0) {
+        return (1);
+    }
+
+    if (next_state == detools_apply_patch_state_extra_size_t) {
+        res = in_place_from_read(self_p,
+                                 from_p,
+                                 (size_t)self_p->segment.from_offset,
+                                 size);
+
+        if (res != 0) {
+            return (-DETOOLS_IO_FAILED);
+        }
+
+        self_p->segment.from_offset += (int)size;
+
+        for (i = 0; i < size; i++) {
+            from_p[i] = (uint8_t)(from_p[i] + buf_p[i]);
+        }
+    } else {
+        memcpy(from_p, buf_p, size);
+    }
+
+    res = in_place_mem_write(self_p,
+                             self_p->segment.to_pos + self_p->segment.to_offset,
+                             from_p,
+                             size);
+
+    if (res != 0) {
+        return (-DETOOLS_IO_FAILED);
+    }
+
+    self_p->to_pos += size;
+    self_p->segment.to_pos += size;
+    self_p->chunk_size -= size;
+
+    return (res);
+}
+
+#endif
+
 static int in_place_process_data(struct detools_apply_patch_in_place_t *self_p,
                                  enum detools_apply_patch_state_t next_state)
 {
     int res;
     size_t i;
-    uint8_t to[128];
+    uint8_t stack_buf[DETOOLS_CONFIG_IN_PLACE_BUF_SIZE];
+    uint8_t *to_p;
+    uint8_t *from_p;
     size_t to_size;
-    uint8_t from[128];
 
-    to_size = MIN(sizeof(to), self_p->chunk_size);
+    /* Patch data in the first half of the workspace, from data in the
+     * second. */
+    to_p = in_place_workspace(self_p, &stack_buf[0], sizeof(stack_buf), &to_size);
+    to_size /= 2;
+    from_p = &to_p[to_size];
+    to_size = MIN(to_size, self_p->chunk_size);
 
     if (to_size == 0) {
         self_p->state = next_state;
@@ -1824,8 +3172,16 @@ static int in_place_process_data(struct detools_apply_patch_in_place_t *self_p,
         return (0);
     }
 
+#if DETOOLS_CONFIG_COMPRESSION_NONE == 1
+    res = in_place_process_data_none(self_p, next_state);
+
+    if (res != 1) {
+        return (res);
+    }
+#endif
+
     res = patch_reader_decompress(&self_p->patch_reader,
-                                  &to[0],
+                                  to_p,
                                   &to_size);
 
     if (res != 0) {
@@ -1833,10 +3189,10 @@ static int in_place_process_data(struct detools_apply_patch_in_place_t *self_p,
     }
 
     if (next_state == detools_apply_patch_state_extra_size_t) {
-        res = in_place_mem_read(self_p,
-                                &from[0],
-                                (size_t)self_p->segment.from_offset,
-                                to_size);
+        res = in_place_from_read(self_p,
+                                 from_p,
+                                 (size_t)self_p->segment.from_offset,
+                                 to_size);
 
         if (res != 0) {
             return (-DETOOLS_IO_FAILED);
@@ -1845,13 +3201,13 @@ static int in_place_process_data(struct detools_apply_patch_in_place_t *self_p,
         self_p->segment.from_offset += (int)to_size;
 
         for (i = 0; i < to_size; i++) {
-            to[i] = (uint8_t)(to[i] + from[i]);
+            to_p[i] = (uint8_t)(to_p[i] + from_p[i]);
         }
     }
 
     res = in_place_mem_write(self_p,
                              self_p->segment.to_pos + self_p->segment.to_offset,
-                             &to[0],
+                             to_p,
                              to_size);
 
     if (res != 0) {
@@ -1946,7 +3302,7 @@ static int apply_patch_in_place_process_once(
         break;
 
     case detools_apply_patch_state_done_t:
-        res = -DETOOLS_ALREADY_DONE;
+        res = patch_reader_drain(&self_p->patch_reader);
         break;
 
     case detools_apply_patch_state_failed_t:
@@ -1984,11 +3340,106 @@ int detools_apply_patch_in_place_init(
     self_p->arg_p = arg_p;
     self_p->state = detools_apply_patch_state_init_t;
     self_p->ongoing_step = 1;
+    self_p->completed_step = 0;
+    self_p->workspace.buf_p = NULL;
+    self_p->workspace.size = 0;
+    self_p->swap.buf_p = NULL;
+    self_p->swap.size = 0;
+    self_p->swap.segments = 0;
     self_p->patch_reader.destroy = NULL;
+#if DETOOLS_CONFIG_COMPRESSION_LZMA == 1        \
+    || DETOOLS_CONFIG_COMPRESSION_LZMA_EMBEDDED == 1
+    patch_reader_set_lzma_memory(&self_p->patch_reader,
+                                 NULL,
+                                 0,
+                                 DETOOLS_CONFIG_LZMA_MEMORY_LIMIT);
+#endif
+#if DETOOLS_CONFIG_COMPRESSION_LZ4 == 1
+    patch_reader_set_lz4_window(&self_p->patch_reader, NULL, 0);
+    self_p->patch_reader.source_read = NULL;
+#endif
+
+    if (step_get != NULL) {
+        if (step_get(arg_p, &self_p->completed_step) != 0) {
+            return (-DETOOLS_STEP_GET_FAILED);
+        }
+    }
+
+    return (0);
+}
+
+int detools_apply_patch_in_place_set_workspace(
+    struct detools_apply_patch_in_place_t *self_p,
+    void *buf_p,
+    size_t size)
+{
+    if (self_p->state != detools_apply_patch_state_init_t) {
+        return (-DETOOLS_INTERNAL_ERROR);
+    }
+
+    if ((buf_p != NULL) && (size < 2)) {
+        return (-DETOOLS_OUT_OF_MEMORY);
+    }
+
+    self_p->workspace.buf_p = (uint8_t *)buf_p;
+    self_p->workspace.size = size;
+
+    return (0);
+}
+
+int detools_apply_patch_in_place_set_swap(
+    struct detools_apply_patch_in_place_t *self_p,
+    void *buf_p,
+    size_t size)
+{
+    if (self_p->state != detools_apply_patch_state_init_t) {
+        return (-DETOOLS_INTERNAL_ERROR);
+    }
+
+    self_p->swap.buf_p = (uint8_t *)buf_p;
+    self_p->swap.size = size;
+
+    return (0);
+}
+
+#if DETOOLS_CONFIG_COMPRESSION_LZMA == 1        \
+    || DETOOLS_CONFIG_COMPRESSION_LZMA_EMBEDDED == 1
+
+int detools_apply_patch_in_place_set_lzma_memory(
+    struct detools_apply_patch_in_place_t *self_p,
+    void *buf_p,
+    size_t size,
+    uint64_t limit)
+{
+    if (self_p->state != detools_apply_patch_state_init_t) {
+        return (-DETOOLS_INTERNAL_ERROR);
+    }
+
+    patch_reader_set_lzma_memory(&self_p->patch_reader, buf_p, size, limit);
+
+    return (0);
+}
+
+#endif
+
+#if DETOOLS_CONFIG_COMPRESSION_LZ4 == 1
+
+int detools_apply_patch_in_place_set_lz4_window(
+    struct detools_apply_patch_in_place_t *self_p,
+    void *buf_p,
+    size_t size)
+{
+    if (self_p->state != detools_apply_patch_state_init_t) {
+        return (-DETOOLS_INTERNAL_ERROR);
+    }
+
+    patch_reader_set_lz4_window(&self_p->patch_reader, buf_p, size);
 
     return (0);
 }
 
+#endif
+
 int detools_apply_patch_in_place_process(
     struct detools_apply_patch_in_place_t *self_p,
     const uint8_t *patch_p,
@@ -2371,6 +3822,8 @@ err1:
     return (res);
 }
 
+#if DETOOLS_CONFIG_FILE_IO_MMAP == 0
+
 struct in_place_file_io_t {
     FILE *fmemory_p;
     FILE *fpatch_p;
@@ -2496,11 +3949,242 @@ static int in_place_file_io_cleanup(struct in_place_file_io_t *self_p)
     return (res);
 }
 
+#else
+
+/* Maps the memory file so that reads and writes are plain copies,
+   and only synchronizes it with the file at step boundaries. */
+struct in_place_mmap_io_t {
+    uint8_t *memory_p;
+    size_t memory_size;
+    const uint8_t *patch_p;
+    size_t patch_size;
+    detools_step_set_t step_set;
+};
+
+static int in_place_mmap_io_map(const char *name_p,
+                                bool writable,
+                                uint8_t **buf_pp,
+                                size_t *size_p)
+{
+    int fd;
+    struct stat st;
+    void *buf_p;
+
+    fd = open(name_p, writable ? O_RDWR : O_RDONLY);
+
+    if (fd < 0) {
+        return (-DETOOLS_FILE_OPEN_FAILED);
+    }
+
+    if ((fstat(fd, &st) != 0) || (st.st_size <= 0)) {
+        (void)close(fd);
+
+        return (-DETOOLS_FILE_TELL_FAILED);
+    }
+
+    buf_p = mmap(NULL,
+                 (size_t)st.st_size,
+                 writable ? (PROT_READ | PROT_WRITE) : PROT_READ,
+                 MAP_SHARED,
+                 fd,
+                 0);
+    (void)close(fd);
+
+    if (buf_p == MAP_FAILED) {
+        return (-DETOOLS_FILE_OPEN_FAILED);
+    }
+
+    *buf_pp = (uint8_t *)buf_p;
+    *size_p = (size_t)st.st_size;
+
+    return (0);
+}
+
+static int in_place_mmap_io_init(struct in_place_mmap_io_t *self_p,
+                                 const char *memory_p,
+                                 const char *patch_p,
+                                 detools_step_set_t step_set)
+{
+    int res;
+    uint8_t *buf_p;
+
+    self_p->step_set = step_set;
+
+    /* Memory. */
+    res = in_place_mmap_io_map(memory_p,
+                               true,
+                               &self_p->memory_p,
+                               &self_p->memory_size);
+
+    if (res != 0) {
+        return (res);
+    }
+
+    /* Patch. */
+    res = in_place_mmap_io_map(patch_p, false, &buf_p, &self_p->patch_size);
+
+    if (res != 0) {
+        (void)munmap(self_p->memory_p, self_p->memory_size);
+
+        return (res);
+    }
+
+    self_p->patch_p = buf_p;
+    (void)madvise(buf_p, self_p->patch_size, MADV_SEQUENTIAL);
+
+    return (0);
+}
+
+static int in_place_mmap_io_mem_read(void *arg_p,
+                                     void *dst_p,
+                                     uintptr_t src,
+                                     size_t size)
+{
+    struct in_place_mmap_io_t *self_p;
+
+    self_p = (struct in_place_mmap_io_t *)arg_p;
+
+    if ((src > self_p->memory_size) || (size > self_p->memory_size - src)) {
+        return (-DETOOLS_FILE_READ_FAILED);
+    }
+
+    memcpy(dst_p, &self_p->memory_p[src], size);
+
+    return (0);
+}
+
+static int in_place_mmap_io_mem_write(void *arg_p,
+                                      uintptr_t dst,
+                                      void *src_p,
+                                      size_t size)
+{
+    struct in_place_mmap_io_t *self_p;
+
+    self_p = (struct in_place_mmap_io_t *)arg_p;
+
+    if ((dst > self_p->memory_size) || (size > self_p->memory_size - dst)) {
+        return (-DETOOLS_FILE_WRITE_FAILED);
+    }
+
+    memcpy(&self_p->memory_p[dst], src_p, size);
+
+    return (0);
+}
+
+static int in_place_mmap_io_mem_erase(void *arg_p, uintptr_t addr, size_t size)
+{
+    struct in_place_mmap_io_t *self_p;
+
+    self_p = (struct in_place_mmap_io_t *)arg_p;
+
+    if ((addr > self_p->memory_size) || (size > self_p->memory_size - addr)) {
+        return (-DETOOLS_FILE_WRITE_FAILED);
+    }
+
+    memset(&self_p->memory_p[addr], 0xff, size);
+
+    return (0);
+}
+
+static int in_place_mmap_io_step_set(void *arg_p, int step)
+{
+    struct in_place_mmap_io_t *self_p;
+
+    self_p = (struct in_place_mmap_io_t *)arg_p;
+
+    /* The step must never be stored before the data it covers. */
+    if (msync(self_p->memory_p, self_p->memory_size, MS_SYNC) != 0) {
+        return (-DETOOLS_FILE_WRITE_FAILED);
+    }
+
+    return (self_p->step_set(arg_p, step));
+}
+
+static int in_place_mmap_io_cleanup(struct in_place_mmap_io_t *self_p)
+{
+    int res;
+
+    res = msync(self_p->memory_p, self_p->memory_size, MS_SYNC);
+
+    if (munmap(self_p->memory_p, self_p->memory_size) != 0) {
+        res = -1;
+    }
+
+    if (munmap((void *)self_p->patch_p, self_p->patch_size) != 0) {
+        res = -1;
+    }
+
+    if (res != 0) {
+        res = -DETOOLS_FILE_CLOSE_FAILED;
+    }
+
+    return (res);
+}
+
+static int in_place_mmap_io_apply(const char *memory_p,
+                                  const char *patch_p,
+                                  detools_step_set_t step_set,
+                                  detools_step_get_t step_get)
+{
+    int res;
+    int res2;
+    struct in_place_mmap_io_t mmap_io;
+    struct detools_apply_patch_in_place_t apply_patch;
+    uint8_t workspace[4096];
+
+    res = in_place_mmap_io_init(&mmap_io, memory_p, patch_p, step_set);
+
+    if (res != 0) {
+        return (res);
+    }
+
+    res = detools_apply_patch_in_place_init(&apply_patch,
+                                            in_place_mmap_io_mem_read,
+                                            in_place_mmap_io_mem_write,
+                                            in_place_mmap_io_mem_erase,
+                                            in_place_mmap_io_step_set,
+                                            step_get,
+                                            mmap_io.patch_size,
+                                            &mmap_io);
+
+    if (res == 0) {
+        res = detools_apply_patch_in_place_set_workspace(&apply_patch,
+                &workspace[0],
+                sizeof(workspace));
+    }
+
+    if (res == 0) {
+        /* The whole patch is mapped, so hand it over in one go. */
+        res = detools_apply_patch_in_place_process(&apply_patch,
+                mmap_io.patch_p,
+                mmap_io.patch_size);
+
+        if (res == 0) {
+            res = detools_apply_patch_in_place_finalize(&apply_patch);
+        } else {
+            (void)detools_apply_patch_in_place_finalize(&apply_patch);
+        }
+    }
+
+    res2 = in_place_mmap_io_cleanup(&mmap_io);
+
+    if ((res >= 0) && (res2 != 0)) {
+        res = res2;
+    }
+
+    return (res);
+}
+
+#endif
+
 int detools_apply_patch_in_place_filenames(const char *memory_p,
         const char *patch_p,
         detools_step_set_t step_set,
         detools_step_get_t step_get)
 {
+#if DETOOLS_CONFIG_FILE_IO_MMAP == 1
+    return (in_place_mmap_io_apply(memory_p, patch_p, step_set, step_get));
+#else
     int res;
     struct in_place_file_io_t file_io;
     size_t patch_size;
@@ -2533,6 +4217,7 @@ err1:
     (void)in_place_file_io_cleanup(&file_io);
 
     return (res);
+#endif
 }
 
 #endif
@@ -2626,6 +4311,18 @@ const char *detools_error_as_string(int error)
     case DETOOLS_HEATSHRINK_HEADER:
         return "Heatshrink header.";
 
+    case DETOOLS_LZMA_MEMORY_LIMIT:
+        return "LZMA memory limit.";
+
+    case DETOOLS_LZMA_MEMORY_MISMATCH:
+        return "LZMA memory mismatch.";
+
+    case DETOOLS_LZ4_DECODE:
+        return "LZ4 decode.";
+
+    case DETOOLS_LZ4_WINDOW:
+        return "LZ4 window.";
+
     default:
         return "Unknown error.";
     }
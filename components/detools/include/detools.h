@@ -39,6 +39,16 @@
 #    define DETOOLS_CONFIG_FILE_IO                 0
 #endif
 
+/* Maps the memory and patch files in the in-place file API instead
+   of seeking and reading through stdio. */
+#ifndef DETOOLS_CONFIG_FILE_IO_MMAP
+#    if defined(__linux__)
+#        define DETOOLS_CONFIG_FILE_IO_MMAP        1
+#    else
+#        define DETOOLS_CONFIG_FILE_IO_MMAP        0
+#    endif
+#endif
+
 #ifndef DETOOLS_CONFIG_COMPRESSION_NONE
 #    define DETOOLS_CONFIG_COMPRESSION_NONE        0
 #endif
@@ -47,6 +57,11 @@
 #    define DETOOLS_CONFIG_COMPRESSION_LZMA        0
 #endif
 
+/* Decodes LZMA patches with the in-tree decoder instead of liblzma. */
+#ifndef DETOOLS_CONFIG_COMPRESSION_LZMA_EMBEDDED
+#    define DETOOLS_CONFIG_COMPRESSION_LZMA_EMBEDDED  0
+#endif
+
 #ifndef DETOOLS_CONFIG_COMPRESSION_CRLE
 #    define DETOOLS_CONFIG_COMPRESSION_CRLE        0
 #endif
@@ -55,6 +70,15 @@
 #    define DETOOLS_CONFIG_COMPRESSION_HEATSHRINK  1
 #endif
 
+#ifndef DETOOLS_CONFIG_COMPRESSION_LZ4
+#    define DETOOLS_CONFIG_COMPRESSION_LZ4         0
+#endif
+
+#if DETOOLS_CONFIG_COMPRESSION_LZMA == 1                \
+    && DETOOLS_CONFIG_COMPRESSION_LZMA_EMBEDDED == 1
+#    error "Only one LZMA decoder can be enabled."
+#endif
+
 #include <stdint.h>
 #include <string.h>
 #include <stdio.h>
@@ -91,6 +115,10 @@
 #define DETOOLS_CORRUPT_PATCH_OVERFLOW                   25
 #define DETOOLS_CORRUPT_PATCH_CRLE_KIND                  26
 #define DETOOLS_HEATSHRINK_HEADER                        27
+#define DETOOLS_LZMA_MEMORY_LIMIT                        28
+#define DETOOLS_LZMA_MEMORY_MISMATCH                     29
+#define DETOOLS_LZ4_DECODE                               30
+#define DETOOLS_LZ4_WINDOW                               31
 
 /**
  * Read callback.
@@ -197,6 +225,10 @@ typedef int (*detools_state_write_t)(void *arg_p, const void *buf_p, size_t size
  */
 typedef int (*detools_step_set_t)(void *arg_p, int step);
 
+/* Step set before an in-place apply starts keeping source segments in
+ * a swap buffer, which an interrupted apply cannot be resumed from. */
+#define DETOOLS_IN_PLACE_SWAP_STEP                       (-1)
+
 /**
  * Step get callback.
  *
@@ -208,6 +240,19 @@ typedef int (*detools_step_set_t)(void *arg_p, int step);
  */
 typedef int (*detools_step_get_t)(void *arg_p, int *step_p);
 
+/* Largest block of diff data of an uncompressed patch added to the
+ * from data at once, on the stack. Extra data is written straight from
+ * the patch. */
+#ifndef DETOOLS_CONFIG_NONE_BLOCK_SIZE
+#    define DETOOLS_CONFIG_NONE_BLOCK_SIZE         512
+#endif
+
+/* Stack buffer used for in-place memory operations, unless a workspace
+ * is given with detools_apply_patch_in_place_set_workspace(). */
+#ifndef DETOOLS_CONFIG_IN_PLACE_BUF_SIZE
+#    define DETOOLS_CONFIG_IN_PLACE_BUF_SIZE       256
+#endif
+
 struct detools_apply_patch_patch_reader_none_t {
     size_t patch_size;
     size_t patch_offset;
@@ -217,11 +262,46 @@ struct detools_apply_patch_patch_reader_none_t {
 
 #include <lzma.h>
 
+/* Decompressed LZMA data read ahead of the patch reader, to consume
+ * all patch data given. */
+#ifndef DETOOLS_LZMA_STASH_SIZE
+#    define DETOOLS_LZMA_STASH_SIZE                256
+#endif
+
 struct detools_apply_patch_patch_reader_lzma_t {
+    lzma_allocator allocator;
     lzma_stream stream;
-    uint8_t *input_p;
-    uint8_t *output_p;
-    size_t output_size;
+    size_t stash_offset;
+    size_t stash_size;
+    uint8_t stash[DETOOLS_LZMA_STASH_SIZE];
+};
+
+#elif DETOOLS_CONFIG_COMPRESSION_LZMA_EMBEDDED == 1
+
+#include "lzmadec.h"
+
+struct detools_apply_patch_patch_reader_lzma_t {
+    lzmadec_t decoder;
+    bool heap;              /* Decoder buffer is from the heap */
+};
+
+#endif
+
+#if DETOOLS_CONFIG_COMPRESSION_LZMA == 1                \
+    || DETOOLS_CONFIG_COMPRESSION_LZMA_EMBEDDED == 1
+
+/* Default LZMA decoder memory limit in bytes, see
+ * detools_apply_patch_set_lzma_memory(). */
+#ifndef DETOOLS_CONFIG_LZMA_MEMORY_LIMIT
+#    define DETOOLS_CONFIG_LZMA_MEMORY_LIMIT       UINT64_MAX
+#endif
+
+/* Memory the LZMA decoder allocates from instead of the heap. */
+struct detools_lzma_memory_t {
+    uint8_t *buf_p;
+    size_t size;
+    size_t offset;
+    uint64_t limit;
 };
 
 #endif
@@ -233,7 +313,36 @@ struct detools_apply_patch_patch_reader_lzma_t {
 struct detools_apply_patch_patch_reader_heatshrink_t {
     int8_t window_sz2;
     int8_t lookahead_sz2;
+#if HEATSHRINK_DYNAMIC_ALLOC
+    /* Allocated for the window and lookahead sizes of the patch, so
+       patches compressed with different ones can be applied. */
+    heatshrink_decoder *decoder_p;
+#else
     heatshrink_decoder decoder;
+#endif
+};
+
+#endif
+
+#if DETOOLS_CONFIG_COMPRESSION_LZ4 == 1
+
+#include "lz4dec.h"
+
+/* LZ4 window size in bytes when none is given, see
+ * detools_apply_patch_set_lz4_window(). */
+#ifndef DETOOLS_CONFIG_LZ4_WINDOW_SIZE
+#    define DETOOLS_CONFIG_LZ4_WINDOW_SIZE         LZ4DEC_WINDOW_SIZE_MAX
+#endif
+
+struct detools_apply_patch_patch_reader_lz4_t {
+    lz4dec_t decoder;
+    bool heap;              /* Decoder window is from the heap */
+};
+
+/* Window the LZ4 decoder uses instead of one from the heap. */
+struct detools_lz4_window_t {
+    uint8_t *buf_p;
+    size_t size;
 };
 
 #endif
@@ -273,6 +382,9 @@ struct detools_apply_patch_patch_reader_crle_t {
     } kind;
 };
 
+/* Longest size value in a patch. */
+#define DETOOLS_SIZE_MAX_BYTES                     4
+
 struct detools_apply_patch_patch_reader_t {
     struct detools_apply_patch_chunk_t *patch_chunk_p;
     struct {
@@ -281,11 +393,18 @@ struct detools_apply_patch_patch_reader_t {
         int offset;
         bool is_signed;
     } size;
+    /* Decompressed data read ahead to unpack a size value at once. */
+    struct {
+        uint8_t offset;
+        uint8_t size;
+        uint8_t buf[DETOOLS_SIZE_MAX_BYTES];
+    } ahead;
     union {
 #if DETOOLS_CONFIG_COMPRESSION_NONE == 1
         struct detools_apply_patch_patch_reader_none_t none;
 #endif
-#if DETOOLS_CONFIG_COMPRESSION_LZMA == 1
+#if DETOOLS_CONFIG_COMPRESSION_LZMA == 1                \
+    || DETOOLS_CONFIG_COMPRESSION_LZMA_EMBEDDED == 1
         struct detools_apply_patch_patch_reader_lzma_t lzma;
 #endif
 #if DETOOLS_CONFIG_COMPRESSION_CRLE == 1
@@ -293,8 +412,21 @@ struct detools_apply_patch_patch_reader_t {
 #endif
 #if DETOOLS_CONFIG_COMPRESSION_HEATSHRINK == 1
         struct detools_apply_patch_patch_reader_heatshrink_t heatshrink;
+#endif
+#if DETOOLS_CONFIG_COMPRESSION_LZ4 == 1
+        struct detools_apply_patch_patch_reader_lz4_t lz4;
 #endif
     } compression;
+#if DETOOLS_CONFIG_COMPRESSION_LZMA == 1                \
+    || DETOOLS_CONFIG_COMPRESSION_LZMA_EMBEDDED == 1
+    struct detools_lzma_memory_t lzma_memory;
+#endif
+#if DETOOLS_CONFIG_COMPRESSION_LZ4 == 1
+    struct detools_lz4_window_t lz4_window;
+    /* Reads source image data to prime the LZ4 window with, or NULL. */
+    int (*source_read)(void *arg_p, size_t offset, uint8_t *buf_p, size_t size);
+    void *source_arg_p;
+#endif
     int (*destroy)(struct detools_apply_patch_patch_reader_t *self_p);
     int (*decompress)(struct detools_apply_patch_patch_reader_t *self_p,
                       uint8_t *buf_p,
@@ -352,6 +484,7 @@ struct detools_apply_patch_in_place_t {
     void *arg_p;
     enum detools_apply_patch_state_t state;
     int ongoing_step;
+    int completed_step;
     size_t to_pos;
     size_t to_size;
     size_t segment_size;
@@ -364,6 +497,16 @@ struct detools_apply_patch_in_place_t {
         size_t to_size;
         size_t to_pos;
     } segment;
+    struct {
+        uint8_t *buf_p;
+        size_t size;
+    } workspace;
+    struct {
+        uint8_t *buf_p;
+        size_t size;
+        size_t segments;
+        size_t end;
+    } swap;
     struct detools_apply_patch_patch_reader_t patch_reader;
     struct detools_apply_patch_chunk_t chunk;
 };
@@ -389,11 +532,78 @@ int detools_apply_patch_init(struct detools_apply_patch_t *self_p,
                              detools_write_t to_write,
                              void *arg_p);
 
+#if DETOOLS_CONFIG_COMPRESSION_LZMA == 1                \
+    || DETOOLS_CONFIG_COMPRESSION_LZMA_EMBEDDED == 1
+
+/**
+ * Make the LZMA decoder allocate from given buffer instead of the
+ * heap, and refuse patches that need more than given number of bytes
+ * before anything is allocated. Call after
+ * `detools_apply_patch_init()` and before any patch data is
+ * processed.
+ *
+ * @param[in] self_p Initialized apply patch object.
+ * @param[in] buf_p Buffer, or NULL to use the heap.
+ * @param[in] size Buffer size in bytes.
+ * @param[in] limit Memory limit in bytes, as estimated by liblzma.
+ *
+ * With the embedded decoder the buffer holds the decoder
+ * probabilities, 16 KiB for the default lc=3 and lp=0, and the
+ * dictionary. A patch compressed with a larger dictionary than fits
+ * in the rest is refused, so the buffer size trades RAM for
+ * compression ratio.
+ *
+ * @return zero(0) or negative error code.
+ */
+int detools_apply_patch_set_lzma_memory(struct detools_apply_patch_t *self_p,
+                                        void *buf_p,
+                                        size_t size,
+                                        uint64_t limit);
+
+#endif
+
+#if DETOOLS_CONFIG_COMPRESSION_LZ4 == 1
+
+/**
+ * Make the LZ4 decoder keep its window in given buffer instead of one
+ * of DETOOLS_CONFIG_LZ4_WINDOW_SIZE bytes from the heap. Call after
+ * `detools_apply_patch_init()` and before any patch data is
+ * processed.
+ *
+ * The window size is the largest match offset a patch may use, up to
+ * 64 KiB. Patches compressed with a larger match offset than fits are
+ * refused, so the window size trades RAM for compression ratio.
+ *
+ * Source primed patches also read source data into the window, through
+ * the from callbacks, so that their matches can point into the source.
+ * In-place apply does not support them, as the source is overwritten.
+ *
+ * @param[in] self_p Initialized apply patch object.
+ * @param[in] buf_p Buffer, or NULL to use the heap.
+ * @param[in] size Buffer size in bytes.
+ *
+ * @return zero(0) or negative error code.
+ */
+int detools_apply_patch_set_lz4_window(struct detools_apply_patch_t *self_p,
+                                       void *buf_p,
+                                       size_t size);
+
+#endif
+
 /**
  * Dump given apply patch object state. Call
  * `detools_apply_patch_restore()` to restore an apply patch object to
  * the dumped state.
  *
+ * LZMA patches can only be dumped if the decoder allocates from a
+ * buffer given to `detools_apply_patch_set_lzma_memory()`, and the
+ * used part of it is dumped as well. The state holds pointers, so it
+ * can only be restored by the same program, with the same buffer
+ * address. The embedded LZMA decoder has no such limits, its state
+ * can be restored into any large enough buffer. LZ4 patches dump the
+ * used part of the window, and are restored into a window of at least
+ * the same size.
+ *
  * @param[in] self_p Apply patch object to dump.
  * @param[in] write Write callback.
  *
@@ -466,7 +676,8 @@ int detools_apply_patch_process(struct detools_apply_patch_t *self_p,
 int detools_apply_patch_finalize(struct detools_apply_patch_t *self_p);
 
 /**
- * Initialize given in-place apply patch object.
+ * Initialize given in-place apply patch object. The completed step is
+ * read with step_get once, here, and then tracked as steps are set.
  *
  * @param[out] self_p In-place apply patch object to initialize.
  * @param[in] mem_read Callback to read data.
@@ -489,6 +700,81 @@ int detools_apply_patch_in_place_init(
     size_t patch_size,
     void *arg_p);
 
+/**
+ * Use given buffer for in-place memory operations instead of
+ * DETOOLS_CONFIG_IN_PLACE_BUF_SIZE bytes on the stack. Segments are
+ * shifted in pieces of the buffer size, and patch data is added to the
+ * from data in pieces of half of it, so a segment sized buffer keeps
+ * the number of memory callbacks down. Call before processing any
+ * patch data.
+ *
+ * @param[in] self_p Initialized in-place apply patch object.
+ * @param[in] buf_p Buffer, or NULL to use the stack.
+ * @param[in] size Buffer size in bytes, at least two.
+ *
+ * @return zero(0) or negative error code.
+ */
+int detools_apply_patch_in_place_set_workspace(
+    struct detools_apply_patch_in_place_t *self_p,
+    void *buf_p,
+    size_t size);
+
+/**
+ * Use given buffer to apply the patch without first shifting the whole
+ * source image by the shift size of the patch, which halves the memory
+ * writes and erases. Source segments are kept in the buffer instead,
+ * once they are overwritten by the target, so it must hold the shift
+ * size rounded up to whole segments, or the source is shifted as
+ * usual. Call before processing any patch data.
+ *
+ * The buffer contents are lost on a restart, so this is not power-fail
+ * safe. DETOOLS_IN_PLACE_SWAP_STEP is set before the first segment is
+ * erased, no other steps are set while patching, and an apply that is
+ * resumed (step_get gave a step) always shifts.
+ *
+ * @param[in] self_p Initialized in-place apply patch object.
+ * @param[in] buf_p Buffer, or NULL to always shift.
+ * @param[in] size Buffer size in bytes.
+ *
+ * @return zero(0) or negative error code.
+ */
+int detools_apply_patch_in_place_set_swap(
+    struct detools_apply_patch_in_place_t *self_p,
+    void *buf_p,
+    size_t size);
+
+#if DETOOLS_CONFIG_COMPRESSION_LZMA == 1                \
+    || DETOOLS_CONFIG_COMPRESSION_LZMA_EMBEDDED == 1
+
+/**
+ * Same as `detools_apply_patch_set_lzma_memory()`, but for in-place
+ * apply.
+ *
+ * @return zero(0) or negative error code.
+ */
+int detools_apply_patch_in_place_set_lzma_memory(
+    struct detools_apply_patch_in_place_t *self_p,
+    void *buf_p,
+    size_t size,
+    uint64_t limit);
+
+#endif
+
+#if DETOOLS_CONFIG_COMPRESSION_LZ4 == 1
+
+/**
+ * Same as `detools_apply_patch_set_lz4_window()`, but for in-place
+ * apply.
+ *
+ * @return zero(0) or negative error code.
+ */
+int detools_apply_patch_in_place_set_lz4_window(
+    struct detools_apply_patch_in_place_t *self_p,
+    void *buf_p,
+    size_t size);
+
+#endif
+
 /**
  * Call this function repeatedly until all patch data has been
  * processed or an error occurres. Call
@@ -578,7 +864,10 @@ int detools_apply_patch_filenames(const char *from_p,
                                   const char *to_p);
 
 /**
- * Apply given patch file to given memory file.
+ * Apply given patch file to given memory file. With
+ * DETOOLS_CONFIG_FILE_IO_MMAP both files are mapped, erase fills
+ * with 0xff and the memory file is synchronized before every step
+ * is set.
  *
  * @param[in] memory_p Memory file name.
  * @param[in] patch_p Patch file name.
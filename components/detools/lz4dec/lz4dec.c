@@ -0,0 +1,533 @@
+/*
+ * SPDX-FileCopyrightText: 2016 Intel Corporation
+ *                         2020 Thesis projects
+ *
+ * SPDX-License-Identifier: Apache 2.0 License
+ *
+ * SPDX-FileContributor: 2021 Laukik Hase
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "lz4dec.h"
+
+#define MAGIC               (0x184d2204u)
+#define MIN_MATCH           (4)
+#define BLOCK_RAW           (0x80000000u)
+
+/* Frame descriptor flags */
+#define FLG_VERSION_MASK    (0xc0)
+#define FLG_VERSION         (0x40)
+#define FLG_BLOCK_CHECKSUM  (0x10)
+#define FLG_CONTENT_SIZE    (0x08)
+#define FLG_CONTENT_CHECKSUM (0x04)
+#define FLG_RESERVED        (0x02)
+#define FLG_DICT_ID         (0x01)
+#define BD_RESERVED         (0x8f)
+
+#ifndef MIN
+#define MIN(x, y) (((x) < (y)) ? (x) : (y))
+#endif
+
+enum {
+    STATE_HEADER = 0,
+    STATE_BLOCK_SIZE,
+    STATE_BLOCK_SOURCE,
+    STATE_SOURCE,
+    STATE_BLOCK_CHECKSUM,
+    STATE_TOKEN,
+    STATE_LITERAL_LENGTH,
+    STATE_LITERALS,
+    STATE_OFFSET,
+    STATE_MATCH_LENGTH,
+    STATE_MATCH,
+    STATE_RAW,
+    STATE_CONTENT_CHECKSUM,
+    STATE_END
+};
+
+static void window_append(lz4dec_t *dec, const uint8_t *buf_p, size_t size)
+{
+    size_t n;
+
+    if (size >= dec->window_size) {
+        buf_p += (size - dec->window_size);
+        size = dec->window_size;
+    }
+
+    dec->window_full = MIN(dec->window_full + size, dec->window_size);
+
+    while (size > 0) {
+        n = MIN(size, dec->window_size - dec->window_pos);
+        memcpy(&dec->window_p[dec->window_pos], buf_p, n);
+        dec->window_pos += n;
+
+        if (dec->window_pos == dec->window_size) {
+            dec->window_pos = 0;
+        }
+
+        buf_p += n;
+        size -= n;
+    }
+}
+
+/* Copies a match from the window up to where it overlaps itself, then
+ * repeats the output in growing pieces. */
+static void match_copy(lz4dec_t *dec, uint8_t *out_p, size_t size)
+{
+    size_t src;
+    size_t pos;
+    size_t end;
+    size_t distance;
+    size_t n;
+
+    pos = 0;
+    end = MIN(size, dec->offset);
+
+    while (pos < end) {
+        src = (dec->window_pos + dec->window_size - dec->offset + pos);
+
+        while (src >= dec->window_size) {
+            src -= dec->window_size;
+        }
+
+        n = MIN(end - pos, dec->window_size - src);
+        memcpy(&out_p[pos], &dec->window_p[src], n);
+        pos += n;
+    }
+
+    /* Any multiple of the offset back is the same data. */
+    while (pos < size) {
+        distance = (pos - (pos % dec->offset));
+        n = MIN(distance, size - pos);
+        memcpy(&out_p[pos], &out_p[pos - distance], n);
+        pos += n;
+    }
+
+    window_append(dec, out_p, size);
+}
+
+static uint32_t block_size_max(uint8_t bd)
+{
+    return (1u << (8 + 2 * ((bd >> 4) & 0x7)));
+}
+
+static lz4dec_res decode_header(lz4dec_t *dec)
+{
+    uint32_t magic;
+
+    magic = ((uint32_t)dec->header[0]
+             | ((uint32_t)dec->header[1] << 8)
+             | ((uint32_t)dec->header[2] << 16)
+             | ((uint32_t)dec->header[3] << 24));
+    dec->flags = dec->header[4];
+
+    if ((magic != MAGIC)
+        || ((dec->flags & FLG_VERSION_MASK) != FLG_VERSION)
+        || ((dec->flags & FLG_RESERVED) != 0)
+        || ((dec->header[5] & BD_RESERVED) != 0)
+        || (((dec->header[5] >> 4) & 0x7) < 4)
+        || (dec->primed && ((dec->flags & FLG_DICT_ID) == 0))) {
+        return LZ4DEC_ERROR_DATA;
+    }
+
+    dec->header_size = 7;
+
+    if (dec->flags & FLG_CONTENT_SIZE) {
+        dec->header_size += 8;
+    }
+
+    if (dec->flags & FLG_DICT_ID) {
+        dec->header_size += 4;
+    }
+
+    return LZ4DEC_OK;
+}
+
+/* The dictionary id of a primed frame is the priming size. */
+static lz4dec_res decode_dict_id(lz4dec_t *dec)
+{
+    const uint8_t *id_p;
+
+    id_p = &dec->header[dec->header_size - 5];
+    dec->dict_size = ((uint32_t)id_p[0]
+                      | ((uint32_t)id_p[1] << 8)
+                      | ((uint32_t)id_p[2] << 16)
+                      | ((uint32_t)id_p[3] << 24));
+
+    if (dec->dict_size > dec->window_size) {
+        return LZ4DEC_ERROR_WINDOW;
+    }
+
+    return LZ4DEC_OK;
+}
+
+static void block_end(lz4dec_t *dec)
+{
+    dec->count = 0;
+    dec->field = 0;
+
+    if (dec->flags & FLG_BLOCK_CHECKSUM) {
+        dec->state = STATE_BLOCK_CHECKSUM;
+    } else {
+        dec->state = STATE_BLOCK_SIZE;
+    }
+}
+
+static lz4dec_res block_start(lz4dec_t *dec, uint32_t block)
+{
+    uint32_t size;
+
+    dec->count = 0;
+
+    if (block == 0) {
+        if (dec->flags & FLG_CONTENT_CHECKSUM) {
+            dec->state = STATE_CONTENT_CHECKSUM;
+        } else {
+            dec->state = STATE_END;
+        }
+
+        return LZ4DEC_OK;
+    }
+
+    size = (block & ~BLOCK_RAW);
+
+    if (size > block_size_max(dec->header[5])) {
+        return LZ4DEC_ERROR_DATA;
+    }
+
+    if (block & BLOCK_RAW) {
+        dec->state = STATE_RAW;
+        dec->length = size;
+        dec->block_left = 0;
+    } else {
+        dec->state = STATE_TOKEN;
+        dec->block_left = size;
+    }
+
+    return LZ4DEC_OK;
+}
+
+static lz4dec_res literals_start(lz4dec_t *dec)
+{
+    if (dec->length > dec->block_left) {
+        return LZ4DEC_ERROR_DATA;
+    }
+
+    dec->block_left -= dec->length;
+    dec->state = STATE_LITERALS;
+
+    return LZ4DEC_OK;
+}
+
+static lz4dec_res match_start(lz4dec_t *dec)
+{
+    dec->offset = dec->field;
+
+    if (dec->offset > dec->window_size) {
+        return LZ4DEC_ERROR_WINDOW;
+    }
+
+    if ((dec->offset == 0) || (dec->offset > dec->window_full)) {
+        return LZ4DEC_ERROR_DATA;
+    }
+
+    dec->length = (dec->match_code + MIN_MATCH);
+
+    if (dec->match_code == 15) {
+        dec->state = STATE_MATCH_LENGTH;
+    } else {
+        dec->state = STATE_MATCH;
+    }
+
+    return LZ4DEC_OK;
+}
+
+/* Decodes a byte of a field, the frame header or a sequence header. */
+static lz4dec_res decode_byte(lz4dec_t *dec, uint8_t byte)
+{
+    switch (dec->state) {
+
+    case STATE_HEADER:
+        dec->header[dec->count++] = byte;
+
+        if (dec->count == 6) {
+            return decode_header(dec);
+        }
+
+        if (dec->count == dec->header_size) {
+            dec->count = 0;
+            dec->field = 0;
+            dec->state = STATE_BLOCK_SIZE;
+
+            if (dec->primed) {
+                return decode_dict_id(dec);
+            }
+        }
+
+        break;
+
+    case STATE_BLOCK_SIZE:
+        dec->field |= ((uint32_t)byte << (8 * dec->count));
+        dec->count++;
+
+        if (dec->count == 4) {
+            if ((dec->field != 0) && dec->primed) {
+                dec->block = dec->field;
+                dec->count = 0;
+                dec->field = 0;
+                dec->state = STATE_BLOCK_SOURCE;
+            } else {
+                return block_start(dec, dec->field);
+            }
+        }
+
+        break;
+
+    case STATE_BLOCK_SOURCE:
+        dec->field |= ((uint32_t)byte << (8 * dec->count));
+        dec->count++;
+
+        if (dec->count == 4) {
+            if (dec->field == LZ4DEC_SOURCE_NONE) {
+                return block_start(dec, dec->block);
+            }
+
+            dec->source_offset = dec->field;
+            dec->source_left = dec->dict_size;
+            dec->state = STATE_SOURCE;
+        }
+
+        break;
+
+    case STATE_BLOCK_CHECKSUM:
+        dec->count++;
+
+        if (dec->count == 4) {
+            dec->count = 0;
+            dec->field = 0;
+            dec->state = STATE_BLOCK_SIZE;
+        }
+
+        break;
+
+    case STATE_CONTENT_CHECKSUM:
+        dec->count++;
+
+        if (dec->count == 4) {
+            dec->state = STATE_END;
+        }
+
+        break;
+
+    default:
+        /* Sequence headers, in a compressed block. */
+        if (dec->block_left == 0) {
+            return LZ4DEC_ERROR_DATA;
+        }
+
+        dec->block_left--;
+
+        switch (dec->state) {
+
+        case STATE_TOKEN:
+            dec->length = (byte >> 4);
+            dec->match_code = (byte & 0xf);
+
+            if (dec->length == 15) {
+                dec->state = STATE_LITERAL_LENGTH;
+            } else {
+                return literals_start(dec);
+            }
+
+            break;
+
+        case STATE_LITERAL_LENGTH:
+            dec->length += byte;
+
+            if (byte != 255) {
+                return literals_start(dec);
+            }
+
+            break;
+
+        case STATE_OFFSET:
+            dec->field |= ((uint32_t)byte << (8 * dec->count));
+            dec->count++;
+
+            if (dec->count == 2) {
+                return match_start(dec);
+            }
+
+            break;
+
+        case STATE_MATCH_LENGTH:
+            dec->length += byte;
+
+            if (byte != 255) {
+                dec->state = STATE_MATCH;
+            }
+
+            break;
+
+        default:
+            return LZ4DEC_ERROR_DATA;
+        }
+
+        break;
+    }
+
+    return LZ4DEC_OK;
+}
+
+void lz4dec_init(lz4dec_t *dec, void *window_p, size_t window_size)
+{
+    memset(dec, 0, sizeof(*dec));
+    dec->state = STATE_HEADER;
+    dec->header_size = LZ4DEC_HEADER_SIZE;
+    dec->window_p = window_p;
+    dec->window_size = MIN(window_size, LZ4DEC_WINDOW_SIZE_MAX);
+}
+
+void lz4dec_init_primed(lz4dec_t *dec, void *window_p, size_t window_size)
+{
+    lz4dec_init(dec, window_p, window_size);
+    dec->primed = 1;
+}
+
+size_t lz4dec_window_used(const lz4dec_t *dec)
+{
+    return dec->window_full;
+}
+
+void lz4dec_set_window(lz4dec_t *dec, void *window_p)
+{
+    dec->window_p = window_p;
+}
+
+lz4dec_res lz4dec_decode(lz4dec_t *dec,
+                         const uint8_t *in_p,
+                         size_t *in_size_p,
+                         uint8_t *out_p,
+                         size_t *out_size_p)
+{
+    size_t in_pos;
+    size_t out_pos;
+    size_t n;
+    lz4dec_res res;
+
+    in_pos = 0;
+    out_pos = 0;
+    res = LZ4DEC_OK;
+
+    while (res == LZ4DEC_OK) {
+        switch (dec->state) {
+
+        case STATE_LITERALS:
+        case STATE_RAW:
+            if (dec->length == 0) {
+                if ((dec->state == STATE_RAW) || (dec->block_left == 0)) {
+                    block_end(dec);
+                } else {
+                    dec->count = 0;
+                    dec->field = 0;
+                    dec->state = STATE_OFFSET;
+                }
+
+                continue;
+            }
+
+            n = MIN(dec->length, *in_size_p - in_pos);
+            n = MIN(n, *out_size_p - out_pos);
+
+            if (n == 0) {
+                goto out;
+            }
+
+            memcpy(&out_p[out_pos], &in_p[in_pos], n);
+            window_append(dec, &out_p[out_pos], n);
+            in_pos += n;
+            out_pos += n;
+            dec->length -= n;
+            break;
+
+        case STATE_MATCH:
+            if (dec->length == 0) {
+                /* The last sequence of a block has no match. */
+                if (dec->block_left == 0) {
+                    res = LZ4DEC_ERROR_DATA;
+                } else {
+                    dec->state = STATE_TOKEN;
+                }
+
+                continue;
+            }
+
+            n = MIN(dec->length, *out_size_p - out_pos);
+
+            if (n == 0) {
+                goto out;
+            }
+
+            match_copy(dec, &out_p[out_pos], n);
+            out_pos += n;
+            dec->length -= n;
+            break;
+
+        case STATE_SOURCE:
+            if (dec->source_left == 0) {
+                res = block_start(dec, dec->block);
+            } else {
+                res = LZ4DEC_NEED_SOURCE;
+            }
+
+            break;
+
+        case STATE_END:
+            res = LZ4DEC_END;
+            break;
+
+        default:
+            if (in_pos == *in_size_p) {
+                goto out;
+            }
+
+            res = decode_byte(dec, in_p[in_pos]);
+            in_pos++;
+            break;
+        }
+    }
+
+out:
+    *in_size_p = in_pos;
+    *out_size_p = out_pos;
+
+    return res;
+}
+
+uint8_t *lz4dec_source(lz4dec_t *dec, uint32_t *offset_p, size_t *size_p)
+{
+    *offset_p = dec->source_offset;
+    *size_p = MIN(dec->source_left, dec->window_size - dec->window_pos);
+
+    return &dec->window_p[dec->window_pos];
+}
+
+void lz4dec_primed(lz4dec_t *dec, size_t size)
+{
+    dec->window_full = MIN(dec->window_full + size, dec->window_size);
+    dec->window_pos += size;
+
+    if (dec->window_pos == dec->window_size) {
+        dec->window_pos = 0;
+    }
+
+    dec->source_offset += size;
+    dec->source_left -= size;
+}
+
+int lz4dec_finished(const lz4dec_t *dec)
+{
+    return (dec->state == STATE_END);
+}
@@ -0,0 +1,139 @@
+/*
+ * SPDX-FileCopyrightText: 2016 Intel Corporation
+ *                         2020 Thesis projects
+ *
+ * SPDX-License-Identifier: Apache 2.0 License
+ *
+ * SPDX-FileContributor: 2021 Laukik Hase
+ */
+
+#ifndef LZ4DEC_H
+#define LZ4DEC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Streaming decoder of LZ4 frames, for small devices. Input and output
+ * may be split anywhere. Decoded data is kept in a window given by the
+ * caller, and its size decides the largest match offset a frame may
+ * use, up to the 64 KiB of the format. Checksums are skipped, the
+ * patch is verified as a whole elsewhere.
+ *
+ * The dictionary id of a frame is skipped, as no dictionaries are
+ * known; a match into one fails as corrupt.
+ *
+ * Primed frames, a format of their own (patch compression id 7), are
+ * primed from the source image. They are LZ4 frames whose dictionary
+ * id is the number of source bytes to prime with, and every block size
+ * is followed by the 32 bit offset of the source data to append to the
+ * window before the block, or 0xffffffff for none. Matches may then
+ * point into the source, which the device already has.
+ */
+
+/* Largest frame header. */
+#define LZ4DEC_HEADER_SIZE      (19)
+
+/* Largest match offset of the format. */
+#define LZ4DEC_WINDOW_SIZE_MAX  (65535)
+
+/* Block source offset of an unprimed block. */
+#define LZ4DEC_SOURCE_NONE      (0xffffffffu)
+
+typedef enum {
+    LZ4DEC_OK = 0,              /* more input or output space needed */
+    LZ4DEC_END,                 /* end of frame */
+    LZ4DEC_NEED_SOURCE,         /* call lz4dec_source() */
+    LZ4DEC_ERROR_WINDOW = -1,   /* match offset beyond the window */
+    LZ4DEC_ERROR_DATA = -2,     /* corrupt or unsupported frame */
+} lz4dec_res;
+
+/* Pointer free, except for window_p, so that it can be saved and
+ * restored with its window anywhere. */
+typedef struct {
+    uint8_t state;
+    uint8_t flags;              /* frame FLG byte */
+    uint8_t header_size;        /* of the frame header, once known */
+    uint8_t count;              /* bytes of the current field */
+    uint8_t primed;             /* a primed frame */
+    uint8_t header[LZ4DEC_HEADER_SIZE];
+    uint8_t match_code;         /* match length bits of the token */
+    uint32_t block_left;        /* input bytes left in the block */
+    uint32_t length;            /* literal or match bytes left */
+    uint32_t offset;            /* match offset */
+    uint32_t field;             /* block size or offset being read */
+    uint32_t block;             /* size of a primed block */
+    uint32_t dict_size;         /* source bytes each priming */
+    uint32_t source_offset;     /* of the source bytes to prime with */
+    uint32_t source_left;
+
+    /* Decoded data ring */
+    uint8_t *window_p;
+    size_t window_size;
+    size_t window_pos;
+    size_t window_full;         /* bytes of the window written */
+} lz4dec_t;
+
+/**
+ * Prepares a decoder for a frame, with given window.
+ */
+void lz4dec_init(lz4dec_t *dec, void *window_p, size_t window_size);
+
+/**
+ * Prepares a decoder for a primed frame, with given window.
+ */
+void lz4dec_init_primed(lz4dec_t *dec, void *window_p, size_t window_size);
+
+/**
+ * Bytes of the window holding decoded data, to be saved with the
+ * decoder.
+ */
+size_t lz4dec_window_used(const lz4dec_t *dec);
+
+/**
+ * Moves the decoder window elsewhere. The used bytes are moved, or
+ * restored, by the caller.
+ */
+void lz4dec_set_window(lz4dec_t *dec, void *window_p);
+
+/**
+ * Decodes input into given output buffer, until the output is full
+ * and the next input byte would produce output, or all input is
+ * consumed.
+ *
+ * @param[in,out] in_size_p Input size in, bytes consumed out.
+ * @param[in,out] out_size_p Output size in, bytes decoded out.
+ *
+ * @return LZ4DEC_OK, LZ4DEC_END or an error.
+ */
+lz4dec_res lz4dec_decode(lz4dec_t *dec,
+                         const uint8_t *in_p,
+                         size_t *in_size_p,
+                         uint8_t *out_p,
+                         size_t *out_size_p);
+
+/**
+ * Where to put source data, once LZ4DEC_NEED_SOURCE is returned. Read
+ * given number of bytes of the source image at given offset into the
+ * returned buffer, then call lz4dec_primed(). Repeat until
+ * lz4dec_decode() no longer returns LZ4DEC_NEED_SOURCE.
+ *
+ * @param[out] offset_p Source offset.
+ * @param[out] size_p Number of bytes.
+ *
+ * @return Buffer in the window.
+ */
+uint8_t *lz4dec_source(lz4dec_t *dec, uint32_t *offset_p, size_t *size_p);
+
+/**
+ * Adds given number of source bytes, read into the buffer returned by
+ * lz4dec_source(), to the window.
+ */
+void lz4dec_primed(lz4dec_t *dec, size_t size);
+
+/**
+ * @return Non-zero if the whole frame is decoded.
+ */
+int lz4dec_finished(const lz4dec_t *dec);
+
+#endif
@@ -0,0 +1,666 @@
+/*
+ * SPDX-FileCopyrightText: 2016 Intel Corporation
+ *                         2020 Thesis projects
+ *
+ * SPDX-License-Identifier: Apache 2.0 License
+ *
+ * SPDX-FileContributor: 2021 Laukik Hase
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "lzmadec.h"
+
+#define RC_TOP              (1u << 24)
+#define PROB_BITS           (11)
+#define PROB_INIT           (1u << (PROB_BITS - 1))
+#define PROB_MOVE_BITS      (5)
+
+#define NUM_STATES          (12)
+#define NUM_LIT_STATES      (7)
+#define POS_STATES_MAX      (1 << 4)
+#define END_POS_MODEL_INDEX (14)
+#define FULL_DISTANCES      (1 << (END_POS_MODEL_INDEX >> 1))
+#define ALIGN_BITS          (4)
+#define LEN_STATES          (4)
+#define MATCH_LEN_MIN       (2)
+#define END_MARKER          (0xffffffffu)
+
+/* Length coder probabilities */
+#define LEN_CHOICE          (0)
+#define LEN_CHOICE_2        (1)
+#define LEN_LOW             (2)
+#define LEN_MID             (LEN_LOW + POS_STATES_MAX * 8)
+#define LEN_HIGH            (LEN_MID + POS_STATES_MAX * 8)
+#define LEN_PROBS           (LEN_HIGH + 256)
+
+/* Probabilities, in the order of the reference decoder */
+#define IS_MATCH            (0)
+#define IS_REP              (IS_MATCH + NUM_STATES * POS_STATES_MAX)
+#define IS_REP_G0           (IS_REP + NUM_STATES)
+#define IS_REP_G1           (IS_REP_G0 + NUM_STATES)
+#define IS_REP_G2           (IS_REP_G1 + NUM_STATES)
+#define IS_REP0_LONG        (IS_REP_G2 + NUM_STATES)
+#define POS_SLOT            (IS_REP0_LONG + NUM_STATES * POS_STATES_MAX)
+#define SPEC_POS            (POS_SLOT + LEN_STATES * 64)
+#define ALIGN               (SPEC_POS + 1 + FULL_DISTANCES - END_POS_MODEL_INDEX)
+#define LEN_CODER           (ALIGN + (1 << ALIGN_BITS))
+#define REP_LEN_CODER       (LEN_CODER + LEN_PROBS)
+#define LITERAL             (REP_LEN_CODER + LEN_PROBS)
+#define LITERAL_SIZE        (0x300)
+
+#ifndef MIN
+#define MIN(x, y) (((x) < (y)) ? (x) : (y))
+#endif
+
+typedef struct {
+    uint32_t range;
+    uint32_t code;
+    const uint8_t *in_p;
+    size_t pos;
+    size_t limit;   /* A symbol may start up to here */
+} rc_t;
+
+static inline void rc_normalize(rc_t *rc)
+{
+    if (rc->range < RC_TOP) {
+        rc->range <<= 8;
+        rc->code = (rc->code << 8) | rc->in_p[rc->pos++];
+    }
+}
+
+static inline uint32_t rc_bit(rc_t *rc, uint16_t *prob_p)
+{
+    uint32_t bound = (rc->range >> PROB_BITS) * *prob_p;
+    uint32_t bit;
+
+    if (rc->code < bound) {
+        rc->range = bound;
+        *prob_p += ((1u << PROB_BITS) - *prob_p) >> PROB_MOVE_BITS;
+        bit = 0;
+    } else {
+        rc->range -= bound;
+        rc->code -= bound;
+        *prob_p -= *prob_p >> PROB_MOVE_BITS;
+        bit = 1;
+    }
+
+    rc_normalize(rc);
+
+    return bit;
+}
+
+static inline uint32_t rc_tree(rc_t *rc, uint16_t *probs_p, int bits)
+{
+    uint32_t m = 1;
+    int i;
+
+    for (i = 0; i < bits; i++) {
+        m = (m << 1) + rc_bit(rc, &probs_p[m]);
+    }
+
+    return m - (1u << bits);
+}
+
+static inline uint32_t rc_tree_reverse(rc_t *rc, uint16_t *probs_p, int bits)
+{
+    uint32_t m = 1;
+    uint32_t symbol = 0;
+    uint32_t bit;
+    int i;
+
+    for (i = 0; i < bits; i++) {
+        bit = rc_bit(rc, &probs_p[m]);
+        m = (m << 1) + bit;
+        symbol |= bit << i;
+    }
+
+    return symbol;
+}
+
+static inline uint32_t rc_direct(rc_t *rc, int bits)
+{
+    uint32_t symbol = 0;
+    uint32_t mask;
+
+    while (bits-- > 0) {
+        rc->range >>= 1;
+        rc->code -= rc->range;
+        mask = 0u - (rc->code >> 31);
+        rc->code += rc->range & mask;
+        symbol = (symbol << 1) + (mask + 1);
+        rc_normalize(rc);
+    }
+
+    return symbol;
+}
+
+static inline uint16_t *dec_probs(lzmadec_t *dec)
+{
+    return (uint16_t *)dec->buf_p;
+}
+
+static inline uint8_t *dec_ring(lzmadec_t *dec)
+{
+    return dec->buf_p + dec->probs_size;
+}
+
+static inline size_t dec_space(const lzmadec_t *dec)
+{
+    return dec->ring_size - dec->pending;
+}
+
+/* Byte dist + 1 positions back. */
+static inline uint8_t dict_get(lzmadec_t *dec, uint32_t dist)
+{
+    size_t index = dec->ring_pos + dec->ring_size - dist - 1;
+
+    if (index >= dec->ring_size) {
+        index -= dec->ring_size;
+    }
+
+    return dec_ring(dec)[index];
+}
+
+static inline void dict_put(lzmadec_t *dec, uint8_t byte)
+{
+    dec_ring(dec)[dec->ring_pos++] = byte;
+
+    if (dec->ring_pos == dec->ring_size) {
+        dec->ring_pos = 0;
+    }
+    if (dec->ring_full < dec->ring_size) {
+        dec->ring_full++;
+    }
+
+    dec->pending++;
+    dec->total++;
+
+    if (dec->unpacked_left != UINT64_MAX) {
+        dec->unpacked_left--;
+    }
+}
+
+static lzmadec_res dict_repeat(lzmadec_t *dec)
+{
+    size_t left = MIN(dec->match_left, dec_space(dec));
+
+    if (dec->unpacked_left < dec->match_left) {
+        return LZMADEC_ERROR_DATA;
+    }
+
+    dec->match_left -= left;
+
+    while (left-- > 0) {
+        dict_put(dec, dict_get(dec, dec->rep0));
+    }
+
+    return LZMADEC_OK;
+}
+
+static uint32_t decode_len(rc_t *rc, uint16_t *probs_p, uint32_t pos_state)
+{
+    if (rc_bit(rc, &probs_p[LEN_CHOICE]) == 0) {
+        return rc_tree(rc, &probs_p[LEN_LOW + pos_state * 8], 3);
+    } else if (rc_bit(rc, &probs_p[LEN_CHOICE_2]) == 0) {
+        return 8 + rc_tree(rc, &probs_p[LEN_MID + pos_state * 8], 3);
+    } else {
+        return 16 + rc_tree(rc, &probs_p[LEN_HIGH], 8);
+    }
+}
+
+static uint32_t decode_dist(rc_t *rc, uint16_t *probs_p, uint32_t len)
+{
+    uint32_t slot;
+    uint32_t dist;
+    int bits;
+
+    slot = rc_tree(rc, &probs_p[POS_SLOT + MIN(len, LEN_STATES - 1) * 64], 6);
+
+    if (slot < 4) {
+        return slot;
+    }
+
+    bits = (slot >> 1) - 1;
+    dist = (2 | (slot & 1)) << bits;
+
+    if (slot < END_POS_MODEL_INDEX) {
+        dist += rc_tree_reverse(rc, &probs_p[SPEC_POS + dist - slot], bits);
+    } else {
+        dist += rc_direct(rc, bits - ALIGN_BITS) << ALIGN_BITS;
+        dist += rc_tree_reverse(rc, &probs_p[ALIGN], ALIGN_BITS);
+    }
+
+    return dist;
+}
+
+static void decode_literal(lzmadec_t *dec, rc_t *rc, uint16_t *probs_p)
+{
+    uint32_t prev = (dec->ring_full > 0) ? dict_get(dec, 0) : 0;
+    uint32_t symbol = 1;
+    uint32_t match_byte;
+    uint32_t match_bit;
+    uint32_t offset;
+
+    probs_p += LITERAL + LITERAL_SIZE * ((((dec->total & ((1u << dec->lp) - 1)) << dec->lc)
+                                          + (prev >> (8 - dec->lc))));
+
+    if (dec->state < NUM_LIT_STATES) {
+        while (symbol < 0x100) {
+            symbol = (symbol << 1) + rc_bit(rc, &probs_p[symbol]);
+        }
+    } else {
+        match_byte = dict_get(dec, dec->rep0);
+        offset = 0x100;
+
+        while (symbol < 0x100) {
+            match_byte <<= 1;
+            match_bit = match_byte & offset;
+
+            if (rc_bit(rc, &probs_p[offset + match_bit + symbol])) {
+                symbol = (symbol << 1) + 1;
+                offset &= match_bit;
+            } else {
+                symbol <<= 1;
+                offset &= ~match_bit;
+            }
+        }
+    }
+
+    dict_put(dec, (uint8_t)symbol);
+
+    if (dec->state < 4) {
+        dec->state = 0;
+    } else if (dec->state < 10) {
+        dec->state -= 3;
+    } else {
+        dec->state -= 6;
+    }
+}
+
+/* Decodes symbols while there is dictionary space and input. */
+static lzmadec_res decode_symbols(lzmadec_t *dec, rc_t *rc)
+{
+    uint16_t *probs_p = dec_probs(dec);
+    uint32_t pos_mask = (1u << dec->pb) - 1;
+    uint32_t pos_state;
+    uint32_t len;
+    uint32_t dist;
+    lzmadec_res res;
+
+    res = dict_repeat(dec);
+
+    if (res != LZMADEC_OK) {
+        return res;
+    }
+
+    while ((dec_space(dec) > 0) && (rc->pos <= rc->limit)) {
+        if (dec->unpacked_left == 0) {
+            dec->status = LZMADEC_STATUS_END;
+            break;
+        }
+
+        pos_state = dec->total & pos_mask;
+
+        if (rc_bit(rc, &probs_p[IS_MATCH + dec->state * POS_STATES_MAX + pos_state]) == 0) {
+            if ((dec->state >= NUM_LIT_STATES) && (dec->rep0 >= dec->ring_full)) {
+                return LZMADEC_ERROR_DATA;
+            }
+
+            decode_literal(dec, rc, probs_p);
+            continue;
+        }
+
+        if (rc_bit(rc, &probs_p[IS_REP + dec->state]) == 0) {
+            len = decode_len(rc, &probs_p[LEN_CODER], pos_state);
+            dec->state = (dec->state < NUM_LIT_STATES) ? 7 : 10;
+            dist = decode_dist(rc, probs_p, len);
+
+            if (dist == END_MARKER) {
+                if (rc->code != 0) {
+                    return LZMADEC_ERROR_DATA;
+                }
+
+                dec->status = LZMADEC_STATUS_END;
+                break;
+            }
+
+            dec->rep3 = dec->rep2;
+            dec->rep2 = dec->rep1;
+            dec->rep1 = dec->rep0;
+            dec->rep0 = dist;
+        } else {
+            if (rc_bit(rc, &probs_p[IS_REP_G0 + dec->state]) == 0) {
+                if (rc_bit(rc, &probs_p[IS_REP0_LONG + dec->state * POS_STATES_MAX + pos_state]) == 0) {
+                    /* Short rep, one byte at rep0 */
+                    dec->state = (dec->state < NUM_LIT_STATES) ? 9 : 11;
+
+                    if (dec->rep0 >= dec->ring_full) {
+                        return LZMADEC_ERROR_DATA;
+                    }
+
+                    dict_put(dec, dict_get(dec, dec->rep0));
+                    continue;
+                }
+            } else {
+                if (rc_bit(rc, &probs_p[IS_REP_G1 + dec->state]) == 0) {
+                    dist = dec->rep1;
+                } else {
+                    if (rc_bit(rc, &probs_p[IS_REP_G2 + dec->state]) == 0) {
+                        dist = dec->rep2;
+                    } else {
+                        dist = dec->rep3;
+                        dec->rep3 = dec->rep2;
+                    }
+
+                    dec->rep2 = dec->rep1;
+                }
+
+                dec->rep1 = dec->rep0;
+                dec->rep0 = dist;
+            }
+
+            len = decode_len(rc, &probs_p[REP_LEN_CODER], pos_state);
+            dec->state = (dec->state < NUM_LIT_STATES) ? 8 : 11;
+        }
+
+        if (dec->rep0 >= dec->ring_full) {
+            return LZMADEC_ERROR_DATA;
+        }
+
+        dec->match_left = len + MATCH_LEN_MIN;
+        res = dict_repeat(dec);
+
+        if (res != LZMADEC_OK) {
+            return res;
+        }
+    }
+
+    return LZMADEC_OK;
+}
+
+/* Decodes from given input, keeping the range coder state. */
+static lzmadec_res decode_input(lzmadec_t *dec,
+                                const uint8_t *in_p,
+                                size_t pos,
+                                size_t limit,
+                                size_t *pos_p)
+{
+    rc_t rc;
+    lzmadec_res res;
+
+    rc.range = dec->range;
+    rc.code = dec->code;
+    rc.in_p = in_p;
+    rc.pos = pos;
+    rc.limit = limit;
+
+    res = decode_symbols(dec, &rc);
+
+    dec->range = rc.range;
+    dec->code = rc.code;
+    *pos_p = rc.pos;
+
+    return res;
+}
+
+static lzmadec_res decode_header(lzmadec_t *dec)
+{
+    uint32_t props = dec->header[0];
+    int i;
+
+    if (props >= (9 * 5 * 5)) {
+        return LZMADEC_ERROR_DATA;
+    }
+
+    dec->lc = props % 9;
+    props /= 9;
+    dec->lp = props % 5;
+    dec->pb = props / 5;
+
+    dec->dict_size = 0;
+    for (i = 4; i >= 1; i--) {
+        dec->dict_size = (dec->dict_size << 8) | dec->header[i];
+    }
+
+    dec->unpacked_left = 0;
+    for (i = 12; i >= 5; i--) {
+        dec->unpacked_left = (dec->unpacked_left << 8) | dec->header[i];
+    }
+
+    /* The range coder always starts with a zero byte. */
+    if (dec->header[13] != 0) {
+        return LZMADEC_ERROR_DATA;
+    }
+
+    dec->range = 0xffffffff;
+    dec->code = 0;
+    for (i = 14; i < LZMADEC_HEADER_SIZE; i++) {
+        dec->code = (dec->code << 8) | dec->header[i];
+    }
+
+    if (dec->code == dec->range) {
+        return LZMADEC_ERROR_DATA;
+    }
+
+    dec->probs_size = (LITERAL + (LITERAL_SIZE << (dec->lc + dec->lp))) * sizeof(uint16_t);
+    dec->status = LZMADEC_STATUS_NEED_BUFFER;
+
+    return LZMADEC_NEED_BUFFER;
+}
+
+void lzmadec_init(lzmadec_t *dec, uint64_t compressed_size)
+{
+    memset(dec, 0, sizeof(*dec));
+    dec->status = LZMADEC_STATUS_HEADER;
+    dec->compressed_left = compressed_size;
+}
+
+size_t lzmadec_memory_usage(const lzmadec_t *dec)
+{
+    return dec->probs_size + (dec->dict_size < LZMADEC_DICT_SIZE_MIN ?
+                              LZMADEC_DICT_SIZE_MIN : dec->dict_size);
+}
+
+size_t lzmadec_buffer_used(const lzmadec_t *dec)
+{
+    if (dec->status < LZMADEC_STATUS_RUN) {
+        return 0;
+    }
+
+    return dec->probs_size + dec->ring_full;
+}
+
+lzmadec_res lzmadec_set_buffer(lzmadec_t *dec, void *buf_p, size_t size)
+{
+    size_t dict_size;
+    size_t i;
+
+    /* Probabilities are 16 bits. */
+    if (((uintptr_t)buf_p & 1) != 0) {
+        return LZMADEC_ERROR_MEMORY;
+    }
+
+    if (dec->status == LZMADEC_STATUS_NEED_BUFFER) {
+        if (size < dec->probs_size + LZMADEC_DICT_SIZE_MIN) {
+            return LZMADEC_ERROR_MEMORY;
+        }
+
+        /* A smaller dictionary only works if all output fits. */
+        dict_size = lzmadec_memory_usage(dec) - dec->probs_size;
+
+        if (dict_size > size - dec->probs_size) {
+            if (dec->unpacked_left > size - dec->probs_size) {
+                return LZMADEC_ERROR_MEMORY;
+            }
+
+            dict_size = size - dec->probs_size;
+        }
+
+        dec->buf_p = buf_p;
+        dec->buf_size = size;
+        dec->ring_size = dict_size;
+
+        for (i = 0; i < dec->probs_size / sizeof(uint16_t); i++) {
+            dec_probs(dec)[i] = PROB_INIT;
+        }
+
+        dec->status = LZMADEC_STATUS_RUN;
+    } else if (dec->status != LZMADEC_STATUS_HEADER) {
+        if (size < dec->probs_size + dec->ring_size) {
+            return LZMADEC_ERROR_MEMORY;
+        }
+
+        dec->buf_p = buf_p;
+        dec->buf_size = size;
+    }
+
+    return LZMADEC_OK;
+}
+
+lzmadec_res lzmadec_decode(lzmadec_t *dec, const uint8_t *in_p, size_t *in_size_p)
+{
+    size_t in_size = MIN(*in_size_p, dec->compressed_left);
+    size_t in_pos = 0;
+    size_t limit;
+    size_t size;
+    size_t pos;
+    lzmadec_res res = LZMADEC_OK;
+
+    while ((dec->status == LZMADEC_STATUS_HEADER) && (in_pos < in_size)) {
+        dec->header[dec->header_size++] = in_p[in_pos++];
+        dec->compressed_left--;
+
+        if (dec->header_size == LZMADEC_HEADER_SIZE) {
+            res = decode_header(dec);
+            break;
+        }
+    }
+
+    if (dec->status != LZMADEC_STATUS_RUN) {
+        goto out;
+    }
+
+    /* Room may have been made for the rest of a match. */
+    res = dict_repeat(dec);
+
+    if (res != LZMADEC_OK) {
+        goto out;
+    }
+
+    /* Finish, or add to, a symbol split between calls. This is also
+     * where the last symbols of the stream are decoded. */
+    if ((dec->temp_size > 0) || (dec->compressed_left == 0)) {
+        size = MIN(2 * LZMADEC_IN_REQUIRED - dec->temp_size, in_size - in_pos);
+        memcpy(&dec->temp[dec->temp_size], &in_p[in_pos], size);
+
+        if (dec->temp_size + size == dec->compressed_left) {
+            memset(&dec->temp[dec->temp_size + size],
+                   0,
+                   sizeof(dec->temp) - dec->temp_size - size);
+            limit = dec->temp_size + size;
+        } else if (dec->temp_size + size < LZMADEC_IN_REQUIRED) {
+            dec->temp_size += size;
+            in_pos += size;
+            goto out;
+        } else {
+            limit = dec->temp_size + size - LZMADEC_IN_REQUIRED;
+        }
+
+        res = decode_input(dec, dec->temp, 0, limit, &pos);
+
+        if ((res == LZMADEC_OK) && (pos > dec->temp_size + size)) {
+            res = LZMADEC_ERROR_DATA;
+        }
+
+        if (res != LZMADEC_OK) {
+            goto out;
+        }
+
+        dec->compressed_left -= pos;
+
+        if (pos < dec->temp_size) {
+            dec->temp_size -= pos;
+            memmove(&dec->temp[0], &dec->temp[pos], dec->temp_size);
+            goto out;
+        }
+
+        in_pos += (pos - dec->temp_size);
+        dec->temp_size = 0;
+    }
+
+    if ((dec->status == LZMADEC_STATUS_RUN)
+        && (in_size - in_pos >= LZMADEC_IN_REQUIRED)) {
+        res = decode_input(dec,
+                           in_p,
+                           in_pos,
+                           in_size - LZMADEC_IN_REQUIRED,
+                           &pos);
+
+        if (res != LZMADEC_OK) {
+            goto out;
+        }
+
+        dec->compressed_left -= (pos - in_pos);
+        in_pos = pos;
+    }
+
+    /* Keep what is left of the input for the next call. */
+    if ((dec->status == LZMADEC_STATUS_RUN)
+        && (in_size - in_pos < LZMADEC_IN_REQUIRED)) {
+        dec->temp_size = in_size - in_pos;
+        memcpy(&dec->temp[0], &in_p[in_pos], dec->temp_size);
+        in_pos = in_size;
+    }
+
+out:
+    *in_size_p = in_pos;
+
+    if (res != LZMADEC_OK) {
+        return res;
+    }
+
+    return (dec->status == LZMADEC_STATUS_END) ? LZMADEC_END : LZMADEC_OK;
+}
+
+size_t lzmadec_read(lzmadec_t *dec, uint8_t *out_p, size_t size)
+{
+    size_t start;
+    size_t left;
+    size_t n;
+
+    size = MIN(size, dec->pending);
+
+    if (size == 0) {
+        return 0;
+    }
+
+    left = size;
+    start = dec->ring_pos + dec->ring_size - dec->pending;
+
+    if (start >= dec->ring_size) {
+        start -= dec->ring_size;
+    }
+
+    while (left > 0) {
+        n = MIN(left, dec->ring_size - start);
+        memcpy(out_p, &dec_ring(dec)[start], n);
+        out_p += n;
+        left -= n;
+        start = 0;
+    }
+
+    dec->pending -= size;
+
+    return size;
+}
+
+int lzmadec_finished(const lzmadec_t *dec)
+{
+    return (dec->status == LZMADEC_STATUS_END)
+        && (dec->pending == 0)
+        && (dec->compressed_left == 0)
+        && (dec->temp_size == 0)
+        && (dec->match_left == 0);
+}
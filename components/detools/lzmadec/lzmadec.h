@@ -0,0 +1,133 @@
+/*
+ * SPDX-FileCopyrightText: 2016 Intel Corporation
+ *                         2020 Thesis projects
+ *
+ * SPDX-License-Identifier: Apache 2.0 License
+ *
+ * SPDX-FileContributor: 2021 Laukik Hase
+ */
+
+#ifndef LZMADEC_H
+#define LZMADEC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Streaming decoder of LZMA (.lzma, "LZMA alone") data, for small
+ * devices. All decoder memory, the probabilities and the dictionary,
+ * is given by the caller, and its size decides the largest
+ * dictionary size a stream may use.
+ */
+
+/* LZMA alone header, followed by the range coder init bytes. */
+#define LZMADEC_HEADER_SIZE     (13 + 5)
+
+/* Input bytes a symbol can use at most. */
+#define LZMADEC_IN_REQUIRED     (24)
+
+/* Smallest dictionary the encoder uses. */
+#define LZMADEC_DICT_SIZE_MIN   (4096)
+
+typedef enum {
+    LZMADEC_OK = 0,             /* more input or output space needed */
+    LZMADEC_END,                /* end of stream */
+    LZMADEC_NEED_BUFFER,        /* header decoded, call lzmadec_set_buffer() */
+    LZMADEC_ERROR_MEMORY = -1,  /* buffer too small for the stream */
+    LZMADEC_ERROR_DATA = -2,    /* corrupt stream */
+} lzmadec_res;
+
+enum {
+    LZMADEC_STATUS_HEADER = 0,
+    LZMADEC_STATUS_NEED_BUFFER,
+    LZMADEC_STATUS_RUN,
+    LZMADEC_STATUS_END
+};
+
+/* Pointer free, except for buf_p, so that it can be saved and
+ * restored with its buffer anywhere. */
+typedef struct {
+    uint8_t status;
+    uint8_t lc;                 /* literal context bits */
+    uint8_t lp;                 /* literal position bits */
+    uint8_t pb;                 /* position bits */
+    uint8_t header_size;
+    uint8_t header[LZMADEC_HEADER_SIZE];
+    uint32_t dict_size;         /* from the header */
+    uint64_t unpacked_left;     /* UINT64_MAX if unknown */
+    uint64_t compressed_left;
+
+    /* Range decoder */
+    uint32_t range;
+    uint32_t code;
+
+    /* LZMA state */
+    uint32_t state;
+    uint32_t rep0;
+    uint32_t rep1;
+    uint32_t rep2;
+    uint32_t rep3;
+    uint32_t match_left;        /* match bytes not yet copied */
+    uint32_t total;             /* low bits of the output position */
+
+    /* Probabilities, then the dictionary ring */
+    uint8_t *buf_p;
+    size_t buf_size;
+    size_t probs_size;
+    size_t ring_size;
+    size_t ring_pos;
+    size_t ring_full;           /* bytes of the ring written */
+    size_t pending;             /* bytes decoded but not yet read */
+
+    /* Input of less than a symbol, with room for padding */
+    uint8_t temp[3 * LZMADEC_IN_REQUIRED];
+    size_t temp_size;
+} lzmadec_t;
+
+/**
+ * Prepares a decoder for a stream of given size, header included.
+ */
+void lzmadec_init(lzmadec_t *dec, uint64_t compressed_size);
+
+/**
+ * Bytes of buffer the stream needs. Valid once the header is decoded.
+ */
+size_t lzmadec_memory_usage(const lzmadec_t *dec);
+
+/**
+ * Bytes of the buffer holding decoder state, to be saved with the
+ * decoder.
+ */
+size_t lzmadec_buffer_used(const lzmadec_t *dec);
+
+/**
+ * Gives the decoder its buffer, once LZMADEC_NEED_BUFFER is returned,
+ * or moves it elsewhere, along with its used bytes.
+ *
+ * @return LZMADEC_OK or LZMADEC_ERROR_MEMORY.
+ */
+lzmadec_res lzmadec_set_buffer(lzmadec_t *dec, void *buf_p, size_t size);
+
+/**
+ * Decodes input into the dictionary, until it is full of unread data
+ * or more input is needed.
+ *
+ * @param[in,out] in_size_p Input size in, bytes consumed out.
+ *
+ * @return LZMADEC_OK, LZMADEC_END, LZMADEC_NEED_BUFFER or an error.
+ */
+lzmadec_res lzmadec_decode(lzmadec_t *dec, const uint8_t *in_p, size_t *in_size_p);
+
+/**
+ * Reads decoded data.
+ *
+ * @return Number of bytes read.
+ */
+size_t lzmadec_read(lzmadec_t *dec, uint8_t *out_p, size_t size);
+
+/**
+ * @return Non-zero if the whole stream is decoded and read.
+ */
+int lzmadec_finished(const lzmadec_t *dec);
+
+#endif
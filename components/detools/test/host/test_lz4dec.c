@@ -0,0 +1,411 @@
+/*
+ * SPDX-FileCopyrightText: 2016 Intel Corporation
+ *                         2020 Thesis projects
+ *
+ * SPDX-License-Identifier: Apache 2.0 License
+ *
+ * SPDX-FileContributor: 2021 Laukik Hase
+ */
+
+/*
+ * Host tests of the LZ4 decoder, against frames of the liblz4 encoder
+ * and primed frames built from liblz4 blocks, as tools/patch_lz4
+ * creates them.
+ *
+ * gcc -Icomponents/detools/lz4dec components/detools/test/host/test_lz4dec.c
+ *     components/detools/lz4dec/lz4dec.c -llz4 -o test_lz4dec
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <lz4.h>
+#include <lz4frame.h>
+
+#include "lz4dec.h"
+
+#define STALLED         (-3)
+#define BAD_SOURCE      (-4)
+
+#define SOURCE_SIZE     (80000)
+#define TARGET_SIZE     (100000)
+#define BLOCK_SIZE      (16384)
+#define DICT_SIZE       (4096)
+
+#ifndef MIN
+#define MIN(x, y) (((x) < (y)) ? (x) : (y))
+#endif
+
+static int failures;
+
+#define TEST_ASSERT(cond) do {                                          \
+        if (!(cond)) {                                                  \
+            fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond);  \
+            failures++;                                                 \
+        }                                                               \
+    } while (0)
+
+static uint32_t prng_state;
+
+static uint32_t prng(void)
+{
+    prng_state ^= prng_state << 13;
+    prng_state ^= prng_state >> 17;
+    prng_state ^= prng_state << 5;
+
+    return prng_state;
+}
+
+/* Words, repeats near and far, and some noise. */
+static void make_data(uint8_t *buf, size_t size, uint32_t seed)
+{
+    static const char *words[] = { "delta ", "patch ", "flash ", "sector ", "image " };
+    size_t pos = 0;
+    size_t i, n, from;
+
+    prng_state = seed;
+
+    while (pos < size) {
+        switch (prng() % 4) {
+        case 0:
+            n = strlen(words[prng() % 5]);
+            memcpy(buf + pos, words[prng() % 5], MIN(n, size - pos));
+            break;
+        case 1:
+            n = prng() % 64 + 1;
+            for (i = 0; i < n && pos + i < size; i++) {
+                buf[pos + i] = (uint8_t)prng();
+            }
+            break;
+        default:
+            n = prng() % 200 + 2;
+            if (pos == 0) {
+                n = 0;
+                break;
+            }
+            from = prng() % pos;
+            for (i = 0; i < n && pos + i < size; i++) {
+                buf[pos + i] = buf[from + i % (pos - from)];
+            }
+            break;
+        }
+        pos += MIN(n, size - pos);
+    }
+}
+
+static void put_le32(uint8_t *buf, size_t *pos_p, uint32_t value)
+{
+    buf[(*pos_p)++] = (uint8_t)value;
+    buf[(*pos_p)++] = (uint8_t)(value >> 8);
+    buf[(*pos_p)++] = (uint8_t)(value >> 16);
+    buf[(*pos_p)++] = (uint8_t)(value >> 24);
+}
+
+/* Source offset a block of the target is primed with, the target
+ * being the source moved by 100 bytes. Every third block is not
+ * primed. */
+static uint32_t block_source(size_t offset)
+{
+    if ((offset / BLOCK_SIZE) % 3 == 2 || offset + 100 + DICT_SIZE > SOURCE_SIZE) {
+        return LZ4DEC_SOURCE_NONE;
+    }
+
+    return (uint32_t)(offset + 100);
+}
+
+/* Builds a frame with a dictionary id of DICT_SIZE, with blocks
+ * compressed by liblz4 against the data before them. A primed frame
+ * appends source data to the window before its blocks, a plain one
+ * starts with source data as its dictionary. */
+static size_t make_frame(uint8_t *out, const uint8_t *data, size_t size,
+                         const uint8_t *source, bool primed)
+{
+    LZ4_stream_t *stream = LZ4_createStream();
+    uint8_t *history = malloc(size + SOURCE_SIZE);
+    size_t history_size = 0;
+    size_t pos = 0;
+    size_t offset, n, tail, size_pos;
+    uint32_t source_offset;
+    int compressed;
+
+    put_le32(out, &pos, 0x184d2204);
+    out[pos++] = 0x40 | 0x01;   /* Version 1, linked blocks, dictionary id */
+    out[pos++] = 0x40;          /* 64 KiB blocks */
+    put_le32(out, &pos, DICT_SIZE);
+    out[pos++] = 0;             /* Header checksum, skipped */
+
+    if (!primed) {
+        memcpy(history, &source[100], DICT_SIZE);
+        history_size = DICT_SIZE;
+    }
+
+    for (offset = 0; offset < size; offset += n) {
+        n = MIN(BLOCK_SIZE, size - offset);
+        size_pos = pos;
+        pos += 4;
+
+        if (primed) {
+            source_offset = block_source(offset);
+            put_le32(out, &pos, source_offset);
+            if (source_offset != LZ4DEC_SOURCE_NONE) {
+                memcpy(&history[history_size], &source[source_offset], DICT_SIZE);
+                history_size += DICT_SIZE;
+            }
+        }
+
+        tail = MIN(history_size, LZ4DEC_WINDOW_SIZE_MAX);
+        LZ4_loadDict(stream, (const char *)&history[history_size - tail], (int)tail);
+        memcpy(&history[history_size], &data[offset], n);
+        compressed = LZ4_compress_fast_continue(stream,
+                                                (const char *)&history[history_size],
+                                                (char *)&out[pos],
+                                                (int)n,
+                                                (int)n - 1,
+                                                1);
+        history_size += n;
+
+        if (compressed > 0) {
+            put_le32(out, &size_pos, (uint32_t)compressed);
+            pos += (size_t)compressed;
+        } else {
+            put_le32(out, &size_pos, 0x80000000u | (uint32_t)n);
+            memcpy(&out[pos], &data[offset], n);
+            pos += n;
+        }
+    }
+
+    put_le32(out, &pos, 0);
+    LZ4_freeStream(stream);
+    free(history);
+
+    return pos;
+}
+
+/* Decodes given frame, fed and read in given chunk sizes. Source data
+ * is read from source, if given. */
+static int decode(const uint8_t *in, size_t in_size, uint8_t *out, size_t *out_size,
+                  size_t window_size, const uint8_t *source,
+                  size_t in_chunk, size_t out_chunk)
+{
+    lz4dec_t dec;
+    lz4dec_res ret = LZ4DEC_OK;
+    uint8_t *window = malloc(window_size);
+    uint8_t *buf;
+    uint32_t offset;
+    size_t in_pos = 0;
+    size_t out_pos = 0;
+    size_t n, m, size;
+    int res = 0;
+
+    if (source != NULL) {
+        lz4dec_init_primed(&dec, window, window_size);
+    } else {
+        lz4dec_init(&dec, window, window_size);
+    }
+
+    while (!lz4dec_finished(&dec)) {
+        n = MIN(in_chunk, in_size - in_pos);
+        m = MIN(out_chunk, *out_size - out_pos);
+        ret = lz4dec_decode(&dec, in + in_pos, &n, out + out_pos, &m);
+        in_pos += n;
+        out_pos += m;
+
+        if (ret == LZ4DEC_NEED_SOURCE) {
+            while (true) {
+                buf = lz4dec_source(&dec, &offset, &size);
+                if (size == 0) {
+                    break;
+                }
+                if (source == NULL || offset + size > SOURCE_SIZE) {
+                    res = BAD_SOURCE;
+                    goto out;
+                }
+                memcpy(buf, &source[offset], size);
+                lz4dec_primed(&dec, size);
+            }
+            continue;
+        }
+        if (ret < 0) {
+            res = ret;
+            break;
+        }
+        if (ret == LZ4DEC_OK && n == 0 && m == 0) {
+            res = STALLED;
+            break;
+        }
+    }
+
+out:
+    free(window);
+    *out_size = out_pos;
+
+    return res;
+}
+
+static void test_frames(void)
+{
+    static const size_t sizes[] = { 0, 1, 1000, 300000 };
+    static const size_t chunks[][2] = {
+        { 1, 1 }, { 7, 333 }, { 4096, 4096 }, { SIZE_MAX, SIZE_MAX }
+    };
+    LZ4F_preferences_t prefs[6];
+    uint8_t *data, *encoded, *decoded;
+    size_t capacity, encoded_size, decoded_size;
+    size_t i, j, k;
+
+    memset(prefs, 0, sizeof(prefs));
+    prefs[1].compressionLevel = 9;
+    prefs[2].compressionLevel = -5;
+    prefs[3].frameInfo.blockSizeID = LZ4F_max256KB;
+    prefs[3].frameInfo.blockMode = LZ4F_blockIndependent;
+    prefs[4].frameInfo.contentChecksumFlag = LZ4F_contentChecksumEnabled;
+    prefs[4].frameInfo.blockChecksumFlag = LZ4F_blockChecksumEnabled;
+    prefs[4].frameInfo.contentSize = sizes[3];
+    /* A dictionary id, of an unused dictionary, is skipped. */
+    prefs[5].frameInfo.dictID = 0x1234;
+    prefs[5].frameInfo.contentChecksumFlag = LZ4F_contentChecksumEnabled;
+
+    capacity = LZ4F_compressFrameBound(sizes[3], NULL) + 1024;
+    data = malloc(sizes[3]);
+    encoded = malloc(capacity);
+    decoded = malloc(sizes[3] + 1);
+    make_data(data, sizes[3], 0x12345678);
+
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        for (j = 0; j < sizeof(prefs) / sizeof(prefs[0]); j++) {
+            if (j == 4) {
+                prefs[4].frameInfo.contentSize = sizes[i];
+            }
+            encoded_size = LZ4F_compressFrame(encoded, capacity, data, sizes[i], &prefs[j]);
+            TEST_ASSERT(!LZ4F_isError(encoded_size));
+
+            for (k = 0; k < sizeof(chunks) / sizeof(chunks[0]); k++) {
+                decoded_size = sizes[i] + 1;
+                TEST_ASSERT(decode(encoded, encoded_size, decoded, &decoded_size,
+                                   LZ4DEC_WINDOW_SIZE_MAX, NULL,
+                                   chunks[k][0], chunks[k][1]) == 0);
+                TEST_ASSERT(decoded_size == sizes[i]);
+                TEST_ASSERT(memcmp(decoded, data, sizes[i]) == 0);
+            }
+        }
+    }
+
+    /* Incompressible data is stored in raw blocks. */
+    for (i = 0; i < sizes[3]; i++) {
+        data[i] = (uint8_t)prng();
+    }
+    encoded_size = LZ4F_compressFrame(encoded, capacity, data, sizes[3], NULL);
+    decoded_size = sizes[3];
+    TEST_ASSERT(decode(encoded, encoded_size, decoded, &decoded_size,
+                       LZ4DEC_WINDOW_SIZE_MAX, NULL, 1000, 1000) == 0);
+    TEST_ASSERT(decoded_size == sizes[3]);
+    TEST_ASSERT(memcmp(decoded, data, sizes[3]) == 0);
+
+    free(data);
+    free(encoded);
+    free(decoded);
+}
+
+static void test_small_window(void)
+{
+    uint8_t *data, *encoded, *decoded;
+    size_t size = 100000;
+    size_t capacity, encoded_size, decoded_size;
+
+    capacity = LZ4F_compressFrameBound(size, NULL);
+    data = malloc(size);
+    encoded = malloc(capacity);
+    decoded = malloc(size);
+
+    /* Far repeats only fit the largest window. */
+    make_data(data, size, 0x12345678);
+    memcpy(&data[60000], &data[1000], 2000);
+    encoded_size = LZ4F_compressFrame(encoded, capacity, data, size, NULL);
+
+    decoded_size = size;
+    TEST_ASSERT(decode(encoded, encoded_size, decoded, &decoded_size,
+                       4096, NULL, 100, 100) == LZ4DEC_ERROR_WINDOW);
+
+    /* Truncated frames never finish. */
+    decoded_size = size;
+    TEST_ASSERT(decode(encoded, encoded_size - 1, decoded, &decoded_size,
+                       LZ4DEC_WINDOW_SIZE_MAX, NULL, 100, 100) == STALLED);
+
+    free(data);
+    free(encoded);
+    free(decoded);
+}
+
+static void test_primed(void)
+{
+    static const size_t chunks[][2] = {
+        { 1, 1 }, { 7, 333 }, { SIZE_MAX, SIZE_MAX }
+    };
+    uint8_t *source, *target, *encoded, *decoded;
+    size_t encoded_size, decoded_size;
+    size_t i, k;
+
+    source = malloc(SOURCE_SIZE);
+    target = malloc(TARGET_SIZE);
+    encoded = malloc(2 * TARGET_SIZE);
+    decoded = malloc(TARGET_SIZE + 1);
+    make_data(source, SOURCE_SIZE, 0x12345678);
+
+    /* The source moved, with some changes. */
+    make_data(target, TARGET_SIZE, 0x87654321);
+    memcpy(target, &source[100], SOURCE_SIZE - 100);
+    for (i = 0; i < SOURCE_SIZE; i += 500) {
+        target[i] ^= 0x55;
+    }
+
+    encoded_size = make_frame(encoded, target, TARGET_SIZE, source, true);
+
+    for (k = 0; k < sizeof(chunks) / sizeof(chunks[0]); k++) {
+        decoded_size = TARGET_SIZE + 1;
+        TEST_ASSERT(decode(encoded, encoded_size, decoded, &decoded_size,
+                           LZ4DEC_WINDOW_SIZE_MAX, source,
+                           chunks[k][0], chunks[k][1]) == 0);
+        TEST_ASSERT(decoded_size == TARGET_SIZE);
+        TEST_ASSERT(memcmp(decoded, target, TARGET_SIZE) == 0);
+    }
+
+    /* The priming size must fit the window. */
+    decoded_size = TARGET_SIZE;
+    TEST_ASSERT(decode(encoded, encoded_size, decoded, &decoded_size,
+                       DICT_SIZE - 1, source, 100, 100) == LZ4DEC_ERROR_WINDOW);
+
+    /* Primed frames are not plain frames with a dictionary id. */
+    decoded_size = TARGET_SIZE + 1;
+    TEST_ASSERT(decode(encoded, encoded_size, decoded, &decoded_size,
+                       LZ4DEC_WINDOW_SIZE_MAX, NULL, 100, 100) != 0);
+
+    /* Plain frames are not primed frames. */
+    encoded_size = LZ4F_compressFrame(encoded, 2 * TARGET_SIZE, target, TARGET_SIZE, NULL);
+    decoded_size = TARGET_SIZE;
+    TEST_ASSERT(decode(encoded, encoded_size, decoded, &decoded_size,
+                       LZ4DEC_WINDOW_SIZE_MAX, source, 100, 100) == LZ4DEC_ERROR_DATA);
+
+    /* A plain frame matching into its dictionary fails, as the
+     * dictionary is unknown. */
+    encoded_size = make_frame(encoded, target, TARGET_SIZE, source, false);
+    decoded_size = TARGET_SIZE;
+    TEST_ASSERT(decode(encoded, encoded_size, decoded, &decoded_size,
+                       LZ4DEC_WINDOW_SIZE_MAX, NULL, 100, 100) == LZ4DEC_ERROR_DATA);
+
+    free(source);
+    free(target);
+    free(encoded);
+    free(decoded);
+}
+
+int main(void)
+{
+    test_frames();
+    test_small_window();
+    test_primed();
+
+    printf("%s: %d failures\n", __FILE__, failures);
+
+    return (failures != 0);
+}
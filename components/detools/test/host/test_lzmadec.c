@@ -0,0 +1,286 @@
+/*
+ * SPDX-FileCopyrightText: 2016 Intel Corporation
+ *                         2020 Thesis projects
+ *
+ * SPDX-License-Identifier: Apache 2.0 License
+ *
+ * SPDX-FileContributor: 2021 Laukik Hase
+ */
+
+/*
+ * Host tests of the LZMA decoder, against streams of the liblzma
+ * encoder, the one the Python lzma module creates patches with.
+ *
+ * gcc -Icomponents/detools/lzmadec components/detools/test/host/test_lzmadec.c
+ *     components/detools/lzmadec/lzmadec.c -llzma -o test_lzmadec
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <lzma.h>
+
+#include "lzmadec.h"
+
+#define STALLED (-3)
+
+#ifndef MIN
+#define MIN(x, y) (((x) < (y)) ? (x) : (y))
+#endif
+
+static int failures;
+
+#define TEST_ASSERT(cond) do {                                          \
+        if (!(cond)) {                                                  \
+            fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond);  \
+            failures++;                                                 \
+        }                                                               \
+    } while (0)
+
+typedef struct {
+    uint32_t preset;
+    int lc;                 /* -1 to keep the preset */
+    int lp;
+    int pb;
+    uint32_t dict_size;     /* Zero(0) to keep the preset */
+} options_t;
+
+static uint32_t prng_state;
+
+static uint32_t prng(void)
+{
+    prng_state ^= prng_state << 13;
+    prng_state ^= prng_state >> 17;
+    prng_state ^= prng_state << 5;
+
+    return prng_state;
+}
+
+/* Words, repeats near and far, and some noise. */
+static void make_data(uint8_t *buf, size_t size)
+{
+    static const char *words[] = { "delta ", "patch ", "flash ", "sector ", "image " };
+    size_t pos = 0;
+    size_t n, from;
+
+    prng_state = 0x12345678;
+
+    while (pos < size) {
+        switch (prng() % 4) {
+        case 0:
+            n = strlen(words[prng() % 5]);
+            memcpy(buf + pos, words[prng() % 5], MIN(n, size - pos));
+            break;
+        case 1:
+            n = prng() % 64 + 1;
+            for (from = 0; from < n && pos + from < size; from++) {
+                buf[pos + from] = (uint8_t)prng();
+            }
+            break;
+        default:
+            n = prng() % 200 + 2;
+            if (pos == 0) {
+                n = 0;
+                break;
+            }
+            from = prng() % pos;
+            for (size_t i = 0; i < n && pos + i < size; i++) {
+                buf[pos + i] = buf[from + i % (pos - from)];
+            }
+            break;
+        }
+        pos += MIN(n, size - pos);
+    }
+}
+
+static size_t encode(const uint8_t *in, size_t in_size, uint8_t *out, size_t out_size,
+                     const options_t *options)
+{
+    lzma_stream stream = LZMA_STREAM_INIT;
+    lzma_options_lzma lzma;
+    lzma_ret ret;
+
+    lzma_lzma_preset(&lzma, options->preset);
+    if (options->lc >= 0) {
+        lzma.lc = options->lc;
+        lzma.lp = options->lp;
+        lzma.pb = options->pb;
+    }
+    if (options->dict_size != 0) {
+        lzma.dict_size = options->dict_size;
+    }
+
+    if (lzma_alone_encoder(&stream, &lzma) != LZMA_OK) {
+        return 0;
+    }
+
+    stream.next_in = in;
+    stream.avail_in = in_size;
+    stream.next_out = out;
+    stream.avail_out = out_size;
+    ret = lzma_code(&stream, LZMA_FINISH);
+    lzma_end(&stream);
+
+    return ret == LZMA_STREAM_END ? out_size - stream.avail_out : 0;
+}
+
+/* Decodes given stream, fed and read in given chunk sizes. The
+ * buffer is limited to buf_size, if not zero(0). */
+static int decode(const uint8_t *in, size_t in_size, uint8_t *out, size_t *out_size,
+                  size_t in_chunk, size_t out_chunk, size_t buf_size)
+{
+    lzmadec_t dec;
+    lzmadec_res ret = LZMADEC_OK;
+    void *buf = NULL;
+    size_t in_pos = 0;
+    size_t out_pos = 0;
+    size_t n, m;
+    int idle = 0;
+    int res = 0;
+
+    lzmadec_init(&dec, in_size);
+
+    while (!lzmadec_finished(&dec)) {
+        n = MIN(in_chunk, in_size - in_pos);
+        ret = lzmadec_decode(&dec, in + in_pos, &n);
+        in_pos += n;
+
+        if (ret == LZMADEC_NEED_BUFFER) {
+            if (buf_size == 0) {
+                buf_size = lzmadec_memory_usage(&dec);
+            }
+            buf = malloc(buf_size);
+            ret = lzmadec_set_buffer(&dec, buf, buf_size);
+            if (ret != LZMADEC_OK) {
+                res = ret;
+                break;
+            }
+            continue;
+        }
+        if (ret < 0) {
+            res = ret;
+            break;
+        }
+
+        m = lzmadec_read(&dec, out + out_pos, MIN(out_chunk, *out_size - out_pos));
+        out_pos += m;
+
+        /* The last symbols may be decoded from earlier input. */
+        idle = (n == 0 && m == 0) ? idle + 1 : 0;
+
+        if (idle > 1) {
+            res = STALLED;
+            break;
+        }
+    }
+
+    free(buf);
+    *out_size = out_pos;
+
+    return res;
+}
+
+static void test_round_trips(void)
+{
+    static const size_t sizes[] = { 0, 1, 1000, 70000, 300000 };
+    static const options_t options[] = {
+        { 0, -1, 0, 0, 0 },
+        { 6, -1, 0, 0, 0 },
+        { 9 | LZMA_PRESET_EXTREME, -1, 0, 0, 0 },
+        { 6, 0, 2, 0, 0 },
+        { 6, 4, 0, 4, 0 },
+        { 6, 3, 0, 2, LZMADEC_DICT_SIZE_MIN },
+        { 1, 1, 1, 1, 40000 }
+    };
+    static const size_t chunks[][2] = {
+        { 1, 1 }, { 7, 333 }, { 4096, 4096 }, { SIZE_MAX, SIZE_MAX }
+    };
+    uint8_t *data, *encoded, *decoded;
+    size_t encoded_size, decoded_size;
+    size_t i, j, k;
+
+    data = malloc(sizes[4]);
+    encoded = malloc(2 * sizes[4] + 1024);
+    decoded = malloc(sizes[4] + 1);
+    make_data(data, sizes[4]);
+
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        for (j = 0; j < sizeof(options) / sizeof(options[0]); j++) {
+            encoded_size = encode(data, sizes[i], encoded, 2 * sizes[4] + 1024, &options[j]);
+            TEST_ASSERT(encoded_size > LZMADEC_HEADER_SIZE);
+
+            for (k = 0; k < sizeof(chunks) / sizeof(chunks[0]); k++) {
+                /* Byte by byte is slow and covered by the smaller sizes. */
+                if (sizes[i] > 70000 && chunks[k][0] == 1) {
+                    continue;
+                }
+
+                decoded_size = sizes[i] + 1;
+                TEST_ASSERT(decode(encoded, encoded_size, decoded, &decoded_size,
+                                   chunks[k][0], chunks[k][1], 0) == 0);
+                TEST_ASSERT(decoded_size == sizes[i]);
+                TEST_ASSERT(memcmp(decoded, data, sizes[i]) == 0);
+            }
+        }
+    }
+
+    free(data);
+    free(encoded);
+    free(decoded);
+}
+
+static void test_corrupt(void)
+{
+    static const options_t options = { 6, -1, 0, 0, 65536 };
+    uint8_t *data, *encoded, *decoded;
+    size_t size = 70000;
+    size_t encoded_size, decoded_size;
+    size_t i;
+    int res;
+
+    data = malloc(size);
+    encoded = malloc(2 * size);
+    decoded = malloc(size + 1);
+    make_data(data, size);
+    encoded_size = encode(data, size, encoded, 2 * size, &options);
+
+    /* Cut short. */
+    decoded_size = size + 1;
+    res = decode(encoded, encoded_size - 1, decoded, &decoded_size, 100, 100, 0);
+    TEST_ASSERT(res != 0);
+
+    /* A buffer too small for the dictionary of the stream. */
+    decoded_size = size + 1;
+    res = decode(encoded, encoded_size, decoded, &decoded_size, 100, 100, 4096);
+    TEST_ASSERT(res == LZMADEC_ERROR_MEMORY);
+
+    /* Invalid literal and position bits. */
+    encoded[0] = 225;
+    decoded_size = size + 1;
+    res = decode(encoded, encoded_size, decoded, &decoded_size, 100, 100, 0);
+    TEST_ASSERT(res == LZMADEC_ERROR_DATA);
+    encode(data, size, encoded, 2 * size, &options);
+
+    /* Flipped bits anywhere must not run out of bounds, and fail. */
+    for (i = LZMADEC_HEADER_SIZE; i < encoded_size; i += 97) {
+        encoded[i] ^= 0x10;
+        decoded_size = size + 1;
+        res = decode(encoded, encoded_size, decoded, &decoded_size, 61, 1000, 0);
+        TEST_ASSERT(res != 0 || decoded_size != size || memcmp(decoded, data, size) != 0);
+        encoded[i] ^= 0x10;
+    }
+
+    free(data);
+    free(encoded);
+    free(decoded);
+}
+
+int main(void)
+{
+    test_round_trips();
+    test_corrupt();
+
+    printf("%s: %d failures\n", __FILE__, failures);
+
+    return (failures != 0);
+}
@@ -125,6 +125,15 @@ void app_main(void)
     ESP_LOGI(TAG, "Initialising WiFi Connection...");
 
     ESP_ERROR_CHECK(nvs_flash_init());
+
+    /* Finish an update interrupted by a reset or power loss */
+    int err = delta_check_and_resume(NULL);
+    if (err < 0) {
+        ESP_LOGE(TAG, "Error: %s", delta_error_as_string(err));
+    } else if (err > 0) {
+        reboot();
+    }
+
     ESP_ERROR_CHECK(esp_netif_init());
     ESP_ERROR_CHECK(esp_event_loop_create_default());
 
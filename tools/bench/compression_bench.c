@@ -0,0 +1,350 @@
+/*
+ * SPDX-FileCopyrightText: 2016 Intel Corporation
+ *                         2020 Thesis projects
+ *
+ * SPDX-License-Identifier: Apache 2.0 License
+ *
+ * SPDX-FileContributor: 2021 Laukik Hase
+ */
+
+/*
+ * Compares the patch decompressors on the host: patch size, decoder
+ * RAM, decompression speed and whole patch apply speed.
+ *
+ * Usage: compression_bench <source> <target> <patch> [<patch> ...]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "detools.h"
+#include "heatshrink_decoder.h"
+#include "lzmadec.h"
+#include "lz4dec.h"
+
+#define COMPRESSION_LZMA        (1)
+#define COMPRESSION_HEATSHRINK  (4)
+#define COMPRESSION_LZ4         (6)
+
+/* Largest dictionary the benchmark decodes with. */
+#define LZMA_BUFFER_SIZE        (2 * 1024 * 1024)
+
+#define MIN_RUN_TIME            (0.5)
+
+typedef struct {
+    uint8_t *buf_p;
+    size_t size;
+} blob_t;
+
+typedef struct {
+    const blob_t *source;
+    size_t source_offset;
+    uint8_t *target_p;
+    size_t target_offset;
+} ram_io_t;
+
+static uint8_t lzma_buffer[LZMA_BUFFER_SIZE];
+static uint8_t lz4_window[LZ4DEC_WINDOW_SIZE_MAX];
+static uint8_t output[4096];
+
+static int read_file(const char *path_p, blob_t *blob)
+{
+    FILE *file_p = fopen(path_p, "rb");
+    long size;
+
+    if (file_p == NULL) {
+        return -1;
+    }
+
+    fseek(file_p, 0, SEEK_END);
+    size = ftell(file_p);
+    fseek(file_p, 0, SEEK_SET);
+    blob->size = (size_t)size;
+    blob->buf_p = malloc(blob->size);
+
+    if ((blob->buf_p == NULL) || (fread(blob->buf_p, 1, blob->size, file_p) != blob->size)) {
+        fclose(file_p);
+        return -1;
+    }
+
+    fclose(file_p);
+
+    return 0;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Compression and offset of the compressed data. */
+static int patch_header(const blob_t *patch, int *compression_p, size_t *offset_p)
+{
+    size_t offset = 1;
+
+    if (patch->size < 2) {
+        return -1;
+    }
+
+    *compression_p = patch->buf_p[0] & 0xf;
+
+    /* Target size */
+    if (patch->buf_p[offset++] & 0x80) {
+        while ((offset < patch->size) && (patch->buf_p[offset++] & 0x80)) {
+        }
+    }
+
+    *offset_p = offset;
+
+    return 0;
+}
+
+static size_t decode_heatshrink(const uint8_t *in_p, size_t size)
+{
+    static heatshrink_decoder decoder;
+    size_t decoded = 0;
+    size_t count;
+    size_t pos = 1;     /* Window and lookahead byte */
+    HSD_poll_res pres;
+
+    heatshrink_decoder_reset(&decoder);
+
+    while (pos < size) {
+        heatshrink_decoder_sink(&decoder, (uint8_t *)&in_p[pos], size - pos, &count);
+        pos += count;
+
+        do {
+            pres = heatshrink_decoder_poll(&decoder, output, sizeof(output), &count);
+            decoded += count;
+        } while (pres == HSDR_POLL_MORE);
+    }
+
+    while (heatshrink_decoder_finish(&decoder) == HSDR_FINISH_MORE) {
+        heatshrink_decoder_poll(&decoder, output, sizeof(output), &count);
+        decoded += count;
+    }
+
+    return decoded;
+}
+
+static size_t decode_lzma(const uint8_t *in_p, size_t size, size_t *ram_p)
+{
+    static lzmadec_t decoder;
+    size_t decoded = 0;
+    size_t pos = 0;
+    size_t count;
+    lzmadec_res res;
+
+    lzmadec_init(&decoder, size);
+
+    do {
+        count = size - pos;
+        res = lzmadec_decode(&decoder, &in_p[pos], &count);
+        pos += count;
+
+        if (res == LZMADEC_NEED_BUFFER) {
+            *ram_p = lzmadec_memory_usage(&decoder);
+
+            if (lzmadec_set_buffer(&decoder, lzma_buffer, *ram_p) != LZMADEC_OK) {
+                return 0;
+            }
+        } else if (res < 0) {
+            return 0;
+        }
+
+        do {
+            count = lzmadec_read(&decoder, output, sizeof(output));
+            decoded += count;
+        } while (count > 0);
+    } while (!lzmadec_finished(&decoder));
+
+    return decoded;
+}
+
+static size_t decode_lz4(const uint8_t *in_p, size_t size)
+{
+    static lz4dec_t decoder;
+    size_t decoded = 0;
+    size_t pos = 0;
+    size_t in_size;
+    size_t count;
+    lz4dec_res res;
+
+    lz4dec_init(&decoder, lz4_window, sizeof(lz4_window));
+
+    do {
+        in_size = size - pos;
+        count = sizeof(output);
+        res = lz4dec_decode(&decoder, &in_p[pos], &in_size, output, &count);
+        pos += in_size;
+        decoded += count;
+    } while ((res == LZ4DEC_OK) && ((in_size > 0) || (count > 0)));
+
+    return res == LZ4DEC_END ? decoded : 0;
+}
+
+static int ram_read(void *arg_p, uint8_t *buf_p, size_t size)
+{
+    ram_io_t *io = arg_p;
+
+    if (io->source_offset + size > io->source->size) {
+        return -1;
+    }
+
+    memcpy(buf_p, &io->source->buf_p[io->source_offset], size);
+    io->source_offset += size;
+
+    return 0;
+}
+
+static int ram_seek(void *arg_p, int offset)
+{
+    ((ram_io_t *)arg_p)->source_offset += offset;
+
+    return 0;
+}
+
+static int ram_write(void *arg_p, const uint8_t *buf_p, size_t size)
+{
+    ram_io_t *io = arg_p;
+
+    memcpy(&io->target_p[io->target_offset], buf_p, size);
+    io->target_offset += size;
+
+    return 0;
+}
+
+static int apply(const blob_t *source, const blob_t *patch, uint8_t *target_p)
+{
+    struct detools_apply_patch_t apply_patch;
+    ram_io_t io = { source, 0, target_p, 0 };
+    size_t offset;
+    size_t size;
+    int res;
+
+    detools_apply_patch_init(&apply_patch, ram_read, ram_seek, patch->size, ram_write, &io);
+    detools_apply_patch_set_lzma_memory(&apply_patch, lzma_buffer, sizeof(lzma_buffer), UINT64_MAX);
+    detools_apply_patch_set_lz4_window(&apply_patch, lz4_window, sizeof(lz4_window));
+
+    for (offset = 0, res = 0; (offset < patch->size) && (res >= 0); offset += size) {
+        size = patch->size - offset < 512 ? patch->size - offset : 512;
+        res = detools_apply_patch_process(&apply_patch, &patch->buf_p[offset], size);
+    }
+
+    if (res < 0) {
+        detools_apply_patch_finalize(&apply_patch);
+        return res;
+    }
+
+    return detools_apply_patch_finalize(&apply_patch);
+}
+
+static void bench(const char *path_p, const blob_t *source, const blob_t *target, uint8_t *out_p)
+{
+    blob_t patch;
+    int compression;
+    size_t offset;
+    size_t decoded = 0;
+    size_t ram = 0;
+    double start;
+    double decode_time;
+    double apply_time;
+    int runs;
+
+    if ((read_file(path_p, &patch) != 0) || (patch_header(&patch, &compression, &offset) != 0)) {
+        fprintf(stderr, "%s: cannot read patch\n", path_p);
+        return;
+    }
+
+    start = now();
+    runs = 0;
+
+    do {
+        if (compression == COMPRESSION_HEATSHRINK) {
+            decoded = decode_heatshrink(&patch.buf_p[offset], patch.size - offset);
+            ram = sizeof(heatshrink_decoder);
+        } else if (compression == COMPRESSION_LZMA) {
+            decoded = decode_lzma(&patch.buf_p[offset], patch.size - offset, &ram);
+        } else if (compression == COMPRESSION_LZ4) {
+            decoded = decode_lz4(&patch.buf_p[offset], patch.size - offset);
+            ram = sizeof(lz4dec_t) + sizeof(lz4_window);
+        } else {
+            fprintf(stderr, "%s: compression %d not benchmarked\n", path_p, compression);
+            free(patch.buf_p);
+            return;
+        }
+
+        runs++;
+    } while (now() - start < MIN_RUN_TIME);
+
+    decode_time = (now() - start) / runs;
+
+    start = now();
+    runs = 0;
+
+    do {
+        if (apply(source, &patch, out_p) != (int)target->size) {
+            fprintf(stderr, "%s: apply failed\n", path_p);
+            free(patch.buf_p);
+            return;
+        }
+
+        runs++;
+    } while (now() - start < MIN_RUN_TIME);
+
+    apply_time = (now() - start) / runs;
+
+    printf("| %-24s | %8zu | %6.2f%% | %8zu | %10.1f | %10.1f | %s |\n",
+           path_p,
+           patch.size,
+           100.0 * patch.size / target->size,
+           ram,
+           decoded / decode_time / 1e6,
+           target->size / apply_time / 1e6,
+           memcmp(out_p, target->buf_p, target->size) == 0 ? "ok" : "MISMATCH");
+
+    free(patch.buf_p);
+}
+
+int main(int argc, const char *argv[])
+{
+    blob_t source;
+    blob_t target;
+    uint8_t *out_p;
+    int i;
+
+    if (argc < 4) {
+        fprintf(stderr, "Usage: %s <source> <target> <patch> [<patch> ...]\n", argv[0]);
+        return 1;
+    }
+
+    if ((read_file(argv[1], &source) != 0) || (read_file(argv[2], &target) != 0)) {
+        fprintf(stderr, "Cannot read images\n");
+        return 1;
+    }
+
+    out_p = malloc(target.size);
+
+    if (out_p == NULL) {
+        return 1;
+    }
+
+    printf("| %-24s | %8s | %7s | %8s | %10s | %10s | %s |\n",
+           "Patch", "Size", "Ratio", "RAM", "Decode MB/s", "Apply MB/s", "Check");
+
+    for (i = 3; i < argc; i++) {
+        bench(argv[i], &source, &target, out_p);
+    }
+
+    free(out_p);
+    free(source.buf_p);
+    free(target.buf_p);
+
+    return 0;
+}
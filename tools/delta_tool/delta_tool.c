@@ -0,0 +1,460 @@
+/*
+ * SPDX-FileCopyrightText: 2016 Intel Corporation
+ *                         2020 Thesis projects
+ *
+ * SPDX-License-Identifier: Apache 2.0 License
+ *
+ * SPDX-FileContributor: 2021 Laukik Hase
+ */
+
+/*
+ * Host side patch tool, on top of the detools C engine.
+ *
+ * Usage: delta_tool apply <from> <patch> <to> [<sha256>]
+ *        delta_tool apply -l <list>
+ *        delta_tool validate [-j <threads>] <list>
+ *        delta_tool diff [-c none|heatshrink] [-j <threads>] [-m <MiB>] [-i <index>] <from> <to> <patch>
+ *        delta_tool index [-m <MiB>] <from> <index>
+ *
+ * An apply list has one "<from> <patch> <to> <sha256>" line per version
+ * pair, with "-" as to to only verify the output. Consecutive lines
+ * with the same from share its mapping.
+ *
+ * A validate list has one "<from> <patch> [<sha256>]" line per pair.
+ * The pairs are applied in parallel without writing the output, and
+ * the output hash, time and peak heap of each is printed.
+ *
+ * Diff creates a sequential patch, Heatshrink compressed by default.
+ * With -m, the source is indexed by a rolling hash table in at most
+ * given MiB of memory instead of by a suffix array.
+ *
+ * Index writes either index of a source to a file once, for diff -i to
+ * map instead of building it. The index must be of the same source.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "detools.h"
+#include "delta_tool.h"
+
+#define LIST_PATH_MAX   (1024)
+
+static void usage(void)
+{
+    fprintf(stderr,
+            "Usage: delta_tool apply <from> <patch> <to> [<sha256>]\n"
+            "       delta_tool apply -l <list>\n"
+            "       delta_tool validate [-j <threads>] <list>\n"
+            "       delta_tool diff [-c none|heatshrink] [-j <threads>] [-m <MiB>] [-i <index>] <from> <to> <patch>\n"
+            "       delta_tool index [-m <MiB>] <from> <index>\n");
+}
+
+static void print_result(const char *patch_path,
+                         const delta_tool_apply_result_t *result,
+                         bool verify)
+{
+    char hex[2 * DELTA_TOOL_SHA256_SIZE + 1];
+
+    delta_tool_format_sha256(result->sha256, hex);
+    printf("%s %s %u B %.1f ms %.1f MB/s %s\n",
+           !verify ? "DONE" : result->matched ? "OK" : "MISMATCH",
+           patch_path,
+           (unsigned)result->to_size,
+           result->seconds * 1e3,
+           result->to_size / result->seconds / 1e6,
+           hex);
+}
+
+/* Applies one pair, the source already mapped. */
+static int apply_pair(const delta_tool_map_t *from,
+                      const char *patch_path,
+                      const char *to_path,
+                      const char *hex)
+{
+    delta_tool_map_t patch;
+    delta_tool_apply_result_t result;
+    uint8_t sha256[DELTA_TOOL_SHA256_SIZE];
+    int ret;
+
+    if (hex != NULL && delta_tool_parse_sha256(hex, sha256) != 0) {
+        fprintf(stderr, "FAIL %s: bad SHA-256 '%s'\n", patch_path, hex);
+        return -1;
+    }
+
+    ret = delta_tool_map(&patch, patch_path);
+    if (ret != 0) {
+        fprintf(stderr, "FAIL %s: %s\n", patch_path, detools_error_as_string(ret));
+        return -1;
+    }
+
+    ret = delta_tool_apply(from, &patch, to_path, hex != NULL ? sha256 : NULL, &result);
+    delta_tool_unmap(&patch);
+
+    if (ret < 0) {
+        fprintf(stderr, "FAIL %s: %s\n", patch_path, detools_error_as_string(ret));
+        return -1;
+    }
+    print_result(patch_path, &result, hex != NULL);
+
+    return (hex == NULL || result.matched) ? 0 : -1;
+}
+
+static int apply_list(const char *list_path)
+{
+    char from_path[LIST_PATH_MAX];
+    char mapped_path[LIST_PATH_MAX] = "";
+    char patch_path[LIST_PATH_MAX];
+    char to_path[LIST_PATH_MAX];
+    char hex[LIST_PATH_MAX];
+    char line[4 * LIST_PATH_MAX];
+    delta_tool_map_t from = { NULL, 0 };
+    unsigned int pairs = 0;
+    unsigned int failed = 0;
+    FILE *list;
+
+    list = fopen(list_path, "r");
+    if (list == NULL) {
+        fprintf(stderr, "Cannot open %s\n", list_path);
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), list) != NULL) {
+        if (line[0] == '#' || line[0] == '\n') {
+            continue;
+        }
+        if (sscanf(line, "%1023s %1023s %1023s %1023s", from_path, patch_path, to_path, hex) != 4) {
+            fprintf(stderr, "Bad line: %s", line);
+            failed++;
+            continue;
+        }
+        pairs++;
+
+        if (strcmp(from_path, mapped_path) != 0) {
+            delta_tool_unmap(&from);
+            mapped_path[0] = '\0';
+            if (delta_tool_map(&from, from_path) != 0) {
+                fprintf(stderr, "FAIL %s: cannot map %s\n", patch_path, from_path);
+                failed++;
+                continue;
+            }
+            strcpy(mapped_path, from_path);
+        }
+
+        if (apply_pair(&from, patch_path, strcmp(to_path, "-") != 0 ? to_path : NULL, hex) != 0) {
+            failed++;
+        }
+    }
+
+    delta_tool_unmap(&from);
+    fclose(list);
+    printf("%u pairs, %u failed\n", pairs, failed);
+
+    return failed == 0 ? 0 : -1;
+}
+
+static int cmd_apply(int argc, char *argv[])
+{
+    delta_tool_map_t from;
+    int ret;
+
+    if (argc == 3 && strcmp(argv[1], "-l") == 0) {
+        return apply_list(argv[2]);
+    }
+
+    if (argc != 4 && argc != 5) {
+        usage();
+        return -1;
+    }
+
+    if (delta_tool_map(&from, argv[1]) != 0) {
+        fprintf(stderr, "Cannot map %s\n", argv[1]);
+        return -1;
+    }
+    ret = apply_pair(&from, argv[2], argv[3], argc == 5 ? argv[4] : NULL);
+    delta_tool_unmap(&from);
+
+    return ret;
+}
+
+static void print_job(const delta_tool_job_t *job)
+{
+    char hex[2 * DELTA_TOOL_SHA256_SIZE + 1];
+
+    if (job->ret < 0) {
+        printf("FAIL %s %s: %s\n", job->from_path, job->patch_path,
+               detools_error_as_string(job->ret));
+        return;
+    }
+
+    delta_tool_format_sha256(job->output_sha256, hex);
+    printf("%s %s %s %d B %.1f ms %u B heap %s\n",
+           !job->has_sha256 ? "DONE" : job->matched ? "OK" : "MISMATCH",
+           job->from_path,
+           job->patch_path,
+           job->ret,
+           job->seconds * 1e3,
+           (unsigned)job->peak_memory,
+           hex);
+}
+
+static int cmd_validate(int argc, char *argv[])
+{
+    delta_tool_map_t map;
+    delta_tool_job_t *jobs;
+    char *text;
+    char *line;
+    char *save;
+    char *sha256;
+    size_t count = 0;
+    size_t i;
+    unsigned int failed = 0;
+    int workers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    int ret;
+
+    if (argc == 4 && strcmp(argv[1], "-j") == 0) {
+        workers = atoi(argv[2]);
+        argv += 2;
+        argc -= 2;
+    }
+
+    if (argc != 2) {
+        usage();
+        return -1;
+    }
+
+    if (delta_tool_map(&map, argv[1]) != 0) {
+        fprintf(stderr, "Cannot map %s\n", argv[1]);
+        return -1;
+    }
+
+    /* Jobs point into a copy of the list. */
+    text = malloc(map.size + 1);
+    jobs = malloc((map.size / 2 + 1) * sizeof(*jobs));
+    if (text == NULL || jobs == NULL) {
+        delta_tool_unmap(&map);
+        free(text);
+        free(jobs);
+        return -1;
+    }
+    memcpy(text, map.buf, map.size);
+    text[map.size] = '\0';
+    delta_tool_unmap(&map);
+
+    for (line = strtok_r(text, "\n", &save); line != NULL; line = strtok_r(NULL, "\n", &save)) {
+        if (line[0] == '#') {
+            continue;
+        }
+        memset(&jobs[count], 0, sizeof(jobs[count]));
+        jobs[count].from_path = strtok(line, " \t");
+        jobs[count].patch_path = strtok(NULL, " \t");
+        sha256 = strtok(NULL, " \t");
+        if (jobs[count].patch_path == NULL) {
+            continue;
+        }
+        if (sha256 != NULL) {
+            if (delta_tool_parse_sha256(sha256, jobs[count].sha256) != 0) {
+                fprintf(stderr, "Bad SHA-256 '%s'\n", sha256);
+                failed++;
+                continue;
+            }
+            jobs[count].has_sha256 = true;
+        }
+        count++;
+    }
+
+    ret = delta_tool_validate(jobs, count, workers);
+    if (ret != 0) {
+        fprintf(stderr, "Validation failed: %s\n", detools_error_as_string(ret));
+    } else {
+        for (i = 0; i < count; i++) {
+            print_job(&jobs[i]);
+            if (jobs[i].ret < 0 || (jobs[i].has_sha256 && !jobs[i].matched)) {
+                failed++;
+            }
+        }
+        printf("%u pairs, %u failed\n", (unsigned)count, failed);
+    }
+
+    free(jobs);
+    free(text);
+
+    return (ret == 0 && failed == 0) ? 0 : -1;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int write_file(const char *path, const delta_tool_buffer_t *buffer)
+{
+    FILE *file_p = fopen(path, "wb");
+    int ret = 0;
+
+    if (file_p == NULL) {
+        return -1;
+    }
+    if (buffer->size > 0 && fwrite(buffer->buf, buffer->size, 1, file_p) != 1) {
+        ret = -1;
+    }
+    if (fclose(file_p) != 0) {
+        ret = -1;
+    }
+
+    return ret;
+}
+
+static int cmd_diff(int argc, char *argv[])
+{
+    delta_tool_diff_opts_t opts = {
+        .compression = DELTA_TOOL_COMPRESSION_HEATSHRINK,
+        .workers = (int)sysconf(_SC_NPROCESSORS_ONLN),
+    };
+    delta_tool_map_t from = { NULL, 0 };
+    delta_tool_map_t to = { NULL, 0 };
+    delta_tool_buffer_t patch = { NULL, 0, 0 };
+    delta_tool_index_t index;
+    const char *index_path = NULL;
+    double start;
+    int ret = -1;
+    int i;
+
+    for (i = 1; i + 1 < argc && argv[i][0] == '-'; i += 2) {
+        if (strcmp(argv[i], "-c") == 0 && strcmp(argv[i + 1], "none") == 0) {
+            opts.compression = DELTA_TOOL_COMPRESSION_NONE;
+        } else if (strcmp(argv[i], "-c") == 0 && strcmp(argv[i + 1], "heatshrink") == 0) {
+            opts.compression = DELTA_TOOL_COMPRESSION_HEATSHRINK;
+        } else if (strcmp(argv[i], "-j") == 0) {
+            opts.workers = atoi(argv[i + 1]);
+        } else if (strcmp(argv[i], "-m") == 0) {
+            opts.memory = (size_t)atoi(argv[i + 1]) << 20;
+        } else if (strcmp(argv[i], "-i") == 0) {
+            index_path = argv[i + 1];
+        } else {
+            break;
+        }
+    }
+
+    if (argc - i != 3) {
+        usage();
+        return -1;
+    }
+
+#if DETOOLS_CONFIG_COMPRESSION_NONE != 1
+    /* Patches this build cannot apply would only fail later. */
+    if (opts.compression == DELTA_TOOL_COMPRESSION_NONE) {
+        fprintf(stderr, "Uncompressed patches need -DDETOOLS_CONFIG_COMPRESSION_NONE=1\n");
+        return -1;
+    }
+#endif
+
+    if (delta_tool_map(&from, argv[i]) != 0 || delta_tool_map(&to, argv[i + 1]) != 0) {
+        fprintf(stderr, "Cannot map %s or %s\n", argv[i], argv[i + 1]);
+        goto out;
+    }
+
+    start = now();
+
+    if (index_path != NULL) {
+        ret = delta_tool_index_map(&index, index_path);
+        if (ret != 0) {
+            fprintf(stderr, "Cannot map index %s: %s\n", index_path, detools_error_as_string(ret));
+            goto out;
+        }
+        if (!delta_tool_index_matches(&index, &from)) {
+            fprintf(stderr, "Index %s is not of %s\n", index_path, argv[i]);
+            ret = -1;
+            goto out;
+        }
+        opts.index = &index;
+    }
+
+    ret = delta_tool_diff(&from, &to, &opts, &patch);
+    if (ret != 0) {
+        fprintf(stderr, "Diff failed: %s\n", detools_error_as_string(ret));
+        goto out;
+    }
+    printf("%s: %u B -> %u B patch, %.1f ms\n",
+           argv[i + 2], (unsigned)to.size, (unsigned)patch.size, (now() - start) * 1e3);
+
+    ret = write_file(argv[i + 2], &patch);
+    if (ret != 0) {
+        fprintf(stderr, "Cannot write %s\n", argv[i + 2]);
+    }
+
+out:
+    if (index_path != NULL) {
+        delta_tool_index_unmap(&index);
+    }
+    delta_tool_buffer_free(&patch);
+    delta_tool_unmap(&to);
+    delta_tool_unmap(&from);
+
+    return ret;
+}
+
+static int cmd_index(int argc, char *argv[])
+{
+    delta_tool_map_t from;
+    size_t memory = 0;
+    double start;
+    int ret;
+
+    if (argc == 5 && strcmp(argv[1], "-m") == 0) {
+        memory = (size_t)atoi(argv[2]) << 20;
+        argv += 2;
+        argc -= 2;
+    }
+
+    if (argc != 3) {
+        usage();
+        return -1;
+    }
+
+    if (delta_tool_map(&from, argv[1]) != 0) {
+        fprintf(stderr, "Cannot map %s\n", argv[1]);
+        return -1;
+    }
+
+    start = now();
+    ret = delta_tool_index_create(&from, memory, argv[2]);
+    if (ret != 0) {
+        fprintf(stderr, "Index failed: %s\n", detools_error_as_string(ret));
+    } else {
+        printf("%s: %u B indexed, %.1f ms\n", argv[2], (unsigned)from.size, (now() - start) * 1e3);
+    }
+    delta_tool_unmap(&from);
+
+    return ret;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc >= 2 && strcmp(argv[1], "apply") == 0) {
+        return cmd_apply(argc - 1, &argv[1]) == 0 ? 0 : 1;
+    }
+
+    if (argc >= 2 && strcmp(argv[1], "validate") == 0) {
+        return cmd_validate(argc - 1, &argv[1]) == 0 ? 0 : 1;
+    }
+
+    if (argc >= 2 && strcmp(argv[1], "diff") == 0) {
+        return cmd_diff(argc - 1, &argv[1]) == 0 ? 0 : 1;
+    }
+
+    if (argc >= 2 && strcmp(argv[1], "index") == 0) {
+        return cmd_index(argc - 1, &argv[1]) == 0 ? 0 : 1;
+    }
+
+    usage();
+
+    return 1;
+}
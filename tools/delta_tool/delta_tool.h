@@ -0,0 +1,239 @@
+/*
+ * SPDX-FileCopyrightText: 2016 Intel Corporation
+ *                         2020 Thesis projects
+ *
+ * SPDX-License-Identifier: Apache 2.0 License
+ *
+ * SPDX-FileContributor: 2021 Laukik Hase
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define DELTA_TOOL_SHA256_SIZE  (32)
+
+/* detools compressions the generator emits. */
+#define DELTA_TOOL_COMPRESSION_NONE         (0)
+#define DELTA_TOOL_COMPRESSION_HEATSHRINK   (4)
+
+/* The Heatshrink configuration the device decodes with. */
+#define DELTA_TOOL_HEATSHRINK_WINDOW_BITS     (8)
+#define DELTA_TOOL_HEATSHRINK_LOOKAHEAD_BITS  (7)
+#define DELTA_TOOL_HEATSHRINK_WINDOW_SIZE     (1 << DELTA_TOOL_HEATSHRINK_WINDOW_BITS)
+
+/* A file mapped read-only into memory. */
+typedef struct {
+    const uint8_t *buf;
+    size_t size;
+} delta_tool_map_t;
+
+typedef struct {
+    size_t to_size;
+    uint8_t sha256[DELTA_TOOL_SHA256_SIZE];
+    bool matched;           /* Output matches the expected SHA-256 */
+    double seconds;
+} delta_tool_apply_result_t;
+
+/* A growing output buffer. */
+typedef struct {
+    uint8_t *buf;
+    size_t size;
+    size_t capacity;
+} delta_tool_buffer_t;
+
+/* A source block in a rolling hash table. */
+typedef struct {
+    uint32_t hash;
+    uint32_t block;         /* Block number + 1, or zero if empty */
+} delta_tool_hash_entry_t;
+
+/* Rolling hash table of the aligned blocks of a source. */
+typedef struct {
+    const delta_tool_hash_entry_t *entries;
+    int bits;               /* Of the table size */
+    uint32_t block_size;
+} delta_tool_hash_table_t;
+
+/* An index file of a source, mapped. */
+typedef struct {
+    delta_tool_map_t map;
+    uint8_t sha256[DELTA_TOOL_SHA256_SIZE];
+    size_t image_size;
+    const int32_t *sa;      /* Suffix array, or NULL */
+    delta_tool_hash_table_t table;  /* No entries if none */
+} delta_tool_index_t;
+
+typedef struct {
+    int compression;        /* DELTA_TOOL_COMPRESSION_* */
+    int workers;            /* Matching threads */
+    size_t memory;          /* Rolling hash index budget, or zero for a
+                             * suffix array */
+    const delta_tool_index_t *index;    /* Of the source, or NULL */
+} delta_tool_diff_opts_t;
+
+/* Streaming Heatshrink encoder. */
+typedef struct {
+    delta_tool_buffer_t *out;
+    uint8_t buf[65536];     /* Window and input not yet encoded */
+    int64_t base;           /* Input position of buf[0] */
+    int64_t pos;            /* Next input position to encode */
+    int64_t end;
+    int64_t *head;          /* Last position per hash */
+    int64_t prev[DELTA_TOOL_HEATSHRINK_WINDOW_SIZE];
+    uint8_t byte;
+    int bits;
+} delta_tool_heatshrink_t;
+
+/* A (base, patch) pair to validate, and its result. */
+typedef struct {
+    const char *from_path;
+    const char *patch_path;
+    uint8_t sha256[DELTA_TOOL_SHA256_SIZE];
+    bool has_sha256;
+    int ret;                /* Output size or negative detools error code */
+    uint8_t output_sha256[DELTA_TOOL_SHA256_SIZE];
+    bool matched;
+    double seconds;
+    size_t peak_memory;     /* Heap the session allocated at most */
+} delta_tool_job_t;
+
+/**
+ * Maps given file read-only. An empty file maps to NULL.
+ *
+ * @return zero(0) or negative detools error code.
+ */
+int delta_tool_map(delta_tool_map_t *map, const char *path);
+
+void delta_tool_unmap(delta_tool_map_t *map);
+
+/**
+ * Applies given sequential patch to given source. The output is
+ * hashed, and written to to_path if not NULL, on a second thread
+ * while the patch is applied.
+ *
+ * @param[in] sha256 Expected SHA-256 of the output, or NULL.
+ *
+ * @return Size of the output or negative detools error code. A
+ *         SHA-256 mismatch is only reported in the result.
+ */
+int delta_tool_apply(const delta_tool_map_t *from,
+                     const delta_tool_map_t *patch,
+                     const char *to_path,
+                     const uint8_t *sha256,
+                     delta_tool_apply_result_t *result);
+
+/**
+ * Parses given 64 hex digits.
+ *
+ * @return zero(0) or -1 if not a SHA-256.
+ */
+int delta_tool_parse_sha256(const char *hex, uint8_t *sha256);
+
+void delta_tool_format_sha256(const uint8_t *sha256, char *hex);
+
+/**
+ * Applies the patch of every job to its base with given number of
+ * worker threads, and fills in the results. Each distinct base is
+ * mapped once. Needs the link time malloc() wrapping of
+ * delta_tool_validate.c.
+ *
+ * @return zero(0) or negative detools error code if the jobs could not
+ *         be run. Failed jobs are only reported in their results.
+ */
+int delta_tool_validate(delta_tool_job_t *jobs, size_t count, int workers);
+
+/**
+ * Builds the suffix array of given buffer, size + 1 entries with the
+ * empty suffix first.
+ *
+ * @return zero(0) or negative detools error code.
+ */
+int delta_tool_suffix_array(const uint8_t *buf, size_t size, int32_t *sa);
+
+/**
+ * Creates a sequential detools patch from given source to given
+ * target, bsdiff style on a suffix array of the source. With a memory
+ * budget in opts, matches are instead looked up in a rolling hash
+ * index of source blocks that fits the budget, and the patch is
+ * created in one pass over the target. With an index of the source in
+ * opts, its suffix array or hash table is used instead of building
+ * one, and the memory budget is ignored.
+ *
+ * @return zero(0) or negative detools error code.
+ */
+int delta_tool_diff(const delta_tool_map_t *from,
+                    const delta_tool_map_t *to,
+                    const delta_tool_diff_opts_t *opts,
+                    delta_tool_buffer_t *patch);
+
+/**
+ * Builds the rolling hash table of given source, with the smallest
+ * blocks for which it fits given memory.
+ *
+ * @return zero(0) or negative detools error code.
+ */
+int delta_tool_hash_table_build(delta_tool_hash_table_t *table,
+                                const delta_tool_map_t *from,
+                                size_t memory);
+
+void delta_tool_hash_table_free(delta_tool_hash_table_t *table);
+
+/**
+ * Writes an index file of given source: its rolling hash table sized to
+ * given memory, or its suffix array if memory is zero, after a header
+ * with the size and SHA-256 of the source.
+ *
+ * @return zero(0) or negative detools error code.
+ */
+int delta_tool_index_create(const delta_tool_map_t *from, size_t memory, const char *path);
+
+/**
+ * Maps given index file.
+ *
+ * @return zero(0) or negative detools error code, -DETOOLS_SHORT_HEADER
+ *         if it is not an index file of this version.
+ */
+int delta_tool_index_map(delta_tool_index_t *index, const char *path);
+
+void delta_tool_index_unmap(delta_tool_index_t *index);
+
+/**
+ * Checks that given index is of given source, by its size and SHA-256.
+ */
+bool delta_tool_index_matches(const delta_tool_index_t *index, const delta_tool_map_t *from);
+
+/**
+ * Appends to given buffer.
+ *
+ * @return zero(0) or negative detools error code.
+ */
+int delta_tool_buffer_append(delta_tool_buffer_t *buffer, const void *buf, size_t size);
+
+void delta_tool_buffer_free(delta_tool_buffer_t *buffer);
+
+/**
+ * Initializes a Heatshrink encoder, window and lookahead sizes
+ * DELTA_TOOL_HEATSHRINK_*_BITS, appending its output to given buffer.
+ *
+ * @return zero(0) or negative detools error code.
+ */
+int delta_tool_heatshrink_init(delta_tool_heatshrink_t *self, delta_tool_buffer_t *out);
+
+/**
+ * Compresses given data, keeping at most a lookahead of it buffered.
+ *
+ * @return zero(0) or negative detools error code.
+ */
+int delta_tool_heatshrink_write(delta_tool_heatshrink_t *self, const uint8_t *buf, size_t size);
+
+/**
+ * Compresses the buffered data and pads the output to a whole byte.
+ *
+ * @return zero(0) or negative detools error code.
+ */
+int delta_tool_heatshrink_finish(delta_tool_heatshrink_t *self);
+
+void delta_tool_heatshrink_destroy(delta_tool_heatshrink_t *self);
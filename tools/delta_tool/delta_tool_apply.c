@@ -0,0 +1,354 @@
+/*
+ * SPDX-FileCopyrightText: 2016 Intel Corporation
+ *                         2020 Thesis projects
+ *
+ * SPDX-License-Identifier: Apache 2.0 License
+ *
+ * SPDX-FileContributor: 2021 Laukik Hase
+ */
+
+/*
+ * Host apply of sequential patches. The source and the patch are
+ * mapped, and the patch is handed to detools in one go. The output is
+ * collected in large blocks, which a second thread hashes and writes
+ * while the next blocks are applied.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "mbedtls/version.h"
+#include "mbedtls/sha256.h"
+
+#include "detools.h"
+#include "delta_tool.h"
+
+#if MBEDTLS_VERSION_NUMBER >= 0x03000000
+#define mbedtls_sha256_starts_ret mbedtls_sha256_starts
+#define mbedtls_sha256_update_ret mbedtls_sha256_update
+#define mbedtls_sha256_finish_ret mbedtls_sha256_finish
+#endif
+
+/* Output blocks in flight between the apply and the hash thread */
+#define APPLY_BLOCK_SIZE    (1024 * 1024)
+#define APPLY_BLOCKS        (4)
+
+typedef struct {
+    const delta_tool_map_t *from;
+    size_t from_offset;
+    int fd;
+    uint8_t *blocks;
+    size_t sizes[APPLY_BLOCKS];
+    /* Blocks tail to head - 1 are queued for the hash thread, block
+     * head is being filled. Both only count up. */
+    size_t head;
+    size_t tail;
+    bool done;
+    int error;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    mbedtls_sha256_context sha256;
+} apply_ctx_t;
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int delta_tool_map(delta_tool_map_t *map, const char *path)
+{
+    struct stat st;
+    void *buf;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return -DETOOLS_FILE_OPEN_FAILED;
+    }
+
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return -DETOOLS_FILE_TELL_FAILED;
+    }
+
+    map->buf = NULL;
+    map->size = (size_t)st.st_size;
+
+    if (map->size > 0) {
+        buf = mmap(NULL, map->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (buf == MAP_FAILED) {
+            close(fd);
+            return -DETOOLS_FILE_READ_FAILED;
+        }
+        map->buf = buf;
+    }
+
+    close(fd);
+
+    return 0;
+}
+
+void delta_tool_unmap(delta_tool_map_t *map)
+{
+    if (map->buf != NULL) {
+        munmap((void *)map->buf, map->size);
+        map->buf = NULL;
+    }
+}
+
+static int write_all(int fd, const uint8_t *buf, size_t size)
+{
+    ssize_t n;
+
+    while (size > 0) {
+        n = write(fd, buf, size);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -DETOOLS_FILE_WRITE_FAILED;
+        }
+        buf += n;
+        size -= (size_t)n;
+    }
+
+    return 0;
+}
+
+static void *hash_thread(void *arg_p)
+{
+    apply_ctx_t *ctx = arg_p;
+    const uint8_t *buf;
+    size_t size;
+    int ret;
+
+    pthread_mutex_lock(&ctx->lock);
+
+    while (true) {
+        while (ctx->tail == ctx->head && !ctx->done) {
+            pthread_cond_wait(&ctx->cond, &ctx->lock);
+        }
+        if (ctx->tail == ctx->head) {
+            break;
+        }
+        buf = &ctx->blocks[(ctx->tail % APPLY_BLOCKS) * APPLY_BLOCK_SIZE];
+        size = ctx->sizes[ctx->tail % APPLY_BLOCKS];
+        pthread_mutex_unlock(&ctx->lock);
+
+        mbedtls_sha256_update_ret(&ctx->sha256, buf, size);
+        ret = (ctx->fd >= 0) ? write_all(ctx->fd, buf, size) : 0;
+
+        pthread_mutex_lock(&ctx->lock);
+        if (ret != 0 && ctx->error == 0) {
+            ctx->error = ret;
+        }
+        ctx->tail++;
+        pthread_cond_broadcast(&ctx->cond);
+    }
+
+    pthread_mutex_unlock(&ctx->lock);
+
+    return NULL;
+}
+
+/* Queues the block being filled and waits for a free one. */
+static int submit_block(apply_ctx_t *ctx, bool last)
+{
+    int ret;
+
+    pthread_mutex_lock(&ctx->lock);
+    ctx->head++;
+    ctx->done = last;
+    pthread_cond_broadcast(&ctx->cond);
+    if (!last) {
+        while (ctx->head - ctx->tail == APPLY_BLOCKS) {
+            pthread_cond_wait(&ctx->cond, &ctx->lock);
+        }
+        ctx->sizes[ctx->head % APPLY_BLOCKS] = 0;
+    }
+    ret = ctx->error;
+    pthread_mutex_unlock(&ctx->lock);
+
+    return ret;
+}
+
+static int apply_from_read(void *arg_p, uint8_t *buf_p, size_t size)
+{
+    apply_ctx_t *ctx = arg_p;
+
+    if (size > ctx->from->size - ctx->from_offset) {
+        return -DETOOLS_FILE_READ_FAILED;
+    }
+    memcpy(buf_p, &ctx->from->buf[ctx->from_offset], size);
+    ctx->from_offset += size;
+
+    return 0;
+}
+
+static int apply_from_seek(void *arg_p, int offset)
+{
+    apply_ctx_t *ctx = arg_p;
+
+    if ((offset < 0 && (size_t)-offset > ctx->from_offset) ||
+        (offset > 0 && (size_t)offset > ctx->from->size - ctx->from_offset)) {
+        return -DETOOLS_FILE_SEEK_FAILED;
+    }
+    ctx->from_offset += offset;
+
+    return 0;
+}
+
+static int apply_to_write(void *arg_p, const uint8_t *buf_p, size_t size)
+{
+    apply_ctx_t *ctx = arg_p;
+    size_t *fill;
+    size_t n;
+    int ret;
+
+    while (size > 0) {
+        fill = &ctx->sizes[ctx->head % APPLY_BLOCKS];
+        n = APPLY_BLOCK_SIZE - *fill;
+        if (n > size) {
+            n = size;
+        }
+        memcpy(&ctx->blocks[(ctx->head % APPLY_BLOCKS) * APPLY_BLOCK_SIZE + *fill], buf_p, n);
+        *fill += n;
+        buf_p += n;
+        size -= n;
+
+        if (*fill == APPLY_BLOCK_SIZE) {
+            ret = submit_block(ctx, false);
+            if (ret != 0) {
+                return ret;
+            }
+        }
+    }
+
+    return 0;
+}
+
+int delta_tool_apply(const delta_tool_map_t *from,
+                     const delta_tool_map_t *patch,
+                     const char *to_path,
+                     const uint8_t *sha256,
+                     delta_tool_apply_result_t *result)
+{
+    struct detools_apply_patch_t apply_patch;
+    apply_ctx_t ctx;
+    pthread_t thread;
+    double start = now();
+    int ret;
+    int ret2;
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.from = from;
+    ctx.fd = -1;
+
+    ctx.blocks = malloc(APPLY_BLOCKS * APPLY_BLOCK_SIZE);
+    if (ctx.blocks == NULL) {
+        return -DETOOLS_OUT_OF_MEMORY;
+    }
+
+    if (to_path != NULL) {
+        ctx.fd = open(to_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (ctx.fd < 0) {
+            free(ctx.blocks);
+            return -DETOOLS_FILE_OPEN_FAILED;
+        }
+    }
+
+    pthread_mutex_init(&ctx.lock, NULL);
+    pthread_cond_init(&ctx.cond, NULL);
+    mbedtls_sha256_init(&ctx.sha256);
+    mbedtls_sha256_starts_ret(&ctx.sha256, 0);
+
+    if (pthread_create(&thread, NULL, hash_thread, &ctx) != 0) {
+        ret = -DETOOLS_INTERNAL_ERROR;
+        goto out;
+    }
+
+    ret = detools_apply_patch_init(&apply_patch,
+                                   apply_from_read,
+                                   apply_from_seek,
+                                   patch->size,
+                                   apply_to_write,
+                                   &ctx);
+    if (ret == 0) {
+        ret = detools_apply_patch_process(&apply_patch, patch->buf, patch->size);
+        if (ret == 0) {
+            ret = detools_apply_patch_finalize(&apply_patch);
+        } else {
+            (void)detools_apply_patch_finalize(&apply_patch);
+        }
+    }
+
+    /* The partly filled block, if any, ends the output. */
+    ret2 = submit_block(&ctx, true);
+    pthread_join(thread, NULL);
+    if (ret >= 0 && ret2 == 0) {
+        ret2 = ctx.error;
+    }
+    if (ret >= 0 && ret2 != 0) {
+        ret = ret2;
+    }
+
+    if (ret >= 0) {
+        mbedtls_sha256_finish_ret(&ctx.sha256, result->sha256);
+        result->to_size = (size_t)ret;
+        result->matched = sha256 != NULL &&
+                          memcmp(result->sha256, sha256, DELTA_TOOL_SHA256_SIZE) == 0;
+        result->seconds = now() - start;
+    }
+
+out:
+    mbedtls_sha256_free(&ctx.sha256);
+    pthread_cond_destroy(&ctx.cond);
+    pthread_mutex_destroy(&ctx.lock);
+    if (ctx.fd >= 0 && close(ctx.fd) != 0 && ret >= 0) {
+        ret = -DETOOLS_FILE_CLOSE_FAILED;
+    }
+    free(ctx.blocks);
+
+    return ret;
+}
+
+int delta_tool_parse_sha256(const char *hex, uint8_t *sha256)
+{
+    unsigned int byte;
+    size_t i;
+
+    if (strlen(hex) != 2 * DELTA_TOOL_SHA256_SIZE ||
+        strspn(hex, "0123456789abcdefABCDEF") != 2 * DELTA_TOOL_SHA256_SIZE) {
+        return -1;
+    }
+
+    for (i = 0; i < DELTA_TOOL_SHA256_SIZE; i++) {
+        if (sscanf(&hex[2 * i], "%2x", &byte) != 1) {
+            return -1;
+        }
+        sha256[i] = (uint8_t)byte;
+    }
+
+    return 0;
+}
+
+void delta_tool_format_sha256(const uint8_t *sha256, char *hex)
+{
+    size_t i;
+
+    for (i = 0; i < DELTA_TOOL_SHA256_SIZE; i++) {
+        sprintf(&hex[2 * i], "%02x", sha256[i]);
+    }
+}
@@ -0,0 +1,756 @@
+/*
+ * SPDX-FileCopyrightText: 2016 Intel Corporation
+ *                         2020 Thesis projects
+ *
+ * SPDX-License-Identifier: Apache 2.0 License
+ *
+ * SPDX-FileContributor: 2021 Laukik Hase
+ */
+
+/*
+ * Sequential patch generator, the bsdiff algorithm of detools
+ * create_patch in C. Matches of the target in the source are found on
+ * a suffix array of the source. The target is split into one segment
+ * per worker thread, and the blocks of the segments are joined into
+ * one patch.
+ *
+ * In rolling hash mode, matches are found by looking up the hash of
+ * every block size window of the target in a table of the hashes of
+ * the aligned source blocks, and extending the hits. The table is
+ * sized to a memory budget, the larger the source the larger the
+ * blocks. The target is scanned once and blocks are written, and
+ * compressed, as they are found.
+ *
+ * Either index can instead be mapped from an index file of the source,
+ * see delta_tool_index.c.
+ *
+ * Patch layout, sizes packed as by the device:
+ *
+ *   (type << 4) | compression, target size,
+ *   compressed: 0 (no data format),
+ *               { diff size, diff data, extra size, extra data,
+ *                 source adjustment } ...
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "detools.h"
+#include "delta_tool.h"
+
+#define PATCH_TYPE_SEQUENTIAL   (0)
+
+/* Smallest target segment worth a thread of its own. */
+#define SEGMENT_SIZE_MIN        (256 * 1024)
+
+/* Rolling hash mode source block sizes. Shorter matches are found by
+ * extending longer ones backwards. */
+#define BLOCK_SIZE_MIN          (16)
+#define BLOCK_SIZE_MAX          (4096)
+
+#define HASH_MULTIPLIER         (0x01000193u)
+
+/* Heap of rolling hash mode besides the table. */
+#define STREAM_MEMORY           (sizeof(writer_t) + (1 << 16) * sizeof(int64_t))
+
+#ifndef MIN
+#define MIN(x, y) (((x) < (y)) ? (x) : (y))
+#endif
+
+/* Diff size bytes of the target added to the source at from_offset,
+ * followed by extra size bytes of the target as is. */
+typedef struct {
+    int64_t from_offset;
+    int64_t diff_size;
+    int64_t extra_size;
+} block_t;
+
+/* Patch data, compressed as blocks are added. */
+typedef struct {
+    const uint8_t *old;
+    const uint8_t *new;
+    int compression;
+    delta_tool_buffer_t *patch;
+    delta_tool_heatshrink_t encoder;
+    int64_t to_offset;
+    int64_t from_offset;        /* Source position after the last block */
+    bool started;
+} writer_t;
+
+typedef struct segment_t segment_t;
+
+struct segment_t {
+    const uint8_t *old;
+    int64_t old_size;
+    const uint8_t *new;
+    int64_t begin;
+    int64_t end;
+    int64_t (*search)(segment_t *seg, int64_t scan, int64_t *pos);
+    int (*add_block)(segment_t *seg, int64_t from_offset, int64_t diff_size, int64_t extra_size);
+    /* Suffix array mode. */
+    const int32_t *sa;
+    block_t *blocks;
+    size_t count;
+    size_t capacity;
+    /* Rolling hash mode. */
+    const delta_tool_hash_table_t *table;
+    uint32_t power;             /* HASH_MULTIPLIER ^ (block_size - 1) */
+    uint32_t hash;
+    int64_t hash_pos;           /* Target position of hash */
+    writer_t *writer;
+    int ret;
+};
+
+int delta_tool_buffer_append(delta_tool_buffer_t *buffer, const void *buf, size_t size)
+{
+    uint8_t *grown;
+    size_t capacity;
+
+    if (buffer->size + size > buffer->capacity) {
+        capacity = buffer->capacity > 0 ? buffer->capacity : 4096;
+        while (capacity < buffer->size + size) {
+            capacity *= 2;
+        }
+        grown = malloc(capacity);
+        if (grown == NULL) {
+            return -DETOOLS_OUT_OF_MEMORY;
+        }
+        if (buffer->size > 0) {
+            memcpy(grown, buffer->buf, buffer->size);
+        }
+        free(buffer->buf);
+        buffer->buf = grown;
+        buffer->capacity = capacity;
+    }
+
+    memcpy(&buffer->buf[buffer->size], buf, size);
+    buffer->size += size;
+
+    return 0;
+}
+
+void delta_tool_buffer_free(delta_tool_buffer_t *buffer)
+{
+    free(buffer->buf);
+    buffer->buf = NULL;
+    buffer->size = 0;
+    buffer->capacity = 0;
+}
+
+static size_t pack_size(uint8_t *bytes, int64_t value)
+{
+    uint64_t left;
+    size_t n = 0;
+
+    bytes[0] = value < 0 ? 0x40 : 0x00;
+    left = value < 0 ? (uint64_t)-value : (uint64_t)value;
+    bytes[0] |= left & 0x3f;
+    left >>= 6;
+
+    while (left > 0) {
+        bytes[n++] |= 0x80;
+        bytes[n] = left & 0x7f;
+        left >>= 7;
+    }
+
+    return n + 1;
+}
+
+static int writer_init(writer_t *writer,
+                       const delta_tool_map_t *from,
+                       const delta_tool_map_t *to,
+                       int compression,
+                       delta_tool_buffer_t *patch)
+{
+    uint8_t byte;
+    int ret;
+
+    memset(writer, 0, sizeof(*writer));
+    writer->old = from->buf;
+    writer->new = to->buf;
+    writer->compression = compression;
+    writer->patch = patch;
+
+    if (compression != DELTA_TOOL_COMPRESSION_HEATSHRINK) {
+        return 0;
+    }
+
+    byte = (uint8_t)(((DELTA_TOOL_HEATSHRINK_WINDOW_BITS - 4) << 4) |
+                     (DELTA_TOOL_HEATSHRINK_LOOKAHEAD_BITS - 3));
+    ret = delta_tool_buffer_append(patch, &byte, 1);
+    if (ret == 0) {
+        ret = delta_tool_heatshrink_init(&writer->encoder, patch);
+    }
+
+    return ret;
+}
+
+static int writer_append(writer_t *writer, const uint8_t *buf, size_t size)
+{
+    if (writer->compression == DELTA_TOOL_COMPRESSION_HEATSHRINK) {
+        return delta_tool_heatshrink_write(&writer->encoder, buf, size);
+    }
+
+    return delta_tool_buffer_append(writer->patch, buf, size);
+}
+
+static int writer_pack(writer_t *writer, int64_t value)
+{
+    uint8_t bytes[10];
+
+    return writer_append(writer, bytes, pack_size(bytes, value));
+}
+
+static int writer_add_block(writer_t *writer,
+                            int64_t from_offset,
+                            int64_t diff_size,
+                            int64_t extra_size)
+{
+    uint8_t diff[4096];
+    int64_t done;
+    int64_t n;
+    int64_t i;
+    int ret = 0;
+
+    if (diff_size == 0 && extra_size == 0) {
+        return 0;
+    }
+
+    /* The previous block seeks to where this one reads the source. The
+     * device starts at zero, anywhere else needs an empty first
+     * block. */
+    if (!writer->started && from_offset != 0) {
+        ret = writer_pack(writer, 0);
+        if (ret == 0) {
+            ret = writer_pack(writer, 0);
+        }
+    }
+    if (ret == 0 && (writer->started || from_offset != 0)) {
+        ret = writer_pack(writer, from_offset - writer->from_offset);
+    }
+    writer->started = true;
+
+    if (ret == 0) {
+        ret = writer_pack(writer, diff_size);
+    }
+    for (done = 0; done < diff_size && ret == 0; done += n) {
+        n = MIN(diff_size - done, (int64_t)sizeof(diff));
+        for (i = 0; i < n; i++) {
+            diff[i] = (uint8_t)(writer->new[writer->to_offset + done + i] -
+                                writer->old[from_offset + done + i]);
+        }
+        ret = writer_append(writer, diff, (size_t)n);
+    }
+    writer->to_offset += diff_size;
+
+    if (ret == 0) {
+        ret = writer_pack(writer, extra_size);
+    }
+    if (ret == 0) {
+        ret = writer_append(writer, &writer->new[writer->to_offset], (size_t)extra_size);
+    }
+    writer->to_offset += extra_size;
+    writer->from_offset = from_offset + diff_size;
+
+    return ret;
+}
+
+static int writer_finish(writer_t *writer)
+{
+    int ret = 0;
+
+    /* The adjustment of the last block. */
+    if (writer->started) {
+        ret = writer_pack(writer, 0);
+    }
+    if (ret == 0 && writer->compression == DELTA_TOOL_COMPRESSION_HEATSHRINK) {
+        ret = delta_tool_heatshrink_finish(&writer->encoder);
+    }
+
+    return ret;
+}
+
+static int64_t match_len(const uint8_t *a, int64_t a_size, const uint8_t *b, int64_t b_size)
+{
+    int64_t i;
+
+    for (i = 0; i < a_size && i < b_size && a[i] == b[i]; i++) {
+    }
+
+    return i;
+}
+
+/* Longest match of the target at scan in the source, by binary search
+ * of the suffix array. */
+static int64_t search_suffix_array(segment_t *seg, int64_t scan, int64_t *pos)
+{
+    const uint8_t *new = &seg->new[scan];
+    int64_t new_size = seg->end - scan;
+    int64_t st = 0;
+    int64_t en = seg->old_size;
+    int64_t x;
+    int64_t y;
+
+    while (en - st >= 2) {
+        x = st + (en - st) / 2;
+        if (memcmp(&seg->old[seg->sa[x]], new, MIN(seg->old_size - seg->sa[x], new_size)) < 0) {
+            st = x;
+        } else {
+            en = x;
+        }
+    }
+
+    x = match_len(&seg->old[seg->sa[st]], seg->old_size - seg->sa[st], new, new_size);
+    y = match_len(&seg->old[seg->sa[en]], seg->old_size - seg->sa[en], new, new_size);
+
+    if (x > y) {
+        *pos = seg->sa[st];
+        return x;
+    }
+    *pos = seg->sa[en];
+
+    return y;
+}
+
+static uint32_t block_hash(const uint8_t *buf, int64_t size)
+{
+    uint32_t hash = 0;
+    int64_t i;
+
+    for (i = 0; i < size; i++) {
+        hash = hash * HASH_MULTIPLIER + buf[i];
+    }
+
+    return hash;
+}
+
+static inline size_t hash_slot(const delta_tool_hash_table_t *table, uint32_t hash)
+{
+    return (hash * 0x9e3779b1u) >> (32 - table->bits);
+}
+
+/* A match of the target at scan starting at a source block with the
+ * same hash, zero(0) if none. */
+static int64_t search_hash(segment_t *seg, int64_t scan, int64_t *pos)
+{
+    const delta_tool_hash_table_t *table = seg->table;
+    const delta_tool_hash_entry_t *entry;
+    int64_t block_size = table->block_size;
+    int64_t len;
+
+    if (seg->end - scan < block_size) {
+        return 0;
+    }
+
+    if (scan == seg->hash_pos + 1) {
+        seg->hash = ((seg->hash - seg->new[scan - 1] * seg->power) * HASH_MULTIPLIER +
+                     seg->new[scan + block_size - 1]);
+    } else {
+        seg->hash = block_hash(&seg->new[scan], block_size);
+    }
+    seg->hash_pos = scan;
+
+    entry = &table->entries[hash_slot(table, seg->hash)];
+    if (entry->block == 0 || entry->hash != seg->hash) {
+        return 0;
+    }
+
+    *pos = (int64_t)(entry->block - 1) * block_size;
+    len = match_len(&seg->old[*pos], seg->old_size - *pos, &seg->new[scan], seg->end - scan);
+
+    return len >= block_size ? len : 0;
+}
+
+static int collect_block(segment_t *seg, int64_t from_offset, int64_t diff_size, int64_t extra_size)
+{
+    block_t *grown;
+    size_t capacity;
+
+    if (diff_size == 0 && extra_size == 0) {
+        return 0;
+    }
+
+    if (seg->count == seg->capacity) {
+        capacity = seg->capacity > 0 ? 2 * seg->capacity : 256;
+        grown = malloc(capacity * sizeof(*grown));
+        if (grown == NULL) {
+            return -DETOOLS_OUT_OF_MEMORY;
+        }
+        if (seg->count > 0) {
+            memcpy(grown, seg->blocks, seg->count * sizeof(*grown));
+        }
+        free(seg->blocks);
+        seg->blocks = grown;
+        seg->capacity = capacity;
+    }
+
+    seg->blocks[seg->count].from_offset = from_offset;
+    seg->blocks[seg->count].diff_size = diff_size;
+    seg->blocks[seg->count].extra_size = extra_size;
+    seg->count++;
+
+    return 0;
+}
+
+static int stream_block(segment_t *seg, int64_t from_offset, int64_t diff_size, int64_t extra_size)
+{
+    return writer_add_block(seg->writer, from_offset, diff_size, extra_size);
+}
+
+/* The bsdiff scan over one target segment. */
+static void *match_segment(void *arg_p)
+{
+    segment_t *seg = arg_p;
+    const uint8_t *old = seg->old;
+    const uint8_t *new = seg->new;
+    int64_t old_size = seg->old_size;
+    int64_t new_size = seg->end;
+    int64_t scan = seg->begin;
+    int64_t len = 0;
+    int64_t pos = 0;
+    int64_t last_scan = seg->begin;
+    int64_t last_pos = 0;
+    int64_t last_offset = 0;
+    int64_t old_score;
+    int64_t scsc;
+    int64_t s, sf, lenf, sb, lenb, ss, lens, overlap, i;
+
+    while (scan < new_size && seg->ret == 0) {
+        old_score = 0;
+
+        for (scsc = scan += len; scan < new_size; scan++) {
+            len = seg->search(seg, scan, &pos);
+
+            /* The old offset is scored from scan to the end of the
+             * match. Hash lookups miss most positions, so scsc may lag
+             * behind. */
+            if (scsc < scan) {
+                scsc = scan;
+            }
+            for (; scsc < scan + len; scsc++) {
+                if (scsc + last_offset < old_size && old[scsc + last_offset] == new[scsc]) {
+                    old_score++;
+                }
+            }
+
+            if ((len == old_score && len != 0) || len > old_score + 8) {
+                break;
+            }
+
+            if (scsc > scan && scan + last_offset < old_size &&
+                old[scan + last_offset] == new[scan]) {
+                old_score--;
+            }
+        }
+
+        if (len == old_score && scan != new_size) {
+            continue;
+        }
+
+        /* Extend the last match forwards and this one backwards. */
+        s = 0;
+        sf = 0;
+        lenf = 0;
+        for (i = 0; last_scan + i < scan && last_pos + i < old_size;) {
+            if (old[last_pos + i] == new[last_scan + i]) {
+                s++;
+            }
+            i++;
+            if (s * 2 - i > sf * 2 - lenf) {
+                sf = s;
+                lenf = i;
+            }
+        }
+
+        lenb = 0;
+        if (scan < new_size) {
+            s = 0;
+            sb = 0;
+            for (i = 1; scan >= last_scan + i && pos >= i; i++) {
+                if (old[pos - i] == new[scan - i]) {
+                    s++;
+                }
+                if (s * 2 - i > sb * 2 - lenb) {
+                    sb = s;
+                    lenb = i;
+                }
+            }
+        }
+
+        if (last_scan + lenf > scan - lenb) {
+            overlap = (last_scan + lenf) - (scan - lenb);
+            s = 0;
+            ss = 0;
+            lens = 0;
+            for (i = 0; i < overlap; i++) {
+                if (new[last_scan + lenf - overlap + i] == old[last_pos + lenf - overlap + i]) {
+                    s++;
+                }
+                if (new[scan - lenb + i] == old[pos - lenb + i]) {
+                    s--;
+                }
+                if (s > ss) {
+                    ss = s;
+                    lens = i + 1;
+                }
+            }
+            lenf += lens - overlap;
+            lenb -= lens;
+        }
+
+        seg->ret = seg->add_block(seg, last_pos, lenf, (scan - lenb) - (last_scan + lenf));
+
+        last_scan = scan - lenb;
+        last_pos = pos - lenb;
+        last_offset = pos - scan;
+    }
+
+    return NULL;
+}
+
+/* Matches on given suffix array, or on one built here if NULL. */
+static int diff_suffix_array(writer_t *writer,
+                             const delta_tool_map_t *from,
+                             const delta_tool_map_t *to,
+                             int workers,
+                             const int32_t *sa)
+{
+    segment_t *segs = NULL;
+    pthread_t *threads = NULL;
+    int32_t *built = NULL;
+    size_t b;
+    int nsegs = 0;
+    int started = 0;
+    int ret = 0;
+    int k;
+
+    if (sa == NULL) {
+        built = malloc((from->size + 1) * sizeof(*built));
+        if (built == NULL) {
+            return -DETOOLS_OUT_OF_MEMORY;
+        }
+        ret = delta_tool_suffix_array(from->buf, from->size, built);
+        if (ret != 0) {
+            goto out;
+        }
+        sa = built;
+    }
+
+    nsegs = workers > 0 ? workers : 1;
+    if ((size_t)nsegs > to->size / SEGMENT_SIZE_MIN) {
+        nsegs = (int)(to->size / SEGMENT_SIZE_MIN);
+    }
+    if (nsegs < 1) {
+        nsegs = 1;
+    }
+
+    segs = malloc(nsegs * sizeof(*segs));
+    threads = malloc(nsegs * sizeof(*threads));
+    if (segs == NULL || threads == NULL) {
+        ret = -DETOOLS_OUT_OF_MEMORY;
+        goto out;
+    }
+
+    for (k = 0; k < nsegs; k++) {
+        memset(&segs[k], 0, sizeof(segs[k]));
+        segs[k].old = from->buf;
+        segs[k].old_size = (int64_t)from->size;
+        segs[k].new = to->buf;
+        segs[k].begin = (int64_t)(to->size * k / nsegs);
+        segs[k].end = (int64_t)(to->size * (k + 1) / nsegs);
+        segs[k].search = search_suffix_array;
+        segs[k].add_block = collect_block;
+        segs[k].sa = sa;
+    }
+
+    /* The first segment runs on this thread. */
+    for (k = 1; k < nsegs; k++) {
+        if (pthread_create(&threads[k], NULL, match_segment, &segs[k]) != 0) {
+            break;
+        }
+        started = k;
+    }
+    match_segment(&segs[0]);
+    for (k = 1; k <= started; k++) {
+        pthread_join(threads[k], NULL);
+    }
+    for (k = started + 1; k < nsegs; k++) {
+        match_segment(&segs[k]);
+    }
+
+    for (k = 0; k < nsegs && ret == 0; k++) {
+        ret = segs[k].ret;
+    }
+    for (k = 0; k < nsegs && ret == 0; k++) {
+        for (b = 0; b < segs[k].count && ret == 0; b++) {
+            ret = writer_add_block(writer,
+                                   segs[k].blocks[b].from_offset,
+                                   segs[k].blocks[b].diff_size,
+                                   segs[k].blocks[b].extra_size);
+        }
+    }
+
+out:
+    if (segs != NULL) {
+        for (k = 0; k < nsegs; k++) {
+            free(segs[k].blocks);
+        }
+    }
+    free(threads);
+    free(segs);
+    free(built);
+
+    return ret;
+}
+
+/* Sizes the table to the memory budget, at most half full. */
+int delta_tool_hash_table_build(delta_tool_hash_table_t *table,
+                                const delta_tool_map_t *from,
+                                size_t memory)
+{
+    delta_tool_hash_entry_t *entries;
+    delta_tool_hash_entry_t *entry;
+    uint32_t hash;
+    int64_t blocks;
+    int64_t i;
+
+    for (table->block_size = BLOCK_SIZE_MIN;; table->block_size *= 2) {
+        blocks = (int64_t)from->size / table->block_size;
+        for (table->bits = 1; ((int64_t)1 << table->bits) < 2 * blocks; table->bits++) {
+        }
+        if (((size_t)1 << table->bits) * sizeof(*entry) <= memory) {
+            break;
+        }
+        if (table->block_size == BLOCK_SIZE_MAX) {
+            return -DETOOLS_OUT_OF_MEMORY;
+        }
+    }
+
+    entries = calloc((size_t)1 << table->bits, sizeof(*entry));
+    if (entries == NULL) {
+        return -DETOOLS_OUT_OF_MEMORY;
+    }
+
+    /* The first of equal blocks is kept. */
+    for (i = 0; i < blocks; i++) {
+        hash = block_hash(&from->buf[i * table->block_size], table->block_size);
+        entry = &entries[hash_slot(table, hash)];
+        if (entry->block == 0) {
+            entry->hash = hash;
+            entry->block = (uint32_t)(i + 1);
+        }
+    }
+    table->entries = entries;
+
+    return 0;
+}
+
+void delta_tool_hash_table_free(delta_tool_hash_table_t *table)
+{
+    free((void *)table->entries);
+    table->entries = NULL;
+}
+
+/* Matches on given hash table, or on one built here in the memory
+ * budget if NULL. */
+static int diff_hash(writer_t *writer,
+                     const delta_tool_map_t *from,
+                     const delta_tool_map_t *to,
+                     const delta_tool_hash_table_t *table,
+                     size_t memory)
+{
+    delta_tool_hash_table_t built = { NULL, 0, 0 };
+    segment_t seg;
+    uint32_t i;
+    int ret;
+
+    if (table == NULL) {
+        if (memory <= STREAM_MEMORY) {
+            return -DETOOLS_OUT_OF_MEMORY;
+        }
+        ret = delta_tool_hash_table_build(&built, from, memory - STREAM_MEMORY);
+        if (ret != 0) {
+            return ret;
+        }
+        table = &built;
+    }
+
+    memset(&seg, 0, sizeof(seg));
+    seg.old = from->buf;
+    seg.old_size = (int64_t)from->size;
+    seg.new = to->buf;
+    seg.begin = 0;
+    seg.end = (int64_t)to->size;
+    seg.search = search_hash;
+    seg.add_block = stream_block;
+    seg.table = table;
+    seg.power = 1;
+    for (i = 1; i < table->block_size; i++) {
+        seg.power *= HASH_MULTIPLIER;
+    }
+    seg.hash_pos = -2;
+    seg.writer = writer;
+    match_segment(&seg);
+    delta_tool_hash_table_free(&built);
+
+    return seg.ret;
+}
+
+int delta_tool_diff(const delta_tool_map_t *from,
+                    const delta_tool_map_t *to,
+                    const delta_tool_diff_opts_t *opts,
+                    delta_tool_buffer_t *patch)
+{
+    const delta_tool_index_t *index = opts->index;
+    writer_t *writer;
+    uint8_t bytes[11];
+    size_t size;
+    int ret;
+
+    if (opts->compression != DELTA_TOOL_COMPRESSION_NONE &&
+        opts->compression != DELTA_TOOL_COMPRESSION_HEATSHRINK) {
+        return -DETOOLS_BAD_COMPRESSION;
+    }
+    if (from->size >= INT32_MAX || to->size >= INT32_MAX) {
+        return -DETOOLS_NOT_IMPLEMENTED;
+    }
+
+    bytes[0] = (uint8_t)((PATCH_TYPE_SEQUENTIAL << 4) | opts->compression);
+    size = 1 + pack_size(&bytes[1], (int64_t)to->size);
+    ret = delta_tool_buffer_append(patch, bytes, size);
+    if (ret != 0 || to->size == 0) {
+        return ret;
+    }
+
+    writer = malloc(sizeof(*writer));
+    if (writer == NULL) {
+        return -DETOOLS_OUT_OF_MEMORY;
+    }
+
+    ret = writer_init(writer, from, to, opts->compression, patch);
+
+    /* No data format patch. */
+    if (ret == 0) {
+        ret = writer_pack(writer, 0);
+    }
+    if (ret == 0) {
+        if (index != NULL && index->table.entries != NULL) {
+            ret = diff_hash(writer, from, to, &index->table, 0);
+        } else if (index != NULL && index->sa != NULL) {
+            ret = diff_suffix_array(writer, from, to, opts->workers, index->sa);
+        } else if (opts->memory > 0) {
+            ret = diff_hash(writer, from, to, NULL, opts->memory);
+        } else {
+            ret = diff_suffix_array(writer, from, to, opts->workers, NULL);
+        }
+    }
+    if (ret == 0) {
+        ret = writer_finish(writer);
+    }
+
+    delta_tool_heatshrink_destroy(&writer->encoder);
+    free(writer);
+
+    return ret;
+}
@@ -0,0 +1,185 @@
+/*
+ * SPDX-FileCopyrightText: 2016 Intel Corporation
+ *                         2020 Thesis projects
+ *
+ * SPDX-License-Identifier: Apache 2.0 License
+ *
+ * SPDX-FileContributor: 2021 Laukik Hase
+ */
+
+/*
+ * Heatshrink encoder for the static (8, 7) configuration the device
+ * decodes with. Greedy LZSS, with hash chains over the last window of
+ * input to find the longest match.
+ *
+ * Input is encoded as it is written, once a full lookahead of it is
+ * buffered, so only the window and the lookahead are kept.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "detools.h"
+#include "delta_tool.h"
+
+#define WINDOW_SIZE     DELTA_TOOL_HEATSHRINK_WINDOW_SIZE
+#define MATCH_MAX       (1 << DELTA_TOOL_HEATSHRINK_LOOKAHEAD_BITS)
+
+/* A backref takes 1 + 8 + 7 bits, a literal 1 + 8 bits. */
+#define MATCH_MIN       (2)
+
+#define HASH_SIZE       (1 << 16)
+
+/* Chain steps per position, bounding the time on repetitive data. */
+#define CHAIN_MAX       (64)
+
+static int put_bits(delta_tool_heatshrink_t *self, unsigned int value, int count)
+{
+    int ret;
+
+    while (count-- > 0) {
+        self->byte = (uint8_t)((self->byte << 1) | ((value >> count) & 1));
+        if (++self->bits == 8) {
+            ret = delta_tool_buffer_append(self->out, &self->byte, 1);
+            if (ret != 0) {
+                return ret;
+            }
+            self->byte = 0;
+            self->bits = 0;
+        }
+    }
+
+    return 0;
+}
+
+static inline const uint8_t *at(const delta_tool_heatshrink_t *self, int64_t pos)
+{
+    return &self->buf[pos - self->base];
+}
+
+static inline unsigned int hash(const uint8_t *buf)
+{
+    return ((unsigned int)buf[0] << 8) | buf[1];
+}
+
+/* Encodes a literal or a backref at the current position. */
+static int encode_one(delta_tool_heatshrink_t *self)
+{
+    const uint8_t *cur = at(self, self->pos);
+    const uint8_t *prev;
+    int64_t limit = self->end - self->pos < MATCH_MAX ? self->end - self->pos : MATCH_MAX;
+    int64_t best_len = 0;
+    int64_t best_dist = 0;
+    int64_t len;
+    int64_t cand;
+    int steps;
+    int ret;
+
+    if (limit >= MATCH_MIN) {
+        cand = self->head[hash(cur)];
+        for (steps = 0; cand >= 0 && self->pos - cand <= WINDOW_SIZE && steps < CHAIN_MAX;
+             steps++) {
+            prev = at(self, cand);
+            for (len = 0; len < limit && prev[len] == cur[len]; len++) {
+            }
+            if (len > best_len) {
+                best_len = len;
+                best_dist = self->pos - cand;
+                if (len == limit) {
+                    break;
+                }
+            }
+            cand = self->prev[cand % WINDOW_SIZE];
+        }
+    }
+
+    if (best_len >= MATCH_MIN) {
+        ret = put_bits(self, 0, 1);
+        if (ret == 0) {
+            ret = put_bits(self, (unsigned int)(best_dist - 1), DELTA_TOOL_HEATSHRINK_WINDOW_BITS);
+        }
+        if (ret == 0) {
+            ret = put_bits(self, (unsigned int)(best_len - 1), DELTA_TOOL_HEATSHRINK_LOOKAHEAD_BITS);
+        }
+    } else {
+        best_len = 1;
+        ret = put_bits(self, 0x100 | cur[0], 9);
+    }
+
+    /* Every position of the match can start a later one. */
+    for (; best_len > 0; best_len--, self->pos++) {
+        if (self->pos + 1 < self->end) {
+            cur = at(self, self->pos);
+            self->prev[self->pos % WINDOW_SIZE] = self->head[hash(cur)];
+            self->head[hash(cur)] = self->pos;
+        }
+    }
+
+    return ret;
+}
+
+int delta_tool_heatshrink_init(delta_tool_heatshrink_t *self, delta_tool_buffer_t *out)
+{
+    memset(self, 0, sizeof(*self));
+    self->out = out;
+    self->head = malloc(HASH_SIZE * sizeof(*self->head));
+    if (self->head == NULL) {
+        return -DETOOLS_OUT_OF_MEMORY;
+    }
+    memset(self->head, 0xff, HASH_SIZE * sizeof(*self->head));
+
+    return 0;
+}
+
+int delta_tool_heatshrink_write(delta_tool_heatshrink_t *self, const uint8_t *buf, size_t size)
+{
+    int64_t keep;
+    size_t n;
+    int ret = 0;
+
+    while (size > 0 && ret == 0) {
+        /* Drop input older than the window of the current position. */
+        if (self->end - self->base == (int64_t)sizeof(self->buf)) {
+            keep = self->pos - WINDOW_SIZE > self->base ? self->pos - WINDOW_SIZE : self->base;
+            memmove(self->buf, at(self, keep), (size_t)(self->end - keep));
+            self->base = keep;
+        }
+
+        n = sizeof(self->buf) - (size_t)(self->end - self->base);
+        n = n < size ? n : size;
+        memcpy(&self->buf[self->end - self->base], buf, n);
+        self->end += (int64_t)n;
+        buf += n;
+        size -= n;
+
+        /* Only with a full lookahead, so the output does not depend on
+         * how the input is split into writes. */
+        while (self->end - self->pos > MATCH_MAX && ret == 0) {
+            ret = encode_one(self);
+        }
+    }
+
+    return ret;
+}
+
+int delta_tool_heatshrink_finish(delta_tool_heatshrink_t *self)
+{
+    int ret = 0;
+
+    while (self->pos < self->end && ret == 0) {
+        ret = encode_one(self);
+    }
+
+    /* Zero padding reads as an incomplete backref and is ignored. */
+    if (ret == 0 && self->bits > 0) {
+        ret = put_bits(self, 0, 8 - self->bits);
+    }
+
+    return ret;
+}
+
+void delta_tool_heatshrink_destroy(delta_tool_heatshrink_t *self)
+{
+    free(self->head);
+    self->head = NULL;
+}
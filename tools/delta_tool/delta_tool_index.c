@@ -0,0 +1,186 @@
+/*
+ * SPDX-FileCopyrightText: 2016 Intel Corporation
+ *                         2020 Thesis projects
+ *
+ * SPDX-License-Identifier: Apache 2.0 License
+ *
+ * SPDX-FileContributor: 2021 Laukik Hase
+ */
+
+/*
+ * Index files of source images, so patches from a popular source are
+ * created without indexing it every time. The file is mapped and the
+ * suffix array or hash table used in place.
+ *
+ * Layout, in host byte order:
+ *
+ *   header, see index_header_t
+ *   suffix array, image size + 1 int32_t, or
+ *   hash table, 2 ^ bits entries, 8 byte aligned
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mbedtls/version.h"
+#include "mbedtls/sha256.h"
+
+#include "detools.h"
+#include "delta_tool.h"
+
+#if MBEDTLS_VERSION_NUMBER >= 0x03000000
+#define mbedtls_sha256_ret mbedtls_sha256
+#endif
+
+#define INDEX_MAGIC     (0x78646964)    /* "didx" */
+#define INDEX_VERSION   (1)
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint8_t sha256[DELTA_TOOL_SHA256_SIZE];
+    uint64_t image_size;
+    uint64_t sa_offset;         /* Zero if no suffix array */
+    uint64_t table_offset;      /* Zero if no hash table */
+    uint32_t block_size;
+    uint32_t bits;
+} index_header_t;
+
+static int write_all(FILE *file_p, const void *buf, size_t size)
+{
+    if (size > 0 && fwrite(buf, size, 1, file_p) != 1) {
+        return -DETOOLS_FILE_WRITE_FAILED;
+    }
+
+    return 0;
+}
+
+int delta_tool_index_create(const delta_tool_map_t *from, size_t memory, const char *path)
+{
+    delta_tool_hash_table_t table = { NULL, 0, 0 };
+    index_header_t header;
+    int32_t *sa = NULL;
+    FILE *file_p;
+    int ret;
+
+    if (from->size >= INT32_MAX) {
+        return -DETOOLS_NOT_IMPLEMENTED;
+    }
+
+    memset(&header, 0, sizeof(header));
+    header.magic = INDEX_MAGIC;
+    header.version = INDEX_VERSION;
+    header.image_size = from->size;
+    mbedtls_sha256_ret(from->buf, from->size, header.sha256, 0);
+
+    if (memory > 0) {
+        ret = delta_tool_hash_table_build(&table, from, memory);
+        header.table_offset = sizeof(header);
+        header.block_size = table.block_size;
+        header.bits = (uint32_t)table.bits;
+    } else {
+        sa = malloc((from->size + 1) * sizeof(*sa));
+        ret = sa != NULL ? delta_tool_suffix_array(from->buf, from->size, sa) :
+              -DETOOLS_OUT_OF_MEMORY;
+        header.sa_offset = sizeof(header);
+    }
+    if (ret != 0) {
+        goto out;
+    }
+
+    file_p = fopen(path, "wb");
+    if (file_p == NULL) {
+        ret = -DETOOLS_FILE_OPEN_FAILED;
+        goto out;
+    }
+
+    ret = write_all(file_p, &header, sizeof(header));
+    if (ret == 0 && sa != NULL) {
+        ret = write_all(file_p, sa, (from->size + 1) * sizeof(*sa));
+    }
+    if (ret == 0 && table.entries != NULL) {
+        ret = write_all(file_p, table.entries, ((size_t)1 << table.bits) * sizeof(*table.entries));
+    }
+    if (fclose(file_p) != 0 && ret == 0) {
+        ret = -DETOOLS_FILE_CLOSE_FAILED;
+    }
+
+out:
+    delta_tool_hash_table_free(&table);
+    free(sa);
+
+    return ret;
+}
+
+int delta_tool_index_map(delta_tool_index_t *index, const char *path)
+{
+    const index_header_t *header;
+    uint64_t size;
+    int ret;
+
+    memset(index, 0, sizeof(*index));
+    ret = delta_tool_map(&index->map, path);
+    if (ret != 0) {
+        return ret;
+    }
+
+    header = (const index_header_t *)index->map.buf;
+    if (index->map.size < sizeof(*header)
+        || header->magic != INDEX_MAGIC
+        || header->version != INDEX_VERSION
+        || header->image_size >= INT32_MAX
+        || (header->sa_offset == 0) == (header->table_offset == 0)) {
+        goto bad;
+    }
+
+    /* The single part follows the header up to the end of the file. */
+    if (header->sa_offset != 0) {
+        size = (header->image_size + 1) * sizeof(*index->sa);
+        if (header->sa_offset != sizeof(*header) || index->map.size != sizeof(*header) + size) {
+            goto bad;
+        }
+        index->sa = (const int32_t *)&index->map.buf[header->sa_offset];
+    } else {
+        if (header->bits < 1 || header->bits > 31 || header->block_size == 0) {
+            goto bad;
+        }
+        size = ((uint64_t)1 << header->bits) * sizeof(*index->table.entries);
+        if (header->table_offset != sizeof(*header) || index->map.size != sizeof(*header) + size) {
+            goto bad;
+        }
+        index->table.entries =
+            (const delta_tool_hash_entry_t *)&index->map.buf[header->table_offset];
+        index->table.bits = (int)header->bits;
+        index->table.block_size = header->block_size;
+    }
+
+    memcpy(index->sha256, header->sha256, sizeof(index->sha256));
+    index->image_size = (size_t)header->image_size;
+
+    return 0;
+
+bad:
+    delta_tool_index_unmap(index);
+
+    return -DETOOLS_SHORT_HEADER;
+}
+
+void delta_tool_index_unmap(delta_tool_index_t *index)
+{
+    delta_tool_unmap(&index->map);
+    index->sa = NULL;
+    index->table.entries = NULL;
+}
+
+bool delta_tool_index_matches(const delta_tool_index_t *index, const delta_tool_map_t *from)
+{
+    uint8_t sha256[DELTA_TOOL_SHA256_SIZE];
+
+    if (index->image_size != from->size) {
+        return false;
+    }
+    mbedtls_sha256_ret(from->buf, from->size, sha256, 0);
+
+    return memcmp(sha256, index->sha256, sizeof(sha256)) == 0;
+}
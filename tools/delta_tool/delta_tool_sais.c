@@ -0,0 +1,249 @@
+/*
+ * SPDX-FileCopyrightText: 2016 Intel Corporation
+ *                         2020 Thesis projects
+ *
+ * SPDX-License-Identifier: Apache 2.0 License
+ *
+ * SPDX-FileContributor: 2021 Laukik Hase
+ */
+
+/*
+ * Suffix array construction by induced sorting (SA-IS, Nong, Zhang
+ * and Chan 2009), in linear time and with the suffix array itself as
+ * the only large work area.
+ *
+ * The text of the top level is the image, with a virtual sentinel
+ * smaller than any byte at its end. Lower levels sort the names of
+ * the LMS substrings, stored in the upper part of the suffix array.
+ */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "detools.h"
+#include "delta_tool.h"
+
+typedef struct {
+    const uint8_t *bytes;       /* Top level, or NULL */
+    const int32_t *names;       /* Lower levels */
+    int32_t n;                  /* Including the sentinel */
+    int32_t k;                  /* Alphabet size */
+    uint8_t *types;             /* Bit set for S-type suffixes */
+} text_t;
+
+static inline int32_t chr(const text_t *t, int32_t i)
+{
+    if (t->bytes != NULL) {
+        return i == t->n - 1 ? 0 : t->bytes[i] + 1;
+    }
+
+    return t->names[i];
+}
+
+static inline bool is_s(const text_t *t, int32_t i)
+{
+    return (t->types[i >> 3] >> (i & 7)) & 1;
+}
+
+static inline void set_s(text_t *t, int32_t i, bool s)
+{
+    if (s) {
+        t->types[i >> 3] |= (uint8_t)(1 << (i & 7));
+    } else {
+        t->types[i >> 3] &= (uint8_t)~(1 << (i & 7));
+    }
+}
+
+static inline bool is_lms(const text_t *t, int32_t i)
+{
+    return i > 0 && is_s(t, i) && !is_s(t, i - 1);
+}
+
+static void get_buckets(const text_t *t, int32_t *bkt, bool end)
+{
+    int32_t sum = 0;
+    int32_t i;
+
+    memset(bkt, 0, t->k * sizeof(*bkt));
+    for (i = 0; i < t->n; i++) {
+        bkt[chr(t, i)]++;
+    }
+    for (i = 0; i < t->k; i++) {
+        sum += bkt[i];
+        bkt[i] = end ? sum : sum - bkt[i];
+    }
+}
+
+static void induce(const text_t *t, int32_t *sa, int32_t *bkt)
+{
+    int32_t i;
+    int32_t j;
+
+    /* L-type suffixes from the bucket heads, left to right. */
+    get_buckets(t, bkt, false);
+    for (i = 0; i < t->n; i++) {
+        j = sa[i] - 1;
+        if (j >= 0 && !is_s(t, j)) {
+            sa[bkt[chr(t, j)]++] = j;
+        }
+    }
+
+    /* S-type suffixes from the bucket tails, right to left. */
+    get_buckets(t, bkt, true);
+    for (i = t->n - 1; i >= 0; i--) {
+        j = sa[i] - 1;
+        if (j >= 0 && is_s(t, j)) {
+            sa[--bkt[chr(t, j)]] = j;
+        }
+    }
+}
+
+static bool lms_equal(const text_t *t, int32_t a, int32_t b)
+{
+    int32_t d;
+
+    for (d = 0; a + d < t->n && b + d < t->n; d++) {
+        if (chr(t, a + d) != chr(t, b + d) || is_s(t, a + d) != is_s(t, b + d)) {
+            return false;
+        }
+        if (d > 0 && (is_lms(t, a + d) || is_lms(t, b + d))) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static int sais(text_t *t, int32_t *sa)
+{
+    int32_t *bkt;
+    int32_t *s1;
+    int32_t n = t->n;
+    int32_t n1 = 0;
+    int32_t name = 0;
+    int32_t prev = -1;
+    int32_t pos;
+    int32_t i;
+    int32_t j;
+    text_t t1;
+    int ret = 0;
+
+    t->types = malloc(n / 8 + 1);
+    bkt = malloc(t->k * sizeof(*bkt));
+    if (t->types == NULL || bkt == NULL) {
+        ret = -DETOOLS_OUT_OF_MEMORY;
+        goto out;
+    }
+    memset(t->types, 0, n / 8 + 1);
+
+    /* The sentinel is S-type and the suffix before it L-type. */
+    set_s(t, n - 1, true);
+    if (n > 1) {
+        set_s(t, n - 2, false);
+    }
+    for (i = n - 3; i >= 0; i--) {
+        set_s(t, i, chr(t, i) < chr(t, i + 1) ||
+                    (chr(t, i) == chr(t, i + 1) && is_s(t, i + 1)));
+    }
+
+    /* Sort the LMS substrings. */
+    get_buckets(t, bkt, true);
+    for (i = 0; i < n; i++) {
+        sa[i] = -1;
+    }
+    for (i = 1; i < n; i++) {
+        if (is_lms(t, i)) {
+            sa[--bkt[chr(t, i)]] = i;
+        }
+    }
+    induce(t, sa, bkt);
+
+    /* Name them in sorted order, with the names of equal substrings
+     * equal. */
+    for (i = 0; i < n; i++) {
+        if (is_lms(t, sa[i])) {
+            sa[n1++] = sa[i];
+        }
+    }
+    for (i = n1; i < n; i++) {
+        sa[i] = -1;
+    }
+    for (i = 0; i < n1; i++) {
+        pos = sa[i];
+        if (prev < 0 || !lms_equal(t, pos, prev)) {
+            name++;
+            prev = pos;
+        }
+        sa[n1 + pos / 2] = name - 1;
+    }
+    for (i = n - 1, j = n - 1; i >= n1; i--) {
+        if (sa[i] >= 0) {
+            sa[j--] = sa[i];
+        }
+    }
+
+    /* Sort the LMS suffixes, recursing if names are not unique. */
+    s1 = &sa[n - n1];
+    if (name < n1) {
+        t1.bytes = NULL;
+        t1.names = s1;
+        t1.n = n1;
+        t1.k = name;
+        ret = sais(&t1, sa);
+        if (ret != 0) {
+            goto out;
+        }
+    } else {
+        for (i = 0; i < n1; i++) {
+            sa[s1[i]] = i;
+        }
+    }
+
+    /* Induce the whole array from the sorted LMS suffixes. */
+    get_buckets(t, bkt, true);
+    for (i = 1, j = 0; i < n; i++) {
+        if (is_lms(t, i)) {
+            s1[j++] = i;
+        }
+    }
+    for (i = 0; i < n1; i++) {
+        sa[i] = s1[sa[i]];
+    }
+    for (i = n1; i < n; i++) {
+        sa[i] = -1;
+    }
+    for (i = n1 - 1; i >= 0; i--) {
+        j = sa[i];
+        sa[i] = -1;
+        sa[--bkt[chr(t, j)]] = j;
+    }
+    induce(t, sa, bkt);
+
+out:
+    free(bkt);
+    free(t->types);
+
+    return ret;
+}
+
+int delta_tool_suffix_array(const uint8_t *buf, size_t size, int32_t *sa)
+{
+    text_t t;
+
+    if (size >= INT32_MAX) {
+        return -DETOOLS_NOT_IMPLEMENTED;
+    }
+
+    if (size == 0) {
+        sa[0] = 0;
+        return 0;
+    }
+
+    t.bytes = buf;
+    t.names = NULL;
+    t.n = (int32_t)size + 1;
+    t.k = 257;
+
+    return sais(&t, sa);
+}
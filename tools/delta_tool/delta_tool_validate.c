@@ -0,0 +1,343 @@
+/*
+ * SPDX-FileCopyrightText: 2016 Intel Corporation
+ *                         2020 Thesis projects
+ *
+ * SPDX-License-Identifier: Apache 2.0 License
+ *
+ * SPDX-FileContributor: 2021 Laukik Hase
+ */
+
+/*
+ * Batch validation of (base, patch) pairs. Every distinct base is
+ * mapped once and shared read-only by all sessions applying patches to
+ * it. Jobs are dealt out to the workers in base order, and a worker
+ * that runs out of jobs steals from the other end of another worker's
+ * queue.
+ *
+ * Peak memory is the heap a session allocates, counted per thread by
+ * wrapping malloc() and free() at link time, see the README.
+ */
+
+#include <malloc.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "mbedtls/version.h"
+#include "mbedtls/sha256.h"
+
+#include "detools.h"
+#include "delta_tool.h"
+
+#if MBEDTLS_VERSION_NUMBER >= 0x03000000
+#define mbedtls_sha256_starts_ret mbedtls_sha256_starts
+#define mbedtls_sha256_update_ret mbedtls_sha256_update
+#define mbedtls_sha256_finish_ret mbedtls_sha256_finish
+#endif
+
+/* Jobs top to bottom - 1 of the sorted jobs belong to one worker. The
+ * owner takes from the top, thieves from the bottom. */
+typedef struct {
+    pthread_mutex_t lock;
+    size_t top;
+    size_t bottom;
+} worker_queue_t;
+
+typedef struct {
+    delta_tool_map_t map;
+    int ret;
+} base_t;
+
+typedef struct {
+    delta_tool_job_t **jobs;            /* Sorted by base */
+    const base_t **bases;               /* Per sorted job */
+    worker_queue_t *queues;
+    int workers;
+} pool_t;
+
+typedef struct {
+    pool_t *pool;
+    int index;
+} worker_t;
+
+typedef struct {
+    struct detools_apply_patch_t apply_patch;
+    const delta_tool_map_t *from;
+    size_t from_offset;
+    mbedtls_sha256_context sha256;
+} session_t;
+
+static __thread size_t heap_used;
+static __thread size_t heap_peak;
+
+void *__real_malloc(size_t size);
+void __real_free(void *ptr);
+
+void *__wrap_malloc(size_t size)
+{
+    void *ptr = __real_malloc(size);
+
+    if (ptr != NULL) {
+        heap_used += malloc_usable_size(ptr);
+        if (heap_used > heap_peak) {
+            heap_peak = heap_used;
+        }
+    }
+
+    return ptr;
+}
+
+void __wrap_free(void *ptr)
+{
+    if (ptr != NULL) {
+        heap_used -= malloc_usable_size(ptr);
+    }
+    __real_free(ptr);
+}
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int session_from_read(void *arg_p, uint8_t *buf_p, size_t size)
+{
+    session_t *session = arg_p;
+
+    if (size > session->from->size - session->from_offset) {
+        return -DETOOLS_FILE_READ_FAILED;
+    }
+    memcpy(buf_p, &session->from->buf[session->from_offset], size);
+    session->from_offset += size;
+
+    return 0;
+}
+
+static int session_from_seek(void *arg_p, int offset)
+{
+    session_t *session = arg_p;
+
+    if ((offset < 0 && (size_t)-offset > session->from_offset) ||
+        (offset > 0 && (size_t)offset > session->from->size - session->from_offset)) {
+        return -DETOOLS_FILE_SEEK_FAILED;
+    }
+    session->from_offset += offset;
+
+    return 0;
+}
+
+static int session_to_write(void *arg_p, const uint8_t *buf_p, size_t size)
+{
+    session_t *session = arg_p;
+
+    mbedtls_sha256_update_ret(&session->sha256, buf_p, size);
+
+    return 0;
+}
+
+static void run_job(delta_tool_job_t *job, const base_t *base)
+{
+    delta_tool_map_t patch;
+    session_t *session;
+    double start = now();
+    int ret;
+
+    heap_used = 0;
+    heap_peak = 0;
+
+    if (base->ret != 0) {
+        job->ret = base->ret;
+        return;
+    }
+
+    ret = delta_tool_map(&patch, job->patch_path);
+    if (ret != 0) {
+        job->ret = ret;
+        return;
+    }
+
+    session = malloc(sizeof(*session));
+    if (session == NULL) {
+        delta_tool_unmap(&patch);
+        job->ret = -DETOOLS_OUT_OF_MEMORY;
+        return;
+    }
+    session->from = &base->map;
+    session->from_offset = 0;
+    mbedtls_sha256_init(&session->sha256);
+    mbedtls_sha256_starts_ret(&session->sha256, 0);
+
+    ret = detools_apply_patch_init(&session->apply_patch,
+                                   session_from_read,
+                                   session_from_seek,
+                                   patch.size,
+                                   session_to_write,
+                                   session);
+    if (ret == 0) {
+        ret = detools_apply_patch_process(&session->apply_patch, patch.buf, patch.size);
+        if (ret == 0) {
+            ret = detools_apply_patch_finalize(&session->apply_patch);
+        } else {
+            (void)detools_apply_patch_finalize(&session->apply_patch);
+        }
+    }
+
+    if (ret >= 0) {
+        mbedtls_sha256_finish_ret(&session->sha256, job->output_sha256);
+        job->matched = job->has_sha256 &&
+                       memcmp(job->output_sha256, job->sha256, DELTA_TOOL_SHA256_SIZE) == 0;
+    }
+    job->ret = ret;
+    mbedtls_sha256_free(&session->sha256);
+    free(session);
+    delta_tool_unmap(&patch);
+    job->seconds = now() - start;
+    job->peak_memory = heap_peak;
+}
+
+static bool take_job(worker_queue_t *queue, bool steal, size_t *job_p)
+{
+    bool taken = false;
+
+    pthread_mutex_lock(&queue->lock);
+    if (queue->top < queue->bottom) {
+        *job_p = steal ? --queue->bottom : queue->top++;
+        taken = true;
+    }
+    pthread_mutex_unlock(&queue->lock);
+
+    return taken;
+}
+
+static void *worker_main(void *arg_p)
+{
+    worker_t *worker = arg_p;
+    pool_t *pool = worker->pool;
+    size_t job = 0;
+    int i;
+
+    while (true) {
+        if (!take_job(&pool->queues[worker->index], false, &job)) {
+            /* Jobs are never added, so empty queues stay empty. */
+            for (i = 1; i < pool->workers; i++) {
+                if (take_job(&pool->queues[(worker->index + i) % pool->workers], true, &job)) {
+                    break;
+                }
+            }
+            if (i == pool->workers) {
+                break;
+            }
+        }
+        run_job(pool->jobs[job], pool->bases[job]);
+    }
+
+    return NULL;
+}
+
+static int compare_base(const void *a_p, const void *b_p)
+{
+    const delta_tool_job_t *a = *(delta_tool_job_t *const *)a_p;
+    const delta_tool_job_t *b = *(delta_tool_job_t *const *)b_p;
+    int res = strcmp(a->from_path, b->from_path);
+
+    if (res == 0) {
+        res = (a > b) - (a < b);
+    }
+
+    return res;
+}
+
+int delta_tool_validate(delta_tool_job_t *jobs, size_t count, int workers)
+{
+    pool_t pool;
+    worker_t *worker_args = NULL;
+    pthread_t *threads = NULL;
+    base_t *bases = NULL;
+    size_t nbases = 0;
+    size_t per_worker;
+    size_t i;
+    int started = 0;
+    int ret = 0;
+    int w;
+
+    if (workers < 1) {
+        workers = 1;
+    }
+
+    memset(&pool, 0, sizeof(pool));
+    pool.workers = workers;
+    pool.jobs = malloc(count * sizeof(*pool.jobs) + 1);
+    pool.bases = malloc(count * sizeof(*pool.bases) + 1);
+    bases = malloc(count * sizeof(*bases) + 1);
+    pool.queues = malloc(workers * sizeof(*pool.queues));
+    threads = malloc(workers * sizeof(*threads));
+    worker_args = malloc(workers * sizeof(*worker_args));
+    if (!pool.jobs || !pool.bases || !bases || !pool.queues || !threads || !worker_args) {
+        ret = -DETOOLS_OUT_OF_MEMORY;
+        goto out;
+    }
+
+    /* Map every distinct base once. */
+    for (i = 0; i < count; i++) {
+        pool.jobs[i] = &jobs[i];
+    }
+    qsort(pool.jobs, count, sizeof(*pool.jobs), compare_base);
+
+    for (i = 0; i < count; i++) {
+        if (i == 0 || strcmp(pool.jobs[i]->from_path, pool.jobs[i - 1]->from_path) != 0) {
+            bases[nbases].ret = delta_tool_map(&bases[nbases].map, pool.jobs[i]->from_path);
+            if (bases[nbases].ret != 0) {
+                bases[nbases].map.buf = NULL;
+            }
+            nbases++;
+        }
+        pool.bases[i] = &bases[nbases - 1];
+    }
+
+    /* Deal out consecutive runs of the sorted jobs, so that a worker
+     * mostly reads one base. */
+    per_worker = (count + workers - 1) / workers;
+    for (w = 0; w < workers; w++) {
+        pthread_mutex_init(&pool.queues[w].lock, NULL);
+        pool.queues[w].top = w * per_worker < count ? w * per_worker : count;
+        pool.queues[w].bottom = (w + 1) * per_worker < count ? (w + 1) * per_worker : count;
+    }
+
+    for (w = 0; w < workers; w++) {
+        worker_args[w].pool = &pool;
+        worker_args[w].index = w;
+        if (pthread_create(&threads[w], NULL, worker_main, &worker_args[w]) != 0) {
+            break;
+        }
+        started++;
+    }
+    /* Started workers steal the jobs of the others. */
+    if (started == 0) {
+        worker_main(&worker_args[0]);
+    }
+    for (w = 0; w < started; w++) {
+        pthread_join(threads[w], NULL);
+    }
+    for (w = 0; w < workers; w++) {
+        pthread_mutex_destroy(&pool.queues[w].lock);
+    }
+
+    for (i = 0; i < nbases; i++) {
+        delta_tool_unmap(&bases[i].map);
+    }
+
+out:
+    free(worker_args);
+    free(threads);
+    free(pool.queues);
+    free(bases);
+    free(pool.bases);
+    free(pool.jobs);
+
+    return ret;
+}
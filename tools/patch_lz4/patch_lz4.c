@@ -0,0 +1,720 @@
+/*
+ * SPDX-FileCopyrightText: 2016 Intel Corporation
+ *                         2020 Thesis projects
+ *
+ * SPDX-License-Identifier: Apache 2.0 License
+ *
+ * SPDX-FileContributor: 2021 Laukik Hase
+ */
+
+/*
+ * Recompresses a detools patch, made with Heatshrink or no
+ * compression, as an LZ4 frame that the device decodes with
+ * components/detools/lz4dec. Matches are limited to given window size
+ * in bytes, the window the device decodes with.
+ *
+ * With a source image, the window is primed with given number of bytes
+ * of the source around the from position at every large extra data of
+ * a sequential patch, where new code often is a moved copy of old code.
+ * Primed patches have compression id 7, see lz4dec.h.
+ *
+ * Usage: patch_lz4 [-w <window size>] [-s <source> [-d <dict size>]]
+ *                  <patch> <lz4 patch>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "heatshrink_decoder.h"
+
+#define COMPRESSION_NONE        (0)
+#define COMPRESSION_HEATSHRINK  (4)
+#define COMPRESSION_LZ4         (6)
+#define COMPRESSION_LZ4_PRIMED  (7)
+
+#define PATCH_TYPE_SEQUENTIAL   (0)
+#define PATCH_TYPE_IN_PLACE     (1)
+
+#define LZ4_MAGIC               (0x184d2204u)
+#define LZ4_FLG                 (0x40 | 0x08)   /* Version 1, linked blocks, content size */
+#define LZ4_FLG_DICT_ID         (0x01)
+#define LZ4_BD                  (0x40)          /* 64 KiB blocks */
+#define LZ4_BLOCK_SIZE          (64 * 1024)
+#define LZ4_WINDOW_SIZE_MAX     (65535)
+#define LZ4_MIN_MATCH           (4)
+#define LZ4_LAST_LITERALS       (5)
+#define LZ4_MF_LIMIT            (12)
+#define LZ4_SOURCE_NONE         (0xffffffffu)
+
+/* Smallest extra data to prime the window for. */
+#define PRIME_SIZE_MIN          (64)
+#define DICT_SIZE_DEFAULT       (4096)
+
+#define HASH_BITS               (16)
+#define CHAIN_DEPTH             (256)
+
+#define PRIME32_1               (2654435761u)
+#define PRIME32_2               (2246822519u)
+#define PRIME32_3               (3266489917u)
+#define PRIME32_4               (668265263u)
+#define PRIME32_5               (374761393u)
+
+typedef struct {
+    uint8_t *buf_p;
+    size_t size;
+    size_t capacity;
+} buffer_t;
+
+/* Priming of the window with source data, before given patch data. */
+typedef struct {
+    size_t offset;
+    uint32_t source_offset;
+} prime_t;
+
+static int read_file(const char *path_p, buffer_t *buffer)
+{
+    FILE *file_p = fopen(path_p, "rb");
+    long size;
+
+    if (file_p == NULL) {
+        return -1;
+    }
+
+    fseek(file_p, 0, SEEK_END);
+    size = ftell(file_p);
+    fseek(file_p, 0, SEEK_SET);
+    buffer->size = (size_t)size;
+    buffer->capacity = buffer->size;
+    buffer->buf_p = malloc(buffer->size + 1);
+
+    if ((buffer->buf_p == NULL) || (fread(buffer->buf_p, 1, buffer->size, file_p) != buffer->size)) {
+        fclose(file_p);
+        return -1;
+    }
+
+    fclose(file_p);
+
+    return 0;
+}
+
+static void append(buffer_t *buffer, const void *buf_p, size_t size)
+{
+    if (buffer->size + size > buffer->capacity) {
+        buffer->capacity = 2 * (buffer->size + size);
+        buffer->buf_p = realloc(buffer->buf_p, buffer->capacity);
+
+        if (buffer->buf_p == NULL) {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+    }
+
+    memcpy(&buffer->buf_p[buffer->size], buf_p, size);
+    buffer->size += size;
+}
+
+static void append_byte(buffer_t *buffer, uint8_t byte)
+{
+    append(buffer, &byte, 1);
+}
+
+static void append_u32(buffer_t *buffer, uint32_t value)
+{
+    uint8_t buf[4] = { value, value >> 8, value >> 16, value >> 24 };
+
+    append(buffer, buf, sizeof(buf));
+}
+
+static uint32_t read_u32(const uint8_t *buf_p)
+{
+    return (buf_p[0] | (buf_p[1] << 8) | (buf_p[2] << 16) | ((uint32_t)buf_p[3] << 24));
+}
+
+static uint32_t rotl32(uint32_t value, int bits)
+{
+    return (value << bits) | (value >> (32 - bits));
+}
+
+/* xxHash32, for the frame header checksum. */
+static uint32_t xxh32(const uint8_t *buf_p, size_t size)
+{
+    uint32_t v[4] = { PRIME32_1 + PRIME32_2, PRIME32_2, 0, -PRIME32_1 };
+    uint32_t h;
+    size_t pos = 0;
+    int i;
+
+    if (size >= 16) {
+        for (; pos + 16 <= size; pos += 16) {
+            for (i = 0; i < 4; i++) {
+                v[i] = rotl32(v[i] + read_u32(&buf_p[pos + 4 * i]) * PRIME32_2, 13) * PRIME32_1;
+            }
+        }
+
+        h = rotl32(v[0], 1) + rotl32(v[1], 7) + rotl32(v[2], 12) + rotl32(v[3], 18);
+    } else {
+        h = PRIME32_5;
+    }
+
+    h += (uint32_t)size;
+
+    for (; pos + 4 <= size; pos += 4) {
+        h = rotl32(h + read_u32(&buf_p[pos]) * PRIME32_3, 17) * PRIME32_4;
+    }
+
+    for (; pos < size; pos++) {
+        h = rotl32(h + buf_p[pos] * PRIME32_5, 11) * PRIME32_1;
+    }
+
+    h ^= h >> 15;
+    h *= PRIME32_2;
+    h ^= h >> 13;
+    h *= PRIME32_3;
+    h ^= h >> 16;
+
+    return h;
+}
+
+static void append_length(buffer_t *buffer, size_t length)
+{
+    for (; length >= 255; length -= 255) {
+        append_byte(buffer, 255);
+    }
+
+    append_byte(buffer, length);
+}
+
+static void append_sequence(buffer_t *buffer,
+                            const uint8_t *literals_p,
+                            size_t literals,
+                            size_t offset,
+                            size_t match)
+{
+    uint8_t token;
+
+    token = (literals >= 15 ? 15 : literals) << 4;
+
+    if (match > 0) {
+        match -= LZ4_MIN_MATCH;
+        token |= (match >= 15 ? 15 : match);
+    }
+
+    append_byte(buffer, token);
+
+    if (literals >= 15) {
+        append_length(buffer, literals - 15);
+    }
+
+    append(buffer, literals_p, literals);
+
+    if (offset > 0) {
+        append_byte(buffer, offset);
+        append_byte(buffer, offset >> 8);
+
+        if (match >= 15) {
+            append_length(buffer, match - 15);
+        }
+    }
+}
+
+static uint32_t hash(const uint8_t *buf_p)
+{
+    return (read_u32(buf_p) * PRIME32_1) >> (32 - HASH_BITS);
+}
+
+/* Longest match at pos, among earlier positions of the same hash
+ * within the window. */
+static size_t find_match(const uint8_t *data_p,
+                         size_t pos,
+                         size_t limit,
+                         const long *head_p,
+                         const long *chain_p,
+                         size_t window_size,
+                         size_t *offset_p)
+{
+    long candidate = head_p[hash(&data_p[pos])];
+    size_t best = 0;
+    size_t length;
+    int depth;
+
+    for (depth = 0; (candidate >= 0) && (depth < CHAIN_DEPTH); depth++) {
+        if (pos - (size_t)candidate > window_size) {
+            break;
+        }
+
+        for (length = 0;
+             (pos + length < limit) && (data_p[candidate + length] == data_p[pos + length]);
+             length++) {
+        }
+
+        if (length > best) {
+            best = length;
+            *offset_p = pos - (size_t)candidate;
+        }
+
+        candidate = chain_p[candidate];
+    }
+
+    return best >= LZ4_MIN_MATCH ? best : 0;
+}
+
+static void insert(const uint8_t *data_p, size_t pos, long *head_p, long *chain_p)
+{
+    uint32_t h = hash(&data_p[pos]);
+
+    chain_p[pos] = head_p[h];
+    head_p[h] = (long)pos;
+}
+
+/* Compresses a block, with matches into earlier blocks and the source
+ * data it is primed with. */
+static void compress_block(buffer_t *frame,
+                           const uint8_t *data_p,
+                           size_t begin,
+                           size_t end,
+                           long *head_p,
+                           long *chain_p,
+                           size_t window_size,
+                           int primed,
+                           uint32_t source_offset)
+{
+    buffer_t block = { NULL, 0, 0 };
+    size_t anchor = begin;
+    size_t pos = begin;
+    size_t match;
+    size_t offset = 0;
+    size_t i;
+
+    if (end - begin >= LZ4_MF_LIMIT + 1) {
+        while (pos + LZ4_MF_LIMIT < end) {
+            match = find_match(data_p, pos, end - LZ4_LAST_LITERALS, head_p, chain_p,
+                               window_size, &offset);
+            insert(data_p, pos, head_p, chain_p);
+
+            if (match == 0) {
+                pos++;
+                continue;
+            }
+
+            append_sequence(&block, &data_p[anchor], pos - anchor, offset, match);
+
+            for (i = 1; i < match; i++) {
+                if (pos + i + LZ4_MIN_MATCH <= end) {
+                    insert(data_p, pos + i, head_p, chain_p);
+                }
+            }
+
+            pos += match;
+            anchor = pos;
+        }
+    }
+
+    append_sequence(&block, &data_p[anchor], end - anchor, 0, 0);
+
+    if (block.size < end - begin) {
+        append_u32(frame, block.size);
+    } else {
+        append_u32(frame, (end - begin) | 0x80000000u);
+    }
+
+    if (primed) {
+        append_u32(frame, source_offset);
+    }
+
+    if (block.size < end - begin) {
+        append(frame, block.buf_p, block.size);
+    } else {
+        append(frame, &data_p[begin], end - begin);
+    }
+
+    free(block.buf_p);
+}
+
+/* Compresses the patch data into a frame. The window sees the patch
+ * data with the source data of each priming inserted before it. */
+static void compress_lz4(buffer_t *frame,
+                         const buffer_t *data,
+                         size_t window_size,
+                         const buffer_t *source,
+                         size_t dict_size,
+                         const prime_t *primes_p,
+                         size_t primes)
+{
+    buffer_t stream = { NULL, 0, 0 };
+    long *head_p = malloc(sizeof(long) << HASH_BITS);
+    long *chain_p = malloc(sizeof(long) * (data->size + primes * dict_size + 1));
+    uint32_t source_offset;
+    size_t descriptor;
+    size_t begin;
+    size_t end;
+    size_t dict;
+    size_t i;
+    size_t p;
+
+    if ((head_p == NULL) || (chain_p == NULL)) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+
+    for (i = 0; i < (1 << HASH_BITS); i++) {
+        head_p[i] = -1;
+    }
+
+    append_u32(frame, LZ4_MAGIC);
+    descriptor = frame->size;
+    append_byte(frame, LZ4_FLG | (source != NULL ? LZ4_FLG_DICT_ID : 0));
+    append_byte(frame, LZ4_BD);
+    append_u32(frame, (uint32_t)data->size);
+    append_u32(frame, (uint32_t)((uint64_t)data->size >> 32));
+
+    if (source != NULL) {
+        append_u32(frame, dict_size);
+    }
+
+    append_byte(frame, xxh32(&frame->buf_p[descriptor], frame->size - descriptor) >> 8);
+
+    for (begin = 0, p = 0; begin < data->size; begin = end) {
+        end = begin + LZ4_BLOCK_SIZE < data->size ? begin + LZ4_BLOCK_SIZE : data->size;
+        source_offset = LZ4_SOURCE_NONE;
+        dict = stream.size;
+
+        if ((p < primes) && (primes_p[p].offset == begin)) {
+            source_offset = primes_p[p].source_offset;
+            append(&stream, &source->buf_p[source_offset], dict_size);
+            p++;
+        }
+
+        if ((p < primes) && (primes_p[p].offset < end)) {
+            end = primes_p[p].offset;
+        }
+
+        append(&stream, &data->buf_p[begin], end - begin);
+
+        for (i = dict; (i < stream.size - (end - begin)) && (i + 4 <= stream.size); i++) {
+            insert(stream.buf_p, i, head_p, chain_p);
+        }
+
+        compress_block(frame,
+                       stream.buf_p,
+                       stream.size - (end - begin),
+                       stream.size,
+                       head_p,
+                       chain_p,
+                       window_size,
+                       source != NULL,
+                       source_offset);
+    }
+
+    append_u32(frame, 0);
+
+    free(stream.buf_p);
+    free(head_p);
+    free(chain_p);
+}
+
+static int unpack_size(const buffer_t *data, size_t *pos_p, long *size_p)
+{
+    uint8_t byte;
+    int offset = 6;
+
+    if (*pos_p >= data->size) {
+        return -1;
+    }
+
+    byte = data->buf_p[(*pos_p)++];
+    *size_p = (byte & 0x3f);
+
+    if (byte & 0x40) {
+        *size_p = -*size_p;
+    }
+
+    while (byte & 0x80) {
+        if ((*pos_p >= data->size) || (offset > 56)) {
+            return -1;
+        }
+
+        byte = data->buf_p[(*pos_p)++];
+
+        if (*size_p < 0) {
+            *size_p -= (long)(byte & 0x7f) << offset;
+        } else {
+            *size_p += (long)(byte & 0x7f) << offset;
+        }
+
+        offset += 7;
+    }
+
+    return 0;
+}
+
+/* Primes the window before every large extra data of a sequential
+ * patch, with the source around the from position. */
+static int find_primes(const buffer_t *data,
+                       const buffer_t *source,
+                       size_t dict_size,
+                       prime_t **primes_pp,
+                       size_t *primes_p)
+{
+    size_t pos = 0;
+    long from = 0;
+    long diff;
+    long extra;
+    long adjustment;
+    long source_offset;
+
+    *primes_pp = NULL;
+    *primes_p = 0;
+
+    /* Data format patch size, always zero. */
+    if ((unpack_size(data, &pos, &diff) != 0) || (diff != 0)) {
+        return -1;
+    }
+
+    while (pos < data->size) {
+        if ((unpack_size(data, &pos, &diff) != 0)
+            || (diff < 0)
+            || ((size_t)diff > data->size - pos)) {
+            return -1;
+        }
+
+        pos += diff;
+        from += diff;
+
+        if ((unpack_size(data, &pos, &extra) != 0)
+            || (extra < 0)
+            || ((size_t)extra > data->size - pos)) {
+            return -1;
+        }
+
+        if (extra >= PRIME_SIZE_MIN) {
+            source_offset = from - (long)dict_size / 2;
+
+            if (source_offset > (long)(source->size - dict_size)) {
+                source_offset = source->size - dict_size;
+            }
+
+            if (source_offset < 0) {
+                source_offset = 0;
+            }
+
+            *primes_pp = realloc(*primes_pp, sizeof(prime_t) * (*primes_p + 1));
+
+            if (*primes_pp == NULL) {
+                return -1;
+            }
+
+            (*primes_pp)[*primes_p].offset = pos;
+            (*primes_pp)[*primes_p].source_offset = (uint32_t)source_offset;
+            (*primes_p)++;
+        }
+
+        pos += extra;
+
+        if (unpack_size(data, &pos, &adjustment) != 0) {
+            return -1;
+        }
+
+        from += adjustment;
+    }
+
+    return 0;
+}
+
+static int decompress_heatshrink(const uint8_t *in_p, size_t size, buffer_t *data)
+{
+    static heatshrink_decoder decoder;
+    uint8_t buf[512];
+    size_t pos = 1;     /* Window and lookahead byte */
+    size_t count;
+    HSD_poll_res pres;
+
+    if ((size == 0)
+        || (((in_p[0] >> 4) + 4) != HEATSHRINK_STATIC_WINDOW_BITS)
+        || (((in_p[0] & 0xf) + 3) != HEATSHRINK_STATIC_LOOKAHEAD_BITS)) {
+        return -1;
+    }
+
+    heatshrink_decoder_reset(&decoder);
+
+    while (pos < size) {
+        heatshrink_decoder_sink(&decoder, (uint8_t *)&in_p[pos], size - pos, &count);
+        pos += count;
+
+        do {
+            pres = heatshrink_decoder_poll(&decoder, buf, sizeof(buf), &count);
+            append(data, buf, count);
+        } while (pres == HSDR_POLL_MORE);
+    }
+
+    while (heatshrink_decoder_finish(&decoder) == HSDR_FINISH_MORE) {
+        heatshrink_decoder_poll(&decoder, buf, sizeof(buf), &count);
+        append(data, buf, count);
+    }
+
+    return 0;
+}
+
+/* Offset of the compressed data, after the header sizes. */
+static int patch_header(const buffer_t *patch, size_t *offset_p)
+{
+    size_t offset = 1;
+    int sizes;
+
+    switch ((patch->buf_p[0] >> 4) & 0x7) {
+
+    case PATCH_TYPE_SEQUENTIAL:
+        sizes = 1;
+        break;
+
+    case PATCH_TYPE_IN_PLACE:
+        sizes = 5;
+        break;
+
+    default:
+        return -1;
+    }
+
+    while (sizes-- > 0) {
+        if ((offset < patch->size) && (patch->buf_p[offset++] & 0x80)) {
+            while ((offset < patch->size) && (patch->buf_p[offset++] & 0x80)) {
+            }
+        }
+    }
+
+    if (offset > patch->size) {
+        return -1;
+    }
+
+    *offset_p = offset;
+
+    return 0;
+}
+
+static void usage(const char *name_p)
+{
+    fprintf(stderr,
+            "Usage: %s [-w <window size>] [-s <source> [-d <dict size>]] "
+            "<patch> <lz4 patch>\n",
+            name_p);
+    exit(1);
+}
+
+int main(int argc, const char *argv[])
+{
+    buffer_t patch;
+    buffer_t data = { NULL, 0, 0 };
+    buffer_t lz4_patch = { NULL, 0, 0 };
+    buffer_t primed_patch = { NULL, 0, 0 };
+    buffer_t source;
+    const char *source_path_p = NULL;
+    prime_t *primes_p = NULL;
+    size_t primes = 0;
+    size_t window_size = LZ4_WINDOW_SIZE_MAX;
+    size_t dict_size = DICT_SIZE_DEFAULT;
+    size_t offset;
+    FILE *file_p;
+    int res;
+    int i;
+
+    for (i = 1; (i + 1 < argc) && (argv[i][0] == '-'); i += 2) {
+        if (strcmp(argv[i], "-w") == 0) {
+            window_size = strtoul(argv[i + 1], NULL, 0);
+        } else if (strcmp(argv[i], "-s") == 0) {
+            source_path_p = argv[i + 1];
+        } else if (strcmp(argv[i], "-d") == 0) {
+            dict_size = strtoul(argv[i + 1], NULL, 0);
+        } else {
+            usage(argv[0]);
+        }
+    }
+
+    if ((argc - i != 2)
+        || (window_size < 1)
+        || (window_size > LZ4_WINDOW_SIZE_MAX)
+        || (dict_size < 4)
+        || (dict_size > window_size)) {
+        usage(argv[0]);
+    }
+
+    if ((read_file(argv[i], &patch) != 0)
+        || (patch.size < 2)
+        || (patch_header(&patch, &offset) != 0)) {
+        fprintf(stderr, "%s: cannot read patch\n", argv[i]);
+        return 1;
+    }
+
+    switch (patch.buf_p[0] & 0xf) {
+
+    case COMPRESSION_NONE:
+        append(&data, &patch.buf_p[offset], patch.size - offset);
+        res = 0;
+        break;
+
+    case COMPRESSION_HEATSHRINK:
+        res = decompress_heatshrink(&patch.buf_p[offset], patch.size - offset, &data);
+        break;
+
+    default:
+        res = -1;
+        break;
+    }
+
+    if (res != 0) {
+        fprintf(stderr, "%s: unsupported compression\n", argv[i]);
+        return 1;
+    }
+
+    if (source_path_p != NULL) {
+        if ((read_file(source_path_p, &source) != 0) || (source.size < dict_size)) {
+            fprintf(stderr, "%s: cannot read source\n", source_path_p);
+            return 1;
+        }
+
+        if ((((patch.buf_p[0] >> 4) & 0x7) != PATCH_TYPE_SEQUENTIAL)
+            || (find_primes(&data, &source, dict_size, &primes_p, &primes) != 0)) {
+            fprintf(stderr, "%s: only sequential patches can be primed\n", argv[i]);
+            return 1;
+        }
+    }
+
+    append(&lz4_patch, patch.buf_p, offset);
+    lz4_patch.buf_p[0] = (patch.buf_p[0] & 0xf0) | COMPRESSION_LZ4;
+    compress_lz4(&lz4_patch, &data, window_size, NULL, 0, NULL, 0);
+
+    /* Priming costs a source offset per block, keep it only if the
+     * frame gets smaller. */
+    if (primes > 0) {
+        append(&primed_patch, patch.buf_p, offset);
+        primed_patch.buf_p[0] = (patch.buf_p[0] & 0xf0) | COMPRESSION_LZ4_PRIMED;
+        compress_lz4(&primed_patch, &data, window_size, &source, dict_size, primes_p, primes);
+
+        if (primed_patch.size < lz4_patch.size) {
+            free(lz4_patch.buf_p);
+            lz4_patch = primed_patch;
+        } else {
+            free(primed_patch.buf_p);
+            primes = 0;
+        }
+    }
+
+    file_p = fopen(argv[i + 1], "wb");
+
+    if ((file_p == NULL) || (fwrite(lz4_patch.buf_p, 1, lz4_patch.size, file_p) != lz4_patch.size)) {
+        fprintf(stderr, "%s: cannot write patch\n", argv[i + 1]);
+        return 1;
+    }
+
+    fclose(file_p);
+    printf("%zu -> %zu bytes, %zu primings\n", patch.size, lz4_patch.size, primes);
+
+    free(patch.buf_p);
+    free(data.buf_p);
+    free(lz4_patch.buf_p);
+    free(primes_p);
+
+    if (source_path_p != NULL) {
+        free(source.buf_p);
+    }
+
+    return 0;
+}